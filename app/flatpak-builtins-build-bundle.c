@@ -37,6 +37,7 @@
 #include "flatpak-utils-private.h"
 #include "flatpak-oci-registry-private.h"
 #include "flatpak-chain-input-stream-private.h"
+#include "flatpak-streaming-bundle-private.h"
 #include "flatpak-builtins-utils.h"
 
 #include <archive.h>
@@ -52,6 +53,7 @@ static gboolean opt_oci_use_labels = TRUE; // Unused now
 static char **opt_gpg_key_ids;
 static char *opt_gpg_homedir;
 static char *opt_from_commit;
+static gboolean opt_zstd = FALSE;
 
 static GOptionEntry options[] = {
   { "runtime", 0, 0, G_OPTION_ARG_NONE, &opt_runtime, N_("Export runtime instead of app"), NULL },
@@ -63,6 +65,7 @@ static GOptionEntry options[] = {
   { "gpg-homedir", 0, 0, G_OPTION_ARG_STRING, &opt_gpg_homedir, N_("GPG Homedir to use when looking for keyrings"), N_("HOMEDIR") },
   { "from-commit", 0, 0, G_OPTION_ARG_STRING, &opt_from_commit, N_("OSTree commit to create a delta bundle from"), N_("COMMIT") },
   { "oci", 0, 0, G_OPTION_ARG_NONE, &opt_oci, N_("Export oci image instead of flatpak bundle"), NULL },
+  { "zstd", 0, 0, G_OPTION_ARG_NONE, &opt_zstd, N_("Create a streaming bundle with zstd compressed parts"), NULL },
   // This is not used anymore as it is the default, but accept it if old code uses it
   { "oci-use-labels", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &opt_oci_use_labels, NULL, NULL },
   { NULL }
@@ -313,6 +316,14 @@ build_bundle (OstreeRepo *repo, const char *commit_checksum, GFile *file,
                                                         1));
     }
 
+  if (opt_zstd)
+    {
+      metadata = g_variant_ref_sink (g_variant_builder_end (&metadata_builder));
+
+      return flatpak_streaming_bundle_write (repo, commit_checksum, from_commit, metadata, file,
+                                             cancellable, error);
+    }
+
   g_variant_builder_init (&param_builder, G_VARIANT_TYPE ("a{sv}"));
   g_variant_builder_add (&param_builder, "{sv}", "min-fallback-size", g_variant_new_uint32 (0));
   g_variant_builder_add (&param_builder, "{sv}", "compression", g_variant_new_byte ('x'));
@@ -671,6 +682,9 @@ flatpak_builtin_build_bundle (int argc, char **argv, GCancellable *cancellable,
         return FALSE;
     }
 
+  if (opt_oci && opt_zstd)
+    return usage_error (context, _("Can't use --zstd with --oci"), error);
+
   file = g_file_new_for_commandline_arg (filename);
 
   if (flatpak_file_get_path_cached (file) == NULL)
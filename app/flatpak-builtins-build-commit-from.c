@@ -253,6 +253,300 @@ get_subsets (char **subsets, GVariant **out)
 }
 
 
+typedef struct
+{
+  OstreeRepo   *dst_repo;
+  gboolean      have_timestamp;
+  guint64       timestamp;
+  GCancellable *cancellable;
+  GMutex        lock;
+  GError       *error;
+} CommitFromContext;
+
+typedef struct
+{
+  const char *dst_ref;
+  const char *resolved_ref;
+  char       *dst_parent;
+  char       *commit_checksum; /* NULL if unchanged */
+  GVariant   *dst_commitv;
+} CommitFromJob;
+
+static void
+commit_from_job_free (CommitFromJob *job)
+{
+  g_free (job->dst_parent);
+  g_free (job->commit_checksum);
+  if (job->dst_commitv)
+    g_variant_unref (job->dst_commitv);
+  g_free (job);
+}
+
+/* Creates the new commit for one ref. This runs on a worker thread, all
+ * refs share the same transaction on the destination repo. */
+static gboolean
+commit_from_ref (CommitFromContext *ctx,
+                 CommitFromJob     *job,
+                 GError           **error)
+{
+  OstreeRepo *dst_repo = ctx->dst_repo;
+  GCancellable *cancellable = ctx->cancellable;
+  const char *dst_ref = job->dst_ref;
+  const char *resolved_ref = job->resolved_ref;
+  const char *dst_parent = job->dst_parent;
+  g_autoptr(GFile) dst_parent_root = NULL;
+  g_autoptr(GFile) src_ref_root = NULL;
+  g_autoptr(GVariant) src_commitv = NULL;
+  g_autoptr(GVariant) subsets_v = NULL;
+  g_autoptr(OstreeMutableTree) mtree = NULL;
+  g_autoptr(GFile) dst_root = NULL;
+  g_autoptr(GVariant) commitv_metadata = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  OstreeRepoCommitState src_commit_state;
+  const char *subject;
+  const char *body;
+  g_autofree char *commit_checksum = NULL;
+  GVariantBuilder metadata_builder;
+  guint64 timestamp;
+  gint j;
+  const char *dst_collection_id = NULL;
+  const char *main_collection_id = NULL;
+  g_autoptr(GPtrArray) collection_ids = NULL;
+
+  dst_collection_id = ostree_repo_get_collection_id (dst_repo);
+
+  if (dst_parent != NULL &&
+      !ostree_repo_read_commit (dst_repo, dst_parent, &dst_parent_root, NULL, cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_read_commit (dst_repo, resolved_ref, &src_ref_root, NULL, cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_load_commit (dst_repo, resolved_ref, &src_commitv, &src_commit_state, error))
+    return FALSE;
+
+  if (src_commit_state & OSTREE_REPO_COMMIT_STATE_PARTIAL)
+    return flatpak_fail (error, _("Can't commit from partial source commit"));
+
+  /* Don't create a new commit if this is the same tree */
+  if (!opt_force && dst_parent_root != NULL && g_file_equal (dst_parent_root, src_ref_root))
+    return TRUE;
+
+  mtree = ostree_mutable_tree_new ();
+  if (!ostree_repo_write_directory_to_mtree (dst_repo, src_ref_root, mtree, NULL,
+                                             cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_write_mtree (dst_repo, mtree, &dst_root, cancellable, error))
+    return FALSE;
+
+  commitv_metadata = g_variant_get_child_value (src_commitv, 0);
+
+  g_variant_get_child (src_commitv, 3, "&s", &subject);
+  if (opt_subject)
+    subject = (const char *) opt_subject;
+  g_variant_get_child (src_commitv, 4, "&s", &body);
+  if (opt_body)
+    body = (const char *) opt_body;
+
+  collection_ids = g_ptr_array_new_with_free_func (g_free);
+  if (dst_collection_id)
+    {
+      main_collection_id = dst_collection_id;
+      g_ptr_array_add (collection_ids, g_strdup (dst_collection_id));
+    }
+
+  if (opt_extra_collection_ids != NULL)
+    {
+      for (j = 0; opt_extra_collection_ids[j] != NULL; j++)
+        {
+          const char *cid = opt_extra_collection_ids[j];
+          if (main_collection_id == NULL)
+            main_collection_id = cid; /* Fall back to first arg */
+
+          if (g_strcmp0 (cid, dst_collection_id) != 0)
+            g_ptr_array_add (collection_ids, g_strdup (cid));
+        }
+    }
+
+  g_ptr_array_sort (collection_ids, (GCompareFunc) flatpak_strcmp0_ptr);
+
+  /* Copy old metadata */
+  g_variant_builder_init (&metadata_builder, G_VARIANT_TYPE ("a{sv}"));
+
+  /* Bindings. xa.ref is deprecated but added anyway for backwards compatibility. */
+  g_variant_builder_add (&metadata_builder, "{sv}", "ostree.collection-binding",
+                         g_variant_new_string (main_collection_id ? main_collection_id : ""));
+  if (collection_ids->len > 0)
+    {
+      g_autoptr(GVariantBuilder) cr_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ss)"));
+
+      for (j = 0; j < collection_ids->len; j++)
+        g_variant_builder_add (cr_builder, "(ss)", g_ptr_array_index (collection_ids, j), dst_ref);
+
+      g_variant_builder_add (&metadata_builder, "{sv}", "ostree.collection-refs-binding",
+                             g_variant_builder_end (cr_builder));
+    }
+  g_variant_builder_add (&metadata_builder, "{sv}", "ostree.ref-binding",
+                         g_variant_new_strv (&dst_ref, 1));
+  g_variant_builder_add (&metadata_builder, "{sv}", "xa.ref", g_variant_new_string (dst_ref));
+
+  /* Record the source commit. This is nice to have, but it also
+     means the commit-from gets a different commit id, which
+     avoids problems with e.g.  sharing .commitmeta files
+     (signatures) */
+  g_variant_builder_add (&metadata_builder, "{sv}", "xa.from_commit", g_variant_new_string (resolved_ref));
+
+  if (opt_src_repo)
+    {
+      guint64 download_size;
+      if (!flatpak_repo_collect_sizes (dst_repo, src_ref_root, NULL, &download_size,
+                                       cancellable, error))
+        {
+          return FALSE;
+        }
+      g_variant_builder_add (&metadata_builder, "{sv}", "xa.download-size", g_variant_new_uint64 (GUINT64_TO_BE (download_size)));
+    }
+
+  for (j = 0; j < g_variant_n_children (commitv_metadata); j++)
+    {
+      g_autoptr(GVariant) child = g_variant_get_child_value (commitv_metadata, j);
+      g_autoptr(GVariant) keyv = g_variant_get_child_value (child, 0);
+      const char *key = g_variant_get_string (keyv, NULL);
+
+      if (strcmp (key, "xa.ref") == 0 ||
+          strcmp (key, "xa.from_commit") == 0 ||
+          strcmp (key, "ostree.collection-binding") == 0 ||
+          strcmp (key, "ostree.collection-refs-binding") == 0 ||
+          strcmp (key, "ostree.ref-binding") == 0)
+        continue;
+
+      if (opt_src_repo && strcmp (key, "xa.download-size") == 0)
+        continue;
+
+      if (opt_endoflife &&
+          strcmp (key, OSTREE_COMMIT_META_KEY_ENDOFLIFE) == 0)
+        continue;
+
+      if (opt_endoflife_rebase &&
+          strcmp (key, OSTREE_COMMIT_META_KEY_ENDOFLIFE_REBASE) == 0)
+        continue;
+
+      if (opt_token_type >= 0 && strcmp (key, "xa.token-type") == 0)
+        continue;
+
+      if (opt_subsets != NULL && strcmp (key, "xa.subsets") == 0)
+        continue;
+
+      g_variant_builder_add_value (&metadata_builder, child);
+    }
+
+  if (opt_endoflife && *opt_endoflife)
+    g_variant_builder_add (&metadata_builder, "{sv}", OSTREE_COMMIT_META_KEY_ENDOFLIFE,
+                           g_variant_new_string (opt_endoflife));
+
+  if (opt_endoflife_rebase)
+    {
+      g_auto(GStrv) dst_ref_parts = g_strsplit (dst_ref, "/", 0);
+
+      for (j = 0; opt_endoflife_rebase[j] != NULL; j++)
+        {
+          const char *old_prefix = opt_endoflife_rebase[j];
+
+          if (flatpak_has_name_prefix (dst_ref_parts[1], old_prefix))
+            {
+              g_autofree char *new_id = g_strconcat (opt_endoflife_rebase_new[j], dst_ref_parts[1] + strlen(old_prefix), NULL);
+              g_autofree char *rebased_ref = g_build_filename (dst_ref_parts[0], new_id, dst_ref_parts[2], dst_ref_parts[3], NULL);
+
+              g_variant_builder_add (&metadata_builder, "{sv}", OSTREE_COMMIT_META_KEY_ENDOFLIFE_REBASE,
+                                     g_variant_new_string (rebased_ref));
+              break;
+            }
+        }
+    }
+
+  if (opt_token_type >= 0)
+    g_variant_builder_add (&metadata_builder, "{sv}", "xa.token-type",
+                           g_variant_new_int32 (GINT32_TO_LE (opt_token_type)));
+
+  /* Skip "" subsets as they mean everything. This way --subsets= causes old subsets to be stripped from the original commit */
+  if (get_subsets (opt_subsets, &subsets_v))
+    g_variant_builder_add (&metadata_builder, "{sv}", "xa.subsets", subsets_v);
+
+  timestamp = ostree_commit_get_timestamp (src_commitv);
+  if (ctx->have_timestamp)
+    timestamp = ctx->timestamp;
+
+  metadata = g_variant_ref_sink (g_variant_builder_end (&metadata_builder));
+  if (!ostree_repo_write_commit_with_time (dst_repo, dst_parent, subject, body, metadata,
+                                           OSTREE_REPO_FILE (dst_root),
+                                           timestamp,
+                                           &commit_checksum, cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_load_commit (dst_repo, commit_checksum, &job->dst_commitv, NULL, error))
+    return FALSE;
+
+  /* This doesn't copy the detached metadata. I'm not sure if this is a problem.
+   * The main thing there is commit signatures, and we can't copy those, as the commit hash changes.
+   */
+
+  if (opt_gpg_key_ids)
+    {
+      char **iter;
+
+      for (iter = opt_gpg_key_ids; iter && *iter; iter++)
+        {
+          const char *keyid = *iter;
+          g_autoptr(GError) my_error = NULL;
+
+          if (!ostree_repo_sign_commit (dst_repo,
+                                        commit_checksum,
+                                        keyid,
+                                        opt_gpg_homedir,
+                                        cancellable,
+                                        &my_error) &&
+              !g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+            {
+              g_propagate_error (error, g_steal_pointer (&my_error));
+              return FALSE;
+            }
+        }
+    }
+
+  job->commit_checksum = g_steal_pointer (&commit_checksum);
+
+  return TRUE;
+}
+
+static void
+commit_from_ref_thread (gpointer data,
+                        gpointer user_data)
+{
+  CommitFromJob *job = data;
+  CommitFromContext *ctx = user_data;
+  g_autoptr(GError) local_error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&ctx->lock);
+  failed = ctx->error != NULL;
+  g_mutex_unlock (&ctx->lock);
+
+  /* Don't bother with the rest once something failed */
+  if (failed)
+    return;
+
+  if (!commit_from_ref (ctx, job, &local_error))
+    {
+      g_prefix_error (&local_error, "%s: ", job->dst_ref);
+
+      g_mutex_lock (&ctx->lock);
+      if (ctx->error == NULL)
+        ctx->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&ctx->lock);
+    }
+}
+
 gboolean
 flatpak_builtin_build_commit_from (int argc, char **argv, GCancellable *cancellable, GError **error)
 {
@@ -268,9 +562,10 @@ flatpak_builtin_build_commit_from (int argc, char **argv, GCancellable *cancella
   g_autoptr(FlatpakRepoTransaction) transaction = NULL;
   g_autoptr(GPtrArray) src_refs = NULL;
   g_autoptr(GPtrArray) resolved_src_refs = NULL;
-  OstreeRepoCommitState src_commit_state;
+  CommitFromContext ctx = { 0 };
+  g_autoptr(GPtrArray) jobs = NULL;
+  GThreadPool *pool;
   struct timespec ts;
-  guint64 timestamp;
   int i;
   const char *src_collection_id;
 
@@ -454,255 +749,88 @@ flatpak_builtin_build_commit_from (int argc, char **argv, GCancellable *cancella
   if (transaction == NULL)
     return FALSE;
 
+  /* The refs are independent of each other, so create the new commits
+   * concurrently. Refs, deltas and output are handled here afterwards,
+   * in the order the refs were given. */
+  ctx.dst_repo = dst_repo;
+  ctx.have_timestamp = opt_timestamp != NULL;
+  ctx.timestamp = opt_timestamp ? ts.tv_sec : 0;
+  ctx.cancellable = cancellable;
+
+  jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) commit_from_job_free);
   for (i = 0; i < resolved_src_refs->len; i++)
     {
-      const char *dst_ref = dst_refs[i];
-      const char *resolved_ref = g_ptr_array_index (resolved_src_refs, i);
-      g_autofree char *dst_parent = NULL;
-      g_autoptr(GFile) dst_parent_root = NULL;
-      g_autoptr(GFile) src_ref_root = NULL;
-      g_autoptr(GVariant) src_commitv = NULL;
-      g_autoptr(GVariant) dst_commitv = NULL;
-      g_autoptr(GVariant) subsets_v = NULL;
-      g_autoptr(OstreeMutableTree) mtree = NULL;
-      g_autoptr(GFile) dst_root = NULL;
-      g_autoptr(GVariant) commitv_metadata = NULL;
-      g_autoptr(GVariant) metadata = NULL;
-      const char *subject;
-      const char *body;
-      g_autofree char *commit_checksum = NULL;
-      GVariantBuilder metadata_builder;
-      gint j;
-      const char *dst_collection_id = NULL;
-      const char *main_collection_id = NULL;
-      g_autoptr(GPtrArray) collection_ids = NULL;
-
-      dst_collection_id = ostree_repo_get_collection_id (dst_repo);
-
-      if (!flatpak_repo_resolve_rev (dst_repo, dst_collection_id, NULL, dst_ref, TRUE,
-                                     &dst_parent, cancellable, error))
-        return FALSE;
-
-      if (dst_parent != NULL &&
-          !ostree_repo_read_commit (dst_repo, dst_parent, &dst_parent_root, NULL, cancellable, error))
-        return FALSE;
-
-      if (!ostree_repo_read_commit (dst_repo, resolved_ref, &src_ref_root, NULL, cancellable, error))
-        return FALSE;
-
-      if (!ostree_repo_load_commit (dst_repo, resolved_ref, &src_commitv, &src_commit_state, error))
-        return FALSE;
+      CommitFromJob *job = g_new0 (CommitFromJob, 1);
 
-      if (src_commit_state & OSTREE_REPO_COMMIT_STATE_PARTIAL)
-        return flatpak_fail (error, _("Can't commit from partial source commit"));
+      job->dst_ref = dst_refs[i];
+      job->resolved_ref = g_ptr_array_index (resolved_src_refs, i);
+      g_ptr_array_add (jobs, job);
 
-      /* Don't create a new commit if this is the same tree */
-      if (!opt_force && dst_parent_root != NULL && g_file_equal (dst_parent_root, src_ref_root))
-        {
-          g_print (_("%s: no change\n"), dst_ref);
-          continue;
-        }
-
-      mtree = ostree_mutable_tree_new ();
-      if (!ostree_repo_write_directory_to_mtree (dst_repo, src_ref_root, mtree, NULL,
-                                                 cancellable, error))
-        return FALSE;
-
-      if (!ostree_repo_write_mtree (dst_repo, mtree, &dst_root, cancellable, error))
+      if (!flatpak_repo_resolve_rev (dst_repo, ostree_repo_get_collection_id (dst_repo), NULL,
+                                     job->dst_ref, TRUE, &job->dst_parent, cancellable, error))
         return FALSE;
+    }
 
-      commitv_metadata = g_variant_get_child_value (src_commitv, 0);
-
-      g_variant_get_child (src_commitv, 3, "&s", &subject);
-      if (opt_subject)
-        subject = (const char *) opt_subject;
-      g_variant_get_child (src_commitv, 4, "&s", &body);
-      if (opt_body)
-        body = (const char *) opt_body;
-
-      collection_ids = g_ptr_array_new_with_free_func (g_free);
-      if (dst_collection_id)
-        {
-          main_collection_id = dst_collection_id;
-          g_ptr_array_add (collection_ids, g_strdup (dst_collection_id));
-        }
-
-      if (opt_extra_collection_ids != NULL)
-        {
-          for (j = 0; opt_extra_collection_ids[j] != NULL; j++)
-            {
-              const char *cid = opt_extra_collection_ids[j];
-              if (main_collection_id == NULL)
-                main_collection_id = cid; /* Fall back to first arg */
-
-              if (g_strcmp0 (cid, dst_collection_id) != 0)
-                g_ptr_array_add (collection_ids, g_strdup (cid));
-            }
-        }
-
-      g_ptr_array_sort (collection_ids, (GCompareFunc) flatpak_strcmp0_ptr);
-
-      /* Copy old metadata */
-      g_variant_builder_init (&metadata_builder, G_VARIANT_TYPE ("a{sv}"));
-
-      /* Bindings. xa.ref is deprecated but added anyway for backwards compatibility. */
-      g_variant_builder_add (&metadata_builder, "{sv}", "ostree.collection-binding",
-                             g_variant_new_string (main_collection_id ? main_collection_id : ""));
-      if (collection_ids->len > 0)
-        {
-          g_autoptr(GVariantBuilder) cr_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ss)"));
-
-          for (j = 0; j < collection_ids->len; j++)
-            g_variant_builder_add (cr_builder, "(ss)", g_ptr_array_index (collection_ids, j), dst_ref);
-
-          g_variant_builder_add (&metadata_builder, "{sv}", "ostree.collection-refs-binding",
-                                 g_variant_builder_end (cr_builder));
-        }
-      g_variant_builder_add (&metadata_builder, "{sv}", "ostree.ref-binding",
-                             g_variant_new_strv (&dst_ref, 1));
-      g_variant_builder_add (&metadata_builder, "{sv}", "xa.ref", g_variant_new_string (dst_ref));
-
-      /* Record the source commit. This is nice to have, but it also
-         means the commit-from gets a different commit id, which
-         avoids problems with e.g.  sharing .commitmeta files
-         (signatures) */
-      g_variant_builder_add (&metadata_builder, "{sv}", "xa.from_commit", g_variant_new_string (resolved_ref));
-
-      if (opt_src_repo)
-        {
-          guint64 download_size;
-          if (!flatpak_repo_collect_sizes (dst_repo, src_ref_root, NULL, &download_size,
-                                           cancellable, error))
-            {
-              return FALSE;
-            }
-          g_variant_builder_add (&metadata_builder, "{sv}", "xa.download-size", g_variant_new_uint64 (GUINT64_TO_BE (download_size)));
-        }
-
-      for (j = 0; j < g_variant_n_children (commitv_metadata); j++)
-        {
-          g_autoptr(GVariant) child = g_variant_get_child_value (commitv_metadata, j);
-          g_autoptr(GVariant) keyv = g_variant_get_child_value (child, 0);
-          const char *key = g_variant_get_string (keyv, NULL);
-
-          if (strcmp (key, "xa.ref") == 0 ||
-              strcmp (key, "xa.from_commit") == 0 ||
-              strcmp (key, "ostree.collection-binding") == 0 ||
-              strcmp (key, "ostree.collection-refs-binding") == 0 ||
-              strcmp (key, "ostree.ref-binding") == 0)
-            continue;
-
-          if (opt_src_repo && strcmp (key, "xa.download-size") == 0)
-            continue;
+  g_mutex_init (&ctx.lock);
 
-          if (opt_endoflife &&
-              strcmp (key, OSTREE_COMMIT_META_KEY_ENDOFLIFE) == 0)
-            continue;
+  pool = g_thread_pool_new (commit_from_ref_thread, &ctx, g_get_num_processors (), FALSE, error);
+  if (pool == NULL)
+    {
+      g_mutex_clear (&ctx.lock);
+      return FALSE;
+    }
 
-          if (opt_endoflife_rebase &&
-              strcmp (key, OSTREE_COMMIT_META_KEY_ENDOFLIFE_REBASE) == 0)
-            continue;
+  for (i = 0; i < jobs->len; i++)
+    {
+      if (!g_thread_pool_push (pool, g_ptr_array_index (jobs, i), error))
+        break;
+    }
 
-          if (opt_token_type >= 0 && strcmp (key, "xa.token-type") == 0)
-            continue;
+  g_thread_pool_free (pool, i < jobs->len, TRUE);
+  g_mutex_clear (&ctx.lock);
 
-          if (opt_subsets != NULL && strcmp (key, "xa.subsets") == 0)
-            continue;
+  if (i < jobs->len)
+    {
+      g_clear_error (&ctx.error);
+      return FALSE;
+    }
 
-          g_variant_builder_add_value (&metadata_builder, child);
-        }
+  if (ctx.error != NULL)
+    {
+      g_propagate_error (error, ctx.error);
+      return FALSE;
+    }
 
-      if (opt_endoflife && *opt_endoflife)
-        g_variant_builder_add (&metadata_builder, "{sv}", OSTREE_COMMIT_META_KEY_ENDOFLIFE,
-                               g_variant_new_string (opt_endoflife));
+  for (i = 0; i < jobs->len; i++)
+    {
+      CommitFromJob *job = g_ptr_array_index (jobs, i);
+      const char *dst_collection_id = ostree_repo_get_collection_id (dst_repo);
+      gint j;
 
-      if (opt_endoflife_rebase)
+      if (job->commit_checksum == NULL)
         {
-          g_auto(GStrv) dst_ref_parts = g_strsplit (dst_ref, "/", 0);
-
-          for (j = 0; opt_endoflife_rebase[j] != NULL; j++)
-            {
-              const char *old_prefix = opt_endoflife_rebase[j];
-
-              if (flatpak_has_name_prefix (dst_ref_parts[1], old_prefix))
-                {
-                  g_autofree char *new_id = g_strconcat (opt_endoflife_rebase_new[j], dst_ref_parts[1] + strlen(old_prefix), NULL);
-                  g_autofree char *rebased_ref = g_build_filename (dst_ref_parts[0], new_id, dst_ref_parts[2], dst_ref_parts[3], NULL);
-
-                  g_variant_builder_add (&metadata_builder, "{sv}", OSTREE_COMMIT_META_KEY_ENDOFLIFE_REBASE,
-                                         g_variant_new_string (rebased_ref));
-                  break;
-                }
-            }
+          g_print (_("%s: no change\n"), job->dst_ref);
+          continue;
         }
 
-      if (opt_token_type >= 0)
-        g_variant_builder_add (&metadata_builder, "{sv}", "xa.token-type",
-                               g_variant_new_int32 (GINT32_TO_LE (opt_token_type)));
-
-      /* Skip "" subsets as they mean everything. This way --subsets= causes old subsets to be stripped from the original commit */
-      if (get_subsets (opt_subsets, &subsets_v))
-        g_variant_builder_add (&metadata_builder, "{sv}", "xa.subsets", subsets_v);
-
-      timestamp = ostree_commit_get_timestamp (src_commitv);
-      if (opt_timestamp)
-        timestamp = ts.tv_sec;
-
-      metadata = g_variant_ref_sink (g_variant_builder_end (&metadata_builder));
-      if (!ostree_repo_write_commit_with_time (dst_repo, dst_parent, subject, body, metadata,
-                                               OSTREE_REPO_FILE (dst_root),
-                                               timestamp,
-                                               &commit_checksum, cancellable, error))
-        return FALSE;
-
-      g_print ("%s: %s\n", dst_ref, commit_checksum);
-
-      if (!ostree_repo_load_commit (dst_repo, commit_checksum, &dst_commitv, NULL, error))
-        return FALSE;
-
-      /* This doesn't copy the detached metadata. I'm not sure if this is a problem.
-       * The main thing there is commit signatures, and we can't copy those, as the commit hash changes.
-       */
-
-      if (opt_gpg_key_ids)
-        {
-          char **iter;
-
-          for (iter = opt_gpg_key_ids; iter && *iter; iter++)
-            {
-              const char *keyid = *iter;
-              g_autoptr(GError) my_error = NULL;
-
-              if (!ostree_repo_sign_commit (dst_repo,
-                                            commit_checksum,
-                                            keyid,
-                                            opt_gpg_homedir,
-                                            cancellable,
-                                            &my_error) &&
-                  !g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
-                {
-                  g_propagate_error (error, g_steal_pointer (&my_error));
-                  return FALSE;
-                }
-            }
-        }
+      g_print ("%s: %s\n", job->dst_ref, job->commit_checksum);
 
       if (dst_collection_id != NULL)
         {
-          OstreeCollectionRef ref = { (char *) dst_collection_id, (char *) dst_ref };
-          ostree_repo_transaction_set_collection_ref (dst_repo, &ref, commit_checksum);
+          OstreeCollectionRef ref = { (char *) dst_collection_id, (char *) job->dst_ref };
+          ostree_repo_transaction_set_collection_ref (dst_repo, &ref, job->commit_checksum);
         }
       else
         {
-          ostree_repo_transaction_set_ref (dst_repo, NULL, dst_ref, commit_checksum);
+          ostree_repo_transaction_set_ref (dst_repo, NULL, job->dst_ref, job->commit_checksum);
         }
 
       if (opt_extra_collection_ids)
         {
           for (j = 0; opt_extra_collection_ids[j] != NULL; j++)
             {
-              OstreeCollectionRef ref = { (char *) opt_extra_collection_ids[j], (char *) dst_ref };
-              ostree_repo_transaction_set_collection_ref (dst_repo, &ref, commit_checksum);
+              OstreeCollectionRef ref = { (char *) opt_extra_collection_ids[j], (char *) job->dst_ref };
+              ostree_repo_transaction_set_collection_ref (dst_repo, &ref, job->commit_checksum);
             }
         }
 
@@ -711,14 +839,14 @@ flatpak_builtin_build_commit_from (int argc, char **argv, GCancellable *cancella
         const char *from[2];
         gsize n_from = 0;
 
-        if (dst_parent != NULL)
-          from[n_from++] = dst_parent;
+        if (job->dst_parent != NULL)
+          from[n_from++] = job->dst_parent;
         from[n_from++] = NULL;
 
         for (j = 0; j < n_from; j++)
           {
             g_autoptr(GError) local_error = NULL;
-            if (!rewrite_delta (src_repo, resolved_ref, dst_repo, commit_checksum, dst_commitv, from[j], &local_error))
+            if (!rewrite_delta (src_repo, job->resolved_ref, dst_repo, job->commit_checksum, job->dst_commitv, from[j], &local_error))
               g_debug ("Failed to copy delta: %s", local_error->message);
           }
       }
@@ -26,6 +26,7 @@
 #include <string.h>
 
 #include <glib/gi18n.h>
+#include <gio/gunixinputstream.h>
 
 #include "libglnx/libglnx.h"
 
@@ -54,6 +55,7 @@ static char **opt_subsets;
 static char *opt_collection_id = NULL;
 static int opt_token_type = -1;
 static gboolean opt_no_summary_index = FALSE;
+static gboolean opt_no_export_cache = FALSE;
 
 static GOptionEntry options[] = {
   { "subject", 's', 0, G_OPTION_ARG_STRING, &opt_subject, N_("One line subject"), N_("SUBJECT") },
@@ -77,6 +79,7 @@ static GOptionEntry options[] = {
   { "disable-fsync", 0, 0, G_OPTION_ARG_NONE, &opt_disable_fsync, "Do not invoke fsync()", NULL },
   { "disable-sandbox", 0, 0, G_OPTION_ARG_NONE, &opt_disable_sandbox, "Do not sandbox icon validator", NULL },
   { "no-summary-index", 0, 0, G_OPTION_ARG_NONE, &opt_no_summary_index, N_("Don't generate a summary index"), NULL },
+  { "no-export-cache", 0, 0, G_OPTION_ARG_NONE, &opt_no_export_cache, N_("Read all files, don't use or update the export cache"), NULL },
 
   { NULL }
 };
@@ -215,6 +218,536 @@ commit_filter (OstreeRepo *repo,
   return OSTREE_REPO_COMMIT_FILTER_ALLOW;
 }
 
+/* The export cache remembers the object checksum of every file committed
+ * from the build directory, keyed by the file's identity and change
+ * times, so that unchanged files don't have to be read again on the next
+ * export. It lives in the build directory next to the metadata. */
+#define EXPORT_CACHE_NAME ".export-cache"
+#define EXPORT_CACHE_FORMAT "a(tttxxxxus)"
+
+typedef struct
+{
+  guint64 dev;
+  guint64 ino;
+  guint64 size;
+  gint64  mtime;
+  gint64  mtime_nsec;
+  gint64  ctime;
+  gint64  ctime_nsec;
+  guint32 mode;
+} ExportCacheKey;
+
+static void
+export_cache_key_init (ExportCacheKey    *key,
+                       const struct stat *stbuf)
+{
+  memset (key, 0, sizeof (*key));
+  key->dev = stbuf->st_dev;
+  key->ino = stbuf->st_ino;
+  key->size = stbuf->st_size;
+  key->mtime = stbuf->st_mtim.tv_sec;
+  key->mtime_nsec = stbuf->st_mtim.tv_nsec;
+  key->ctime = stbuf->st_ctim.tv_sec;
+  key->ctime_nsec = stbuf->st_ctim.tv_nsec;
+  key->mode = stbuf->st_mode;
+}
+
+static guint
+export_cache_key_hash (gconstpointer v)
+{
+  const ExportCacheKey *key = v;
+
+  return (guint) (key->ino ^ (key->dev << 16) ^ key->mtime_nsec ^ key->ctime_nsec);
+}
+
+static gboolean
+export_cache_key_equal (gconstpointer v1,
+                        gconstpointer v2)
+{
+  return memcmp (v1, v2, sizeof (ExportCacheKey)) == 0;
+}
+
+static GHashTable *
+export_cache_new (void)
+{
+  return g_hash_table_new_full (export_cache_key_hash, export_cache_key_equal, g_free, g_free);
+}
+
+/* A missing or unreadable cache just means everything gets read */
+static GHashTable *
+export_cache_load (GFile *base)
+{
+  GHashTable *cache = export_cache_new ();
+  g_autoptr(GFile) cache_file = g_file_get_child (base, EXPORT_CACHE_NAME);
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) entries = NULL;
+  GVariantIter iter;
+  ExportCacheKey key;
+  const char *checksum;
+  char *contents;
+  gsize length;
+
+  if (!g_file_load_contents (cache_file, NULL, &contents, &length, NULL, NULL))
+    return cache;
+
+  bytes = g_bytes_new_take (contents, length);
+
+  entries = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (EXPORT_CACHE_FORMAT), bytes, FALSE));
+
+  memset (&key, 0, sizeof (key));
+  g_variant_iter_init (&iter, entries);
+  while (g_variant_iter_next (&iter, "(tttxxxxu&s)",
+                              &key.dev, &key.ino, &key.size,
+                              &key.mtime, &key.mtime_nsec,
+                              &key.ctime, &key.ctime_nsec,
+                              &key.mode, &checksum))
+    {
+      if (ostree_validate_checksum_string (checksum, NULL))
+        g_hash_table_replace (cache, g_memdup (&key, sizeof (key)), g_strdup (checksum));
+    }
+
+  return cache;
+}
+
+static gboolean
+export_cache_save (GFile      *base,
+                   GHashTable *cache,
+                   GError    **error)
+{
+  g_autoptr(GFile) cache_file = g_file_get_child (base, EXPORT_CACHE_NAME);
+  g_autoptr(GVariantBuilder) builder = g_variant_builder_new (G_VARIANT_TYPE (EXPORT_CACHE_FORMAT));
+  g_autoptr(GVariant) entries = NULL;
+  GHashTableIter iter;
+  gpointer k, v;
+
+  g_hash_table_iter_init (&iter, cache);
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      const ExportCacheKey *key = k;
+
+      g_variant_builder_add (builder, "(tttxxxxus)",
+                             key->dev, key->ino, key->size,
+                             key->mtime, key->mtime_nsec,
+                             key->ctime, key->ctime_nsec,
+                             key->mode, (const char *) v);
+    }
+
+  entries = g_variant_ref_sink (g_variant_builder_end (builder));
+
+  return g_file_replace_contents (cache_file,
+                                  g_variant_get_data (entries), g_variant_get_size (entries),
+                                  NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
+                                  NULL, NULL, error);
+}
+
+/* State for committing a build directory with a pool of worker
+ * threads. The directory walk, the commit filter and all mtree changes
+ * happen on the main thread; the workers only checksum and write the
+ * file objects. */
+typedef struct
+{
+  OstreeRepo   *repo;
+  int           root_dfd;
+  gboolean      reuse_objects;
+  GHashTable   *old_cache;
+  GHashTable   *new_cache;
+  GCancellable *cancellable;
+  GMutex        lock;
+  GError       *error;
+} ParallelCommit;
+
+typedef struct
+{
+  char       *name;
+  char       *relpath; /* Relative to root_dfd */
+  struct stat stbuf;   /* With the owner and mode from the commit filter */
+  char       *checksum; /* Initially from the export cache, if any */
+} CommitFileJob;
+
+static void
+commit_file_job_free (CommitFileJob *job)
+{
+  g_free (job->name);
+  g_free (job->relpath);
+  g_free (job->checksum);
+  g_free (job);
+}
+
+static GFileInfo *
+file_info_for_stat (const char        *name,
+                    const struct stat *stbuf,
+                    const char        *symlink_target)
+{
+  GFileInfo *info = g_file_info_new ();
+
+  g_file_info_set_name (info, name);
+  if (S_ISDIR (stbuf->st_mode))
+    g_file_info_set_file_type (info, G_FILE_TYPE_DIRECTORY);
+  else if (S_ISLNK (stbuf->st_mode))
+    g_file_info_set_file_type (info, G_FILE_TYPE_SYMBOLIC_LINK);
+  else
+    g_file_info_set_file_type (info, G_FILE_TYPE_REGULAR);
+  g_file_info_set_size (info, stbuf->st_size);
+  g_file_info_set_attribute_uint32 (info, "unix::uid", stbuf->st_uid);
+  g_file_info_set_attribute_uint32 (info, "unix::gid", stbuf->st_gid);
+  g_file_info_set_attribute_uint32 (info, "unix::mode", stbuf->st_mode);
+  if (symlink_target)
+    g_file_info_set_symlink_target (info, symlink_target);
+
+  return info;
+}
+
+static gboolean
+commit_file (ParallelCommit *pc,
+             CommitFileJob  *job,
+             GError        **error)
+{
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GInputStream) file_input = NULL;
+  g_autoptr(GInputStream) content = NULL;
+  g_autofree char *symlink_target = NULL;
+  g_autofree guchar *csum = NULL;
+  guint64 length;
+
+  /* The object might be gone, or this could be a different repo */
+  if (job->checksum != NULL)
+    {
+      gboolean have_object;
+
+      if (!ostree_repo_has_object (pc->repo, OSTREE_OBJECT_TYPE_FILE, job->checksum,
+                                   &have_object, pc->cancellable, error))
+        return FALSE;
+
+      if (have_object)
+        return TRUE;
+
+      g_clear_pointer (&job->checksum, g_free);
+    }
+
+  /* Checksumming is much cheaper than compressing an object just to find
+   * that the repo already has it */
+  if (pc->reuse_objects)
+    {
+      gboolean have_object;
+
+      if (!ostree_checksum_file_at (pc->root_dfd, job->relpath, &job->stbuf,
+                                    OSTREE_OBJECT_TYPE_FILE, OSTREE_CHECKSUM_FLAGS_IGNORE_XATTRS,
+                                    &job->checksum, pc->cancellable, error))
+        return FALSE;
+
+      if (!ostree_repo_has_object (pc->repo, OSTREE_OBJECT_TYPE_FILE, job->checksum,
+                                   &have_object, pc->cancellable, error))
+        return FALSE;
+
+      if (have_object)
+        return TRUE;
+    }
+
+  if (S_ISLNK (job->stbuf.st_mode))
+    {
+      symlink_target = glnx_readlinkat_malloc (pc->root_dfd, job->relpath, pc->cancellable, error);
+      if (symlink_target == NULL)
+        return FALSE;
+    }
+  else
+    {
+      glnx_autofd int fd = -1;
+
+      if (!glnx_openat_rdonly (pc->root_dfd, job->relpath, FALSE, &fd, error))
+        return FALSE;
+
+      file_input = g_unix_input_stream_new (glnx_steal_fd (&fd), TRUE);
+    }
+
+  file_info = file_info_for_stat (job->name, &job->stbuf, symlink_target);
+
+  if (!ostree_raw_file_to_content_stream (file_input, file_info, NULL,
+                                          &content, &length,
+                                          pc->cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_write_content (pc->repo, job->checksum, content, length,
+                                  job->checksum ? NULL : &csum,
+                                  pc->cancellable, error))
+    return FALSE;
+
+  if (job->checksum == NULL)
+    job->checksum = ostree_checksum_from_bytes (csum);
+
+  return TRUE;
+}
+
+static void
+commit_file_thread (gpointer data,
+                    gpointer user_data)
+{
+  CommitFileJob *job = data;
+  ParallelCommit *pc = user_data;
+  g_autoptr(GError) local_error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&pc->lock);
+  failed = pc->error != NULL;
+  g_mutex_unlock (&pc->lock);
+
+  /* Don't bother with the rest once something failed */
+  if (failed)
+    return;
+
+  if (!commit_file (pc, job, &local_error))
+    {
+      g_prefix_error (&local_error, "Writing %s: ", job->relpath);
+
+      g_mutex_lock (&pc->lock);
+      if (pc->error == NULL)
+        pc->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&pc->lock);
+    }
+}
+
+static gboolean
+write_dir_metadata (OstreeRepo        *repo,
+                    OstreeMutableTree *mtree,
+                    GFileInfo         *dir_info,
+                    GCancellable      *cancellable,
+                    GError           **error)
+{
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autofree guchar *csum = NULL;
+  g_autofree char *checksum = NULL;
+
+  dirmeta = ostree_create_directory_metadata (dir_info, NULL);
+  if (!ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL,
+                                   dirmeta, &csum, cancellable, error))
+    return FALSE;
+
+  checksum = ostree_checksum_from_bytes (csum);
+  ostree_mutable_tree_set_metadata_checksum (mtree, checksum);
+
+  return TRUE;
+}
+
+/* Walks the directory like ostree_repo_write_directory_to_mtree() does,
+ * applying commit_filter() to each entry, and queues the files for the
+ * workers. The jobs are also added to @jobs, and the mtree directory they
+ * belong in to @job_mtrees (these are owned by their parent mtree). */
+static gboolean
+walk_build_dir (ParallelCommit    *pc,
+                CommitData        *commit_data,
+                int                dfd,
+                const char        *relpath,
+                const char        *path,
+                OstreeMutableTree *mtree,
+                GThreadPool       *pool,
+                GPtrArray         *jobs,
+                GPtrArray         *job_mtrees,
+                GError           **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+
+  if (!glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      struct stat stbuf;
+      g_autoptr(GFileInfo) file_info = NULL;
+      g_autofree char *child_relpath = NULL;
+      g_autofree char *child_path = NULL;
+      g_autofree char *symlink_target = NULL;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, pc->cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (!glnx_fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW, error))
+        return FALSE;
+
+      if (!S_ISDIR (stbuf.st_mode) && !S_ISREG (stbuf.st_mode) && !S_ISLNK (stbuf.st_mode))
+        return flatpak_fail (error, "Not a regular file or symlink: %s", dent->d_name);
+
+      child_relpath = g_build_filename (relpath, dent->d_name, NULL);
+      child_path = g_build_filename (path, dent->d_name, NULL);
+
+      if (S_ISLNK (stbuf.st_mode))
+        {
+          symlink_target = glnx_readlinkat_malloc (iter.fd, dent->d_name, pc->cancellable, error);
+          if (symlink_target == NULL)
+            return FALSE;
+        }
+
+      file_info = file_info_for_stat (dent->d_name, &stbuf, symlink_target);
+      if (commit_filter (pc->repo, child_path, file_info, commit_data) != OSTREE_REPO_COMMIT_FILTER_ALLOW)
+        continue;
+
+      if (S_ISDIR (stbuf.st_mode))
+        {
+          g_autoptr(OstreeMutableTree) child_mtree = NULL;
+          glnx_autofd int child_dfd = -1;
+
+          if (!ostree_mutable_tree_ensure_dir (mtree, dent->d_name, &child_mtree, error))
+            return FALSE;
+
+          if (!write_dir_metadata (pc->repo, child_mtree, file_info, pc->cancellable, error))
+            return FALSE;
+
+          if (!glnx_opendirat (iter.fd, dent->d_name, FALSE, &child_dfd, error))
+            return FALSE;
+
+          if (!walk_build_dir (pc, commit_data, child_dfd, child_relpath, child_path,
+                               child_mtree, pool, jobs, job_mtrees, error))
+            return FALSE;
+        }
+      else
+        {
+          CommitFileJob *job = g_new0 (CommitFileJob, 1);
+
+          job->name = g_strdup (dent->d_name);
+          job->relpath = g_steal_pointer (&child_relpath);
+          job->stbuf = stbuf;
+          job->stbuf.st_uid = g_file_info_get_attribute_uint32 (file_info, "unix::uid");
+          job->stbuf.st_gid = g_file_info_get_attribute_uint32 (file_info, "unix::gid");
+          job->stbuf.st_mode = g_file_info_get_attribute_uint32 (file_info, "unix::mode");
+
+          if (pc->old_cache != NULL)
+            {
+              ExportCacheKey key;
+
+              export_cache_key_init (&key, &job->stbuf);
+              job->checksum = g_strdup (g_hash_table_lookup (pc->old_cache, &key));
+              if (job->checksum != NULL)
+                g_debug ("Using cached checksum for %s", child_path);
+            }
+
+          g_ptr_array_add (jobs, job);
+          g_ptr_array_add (job_mtrees, mtree);
+
+          if (!g_thread_pool_push (pool, job, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Like ostree_repo_write_directory_to_mtree() with commit_filter(), but
+ * file contents are hashed and compressed on all CPUs. Files found in
+ * @old_cache are not read at all, and all committed files are added to
+ * @new_cache. */
+static gboolean
+write_directory_to_mtree_parallel (OstreeRepo        *repo,
+                                   GFile             *dir,
+                                   OstreeMutableTree *mtree,
+                                   CommitData        *commit_data,
+                                   gboolean           reuse_objects,
+                                   GHashTable        *old_cache,
+                                   GHashTable        *new_cache,
+                                   GCancellable      *cancellable,
+                                   GError           **error)
+{
+  ParallelCommit pc = { 0 };
+  glnx_autofd int root_dfd = -1;
+  g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) commit_file_job_free);
+  g_autoptr(GPtrArray) job_mtrees = g_ptr_array_new ();
+  g_autoptr(GFileInfo) dir_info = NULL;
+  g_autofree char *dir_name = NULL;
+  struct stat stbuf;
+  GThreadPool *pool;
+  gboolean res;
+  guint i;
+
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (dir), TRUE, &root_dfd, error))
+    return FALSE;
+
+  if (!glnx_fstat (root_dfd, &stbuf, error))
+    return FALSE;
+
+  dir_name = g_file_get_basename (dir);
+  dir_info = file_info_for_stat (dir_name, &stbuf, NULL);
+  if (commit_filter (repo, "/", dir_info, commit_data) != OSTREE_REPO_COMMIT_FILTER_ALLOW)
+    return TRUE;
+
+  if (!write_dir_metadata (repo, mtree, dir_info, cancellable, error))
+    return FALSE;
+
+  pc.repo = repo;
+  pc.root_dfd = root_dfd;
+  pc.reuse_objects = reuse_objects;
+  pc.old_cache = old_cache;
+  pc.new_cache = new_cache;
+  pc.cancellable = cancellable;
+  g_mutex_init (&pc.lock);
+
+  pool = g_thread_pool_new (commit_file_thread, &pc, g_get_num_processors (), FALSE, error);
+  if (pool == NULL)
+    {
+      g_mutex_clear (&pc.lock);
+      return FALSE;
+    }
+
+  res = walk_build_dir (&pc, commit_data, root_dfd, "", "/", mtree, pool, jobs, job_mtrees, error);
+
+  /* Wait for the queued jobs to finish, even if the walk failed */
+  g_thread_pool_free (pool, !res, TRUE);
+  g_mutex_clear (&pc.lock);
+
+  if (!res)
+    {
+      g_clear_error (&pc.error);
+      return FALSE;
+    }
+
+  if (pc.error != NULL)
+    {
+      g_propagate_error (error, pc.error);
+      return FALSE;
+    }
+
+  for (i = 0; i < jobs->len; i++)
+    {
+      CommitFileJob *job = g_ptr_array_index (jobs, i);
+
+      if (!ostree_mutable_tree_replace_file (g_ptr_array_index (job_mtrees, i),
+                                             job->name, job->checksum, error))
+        return FALSE;
+
+      if (new_cache != NULL)
+        {
+          ExportCacheKey key;
+
+          export_cache_key_init (&key, &job->stbuf);
+          g_hash_table_replace (new_cache, g_memdup (&key, sizeof (key)), g_strdup (job->checksum));
+        }
+    }
+
+  return TRUE;
+}
+
+/* Archive repos (the normal export target) use the parallel writer. For
+ * bare repos, ostree can reuse the objects found by
+ * ostree_repo_scan_hardlinks() without reading the files at all. */
+static gboolean
+write_build_directory (OstreeRepo               *repo,
+                       GFile                    *dir,
+                       OstreeMutableTree        *mtree,
+                       OstreeRepoCommitModifier *modifier,
+                       CommitData               *commit_data,
+                       gboolean                  reuse_objects,
+                       GHashTable               *old_cache,
+                       GHashTable               *new_cache,
+                       GCancellable             *cancellable,
+                       GError                  **error)
+{
+  if (ostree_repo_get_mode (repo) == OSTREE_REPO_MODE_ARCHIVE_Z2)
+    return write_directory_to_mtree_parallel (repo, dir, mtree, commit_data, reuse_objects,
+                                              old_cache, new_cache, cancellable, error);
+
+  return ostree_repo_write_directory_to_mtree (repo, dir, mtree, modifier, cancellable, error);
+}
+
 static gboolean
 add_file_to_mtree (GFile             *file,
                    const char        *name,
@@ -303,16 +836,12 @@ find_file_in_tree (GFile *base, const char *filename)
   return FALSE;
 }
 
-typedef gboolean (* VisitFileFunc) (GFile   *file,
-                                    GError **error);
-
 static gboolean
-visit_files_in_tree (GFile        *base,
-                     VisitFileFunc visit_file,
-                     gpointer      data)
+collect_files_in_tree (GFile     *base,
+                       GPtrArray *files,
+                       GError   **error)
 {
   g_autoptr(GFileEnumerator) enumerator = NULL;
-  GError **error = data;
 
   enumerator = g_file_enumerate_children (base,
                                           G_FILE_ATTRIBUTE_STANDARD_TYPE ","
@@ -321,7 +850,7 @@ visit_files_in_tree (GFile        *base,
                                           NULL,
                                           NULL);
   if (!enumerator)
-    return FALSE;
+    return TRUE;
 
   do
     {
@@ -338,13 +867,10 @@ visit_files_in_tree (GFile        *base,
       type = g_file_info_get_file_type (info);
 
       if (type == G_FILE_TYPE_REGULAR)
-        {
-          if (!visit_file (child, data))
-            return FALSE;
-        }
+        g_ptr_array_add (files, g_strdup (flatpak_file_get_path_cached (child)));
       else if (type == G_FILE_TYPE_DIRECTORY)
         {
-          if (!visit_files_in_tree (child, visit_file, data))
+          if (!collect_files_in_tree (child, files, error))
             return FALSE;
         }
     }
@@ -366,41 +892,67 @@ add_args (GPtrArray *argv_array, ...)
   va_end (args);
 }
 
+/* Limits the size of the validator command line */
+#define ICON_VALIDATION_BATCH_SIZE 128
+
+/* Validates a batch of icons with a single (sandboxed) validator run */
 static gboolean
-validate_icon_file (GFile *file, GError **error)
+validate_icon_files (const char **names,
+                     guint        n_names,
+                     GError     **error)
 {
   g_autoptr(GPtrArray) args = NULL;
-  const char *name;
-  int status;
+  g_autoptr(GKeyFile) results = NULL;
+  g_autofree char *out = NULL;
   g_autofree char *err = NULL;
+  int status;
+  guint i;
   const char *validate_icon = LIBEXECDIR "/flatpak-validate-icon";
 
-  name = flatpak_file_get_path_cached (file);
-
   if (g_getenv ("FLATPAK_VALIDATE_ICON"))
     validate_icon = g_getenv ("FLATPAK_VALIDATE_ICON");
 
   args = g_ptr_array_new_with_free_func (g_free);
 
+  add_args (args, validate_icon, "--batch", NULL);
 #ifndef DISABLE_SANDBOXED_TRIGGERS
   if (!opt_disable_sandbox)
-    add_args (args, validate_icon, "--sandbox", "512", "512", name, NULL);
-  else
+    add_args (args, "--sandbox", NULL);
 #endif
-    add_args (args, validate_icon, "512", "512", name, NULL);
+  add_args (args, "512", "512", NULL);
+  for (i = 0; i < n_names; i++)
+    add_args (args, names[i], NULL);
 
   g_ptr_array_add (args, NULL);
 
-  if (!g_spawn_sync (NULL, (char **) args->pdata, NULL, 0, NULL, NULL, NULL, &err, &status, error))
+  if (!g_spawn_sync (NULL, (char **) args->pdata, NULL, 0, NULL, NULL, &out, &err, &status, error))
     {
       g_debug ("Icon validation: %s", (*error)->message);
       return FALSE;
     }
 
-  if (!g_spawn_check_exit_status (status, NULL))
+  results = g_key_file_new ();
+  if (!g_key_file_load_from_data (results, out, -1, G_KEY_FILE_NONE, NULL))
+    g_clear_pointer (&results, g_key_file_unref);
+
+  for (i = 0; i < n_names; i++)
     {
-      g_debug ("Icon validation: %s", err);
-      return flatpak_fail (error, "%s is not a valid icon: %s", name, err);
+      g_autofree char *group = g_strdup_printf ("Icon Validator %u", i);
+      g_autofree char *icon_error = NULL;
+
+      /* A missing result means the validator failed as a whole */
+      if (results == NULL || !g_key_file_has_group (results, group))
+        {
+          g_debug ("Icon validation: %s", err);
+          return flatpak_fail (error, "%s is not a valid icon: %s", names[i], err);
+        }
+
+      icon_error = g_key_file_get_string (results, group, "error", NULL);
+      if (icon_error != NULL)
+        {
+          g_debug ("Icon validation: %s", icon_error);
+          return flatpak_fail (error, "%s is not a valid icon: %s", names[i], icon_error);
+        }
     }
 
   return TRUE;
@@ -412,11 +964,22 @@ validate_exported_icons (GFile      *export,
                          GError    **error)
 {
   g_autoptr(GFile) icondir = NULL;
+  g_autoptr(GPtrArray) files = g_ptr_array_new_with_free_func (g_free);
+  guint i;
 
   icondir = g_file_resolve_relative_path (export, "share/icons/hicolor");
-  visit_files_in_tree (icondir, validate_icon_file, error);
+  if (!collect_files_in_tree (icondir, files, error))
+    return FALSE;
 
-  return !*error;
+  for (i = 0; i < files->len; i += ICON_VALIDATION_BATCH_SIZE)
+    {
+      if (!validate_icon_files ((const char **) &files->pdata[i],
+                                MIN (files->len - i, ICON_VALIDATION_BATCH_SIZE),
+                                error))
+        return FALSE;
+    }
+
+  return TRUE;
 }
 
 static GFile *
@@ -812,6 +1375,9 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   g_autoptr(GVariant) subsets_v = NULL;
   gboolean is_runtime = FALSE;
   gboolean is_extension = FALSE;
+  gboolean reuse_objects = FALSE;
+  g_autoptr(GHashTable) old_cache = NULL;
+  g_autoptr(GHashTable) new_cache = NULL;
   guint64 installed_size = 0, download_size = 0;
   struct timespec ts;
   const char *collection_id;
@@ -943,6 +1509,9 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
       if (!ostree_repo_open (repo, cancellable, error))
         goto out;
 
+      /* Only an existing repo can have objects worth looking for */
+      reuse_objects = TRUE;
+
       repo_collection_id = ostree_repo_get_collection_id (repo);
       if (!flatpak_repo_resolve_rev (repo, repo_collection_id, NULL, full_branch, TRUE,
                                      &parent, cancellable, error))
@@ -990,6 +1559,12 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   if (!ostree_mutable_tree_ensure_dir (mtree, "files", &files_mtree, error))
     goto out;
 
+  if (!opt_no_export_cache)
+    {
+      old_cache = export_cache_load (base);
+      new_cache = export_cache_new ();
+    }
+
   modifier = ostree_repo_commit_modifier_new (OSTREE_REPO_COMMIT_MODIFIER_FLAGS_SKIP_XATTRS,
                                               (OstreeRepoCommitFilter) commit_filter, &commit_data, NULL);
 
@@ -997,7 +1572,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, files, files_mtree, modifier, cancellable, error))
+      if (!write_build_directory (repo, files, files_mtree, modifier, &commit_data, reuse_objects, old_cache, new_cache, cancellable, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -1006,7 +1581,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, usr, files_mtree, modifier, cancellable, error))
+      if (!write_build_directory (repo, usr, files_mtree, modifier, &commit_data, reuse_objects, old_cache, new_cache, cancellable, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -1015,7 +1590,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
     {
       commit_data.exclude = (const char **) opt_exclude;
       commit_data.include = (const char **) opt_include;
-      if (!ostree_repo_write_directory_to_mtree (repo, files, files_mtree, modifier, cancellable, error))
+      if (!write_build_directory (repo, files, files_mtree, modifier, &commit_data, reuse_objects, old_cache, new_cache, cancellable, error))
         goto out;
       commit_data.exclude = NULL;
       commit_data.include = NULL;
@@ -1023,7 +1598,7 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
       if (!ostree_mutable_tree_ensure_dir (mtree, "export", &export_mtree, error))
         goto out;
 
-      if (!ostree_repo_write_directory_to_mtree (repo, export, export_mtree, modifier, cancellable, error))
+      if (!write_build_directory (repo, export, export_mtree, modifier, &commit_data, reuse_objects, old_cache, new_cache, cancellable, error))
         goto out;
     }
 
@@ -1129,6 +1704,15 @@ flatpak_builtin_build_export (int argc, char **argv, GCancellable *cancellable,
   if (!ostree_repo_commit_transaction (repo, &stats, cancellable, error))
     goto out;
 
+  /* Only files committed this time are kept, so the cache doesn't grow */
+  if (new_cache != NULL && g_hash_table_size (new_cache) > 0)
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      if (!export_cache_save (base, new_cache, &local_error))
+        g_debug ("Failed to save export cache: %s", local_error->message);
+    }
+
   if (opt_update_appstream &&
       !flatpak_repo_generate_appstream (repo, (const char **) opt_gpg_key_ids, opt_gpg_homedir,
                                         (opt_timestamp != NULL) ? ts.tv_sec : 0, cancellable, error))
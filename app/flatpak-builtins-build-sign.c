@@ -31,6 +31,7 @@
 
 #include "flatpak-builtins.h"
 #include "flatpak-utils-private.h"
+#include "flatpak-gpg-signer-private.h"
 
 static char *opt_arch;
 static gboolean opt_runtime;
@@ -56,10 +57,9 @@ flatpak_builtin_build_sign (int argc, char **argv, GCancellable *cancellable, GE
   const char *location;
   const char *branch;
   const char *id = NULL;
-  g_autofree char *commit_checksum = NULL;
   int i;
-  char **iter;
   g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) commits = g_ptr_array_new_with_free_func (g_free);
   const char *collection_id;
 
   context = g_option_context_new (_("LOCATION [ID [BRANCH]] - Sign an application or runtime"));
@@ -134,32 +134,23 @@ flatpak_builtin_build_sign (int argc, char **argv, GCancellable *cancellable, GE
   for (i = 0; i < refs->len; i++)
     {
       const char *ref = g_ptr_array_index (refs, i);
+      char *commit_checksum;
 
       if (!flatpak_repo_resolve_rev (repo, collection_id, NULL, ref, FALSE,
                                      &commit_checksum, cancellable, error))
         return FALSE;
 
-      for (iter = opt_gpg_key_ids; iter && *iter; iter++)
-        {
-          const char *keyid = *iter;
-          g_autoptr(GError) local_error = NULL;
-
-          if (!ostree_repo_sign_commit (repo,
-                                        commit_checksum,
-                                        keyid,
-                                        opt_gpg_homedir,
-                                        cancellable,
-                                        &local_error))
-            {
-              if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
-                {
-                  g_propagate_error (error, g_steal_pointer (&local_error));
-                  return FALSE;
-                }
-            }
-        }
+      g_ptr_array_add (commits, commit_checksum);
     }
 
+  /* Keys that already signed a commit are skipped */
+  if (!flatpak_gpg_sign_commits (repo, commits,
+                                 (const char **) opt_gpg_key_ids,
+                                 opt_gpg_homedir,
+                                 g_get_num_processors (),
+                                 cancellable, error))
+    return FALSE;
+
   return TRUE;
 }
 
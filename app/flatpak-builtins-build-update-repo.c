@@ -304,6 +304,59 @@ spawn_delta_generation (GMainContext *context,
   return TRUE;
 }
 
+typedef struct
+{
+  char   *ref;
+  char   *from;
+  char   *to;
+  guint64 size;
+} DeltaJob;
+
+static void
+delta_job_free (DeltaJob *job)
+{
+  g_free (job->ref);
+  g_free (job->from);
+  g_free (job->to);
+  g_free (job);
+}
+
+static void
+add_delta_job (GPtrArray  *jobs,
+               const char *ref,
+               const char *from,
+               const char *to,
+               GVariant   *to_commitv)
+{
+  g_autoptr(GVariant) metadata = g_variant_get_child_value (to_commitv, 0);
+  DeltaJob *job = g_new0 (DeltaJob, 1);
+  guint64 installed_size;
+
+  job->ref = g_strdup (ref);
+  job->from = g_strdup (from);
+  job->to = g_strdup (to);
+
+  /* The installed size of the target is a rough estimate of how much work
+   * the delta is, good enough to start the big ones first */
+  if (g_variant_lookup (metadata, "xa.installed-size", "t", &installed_size))
+    job->size = GUINT64_FROM_BE (installed_size);
+
+  g_ptr_array_add (jobs, job);
+}
+
+static int
+delta_job_compare (gconstpointer a,
+                   gconstpointer b)
+{
+  const DeltaJob *job_a = *(const DeltaJob **) a;
+  const DeltaJob *job_b = *(const DeltaJob **) b;
+
+  if (job_a->size != job_b->size)
+    return job_a->size > job_b->size ? -1 : 1;
+
+  return 0;
+}
+
 static gboolean
 generate_all_deltas (OstreeRepo   *repo,
                      GPtrArray   **unwanted_deltas,
@@ -322,6 +375,7 @@ generate_all_deltas (OstreeRepo   *repo,
   int n_spawned_delta_generate = 0;
   g_autoptr(GMainContextPopDefault) context = NULL;
   g_autoptr(GPtrArray) ignore_patterns = g_ptr_array_new_with_free_func ((GDestroyNotify)g_pattern_spec_free);
+  g_autoptr(GPtrArray) jobs = g_ptr_array_new_with_free_func ((GDestroyNotify) delta_job_free);
 
   g_print ("Generating static deltas\n");
 
@@ -413,12 +467,7 @@ generate_all_deltas (OstreeRepo   *repo,
 
       /* From empty */
       if (!g_hash_table_contains (all_deltas_hash, commit))
-        {
-          if (!spawn_delta_generation (context, &n_spawned_delta_generate, repo, params,
-                                       ref, NULL, commit,
-                                       error))
-            return FALSE;
-        }
+        add_delta_job (jobs, ref, NULL, commit, variant);
 
       /* Mark this one as wanted */
       g_hash_table_insert (wanted_deltas_hash, g_strdup (commit), GINT_TO_POINTER (1));
@@ -439,12 +488,7 @@ generate_all_deltas (OstreeRepo   *repo,
           g_autofree char *from_parent = g_strdup_printf ("%s-%s", parent_commit, commit);
 
           if (!g_hash_table_contains (all_deltas_hash, from_parent))
-            {
-              if (!spawn_delta_generation (context, &n_spawned_delta_generate, repo, params,
-                                           ref, parent_commit, commit,
-                                           error))
-                return FALSE;
-            }
+            add_delta_job (jobs, ref, parent_commit, commit, variant);
 
           /* Mark parent-to-current as wanted */
           g_hash_table_insert (wanted_deltas_hash, g_strdup (from_parent), GINT_TO_POINTER (1));
@@ -464,6 +508,20 @@ generate_all_deltas (OstreeRepo   *repo,
         }
     }
 
+  /* Only deltas that don't exist yet get here. Start the largest ones
+   * first so they don't end up running alone at the end. */
+  g_ptr_array_sort (jobs, delta_job_compare);
+
+  for (i = 0; i < jobs->len; i++)
+    {
+      DeltaJob *job = g_ptr_array_index (jobs, i);
+
+      if (!spawn_delta_generation (context, &n_spawned_delta_generate, repo, params,
+                                   job->ref, job->from, job->to,
+                                   error))
+        return FALSE;
+    }
+
   while (n_spawned_delta_generate > 0)
     g_main_context_iteration (context, TRUE);
 
@@ -655,6 +713,9 @@ flatpak_builtin_build_update_repo (int argc, char **argv,
                               cancellable, error))
         return FALSE;
 
+      if (!opt_prune_dry_run)
+        flatpak_repo_prune_size_memo (repo, cancellable);
+
       formatted_freed_size = g_format_size_full (objsize_total, 0);
 
       g_print (_("Total objects: %u\n"), n_objects_total);
@@ -177,6 +177,32 @@ parse_lang (const char *value, GError **error)
   return g_strdup (value);
 }
 
+static char *
+parse_size (const char *value, GError **error)
+{
+  guint64 size;
+
+  if (!flatpak_utils_ascii_string_to_unsigned (value, 10, 0, G_MAXUINT64, &size, NULL))
+    {
+      flatpak_fail (error, _("'%s' is not a size in bytes"), value);
+      return NULL;
+    }
+
+  return g_strdup_printf ("%" G_GUINT64_FORMAT, size);
+}
+
+static char *
+parse_boolean (const char *value, GError **error)
+{
+  if (strcmp (value, "true") != 0 && strcmp (value, "false") != 0)
+    {
+      flatpak_fail (error, _("'%s' is not true or false"), value);
+      return NULL;
+    }
+
+  return g_strdup (value);
+}
+
 static char *
 print_locale (const char *value)
 {
@@ -191,6 +217,18 @@ print_lang (const char *value)
   return g_strdup (value);
 }
 
+static char *
+print_size (const char *value)
+{
+  return g_strdup (value);
+}
+
+static char *
+print_boolean (const char *value)
+{
+  return g_strdup (value);
+}
+
 static char *
 get_lang_default (FlatpakDir *dir)
 {
@@ -210,6 +248,8 @@ typedef struct
 ConfigKey keys[] = {
   { "languages", parse_lang, print_lang, get_lang_default },
   { "extra-languages", parse_locale, print_locale, NULL },
+  { "summary-low-memory", parse_boolean, print_boolean, NULL },
+  { "prefetch-download-limit", parse_size, print_size, NULL },
 };
 
 static ConfigKey *
@@ -39,6 +39,7 @@ static char *opt_destination_repo;
 static gboolean opt_runtime;
 static gboolean opt_app;
 static gboolean opt_allow_partial;
+static char **opt_delta_from;
 
 static GOptionEntry options[] = {
   { "app", 0, 0, G_OPTION_ARG_NONE, &opt_app, N_("Look for app with the specified name"), NULL },
@@ -46,6 +47,7 @@ static GOptionEntry options[] = {
   { "destination-repo", 0, 0, G_OPTION_ARG_FILENAME, &opt_destination_repo, "Use custom repository directory within the mount", N_("DEST") },
   { "runtime", 0, 0, G_OPTION_ARG_NONE, &opt_runtime, N_("Look for runtime with the specified name"), NULL },
   { "allow-partial", 0, 0, G_OPTION_ARG_NONE, &opt_allow_partial, N_("Allow partial commits in the created repo"), NULL },
+  { "delta-from", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_delta_from, N_("Generate a static delta from COMMIT to the copied commit of its ref"), N_("COMMIT") },
   { NULL }
 };
 
@@ -287,6 +289,376 @@ add_runtime (GHashTable        *all_refs,
   return TRUE;
 }
 
+typedef struct
+{
+  OstreeRepo   *src_repo;
+  OstreeRepo   *dest_repo;
+  GCancellable *cancellable;
+  GMutex        lock;
+  GError       *error;
+} ObjectCopy;
+
+static void
+copy_object_thread (gpointer data,
+                    gpointer user_data)
+{
+  GVariant *object = data;
+  ObjectCopy *copy = user_data;
+  g_autoptr(GError) local_error = NULL;
+  const char *checksum;
+  OstreeObjectType objtype;
+  gboolean have_object;
+  gboolean failed;
+
+  g_mutex_lock (&copy->lock);
+  failed = copy->error != NULL;
+  g_mutex_unlock (&copy->lock);
+
+  /* Don't bother with the rest once something failed */
+  if (failed)
+    return;
+
+  ostree_object_name_deserialize (object, &checksum, &objtype);
+
+  /* The import reflinks or copies the file with copy_file_range() if the
+   * repo modes allow it, and converts the object otherwise */
+  if (!ostree_repo_has_object (copy->dest_repo, objtype, checksum, &have_object,
+                               copy->cancellable, &local_error) ||
+      (!have_object &&
+       !ostree_repo_import_object_from_with_trust (copy->dest_repo, copy->src_repo,
+                                                   objtype, checksum, TRUE,
+                                                   copy->cancellable, &local_error)))
+    {
+      g_mutex_lock (&copy->lock);
+      if (copy->error == NULL)
+        copy->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&copy->lock);
+    }
+}
+
+static int
+object_name_compare (gconstpointer a,
+                     gconstpointer b)
+{
+  GVariant *object_a = *(GVariant **) a;
+  GVariant *object_b = *(GVariant **) b;
+  const char *checksum_a, *checksum_b;
+  OstreeObjectType objtype_a, objtype_b;
+
+  ostree_object_name_deserialize (object_a, &checksum_a, &objtype_a);
+  ostree_object_name_deserialize (object_b, &checksum_b, &objtype_b);
+
+  if (objtype_a != objtype_b)
+    return objtype_a < objtype_b ? -1 : 1;
+
+  return strcmp (checksum_a, checksum_b);
+}
+
+/* Adds the objects reachable from @commit to @objects, leaving out the
+ * commit object itself */
+static gboolean
+collect_commit_objects (OstreeRepo   *repo,
+                        const char   *commit,
+                        GHashTable   *objects,
+                        GCancellable *cancellable,
+                        GError      **error)
+{
+  g_autoptr(GHashTable) reachable = NULL;
+
+  if (!ostree_repo_traverse_commit (repo, commit, 0, &reachable, cancellable, error))
+    return FALSE;
+
+  GLNX_HASH_TABLE_FOREACH (reachable, GVariant *, object)
+  {
+    const char *checksum;
+    OstreeObjectType objtype;
+
+    ostree_object_name_deserialize (object, &checksum, &objtype);
+    if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+      continue;
+
+    g_hash_table_add (objects, g_variant_ref (object));
+  }
+
+  return TRUE;
+}
+
+/* Copies @objects from @src_repo to @dest_repo in one transaction, using a
+ * pool of worker threads. Nothing is synced to disk per object; the writes
+ * are flushed together when the transaction is committed, which suits slow
+ * removable media much better than many small synchronous writes. */
+static gboolean
+copy_objects (OstreeRepo   *src_repo,
+              OstreeRepo   *dest_repo,
+              GHashTable   *objects,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  g_autoptr(GPtrArray) sorted = NULL;
+  ObjectCopy copy = { 0 };
+  GThreadPool *pool;
+  gboolean res = TRUE;
+  guint i;
+
+  if (g_hash_table_size (objects) == 0)
+    return TRUE;
+
+  /* Write the objects in a stable order, so the files of each objects/
+   * subdirectory are created together */
+  sorted = g_ptr_array_new ();
+  GLNX_HASH_TABLE_FOREACH (objects, GVariant *, object)
+  {
+    g_ptr_array_add (sorted, object);
+  }
+  g_ptr_array_sort (sorted, object_name_compare);
+
+  if (!ostree_repo_prepare_transaction (dest_repo, NULL, cancellable, error))
+    return FALSE;
+
+  copy.src_repo = src_repo;
+  copy.dest_repo = dest_repo;
+  copy.cancellable = cancellable;
+  g_mutex_init (&copy.lock);
+
+  pool = g_thread_pool_new (copy_object_thread, &copy, g_get_num_processors (), FALSE, error);
+  if (pool == NULL)
+    res = FALSE;
+
+  for (i = 0; res && i < sorted->len; i++)
+    {
+      if (!g_thread_pool_push (pool, g_ptr_array_index (sorted, i), error))
+        res = FALSE;
+    }
+
+  if (pool != NULL)
+    g_thread_pool_free (pool, !res, TRUE);
+  g_mutex_clear (&copy.lock);
+
+  if (res && copy.error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&copy.error));
+      res = FALSE;
+    }
+  g_clear_error (&copy.error);
+
+  if (!res)
+    {
+      ostree_repo_abort_transaction (dest_repo, cancellable, NULL);
+      return FALSE;
+    }
+
+  return ostree_repo_commit_transaction (dest_repo, NULL, cancellable, error);
+}
+
+/* Copies the objects of all complete commits in @all_refs up front, so that
+ * objects shared between refs are only copied once and the per-ref pulls
+ * only have to add the commits and refs. Refs with subpaths are left to
+ * the pulls, which know how to copy just part of a commit. */
+static gboolean
+copy_all_ref_objects (OstreeRepo   *src_repo,
+                      OstreeRepo   *dest_repo,
+                      GHashTable   *all_refs,
+                      GCancellable *cancellable,
+                      GError      **error)
+{
+  g_autoptr(GHashTable) objects = g_hash_table_new_full (ostree_hash_object_name, g_variant_equal,
+                                                         (GDestroyNotify) g_variant_unref, NULL);
+
+  GLNX_HASH_TABLE_FOREACH_V (all_refs, CommitAndSubpaths *, c_s)
+  {
+    g_autoptr(GVariant) commitv = NULL;
+    OstreeRepoCommitState state;
+
+    if (c_s->commit == NULL || c_s->subpaths != NULL)
+      continue;
+
+    if (!ostree_repo_load_commit (src_repo, c_s->commit, &commitv, &state, error))
+      return FALSE;
+
+    if (state & OSTREE_REPO_COMMIT_STATE_PARTIAL)
+      continue;
+
+    if (!collect_commit_objects (src_repo, c_s->commit, objects, cancellable, error))
+      return FALSE;
+  }
+
+  g_debug ("Copying %u objects", g_hash_table_size (objects));
+
+  return copy_objects (src_repo, dest_repo, objects, cancellable, error);
+}
+
+static char *
+get_commit_ref (GVariant *commitv)
+{
+  g_autoptr(GVariant) metadata = g_variant_get_child_value (commitv, 0);
+  g_autofree const char **ref_bindings = NULL;
+  const char *ref;
+
+  if (g_variant_lookup (metadata, "xa.ref", "&s", &ref))
+    return g_strdup (ref);
+
+  if (g_variant_lookup (metadata, OSTREE_COMMIT_META_KEY_REF_BINDING, "^a&s", &ref_bindings) &&
+      ref_bindings[0] != NULL)
+    return g_strdup (ref_bindings[0]);
+
+  return NULL;
+}
+
+/* Moves the generated deltas from the deltas/ directory of @delta_repo_dfd
+ * to the same place in @dest_dfd */
+static gboolean
+move_deltas (int           delta_repo_dfd,
+             int           dest_dfd,
+             GCancellable *cancellable,
+             GError      **error)
+{
+  g_auto(GLnxDirFdIterator) prefix_iter = { 0, };
+
+  if (!glnx_dirfd_iterator_init_at (delta_repo_dfd, "deltas", FALSE, &prefix_iter, error))
+    return FALSE;
+
+  while (TRUE)
+    {
+      g_auto(GLnxDirFdIterator) iter = { 0, };
+      g_autofree char *dest_prefix = NULL;
+      struct dirent *prefix_dent;
+
+      if (!glnx_dirfd_iterator_next_dent_ensure_dtype (&prefix_iter, &prefix_dent, cancellable, error))
+        return FALSE;
+
+      if (prefix_dent == NULL)
+        break;
+
+      if (prefix_dent->d_type != DT_DIR)
+        continue;
+
+      dest_prefix = g_build_filename ("deltas", prefix_dent->d_name, NULL);
+      if (!glnx_shutil_mkdir_p_at (dest_dfd, dest_prefix, 0755, cancellable, error))
+        return FALSE;
+
+      if (!glnx_dirfd_iterator_init_at (prefix_iter.fd, prefix_dent->d_name, FALSE, &iter, error))
+        return FALSE;
+
+      while (TRUE)
+        {
+          g_autofree char *dest_path = NULL;
+          struct dirent *dent;
+
+          if (!glnx_dirfd_iterator_next_dent (&iter, &dent, cancellable, error))
+            return FALSE;
+
+          if (dent == NULL)
+            break;
+
+          dest_path = g_build_filename (dest_prefix, dent->d_name, NULL);
+          if (!glnx_shutil_rm_rf_at (dest_dfd, dest_path, cancellable, error) ||
+              !glnx_renameat (iter.fd, dent->d_name, dest_dfd, dest_path, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+/* Generates a static delta from each of the --delta-from commits to the
+ * copied commit of the same ref, so that recipients who have the older
+ * commit can update from the media efficiently. Generating a delta needs
+ * both commits, but the from commit shouldn't end up on the media, so the
+ * deltas are generated in a temporary repo next to @dest_repo that has
+ * @src_repo as its parent, and then moved into @dest_repo. */
+static gboolean
+generate_deltas (OstreeRepo   *src_repo,
+                 OstreeRepo   *dest_repo,
+                 GHashTable   *all_refs,
+                 GCancellable *cancellable,
+                 GError      **error)
+{
+  g_autoptr(GVariant) params = NULL;
+  g_auto(GVariantBuilder) param_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_auto(GLnxTmpDir) tmpdir = { 0, };
+  g_autoptr(OstreeRepo) delta_repo = NULL;
+  g_autoptr(GKeyFile) config = NULL;
+  gsize i;
+
+  g_variant_builder_init (&param_builder, G_VARIANT_TYPE ("a{sv}"));
+  /* Fall back for 1 meg files */
+  g_variant_builder_add (&param_builder, "{sv}", "min-fallback-size", g_variant_new_uint32 (1));
+  params = g_variant_ref_sink (g_variant_builder_end (&param_builder));
+
+  /* Keep the temporary repo on the same file system as @dest_repo, so the
+   * deltas can be renamed into place */
+  if (!glnx_mkdtempat (ostree_repo_get_dfd (dest_repo), "tmp/delta-XXXXXX", 0755,
+                       &tmpdir, error))
+    return FALSE;
+
+  delta_repo = ostree_repo_create_at (tmpdir.fd, ".", OSTREE_REPO_MODE_ARCHIVE,
+                                      NULL, cancellable, error);
+  if (delta_repo == NULL)
+    return FALSE;
+
+  config = ostree_repo_copy_config (delta_repo);
+  g_key_file_set_string (config, "core", "parent",
+                         flatpak_file_get_path_cached (ostree_repo_get_path (src_repo)));
+  if (!ostree_repo_write_config (delta_repo, config, error))
+    return FALSE;
+
+  /* Reopen it to pick up the parent */
+  g_clear_object (&delta_repo);
+  delta_repo = ostree_repo_open_at (tmpdir.fd, ".", cancellable, error);
+  if (delta_repo == NULL)
+    return FALSE;
+
+  for (i = 0; opt_delta_from[i] != NULL; i++)
+    {
+      const char *from = opt_delta_from[i];
+      g_autoptr(GVariant) from_commitv = NULL;
+      g_autofree char *ref = NULL;
+      g_autofree char *to = NULL;
+      OstreeRepoCommitState state;
+
+      if (!ostree_repo_load_commit (src_repo, from, &from_commitv, &state, error))
+        return glnx_prefix_error (error, _("Can't generate delta from %s"), from);
+
+      if (state & OSTREE_REPO_COMMIT_STATE_PARTIAL)
+        return flatpak_fail (error, _("Can't generate delta from partial commit %s"), from);
+
+      ref = get_commit_ref (from_commitv);
+
+      GLNX_HASH_TABLE_FOREACH_KV (all_refs, OstreeCollectionRef *, c_r, CommitAndSubpaths *, c_s)
+      {
+        if (ref == NULL || c_s->subpaths != NULL || strcmp (c_r->ref_name, ref) != 0)
+          continue;
+
+        if (c_s->commit != NULL)
+          to = g_strdup (c_s->commit);
+        else if (!ostree_repo_resolve_collection_ref (dest_repo, c_r, FALSE,
+                                                      OSTREE_REPO_RESOLVE_REV_EXT_NONE,
+                                                      &to, cancellable, error))
+          return FALSE;
+        break;
+      }
+
+      if (to == NULL)
+        {
+          g_printerr (_("Warning: Not generating delta from %s, its ref is not being copied\n"), from);
+          continue;
+        }
+
+      if (strcmp (from, to) == 0)
+        continue;
+
+      g_print (_("Generating delta: %s (%.10s-%.10s)\n"), ref, from, to);
+
+      if (!ostree_repo_static_delta_generate (delta_repo, OSTREE_STATIC_DELTA_GENERATE_OPT_MAJOR,
+                                              from, to, NULL, params,
+                                              cancellable, error))
+        return glnx_prefix_error (error, _("Failed to generate delta %s (%.10s-%.10s)"),
+                                  ref, from, to);
+    }
+
+  return move_deltas (tmpdir.fd, ostree_repo_get_dfd (dest_repo), cancellable, error);
+}
+
 /* Copied from src/ostree/ot-builtin-create-usb.c in ostree.git, with slight modifications */
 static gboolean
 ostree_create_usb (GOptionContext *context,
@@ -337,6 +709,9 @@ ostree_create_usb (GOptionContext *context,
   if (!ostree_repo_is_writable (dest_repo, error))
     return glnx_prefix_error (error, "Cannot write to repository");
 
+  if (!copy_all_ref_objects (src_repo, dest_repo, all_refs, cancellable, error))
+    return FALSE;
+
   /* Copy across all of the collection–refs to the destination repo. We have to
    * do it one ref at a time in order to get the subpaths right. */
 
@@ -388,6 +763,10 @@ ostree_create_usb (GOptionContext *context,
     glnx_console_unlock (&console);
   }
 
+  if (opt_delta_from != NULL &&
+      !generate_deltas (src_repo, dest_repo, all_refs, cancellable, error))
+    return FALSE;
+
   /* Ensure a summary file is present to make it easier to look up commit checksums. */
   /* FIXME: It should be possible to work without this, but find_remotes_cb() in
    * ostree-repo-pull.c currently assumes a summary file (signed or unsigned) is
@@ -500,6 +879,12 @@ flatpak_builtin_create_usb (int argc, char **argv, GCancellable *cancellable, GE
   if (!glnx_fstat (mount_root_dfd, &mount_root_stbuf, error))
     return FALSE;
 
+  for (i = 0; opt_delta_from != NULL && opt_delta_from[i] != NULL; i++)
+    {
+      if (!ostree_validate_checksum_string (opt_delta_from[i], error))
+        return FALSE;
+    }
+
   prefs = &argv[2];
   n_prefs = argc - 2;
 
@@ -37,6 +37,7 @@
 
 #include "flatpak-builtins.h"
 #include "flatpak-builtins-utils.h"
+#include "flatpak-history-private.h"
 #include "flatpak-utils-private.h"
 #include "flatpak-table-printer.h"
 
@@ -71,39 +72,28 @@ static Column all_columns[] = {
   { NULL }
 };
 
-#ifdef HAVE_LIBSYSTEMD
+typedef char *(*GetFieldFunc) (gpointer    source,
+                               const char *name,
+                               GError    **error);
 
-static char *
-get_field (sd_journal *j,
-           const char *name,
-           GError    **error)
+static GDateTime *
+date_time_new_from_usec (gint64 t)
 {
-  const char *data;
-  gsize len;
-  int r;
-
-  if ((r = sd_journal_get_data (j, name, (const void **) &data, &len)) < 0)
-    {
-      if (r != -ENOENT)
-        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                     _("Failed to get journal data (%s): %s"),
-                     name, strerror (-r));
+  g_autoptr(GDateTime) seconds = g_date_time_new_from_unix_local (t / G_USEC_PER_SEC);
 
-      return NULL;
-    }
-
-  return g_strndup (data + strlen (name) + 1, len - (strlen (name) + 1));
+  return g_date_time_add (seconds, t % G_USEC_PER_SEC);
 }
 
 static GDateTime *
-get_time (sd_journal *j,
-          GError    **error)
+get_time (GetFieldFunc get_field,
+          gpointer     source,
+          GError     **error)
 {
   g_autofree char *value = NULL;
   GError *local_error = NULL;
   gint64 t;
 
-  value = get_field (j, "_SOURCE_REALTIME_TIMESTAMP", &local_error);
+  value = get_field (source, "_SOURCE_REALTIME_TIMESTAMP", &local_error);
 
   if (local_error)
     {
@@ -111,32 +101,407 @@ get_time (sd_journal *j,
       return NULL;
     }
 
-  t = g_ascii_strtoll (value, NULL, 10) / 1000000;
-  return g_date_time_new_from_unix_local (t);
+  if (value == NULL)
+    return NULL;
+
+  t = g_ascii_strtoll (value, NULL, 10);
+  return date_time_new_from_usec (t);
 }
 
 static gboolean
-print_history (GPtrArray    *dirs,
-               Column       *columns,
-               GDateTime    *since,
-               GDateTime    *until,
-               gboolean      reverse,
-               GCancellable *cancellable,
-               GError      **error)
+print_entry (FlatpakTablePrinter *printer,
+             GPtrArray           *dirs,
+             Column              *columns,
+             GDateTime           *since,
+             GDateTime           *until,
+             GetFieldFunc         get_field,
+             gpointer             source,
+             GError             **error)
 {
-  g_autoptr(FlatpakTablePrinter) printer = NULL;
-  sd_journal *j;
-  int r;
+  g_autofree char *ref_str = NULL;
+  g_autofree char *remote = NULL;
   int i;
   int k;
-  int ret;
 
-  if (columns[0].name == NULL)
+  /* determine whether to skip this entry */
+
+  ref_str = get_field (source, "REF", error);
+  if (*error)
+    return FALSE;
+
+  /* Appstream pulls are probably not interesting, and they are confusing
+   * since by default we include the Application column which shows up blank.
+   */
+  if (ref_str && ref_str[0] && g_str_has_prefix (ref_str, "appstream"))
     return TRUE;
 
-  printer = flatpak_table_printer_new ();
+  remote = get_field (source, "REMOTE", error);
+  if (*error)
+    return FALSE;
 
-  flatpak_table_printer_set_columns (printer, columns, opt_cols == NULL);
+  /* Exclude pull to temp repo */
+  if (remote && remote[0] == '/')
+    return TRUE;
+
+  if (dirs)
+    {
+      gboolean include = FALSE;
+      g_autofree char *installation = get_field (source, "INSTALLATION", NULL);
+
+      for (i = 0; i < dirs->len && !include; i++)
+        {
+          g_autofree char *name = flatpak_dir_get_name (dirs->pdata[i]);
+          if (g_strcmp0 (name, installation) == 0)
+            include = TRUE;
+        }
+      if (!include)
+        return TRUE;
+    }
+
+  if (since || until)
+    {
+      g_autoptr(GDateTime) time = get_time (get_field, source, NULL);
+
+      if (since && time && g_date_time_difference (since, time) >= 0)
+        return TRUE;
+
+      if (until && time && g_date_time_difference (until, time) <= 0)
+        return TRUE;
+    }
+
+  for (k = 0; columns[k].name; k++)
+    {
+      if (strcmp (columns[k].name, "time") == 0)
+        {
+          g_autoptr(GDateTime) time = NULL;
+          g_autofree char *s = NULL;
+
+          time = get_time (get_field, source, error);
+          if (*error)
+            return FALSE;
+
+          if (time)
+            s = g_date_time_format (time, "%b %e %T");
+          flatpak_table_printer_add_column (printer, s);
+        }
+      else if (strcmp (columns[k].name, "change") == 0)
+        {
+          g_autofree char *op = get_field (source, "OPERATION", error);
+          if (*error)
+            return FALSE;
+          flatpak_table_printer_add_column (printer, op);
+        }
+      else if (strcmp (columns[k].name, "ref") == 0 ||
+               strcmp (columns[k].name, "application") == 0 ||
+               strcmp (columns[k].name, "arch") == 0 ||
+               strcmp (columns[k].name, "branch") == 0)
+        {
+          g_autofree char *value = NULL;
+
+          if (ref_str && ref_str[0] &&
+              !flatpak_is_app_runtime_or_appstream_ref (ref_str) &&
+              g_strcmp0 (ref_str, OSTREE_REPO_METADATA_REF) != 0)
+            g_warning ("Unknown ref in history: %s", ref_str);
+
+          if (strcmp (columns[k].name, "ref") == 0)
+            value = g_strdup (ref_str);
+          else if (ref_str && ref_str[0] &&
+                   (g_str_has_prefix (ref_str, "app/") ||
+                    g_str_has_prefix (ref_str, "runtime/")))
+            {
+              g_autoptr(FlatpakDecomposed) ref = NULL;
+              ref = flatpak_decomposed_new_from_ref (ref_str, NULL);
+              if (ref == NULL)
+                g_warning ("Invalid ref in history: %s", ref_str);
+              else
+                {
+                  if (strcmp (columns[k].name, "application") == 0)
+                    value = flatpak_decomposed_dup_id (ref);
+                  else if (strcmp (columns[k].name, "arch") == 0)
+                    value = flatpak_decomposed_dup_arch (ref);
+                  else
+                    value = flatpak_decomposed_dup_branch (ref);
+                }
+            }
+
+            flatpak_table_printer_add_column (printer, value);
+        }
+      else if (strcmp (columns[k].name, "installation") == 0)
+        {
+          g_autofree char *installation = get_field (source, "INSTALLATION", error);
+          if (*error)
+            return FALSE;
+          flatpak_table_printer_add_column (printer, installation);
+        }
+      else if (strcmp (columns[k].name, "remote") == 0)
+        {
+          flatpak_table_printer_add_column (printer, remote);
+        }
+      else if (strcmp (columns[k].name, "commit") == 0)
+        {
+          g_autofree char *commit = get_field (source, "COMMIT", error);
+          if (*error)
+            return FALSE;
+          flatpak_table_printer_add_column_len (printer, commit, 12);
+        }
+      else if (strcmp (columns[k].name, "old-commit") == 0)
+        {
+          g_autofree char *old_commit = get_field (source, "OLD_COMMIT", error);
+          if (*error)
+            return FALSE;
+          flatpak_table_printer_add_column_len (printer, old_commit, 12);
+        }
+      else if (strcmp (columns[k].name, "url") == 0)
+        {
+          g_autofree char *url = get_field (source, "URL", error);
+          if (*error)
+            return FALSE;
+          flatpak_table_printer_add_column (printer, url);
+        }
+      else if (strcmp (columns[k].name, "user") == 0)
+        {
+          g_autofree char *id = get_field (source, "_UID", error);
+          g_autofree char *oid = NULL;
+          int uid;
+          struct passwd *pwd;
+
+          if (*error)
+            return FALSE;
+
+          if (id)
+            {
+              uid = g_ascii_strtoll (id, NULL, 10);
+              pwd = getpwuid (uid);
+              if (pwd)
+                {
+                  g_free (id);
+                  id = g_strdup (pwd->pw_name);
+                }
+            }
+
+          oid = get_field (source, "OBJECT_UID", NULL);
+          if (oid)
+            {
+              /* flatpak-system-helper acting on behalf of sb else */
+              g_autofree char *str = NULL;
+              uid = g_ascii_strtoll (oid, NULL, 10);
+              pwd = getpwuid (uid);
+              str = g_strdup_printf ("%s (%s)", id, pwd ? pwd->pw_name : oid);
+              flatpak_table_printer_add_column (printer, str);
+            }
+          else
+            flatpak_table_printer_add_column (printer, id);
+        }
+      else if (strcmp (columns[k].name, "tool") == 0)
+        {
+          g_autofree char *exe = get_field (source, "_EXE", error);
+          g_autofree char *oexe = NULL;
+          g_autofree char *tool = NULL;
+          if (*error)
+            return FALSE;
+          if (exe)
+            tool = g_path_get_basename (exe);
+          oexe = get_field (source, "OBJECT_EXE", NULL);
+          if (oexe)
+            {
+              /* flatpak-system-helper acting on behalf of sb else */
+              g_autofree char *otool = NULL;
+              g_autofree char *str = NULL;
+
+              otool = g_path_get_basename (oexe);
+              str = g_strdup_printf ("%s (%s)", tool, otool);
+              flatpak_table_printer_add_column (printer, str);
+            }
+          else
+            flatpak_table_printer_add_column (printer, tool);
+        }
+      else if (strcmp (columns[k].name, "version") == 0)
+        {
+          g_autofree char *version = get_field (source, "FLATPAK_VERSION", error);
+          if (*error)
+            return FALSE;
+          flatpak_table_printer_add_column (printer, version);
+        }
+    }
+
+  flatpak_table_printer_finish_row (printer);
+
+  return TRUE;
+}
+
+static char *
+get_store_field (gpointer    source,
+                 const char *name,
+                 GError    **error)
+{
+  return flatpak_history_entry_dup_field (source, name);
+}
+
+static gint
+compare_entry_time (gconstpointer a,
+                    gconstpointer b)
+{
+  GVariant *entry_a = *(GVariant **) a;
+  GVariant *entry_b = *(GVariant **) b;
+  guint64 time_a, time_b;
+
+  g_variant_get_child (entry_a, 0, "t", &time_a);
+  g_variant_get_child (entry_b, 0, "t", &time_b);
+
+  if (time_a < time_b)
+    return -1;
+  if (time_a > time_b)
+    return 1;
+  return 0;
+}
+
+static gint64
+date_time_to_usec (GDateTime *time)
+{
+  return g_date_time_to_unix (time) * G_USEC_PER_SEC + g_date_time_get_microsecond (time);
+}
+
+/* The first store entry that is after @since, like in print_entry() */
+static gint64
+since_to_store_time (GDateTime *since)
+{
+  if (since == NULL)
+    return 0;
+
+  return date_time_to_usec (since) + 1;
+}
+
+/* Returns the history stores of all @dirs, or NULL if the journal has to be
+ * used instead because some store is missing or was created after @since. */
+static GPtrArray *
+open_history_stores (GPtrArray *dirs,
+                     GDateTime *since)
+{
+  g_autoptr(GPtrArray) logs = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_history_log_free);
+  int i;
+
+  if (dirs == NULL)
+    return NULL;
+
+  for (i = 0; i < dirs->len; i++)
+    {
+      FlatpakDir *dir = g_ptr_array_index (dirs, i);
+      g_autoptr(GError) local_error = NULL;
+      FlatpakHistoryLog *log;
+
+      log = flatpak_history_log_open (flatpak_dir_get_path (dir), &local_error);
+      if (log == NULL)
+        {
+          if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            g_debug ("Can't use history store: %s", local_error->message);
+#ifdef HAVE_LIBSYSTEMD
+          return NULL;
+#else
+          continue;
+#endif
+        }
+
+      g_ptr_array_add (logs, log);
+
+#ifdef HAVE_LIBSYSTEMD
+      if (since_to_store_time (since) < flatpak_history_log_get_created (log))
+        return NULL;
+#endif
+    }
+
+  return g_steal_pointer (&logs);
+}
+
+static gboolean
+print_store_history (FlatpakTablePrinter *printer,
+                     GPtrArray           *logs,
+                     GPtrArray           *dirs,
+                     Column              *columns,
+                     GDateTime           *since,
+                     GDateTime           *until,
+                     gboolean             reverse,
+                     GError             **error)
+{
+  g_autoptr(GPtrArray) entries = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  int i;
+
+  for (i = 0; i < logs->len; i++)
+    {
+      FlatpakHistoryLog *log = g_ptr_array_index (logs, i);
+      gsize n_entries = flatpak_history_log_get_n_entries (log);
+      gsize j;
+
+      for (j = flatpak_history_log_lookup_time (log, since_to_store_time (since)); j < n_entries; j++)
+        {
+          GVariant *entry;
+
+          if (until &&
+              flatpak_history_log_get_entry_time (log, j) >= date_time_to_usec (until))
+            break;
+
+          entry = flatpak_history_log_get_entry (log, j);
+          if (entry == NULL)
+            {
+              g_warning ("Invalid entry in history store");
+              continue;
+            }
+
+          g_ptr_array_add (entries, entry);
+        }
+    }
+
+  /* Merge the installations, the sort is stable */
+  g_ptr_array_sort (entries, compare_entry_time);
+
+  for (i = 0; i < entries->len; i++)
+    {
+      GVariant *entry = g_ptr_array_index (entries, reverse ? entries->len - i - 1 : i);
+
+      if (!print_entry (printer, dirs, columns, since, until,
+                        get_store_field, entry, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+#ifdef HAVE_LIBSYSTEMD
+
+static char *
+get_journal_field (gpointer    source,
+                   const char *name,
+                   GError    **error)
+{
+  sd_journal *j = source;
+  const char *data;
+  gsize len;
+  int r;
+
+  if ((r = sd_journal_get_data (j, name, (const void **) &data, &len)) < 0)
+    {
+      if (r != -ENOENT)
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     _("Failed to get journal data (%s): %s"),
+                     name, strerror (-r));
+
+      return NULL;
+    }
+
+  return g_strndup (data + strlen (name) + 1, len - (strlen (name) + 1));
+}
+
+static gboolean
+print_journal_history (FlatpakTablePrinter *printer,
+                       GPtrArray           *dirs,
+                       Column              *columns,
+                       GDateTime           *since,
+                       GDateTime           *until,
+                       gboolean             reverse,
+                       GError             **error)
+{
+  sd_journal *j;
+  int r;
+  int ret;
 
   if ((r = sd_journal_open (&j, 0)) < 0)
     {
@@ -149,6 +514,7 @@ print_history (GPtrArray    *dirs,
     {
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                    _("Failed to add match to journal: %s"), strerror (-r));
+      sd_journal_close (j);
       return FALSE;
     }
 
@@ -160,216 +526,20 @@ print_history (GPtrArray    *dirs,
     while ((reverse && sd_journal_previous (j) > 0) ||
            (!reverse && sd_journal_next (j) > 0))
       {
-        g_autofree char *ref_str = NULL;
-        g_autofree char *remote = NULL;
-
-        /* determine whether to skip this entry */
-
-        ref_str = get_field (j, "REF", error);
-        if (*error)
-          return FALSE;
-
-        /* Appstream pulls are probably not interesting, and they are confusing
-         * since by default we include the Application column which shows up blank.
-         */
-        if (ref_str && ref_str[0] && g_str_has_prefix (ref_str, "appstream"))
-          continue;
-
-        remote = get_field (j, "REMOTE", error);
-        if (*error)
-          return FALSE;
-
-        /* Exclude pull to temp repo */
-        if (remote && remote[0] == '/')
-          continue;
-
-        if (dirs)
-          {
-            gboolean include = FALSE;
-            g_autofree char *installation = get_field (j, "INSTALLATION", NULL);
-
-            for (i = 0; i < dirs->len && !include; i++)
-              {
-                g_autofree char *name = flatpak_dir_get_name (dirs->pdata[i]);
-                if (g_strcmp0 (name, installation) == 0)
-                  include = TRUE;
-              }
-            if (!include)
-              continue;
-          }
-
-        if (since || until)
-          {
-            g_autoptr(GDateTime) time = get_time (j, NULL);
-
-            if (since && time && g_date_time_difference (since, time) >= 0)
-              continue;
-
-            if (until && time && g_date_time_difference (until, time) <= 0)
-              continue;
-          }
-
-        for (k = 0; columns[k].name; k++)
+        if (!print_entry (printer, dirs, columns, since, until,
+                          get_journal_field, j, error))
           {
-            if (strcmp (columns[k].name, "time") == 0)
-              {
-                g_autoptr(GDateTime) time = NULL;
-                g_autofree char *s = NULL;
-
-                time = get_time (j, error);
-                if (*error)
-                  return FALSE;
-
-                s = g_date_time_format (time, "%b %e %T");
-                flatpak_table_printer_add_column (printer, s);
-              }
-            else if (strcmp (columns[k].name, "change") == 0)
-              {
-                g_autofree char *op = get_field (j, "OPERATION", error);
-                if (*error)
-                  return FALSE;
-                flatpak_table_printer_add_column (printer, op);
-              }
-            else if (strcmp (columns[k].name, "ref") == 0 ||
-                     strcmp (columns[k].name, "application") == 0 ||
-                     strcmp (columns[k].name, "arch") == 0 ||
-                     strcmp (columns[k].name, "branch") == 0)
-              {
-                g_autofree char *value = NULL;
-
-                if (ref_str && ref_str[0] &&
-                    !flatpak_is_app_runtime_or_appstream_ref (ref_str) &&
-                    g_strcmp0 (ref_str, OSTREE_REPO_METADATA_REF) != 0)
-                  g_warning ("Unknown ref in history: %s", ref_str);
-
-                if (strcmp (columns[k].name, "ref") == 0)
-                  value = g_strdup (ref_str);
-                else if (ref_str && ref_str[0] &&
-                         (g_str_has_prefix (ref_str, "app/") ||
-                          g_str_has_prefix (ref_str, "runtime/")))
-                  {
-                    g_autoptr(FlatpakDecomposed) ref = NULL;
-                    ref = flatpak_decomposed_new_from_ref (ref_str, NULL);
-                    if (ref == NULL)
-                      g_warning ("Invalid ref in history: %s", ref_str);
-                    else
-                      {
-                        if (strcmp (columns[k].name, "application") == 0)
-                          value = flatpak_decomposed_dup_id (ref);
-                        else if (strcmp (columns[k].name, "arch") == 0)
-                          value = flatpak_decomposed_dup_arch (ref);
-                        else
-                          value = flatpak_decomposed_dup_branch (ref);
-                      }
-                  }
-
-                  flatpak_table_printer_add_column (printer, value);
-              }
-            else if (strcmp (columns[k].name, "installation") == 0)
-              {
-                g_autofree char *installation = get_field (j, "INSTALLATION", error);
-                if (*error)
-                  return FALSE;
-                flatpak_table_printer_add_column (printer, installation);
-              }
-            else if (strcmp (columns[k].name, "remote") == 0)
-              {
-                flatpak_table_printer_add_column (printer, remote);
-              }
-            else if (strcmp (columns[k].name, "commit") == 0)
-              {
-                g_autofree char *commit = get_field (j, "COMMIT", error);
-                if (*error)
-                  return FALSE;
-                flatpak_table_printer_add_column_len (printer, commit, 12);
-              }
-            else if (strcmp (columns[k].name, "old-commit") == 0)
-              {
-                g_autofree char *old_commit = get_field (j, "OLD_COMMIT", error);
-                if (*error)
-                  return FALSE;
-                flatpak_table_printer_add_column_len (printer, old_commit, 12);
-              }
-            else if (strcmp (columns[k].name, "url") == 0)
-              {
-                g_autofree char *url = get_field (j, "URL", error);
-                if (*error)
-                  return FALSE;
-                flatpak_table_printer_add_column (printer, url);
-              }
-            else if (strcmp (columns[k].name, "user") == 0)
-              {
-                g_autofree char *id = get_field (j, "_UID", error);
-                g_autofree char *oid = NULL;
-                int uid;
-                struct passwd *pwd;
-
-                if (*error)
-                  return FALSE;
-
-                uid = g_ascii_strtoll (id, NULL, 10);
-                pwd = getpwuid (uid);
-                if (pwd)
-                  {
-                    g_free (id);
-                    id = g_strdup (pwd->pw_name);
-                  }
-
-                oid = get_field (j, "OBJECT_UID", NULL);
-                if (oid)
-                  {
-                    /* flatpak-system-helper acting on behalf of sb else */
-                    g_autofree char *str = NULL;
-                    uid = g_ascii_strtoll (oid, NULL, 10);
-                    pwd = getpwuid (uid);
-                    str = g_strdup_printf ("%s (%s)", id, pwd ? pwd->pw_name : oid);
-                    flatpak_table_printer_add_column (printer, str);
-                  }
-                else
-                  flatpak_table_printer_add_column (printer, id);
-              }
-            else if (strcmp (columns[k].name, "tool") == 0)
-              {
-                g_autofree char *exe = get_field (j, "_EXE", error);
-                g_autofree char *oexe = NULL;
-                g_autofree char *tool = NULL;
-                if (*error)
-                  return FALSE;
-                tool = g_path_get_basename (exe);
-                oexe = get_field (j, "OBJECT_EXE", NULL);
-                if (oexe)
-                  {
-                    /* flatpak-system-helper acting on behalf of sb else */
-                    g_autofree char *otool = NULL;
-                    g_autofree char *str = NULL;
-
-                    otool = g_path_get_basename (oexe);
-                    str = g_strdup_printf ("%s (%s)", tool, otool);
-                    flatpak_table_printer_add_column (printer, str);
-                  }
-                else
-                  flatpak_table_printer_add_column (printer, tool);
-              }
-            else if (strcmp (columns[k].name, "version") == 0)
-              {
-                g_autofree char *version = get_field (j, "FLATPAK_VERSION", error);
-                if (*error)
-                  return FALSE;
-                flatpak_table_printer_add_column (printer, version);
-              }
+            sd_journal_close (j);
+            return FALSE;
           }
-
-        flatpak_table_printer_finish_row (printer);
       }
 
-  flatpak_table_printer_print (printer);
-
   sd_journal_close (j);
 
   return TRUE;
 }
 
-#else
+#endif
 
 static gboolean
 print_history (GPtrArray    *dirs,
@@ -380,14 +550,39 @@ print_history (GPtrArray    *dirs,
                GCancellable *cancellable,
                GError      **error)
 {
+  g_autoptr(FlatpakTablePrinter) printer = NULL;
+  g_autoptr(GPtrArray) logs = NULL;
+
   if (columns[0].name == NULL)
     return TRUE;
 
-  g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "history not available without libsystemd");
-  return FALSE;
-}
+  printer = flatpak_table_printer_new ();
 
+  flatpak_table_printer_set_columns (printer, columns, opt_cols == NULL);
+
+  /* The per-installation history stores can be searched by time, so prefer
+   * them when they go back far enough. */
+  logs = open_history_stores (dirs, since);
+  if (logs != NULL)
+    {
+      if (!print_store_history (printer, logs, dirs, columns, since, until, reverse, error))
+        return FALSE;
+    }
+  else
+    {
+#ifdef HAVE_LIBSYSTEMD
+      if (!print_journal_history (printer, dirs, columns, since, until, reverse, error))
+        return FALSE;
+#else
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "history not available without libsystemd");
+      return FALSE;
 #endif
+    }
+
+  flatpak_table_printer_print (printer);
+
+  return TRUE;
+}
 
 static GDateTime *
 parse_time (const char *since_opt)
@@ -423,6 +618,12 @@ parse_time (const char *since_opt)
       rest = strptime (since_opt, fmts[i], &tm);
       if (rest && *rest == '\0')
         return g_date_time_new_local (tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+      /* Allow fractions of a second after the seconds */
+      if (rest && *rest == '.' && g_str_has_suffix (fmts[i], "%S") &&
+          g_ascii_isdigit (rest[1]) && strspn (rest + 1, "0123456789") == strlen (rest + 1))
+        return g_date_time_new_local (tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min,
+                                      tm.tm_sec + g_ascii_strtod (rest, NULL));
     }
 
   parts = g_strsplit (since_opt, " ", -1);
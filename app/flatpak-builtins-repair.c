@@ -362,6 +362,7 @@ flatpak_builtin_repair (int argc, char **argv, GCancellable *cancellable, GError
    *  * Remove leftover .removed contents
    *  + Enumerate all deployed refs:
    *  +   if they are not in the repo (or is partial for a non-subdir deploy), re-install them (pull + deploy)
+   *  + Sweep the whole exports dir for dangling symlinks, as regular updates only check the changed app
    */
 
   if (!flatpak_dir_delete_mirror_refs (dir, opt_dry_run, cancellable, error))
@@ -517,6 +518,18 @@ flatpak_builtin_repair (int argc, char **argv, GCancellable *cancellable, GError
         return FALSE;
     }
 
+  {
+    g_auto(GLnxLockFile) lock = { 0, };
+
+    g_print (_("Removing stale exports\n"));
+
+    if (!flatpak_dir_lock (dir, &lock, cancellable, error))
+      return FALSE;
+
+    if (!flatpak_dir_update_exports (dir, NULL, cancellable, error))
+      return FALSE;
+  }
+
   if (opt_reinstall_all)
     {
       g_print ("Reinstalling appstream\n");
@@ -33,6 +33,7 @@
 #include "flatpak-builtins-utils.h"
 #include "flatpak-cli-transaction.h"
 #include "flatpak-quiet-transaction.h"
+#include "flatpak-table-printer.h"
 #include "flatpak-utils-private.h"
 #include "flatpak-error.h"
 
@@ -51,6 +52,9 @@ static gboolean opt_app;
 static gboolean opt_appstream;
 static gboolean opt_yes;
 static gboolean opt_noninteractive;
+static gboolean opt_check;
+static gboolean opt_prefetch;
+static gboolean opt_force_prefetch;
 
 static GOptionEntry options[] = {
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, N_("Arch to update for"), N_("ARCH") },
@@ -67,11 +71,173 @@ static GOptionEntry options[] = {
   { "subpath", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_subpaths, N_("Only update this subpath"), N_("PATH") },
   { "assumeyes", 'y', 0, G_OPTION_ARG_NONE, &opt_yes, N_("Automatically answer yes for all questions"), NULL },
   { "noninteractive", 0, 0, G_OPTION_ARG_NONE, &opt_noninteractive, N_("Produce minimal output and don't ask questions"), NULL },
+  { "check", 0, 0, G_OPTION_ARG_NONE, &opt_check, N_("Only list the available updates, don't install them"), NULL },
+  { "prefetch", 0, 0, G_OPTION_ARG_NONE, &opt_prefetch, N_("Download the available updates in the background, don't deploy them"), NULL },
+  { "force-prefetch", 0, 0, G_OPTION_ARG_NONE, &opt_force_prefetch, N_("With --prefetch, also download on a metered network or on battery power"), NULL },
   /* Translators: A sideload is when you install from a local USB drive rather than the Internet. */
   { "sideload-repo", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_sideload_repos, N_("Use this local repo for sideloads"), N_("PATH") },
   { NULL }
 };
 
+/* This doesn't resolve a transaction, it only compares the deployed commits
+ * with the summaries of their remotes, so it is cheap enough to run often. */
+static gboolean
+check_updates (GPtrArray    *dirs,
+               FlatpakKinds  kinds,
+               gboolean      only_cached,
+               GCancellable *cancellable,
+               GError      **error)
+{
+  g_autoptr(FlatpakTablePrinter) printer = NULL;
+  gboolean has_updates = FALSE;
+  int i, k;
+
+  printer = flatpak_table_printer_new ();
+
+  i = 0;
+  flatpak_table_printer_set_column_title (printer, i++, _("Application ID"));
+  flatpak_table_printer_set_column_title (printer, i++, _("Arch"));
+  flatpak_table_printer_set_column_title (printer, i++, _("Branch"));
+  flatpak_table_printer_set_column_title (printer, i++, _("Installation"));
+  flatpak_table_printer_set_column_title (printer, i++, _("Remote"));
+  flatpak_table_printer_set_column_title (printer, i++, _("Commit"));
+  flatpak_table_printer_set_column_title (printer, i++, _("Download"));
+
+  for (k = 0; k < dirs->len; k++)
+    {
+      FlatpakDir *dir = g_ptr_array_index (dirs, k);
+      g_autoptr(GPtrArray) updates = NULL;
+
+      updates = flatpak_dir_list_available_updates (dir, only_cached, cancellable, error);
+      if (updates == NULL)
+        return FALSE;
+
+      for (i = 0; i < updates->len; i++)
+        {
+          FlatpakDirUpdateInfo *info = g_ptr_array_index (updates, i);
+          g_autofree char *download = NULL;
+
+          if ((flatpak_decomposed_get_kinds (info->ref) & kinds) == 0)
+            continue;
+
+          if (info->prefetched)
+            download = g_strdup (_("prefetched"));
+          else
+            download = g_format_size (info->download_size);
+
+          flatpak_table_printer_take_column (printer, flatpak_decomposed_dup_id (info->ref));
+          flatpak_table_printer_take_column (printer, flatpak_decomposed_dup_arch (info->ref));
+          flatpak_table_printer_take_column (printer, flatpak_decomposed_dup_branch (info->ref));
+          flatpak_table_printer_take_column (printer, flatpak_dir_get_name (dir));
+          flatpak_table_printer_add_column (printer, info->remote);
+          flatpak_table_printer_add_column_len (printer, info->commit, 12);
+          flatpak_table_printer_add_decimal_column (printer, download);
+          flatpak_table_printer_finish_row (printer);
+
+          has_updates = TRUE;
+        }
+    }
+
+  if (has_updates)
+    flatpak_table_printer_print (printer);
+  else
+    g_print (_("No updates available.\n"));
+
+  return TRUE;
+}
+
+static gboolean
+network_is_metered (void)
+{
+#if GLIB_CHECK_VERSION (2, 46, 0)
+  return g_network_monitor_get_network_metered (g_network_monitor_get_default ());
+#else
+  return FALSE;
+#endif
+}
+
+/* TRUE if there is a mains power supply, but none of them is online */
+static gboolean
+on_battery_power (void)
+{
+  const char *power_supply_dir = g_getenv ("FLATPAK_POWER_SUPPLY_DIR");
+  g_autoptr(GDir) dir = NULL;
+  gboolean has_mains = FALSE;
+  const char *name;
+
+  /* The tests point this at a fake sysfs directory */
+  if (power_supply_dir == NULL)
+    power_supply_dir = "/sys/class/power_supply";
+
+  dir = g_dir_open (power_supply_dir, 0, NULL);
+  if (dir == NULL)
+    return FALSE;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      g_autofree char *type_path = g_build_filename (power_supply_dir, name, "type", NULL);
+      g_autofree char *online_path = g_build_filename (power_supply_dir, name, "online", NULL);
+      g_autofree char *type = NULL;
+      g_autofree char *online = NULL;
+
+      if (!g_file_get_contents (type_path, &type, NULL, NULL) ||
+          !g_str_has_prefix (type, "Mains"))
+        continue;
+
+      has_mains = TRUE;
+
+      if (g_file_get_contents (online_path, &online, NULL, NULL) &&
+          g_str_has_prefix (online, "1"))
+        return FALSE;
+    }
+
+  return has_mains;
+}
+
+/* This is meant to be run from a timer, so unless forced it does nothing
+ * rather than get in the way of the user when the network is metered or
+ * the system is on battery. */
+static gboolean
+prefetch_updates (GPtrArray    *dirs,
+                  gboolean      force,
+                  GCancellable *cancellable,
+                  GError      **error)
+{
+  int i, k;
+
+  if (!force && network_is_metered ())
+    {
+      g_print (_("Not prefetching updates on a metered network.\n"));
+      return TRUE;
+    }
+
+  if (!force && on_battery_power ())
+    {
+      g_print (_("Not prefetching updates on battery power.\n"));
+      return TRUE;
+    }
+
+  for (k = 0; k < dirs->len; k++)
+    {
+      FlatpakDir *dir = g_ptr_array_index (dirs, k);
+      g_autoptr(GPtrArray) updates = NULL;
+
+      updates = flatpak_dir_prefetch_updates (dir, cancellable, error);
+      if (updates == NULL)
+        return FALSE;
+
+      for (i = 0; i < updates->len; i++)
+        {
+          FlatpakDirUpdateInfo *info = g_ptr_array_index (updates, i);
+
+          if (info->prefetched)
+            g_print (_("Prefetched %s\n"), flatpak_decomposed_get_ref (info->ref));
+        }
+    }
+
+  return TRUE;
+}
+
 gboolean
 flatpak_builtin_update (int           argc,
                         char        **argv,
@@ -103,6 +269,26 @@ flatpak_builtin_update (int           argc,
       return TRUE;
     }
 
+  if (opt_check)
+    {
+      if (argc > 1)
+        return usage_error (context, _("With --check, no REF may be specified"), error);
+
+      return check_updates (dirs, flatpak_kinds_from_bools (opt_app, opt_runtime),
+                            opt_no_pull, cancellable, error);
+    }
+
+  if (opt_prefetch)
+    {
+      if (argc > 1)
+        return usage_error (context, _("With --prefetch, no REF may be specified"), error);
+
+      return prefetch_updates (dirs, opt_force_prefetch, cancellable, error);
+    }
+
+  if (opt_force_prefetch)
+    return usage_error (context, _("--force-prefetch can only be used with --prefetch"), error);
+
   if (opt_noninteractive)
     opt_yes = TRUE; /* Implied */
 
@@ -0,0 +1,35 @@
+/*
+ * Copyright © 2022 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_CHANGE_LOG_H__
+#define __FLATPAK_CHANGE_LOG_H__
+
+#include <gio/gio.h>
+
+#include "flatpak-installation.h"
+
+gboolean  flatpak_change_log_append     (GFile                         *basedir,
+                                         FlatpakInstallationChangeKind  kind,
+                                         const char                    *name,
+                                         GError                       **error);
+guint64   flatpak_change_log_get_latest (GFile                         *basedir);
+GPtrArray *flatpak_change_log_read      (GFile                         *basedir,
+                                         guint64                        since,
+                                         guint64                       *out_latest,
+                                         GError                       **error);
+
+#endif /* __FLATPAK_CHANGE_LOG_H__ */
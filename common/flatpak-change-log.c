@@ -0,0 +1,326 @@
+/*
+ * Copyright © 2022 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <glib/gi18n-lib.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "flatpak-change-log-private.h"
+#include "flatpak-error.h"
+#include "flatpak-installation-private.h"
+#include "flatpak-utils-private.h"
+#include "libglnx/libglnx.h"
+
+/* The change log is an append-only list of the changes made to an
+ * installation, so that clients can find out what changed since they last
+ * looked rather than rescanning everything whenever the .changed file is
+ * touched.
+ *
+ * It lives in $basedir/changes, with one line per change:
+ *
+ *   <sequence number> <kind> <name>
+ *
+ * Sequence numbers start at 1 and increase by one for each change. Names
+ * are refs, pin patterns or remote names, none of which contain spaces.
+ *
+ * Writers take an exclusive flock() on the file and append a whole line
+ * with a single write(), so readers need no locking and just ignore a
+ * trailing partial line. When the log grows over CHANGE_LOG_MAX_SIZE the
+ * oldest half is dropped, by atomically replacing the file. Writers that
+ * were waiting on the lock of the replaced file notice it has been
+ * renamed over and retry with the new one.
+ */
+
+#define CHANGE_LOG_FILE "changes"
+#define CHANGE_LOG_MAX_SIZE (64 * 1024)
+
+static const char *change_kinds[] = {
+  "deployed",      /* FLATPAK_INSTALLATION_CHANGE_KIND_DEPLOYED */
+  "undeployed",    /* FLATPAK_INSTALLATION_CHANGE_KIND_UNDEPLOYED */
+  "pinned",        /* FLATPAK_INSTALLATION_CHANGE_KIND_PINNED */
+  "unpinned",      /* FLATPAK_INSTALLATION_CHANGE_KIND_UNPINNED */
+  "remote",        /* FLATPAK_INSTALLATION_CHANGE_KIND_REMOTE_CHANGED */
+};
+
+static gboolean
+parse_change (const char                    *line,
+              const char                    *end,
+              guint64                       *out_seq,
+              FlatpakInstallationChangeKind *out_kind,
+              char                         **out_name)
+{
+  g_autofree char *str = g_strndup (line, end - line);
+  g_auto(GStrv) parts = g_strsplit (str, " ", 3);
+  char *seq_end;
+  guint64 seq;
+
+  if (g_strv_length (parts) != 3)
+    return FALSE;
+
+  seq = g_ascii_strtoull (parts[0], &seq_end, 10);
+  if (*seq_end != 0 || seq == 0)
+    return FALSE;
+
+  for (gsize i = 0; i < G_N_ELEMENTS (change_kinds); i++)
+    {
+      if (strcmp (parts[1], change_kinds[i]) == 0)
+        {
+          *out_seq = seq;
+          *out_kind = i;
+          if (out_name)
+            *out_name = g_steal_pointer (&parts[2]);
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/* Returns the start of the last complete line in @data, or NULL */
+static const char *
+find_last_line (const char *data,
+                gsize       size)
+{
+  const char *p;
+
+  if (size == 0)
+    return NULL;
+
+  p = data + size - 1; /* The final newline */
+  while (p > data && p[-1] != '\n')
+    p--;
+
+  return p;
+}
+
+static guint64
+get_latest_seq (const char *data,
+                gsize       size)
+{
+  const char *last_line = find_last_line (data, size);
+  FlatpakInstallationChangeKind kind;
+  guint64 seq;
+
+  if (last_line == NULL ||
+      !parse_change (last_line, data + size - 1, &seq, &kind, NULL))
+    return 0;
+
+  return seq;
+}
+
+/* The size of the complete lines in @data */
+static gsize
+get_valid_size (const char *data,
+                gsize       size)
+{
+  while (size > 0 && data[size - 1] != '\n')
+    size--;
+
+  return size;
+}
+
+gboolean
+flatpak_change_log_append (GFile                         *basedir,
+                           FlatpakInstallationChangeKind  kind,
+                           const char                    *name,
+                           GError                       **error)
+{
+  g_autofree char *path = NULL;
+  g_autofree char *line = NULL;
+  g_autoptr(GBytes) contents = NULL;
+  glnx_autofd int fd = -1;
+  const char *data;
+  gsize size, valid_size, line_len;
+
+  g_return_val_if_fail (kind < G_N_ELEMENTS (change_kinds), FALSE);
+
+  path = g_build_filename (flatpak_file_get_path_cached (basedir), CHANGE_LOG_FILE, NULL);
+
+  while (TRUE)
+    {
+      struct stat fd_stbuf, path_stbuf;
+
+      fd = open (path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC | O_NOCTTY, 0644);
+      if (fd == -1)
+        return glnx_throw_errno_prefix (error, "Can't open change log");
+
+      if (flock (fd, LOCK_EX) != 0)
+        return glnx_throw_errno_prefix (error, "Can't lock change log");
+
+      if (!glnx_fstat (fd, &fd_stbuf, error))
+        return FALSE;
+
+      /* Retry if the log was compacted while we waited for the lock */
+      if (stat (path, &path_stbuf) == 0 &&
+          fd_stbuf.st_dev == path_stbuf.st_dev &&
+          fd_stbuf.st_ino == path_stbuf.st_ino)
+        break;
+
+      glnx_close_fd (&fd);
+    }
+
+  contents = glnx_fd_readall_bytes (fd, NULL, error);
+  if (contents == NULL)
+    return FALSE;
+
+  data = g_bytes_get_data (contents, &size);
+  valid_size = get_valid_size (data, size);
+
+  line = g_strdup_printf ("%" G_GUINT64_FORMAT " %s %s\n",
+                          get_latest_seq (data, valid_size) + 1, change_kinds[kind], name);
+  line_len = strlen (line);
+
+  if (valid_size + line_len > CHANGE_LOG_MAX_SIZE)
+    {
+      g_autoptr(GString) compacted = g_string_new ("");
+      const char *keep;
+
+      keep = memchr (data + valid_size / 2, '\n', valid_size - valid_size / 2);
+      keep = keep ? keep + 1 : data + valid_size;
+
+      g_string_append_len (compacted, keep, data + valid_size - keep);
+      g_string_append_len (compacted, line, line_len);
+
+      return glnx_file_replace_contents_at (AT_FDCWD, path,
+                                            (const guint8 *) compacted->str, compacted->len,
+                                            GLNX_FILE_REPLACE_NODATASYNC,
+                                            NULL, error);
+    }
+
+  /* Drop any partial line left by a writer that died half-way */
+  if (valid_size != size && ftruncate (fd, valid_size) != 0)
+    return glnx_throw_errno_prefix (error, "Can't truncate change log");
+
+  if (glnx_loop_write (fd, line, line_len) < 0)
+    return glnx_throw_errno_prefix (error, "Can't write change log");
+
+  return TRUE;
+}
+
+static GBytes *
+load_change_log (GFile   *basedir,
+                 GError **error)
+{
+  g_autofree char *path = NULL;
+  glnx_autofd int fd = -1;
+
+  path = g_build_filename (flatpak_file_get_path_cached (basedir), CHANGE_LOG_FILE, NULL);
+
+  fd = open (path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd == -1)
+    {
+      if (errno == ENOENT)
+        return g_bytes_new_static ("", 0);
+
+      return glnx_null_throw_errno_prefix (error, "Can't open change log");
+    }
+
+  return glnx_fd_readall_bytes (fd, NULL, error);
+}
+
+/* Returns the sequence number of the latest change, or 0 if there is none */
+guint64
+flatpak_change_log_get_latest (GFile *basedir)
+{
+  g_autoptr(GBytes) contents = NULL;
+  const char *data;
+  gsize size;
+
+  contents = load_change_log (basedir, NULL);
+  if (contents == NULL)
+    return 0;
+
+  data = g_bytes_get_data (contents, &size);
+
+  return get_latest_seq (data, get_valid_size (data, size));
+}
+
+/* Returns the changes after @since as FlatpakInstallationChanges,
+ * failing with FLATPAK_ERROR_NOT_CACHED unless all of them are still in
+ * the log. */
+GPtrArray *
+flatpak_change_log_read (GFile    *basedir,
+                         guint64   since,
+                         guint64  *out_latest,
+                         GError  **error)
+{
+  g_autoptr(GPtrArray) changes = NULL;
+  g_autoptr(GBytes) contents = NULL;
+  const char *data, *line, *end;
+  gsize size;
+  guint64 expected_seq = since + 1;
+  guint64 latest;
+  gboolean complete = TRUE;
+
+  contents = load_change_log (basedir, error);
+  if (contents == NULL)
+    return NULL;
+
+  data = g_bytes_get_data (contents, &size);
+  size = get_valid_size (data, size);
+  latest = get_latest_seq (data, size);
+
+  changes = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_installation_change_free);
+
+  for (line = data; line < data + size; line = end + 1)
+    {
+      g_autofree char *name = NULL;
+      FlatpakInstallationChangeKind kind;
+      guint64 seq;
+
+      end = memchr (line, '\n', data + size - line);
+
+      if (!parse_change (line, end, &seq, &kind, &name))
+        {
+          /* We can't tell which change this was, so it may be one we need */
+          complete = FALSE;
+          continue;
+        }
+
+      if (seq <= since)
+        continue;
+
+      /* The changes after @since must all be there, in order. This is not
+       * the case if the oldest of them were dropped when compacting the
+       * log, or if the log was recreated (e.g. with the installation) since
+       * the caller last looked. */
+      if (seq != expected_seq)
+        complete = FALSE;
+      expected_seq = seq + 1;
+
+      g_ptr_array_add (changes, flatpak_installation_change_new (seq, kind, name));
+    }
+
+  if (!complete || since > latest)
+    {
+      g_set_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_CACHED,
+                   _("Changes since %" G_GUINT64_FORMAT " are no longer available"), since);
+      return NULL;
+    }
+
+  if (out_latest)
+    *out_latest = latest;
+
+  return g_steal_pointer (&changes);
+}
@@ -26,6 +26,7 @@
 #include "flatpak-common-types-private.h"
 #include "flatpak-context-private.h"
 #include "flatpak-progress-private.h"
+#include "flatpak-ref-matcher-private.h"
 #include "flatpak-variant-private.h"
 #include "flatpak-ref-utils-private.h"
 #include "libglnx/libglnx.h"
@@ -139,8 +140,15 @@ typedef struct
   GBytes   *summary_sig_bytes;
   GError   *summary_fetch_error;
 
-  GRegex   *allow_refs;
-  GRegex   *deny_refs;
+  GMutex      ref_indexes_lock;
+  GHashTable *ref_indexes; /* summary GVariant -> FlatpakSummaryRefIndex, built lazily */
+
+  GMutex      related_cache_lock;
+  GHashTable *related_cache; /* cache key -> GVariant of related candidates */
+
+  char              *filter_checksum;
+  FlatpakRefMatcher *allow_refs;
+  FlatpakRefMatcher *deny_refs;
   int       refcount;
   gint32    default_token_type;
   GPtrArray *sideload_repos;
@@ -174,6 +182,12 @@ GPtrArray *flatpak_remote_state_match_subrefs (FlatpakRemoteState *self,
                                                FlatpakDecomposed *ref);
 GFile *flatpak_remote_state_lookup_sideload_checksum (FlatpakRemoteState *self,
                                                       char               *checksum);
+GVariant *flatpak_remote_state_get_summary_for_ref (FlatpakRemoteState *self,
+                                                    const char         *ref);
+gboolean flatpak_remote_state_lookup_cache_data (FlatpakRemoteState *self,
+                                                 const char         *ref,
+                                                 VarCacheDataRef    *out_cache_data,
+                                                 GError            **error);
 gboolean flatpak_remote_state_lookup_cache (FlatpakRemoteState *self,
                                             const char         *ref,
                                             guint64            *download_size,
@@ -201,11 +215,38 @@ GVariant *flatpak_remote_state_load_ref_commit (FlatpakRemoteState *self,
 void flatpak_remote_state_add_sideload_repo (FlatpakRemoteState *self,
                                              GFile               *path);
 
+/* Predicates on the refs listed by flatpak_dir_list_remote_refs_filtered(),
+ * evaluated on the ref names in the summary before anything is allocated
+ * for them. NULL strings match anything. */
+typedef struct
+{
+  FlatpakKinds kinds;
+  const char  *id_prefix;
+  const char  *arch;
+  const char  *branch;
+} FlatpakRemoteRefFilter;
+
+
+/* A deployed ref for which a different commit is available in its origin */
+typedef struct
+{
+  FlatpakDecomposed  *ref;
+  char               *remote;
+  char               *commit;
+  char               *installed_commit;
+  guint64             download_size;
+  guint64             installed_size;
+  gboolean            prefetched; /* The commit is already in the local repo */
+  FlatpakRemoteState *state;
+} FlatpakDirUpdateInfo;
+
+void flatpak_dir_update_info_free (FlatpakDirUpdateInfo *info);
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakDir, g_object_unref)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakDeploy, g_object_unref)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakRelated, flatpak_related_free)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakRemoteState, flatpak_remote_state_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakDirUpdateInfo, flatpak_dir_update_info_free)
 
 typedef enum {
   FLATPAK_HELPER_DEPLOY_FLAGS_NONE = 0,
@@ -757,6 +798,13 @@ gboolean              flatpak_dir_needs_update_for_commit_and_subpaths      (Fla
                                                                              FlatpakDecomposed             *ref,
                                                                              const char                    *target_commit,
                                                                              const char                   **opt_subpaths);
+GPtrArray *           flatpak_dir_list_available_updates                    (FlatpakDir                    *self,
+                                                                             gboolean                       only_cached,
+                                                                             GCancellable                  *cancellable,
+                                                                             GError                       **error);
+GPtrArray *           flatpak_dir_prefetch_updates                          (FlatpakDir                    *self,
+                                                                             GCancellable                  *cancellable,
+                                                                             GError                       **error);
 char *                flatpak_dir_check_for_update                          (FlatpakDir                    *self,
                                                                              FlatpakRemoteState            *state,
                                                                              FlatpakDecomposed             *ref,
@@ -933,11 +981,23 @@ gboolean              flatpak_dir_list_remote_refs                          (Fla
                                                                              GHashTable                   **refs,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
+gboolean              flatpak_dir_list_remote_refs_filtered                 (FlatpakDir                    *self,
+                                                                             FlatpakRemoteState            *state,
+                                                                             const FlatpakRemoteRefFilter  *filter,
+                                                                             GHashTable                   **refs,
+                                                                             GCancellable                  *cancellable,
+                                                                             GError                       **error);
 gboolean              flatpak_dir_list_all_remote_refs                      (FlatpakDir                    *self,
                                                                              FlatpakRemoteState            *state,
                                                                              GHashTable                   **out_all_refs,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
+gboolean              flatpak_dir_list_all_remote_refs_filtered             (FlatpakDir                    *self,
+                                                                             FlatpakRemoteState            *state,
+                                                                             const FlatpakRemoteRefFilter  *filter,
+                                                                             GHashTable                   **out_all_refs,
+                                                                             GCancellable                  *cancellable,
+                                                                             GError                       **error);
 gboolean              flatpak_dir_update_remote_configuration               (FlatpakDir                    *self,
                                                                              const char                    *remote,
                                                                              FlatpakRemoteState            *optional_remote_state,
@@ -30,6 +30,7 @@
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <utime.h>
 
 #include <glib/gi18n-lib.h>
@@ -39,6 +40,7 @@
 #include <libxml/tree.h>
 
 #include <gio/gio.h>
+#include <gio/gunixoutputstream.h>
 #include <gio/gunixsocketaddress.h>
 #include <ostree.h>
 
@@ -47,8 +49,10 @@
 #endif
 
 #include "flatpak-appdata-private.h"
+#include "flatpak-change-log-private.h"
 #include "flatpak-dir-private.h"
 #include "flatpak-error.h"
+#include "flatpak-history-private.h"
 #include "flatpak-oci-registry-private.h"
 #include "flatpak-ref.h"
 #include "flatpak-run-private.h"
@@ -161,8 +165,8 @@ static gboolean flatpak_dir_lookup_remote_filter (FlatpakDir *self,
                                                   const char *name,
                                                   gboolean    force_load,
                                                   char      **checksum_out,
-                                                  GRegex    **allow_regex,
-                                                  GRegex    **deny_regex,
+                                                  FlatpakRefMatcher **allow_refs,
+                                                  FlatpakRefMatcher **deny_refs,
                                                   GError **error);
 
 static void ensure_soup_session (FlatpakDir *self);
@@ -214,8 +218,8 @@ typedef struct {
   GTimeVal mtime;
   guint64 last_mtime_check;
   char *checksum;
-  GRegex *allow;
-  GRegex *deny;
+  FlatpakRefMatcher *allow;
+  FlatpakRefMatcher *deny;
 } RemoteFilter;
 
 struct FlatpakDir
@@ -238,8 +242,8 @@ struct FlatpakDir
   GHashTable      *remote_filters;
 
   /* Config cache, protected by config_cache lock */
-  GRegex          *masked;
-  GRegex          *pinned;
+  FlatpakRefMatcher *masked;
+  FlatpakRefMatcher *pinned;
 
   SoupSession     *soup_session;
 };
@@ -348,6 +352,10 @@ flatpak_remote_state_new (void)
   state->refcount = 1;
   state->sideload_repos = g_ptr_array_new_with_free_func ((GDestroyNotify)flatpak_sideload_state_free);
   state->subsummaries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)variant_maybe_unref);
+  g_mutex_init (&state->ref_indexes_lock);
+  state->ref_indexes = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)flatpak_summary_ref_index_free);
+  g_mutex_init (&state->related_cache_lock);
+  state->related_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_variant_unref);
   return state;
 }
 
@@ -373,18 +381,70 @@ flatpak_remote_state_unref (FlatpakRemoteState *remote_state)
       g_clear_pointer (&remote_state->index_ht, g_hash_table_unref);
       g_clear_pointer (&remote_state->index_sig_bytes, g_bytes_unref);
       g_clear_pointer (&remote_state->subsummaries, g_hash_table_unref);
+      g_clear_pointer (&remote_state->ref_indexes, g_hash_table_unref);
+      g_mutex_clear (&remote_state->ref_indexes_lock);
+      g_clear_pointer (&remote_state->related_cache, g_hash_table_unref);
+      g_mutex_clear (&remote_state->related_cache_lock);
       g_clear_pointer (&remote_state->summary, g_variant_unref);
       g_clear_pointer (&remote_state->summary_bytes, g_bytes_unref);
       g_clear_pointer (&remote_state->summary_sig_bytes, g_bytes_unref);
       g_clear_error (&remote_state->summary_fetch_error);
-      g_clear_pointer (&remote_state->allow_refs, g_regex_unref);
-      g_clear_pointer (&remote_state->deny_refs, g_regex_unref);
+      g_free (remote_state->filter_checksum);
+      g_clear_pointer (&remote_state->allow_refs, flatpak_ref_matcher_unref);
+      g_clear_pointer (&remote_state->deny_refs, flatpak_ref_matcher_unref);
       g_clear_pointer (&remote_state->sideload_repos, g_ptr_array_unref);
 
       g_free (remote_state);
     }
 }
 
+/* The ref index keeps a reference to the summary, so the pointer is a
+ * stable key even if the summary is dropped from the state. Each summary
+ * is always looked up with the same collection id (the remote's one for
+ * sideload repos, otherwise the main ref map).
+ *
+ * The state can be used from several threads, so the table is locked.
+ * Indexes are only freed with the state, so the returned one stays valid
+ * after unlocking. */
+static FlatpakSummaryRefIndex *
+flatpak_remote_state_get_ref_index (FlatpakRemoteState *self,
+                                    GVariant           *summary,
+                                    const char         *collection_id)
+{
+  FlatpakSummaryRefIndex *index;
+
+  g_mutex_lock (&self->ref_indexes_lock);
+
+  index = g_hash_table_lookup (self->ref_indexes, summary);
+  if (index == NULL)
+    {
+      index = flatpak_summary_ref_index_new (summary, collection_id);
+      if (index != NULL)
+        g_hash_table_insert (self->ref_indexes, summary, index);
+    }
+
+  g_mutex_unlock (&self->ref_indexes_lock);
+
+  return index;
+}
+
+/* Like flatpak_summary_lookup_ref(), but using the ref index */
+static gboolean
+flatpak_remote_state_lookup_summary_ref (FlatpakRemoteState *self,
+                                         GVariant           *summary,
+                                         const char         *collection_id,
+                                         const char         *ref,
+                                         char              **out_checksum,
+                                         VarRefInfoRef      *out_info)
+{
+  FlatpakSummaryRefIndex *index = flatpak_remote_state_get_ref_index (self, summary, collection_id);
+
+  if (index == NULL)
+    return FALSE;
+
+  return flatpak_summary_ref_index_lookup_ref (index, ref, out_checksum, out_info);
+}
+
 static gboolean
 _validate_summary_for_collection_id (GVariant    *summary_v,
                                      const char  *collection_id,
@@ -579,7 +639,7 @@ flatpak_remote_state_resolve_sideloaded_ref (FlatpakRemoteState *self,
       g_autofree char *sideload_checksum = NULL;
       VarRefInfoRef sideload_info;
 
-      if (flatpak_summary_lookup_ref (ss->summary, self->collection_id, ref, &sideload_checksum, &sideload_info))
+      if (flatpak_remote_state_lookup_summary_ref (self, ss->summary, self->collection_id, ref, &sideload_checksum, &sideload_info))
         {
           guint64 timestamp = get_timestamp_from_ref_info (sideload_info);
 
@@ -638,6 +698,15 @@ get_summary_for_ref (FlatpakRemoteState *self,
   return summary;
 }
 
+/* Returns the (sub)summary that has the data for @ref, or NULL if there
+ * is none, e.g. when only sideloading */
+GVariant *
+flatpak_remote_state_get_summary_for_ref (FlatpakRemoteState *self,
+                                          const char         *ref)
+{
+  return get_summary_for_ref (self, ref);
+}
+
 /* Returns TRUE if the ref is found in the summary or cache.
  * out_checksum and out_variant are only set when the ref is found.
  */
@@ -666,7 +735,7 @@ flatpak_remote_state_lookup_ref (FlatpakRemoteState *self,
 
       summary = get_summary_for_ref (self, ref);
       if (summary == NULL ||
-          !flatpak_summary_lookup_ref (summary, NULL, ref, &checksum, &info))
+          !flatpak_remote_state_lookup_summary_ref (self, summary, NULL, ref, &checksum, &info))
         return flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
                                    _("No such ref '%s' in remote %s"),
                                    ref, self->remote_name);
@@ -719,6 +788,7 @@ flatpak_remote_state_match_subrefs (FlatpakRemoteState *self,
                                     FlatpakDecomposed *ref)
 {
   GVariant *summary;
+  FlatpakSummaryRefIndex *index;
 
   if (self->summary == NULL && self->index == NULL)
     {
@@ -730,7 +800,11 @@ flatpak_remote_state_match_subrefs (FlatpakRemoteState *self,
   if (summary == NULL)
     return g_ptr_array_new_with_free_func ((GDestroyNotify)flatpak_decomposed_unref);
 
-  return flatpak_summary_match_subrefs (summary, NULL, ref);
+  index = flatpak_remote_state_get_ref_index (self, summary, NULL);
+  if (index == NULL)
+    return g_ptr_array_new_with_free_func ((GDestroyNotify)flatpak_decomposed_unref);
+
+  return flatpak_summary_ref_index_match_subrefs (index, ref);
 }
 
 static VarMetadataRef
@@ -770,13 +844,13 @@ flatpak_remote_state_get_cache_version (FlatpakRemoteState *self)
   return GUINT32_FROM_LE (var_metadata_lookup_uint32 (meta, "xa.cache-version", 0));
 }
 
+/* The cache data points into the summary returned by
+ * flatpak_remote_state_get_summary_for_ref() for @ref */
 gboolean
-flatpak_remote_state_lookup_cache (FlatpakRemoteState *self,
-                                   const char         *ref,
-                                   guint64            *out_download_size,
-                                   guint64            *out_installed_size,
-                                   const char        **out_metadata,
-                                   GError            **error)
+flatpak_remote_state_lookup_cache_data (FlatpakRemoteState *self,
+                                        const char         *ref,
+                                        VarCacheDataRef    *out_cache_data,
+                                        GError            **error)
 {
   VarCacheDataRef cache_data;
   VarMetadataRef meta;
@@ -824,12 +898,11 @@ flatpak_remote_state_lookup_cache (FlatpakRemoteState *self,
     }
   else if (summary_version == 1)
     {
-      VarRefMapRef ref_map = var_summary_get_ref_map (summary);
       VarRefInfoRef info;
       VarMetadataRef commit_metadata;
       VarVariantRef cache_data_v;
 
-      if (!flatpak_var_ref_map_lookup_ref (ref_map, ref, &info))
+      if (!flatpak_remote_state_lookup_summary_ref (self, summary_v, NULL, ref, NULL, &info))
         return flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
                                    _("No entry for %s in remote '%s' summary cache "),
                                    ref, self->remote_name);
@@ -847,6 +920,24 @@ flatpak_remote_state_lookup_cache (FlatpakRemoteState *self,
       return FALSE;
     }
 
+  *out_cache_data = cache_data;
+
+  return TRUE;
+}
+
+gboolean
+flatpak_remote_state_lookup_cache (FlatpakRemoteState *self,
+                                   const char         *ref,
+                                   guint64            *out_download_size,
+                                   guint64            *out_installed_size,
+                                   const char        **out_metadata,
+                                   GError            **error)
+{
+  VarCacheDataRef cache_data;
+
+  if (!flatpak_remote_state_lookup_cache_data (self, ref, &cache_data, error))
+    return FALSE;
+
   if (out_installed_size)
     *out_installed_size = var_cache_data_get_installed_size (cache_data);
 
@@ -1248,10 +1339,9 @@ flatpak_remote_state_lookup_sparse_cache (FlatpakRemoteState *self,
     }
   else if (summary_version == 1)
     {
-      VarRefMapRef ref_map = var_summary_get_ref_map (summary);
       VarRefInfoRef info;
 
-      if (flatpak_var_ref_map_lookup_ref (ref_map, ref, &info))
+      if (flatpak_remote_state_lookup_summary_ref (self, summary_v, NULL, ref, NULL, &info))
         {
           *out_metadata = var_ref_info_get_metadata (info);
           return TRUE;
@@ -2503,8 +2593,8 @@ flatpak_dir_finalize (GObject *object)
   g_clear_object (&self->soup_session);
   g_clear_pointer (&self->summary_cache, g_hash_table_unref);
   g_clear_pointer (&self->remote_filters, g_hash_table_unref);
-  g_clear_pointer (&self->masked, g_regex_unref);
-  g_clear_pointer (&self->pinned, g_regex_unref);
+  g_clear_pointer (&self->masked, flatpak_ref_matcher_unref);
+  g_clear_pointer (&self->pinned, flatpak_ref_matcher_unref);
 
   G_OBJECT_CLASS (flatpak_dir_parent_class)->finalize (object);
 }
@@ -3747,8 +3837,8 @@ flatpak_dir_recreate_repo (FlatpakDir   *self,
 
   G_LOCK (config_cache);
 
-  g_clear_pointer (&self->masked, g_regex_unref);
-  g_clear_pointer (&self->pinned, g_regex_unref);
+  g_clear_pointer (&self->masked, flatpak_ref_matcher_unref);
+  g_clear_pointer (&self->pinned, flatpak_ref_matcher_unref);
 
   G_UNLOCK (config_cache);
 
@@ -4195,8 +4285,8 @@ _flatpak_dir_reload_config (FlatpakDir   *self,
   /* Clear cached stuff from repo config */
   G_LOCK (config_cache);
 
-  g_clear_pointer (&self->masked, g_regex_unref);
-  g_clear_pointer (&self->pinned, g_regex_unref);
+  g_clear_pointer (&self->masked, flatpak_ref_matcher_unref);
+  g_clear_pointer (&self->pinned, flatpak_ref_matcher_unref);
 
   G_UNLOCK (config_cache);
   return TRUE;
@@ -4226,6 +4316,20 @@ flatpak_dir_get_config (FlatpakDir *self,
   return g_key_file_get_string (config, "core", ostree_key, error);
 }
 
+/* Adds a change to the change log of the installation. Like the history,
+ * this doesn't fail the operation, but a failure is reported since
+ * clients following the log would miss the change. */
+static void
+flatpak_dir_record_change (FlatpakDir                    *self,
+                           FlatpakInstallationChangeKind  kind,
+                           const char                    *name)
+{
+  g_autoptr(GError) local_error = NULL;
+
+  if (!flatpak_change_log_append (self->basedir, kind, name, &local_error))
+    g_warning ("Failed to record change of %s: %s", name, local_error->message);
+}
+
 GPtrArray *
 flatpak_dir_get_config_patterns (FlatpakDir *dir, const char *key)
 {
@@ -4260,6 +4364,7 @@ flatpak_dir_set_config (FlatpakDir *self,
 {
   g_autoptr(GKeyFile) config = NULL;
   g_autofree char *ostree_key = NULL;
+  g_autoptr(GPtrArray) old_pins = NULL;
 
   if (!flatpak_dir_ensure_repo (self, NULL, error))
     return FALSE;
@@ -4287,6 +4392,9 @@ flatpak_dir_set_config (FlatpakDir *self,
       return TRUE;
     }
 
+  if (strcmp (key, "pinned") == 0)
+    old_pins = flatpak_dir_get_config_patterns (self, key);
+
   if (value == NULL)
     g_key_file_remove_key (config, "core", ostree_key, NULL);
   else
@@ -4298,6 +4406,36 @@ flatpak_dir_set_config (FlatpakDir *self,
   if (!_flatpak_dir_reload_config (self, NULL, error))
     return FALSE;
 
+  if (old_pins != NULL)
+    {
+      g_autoptr(GPtrArray) new_pins = flatpak_dir_get_config_patterns (self, key);
+      gboolean pins_changed = FALSE;
+
+      for (guint i = 0; i < new_pins->len; i++)
+        {
+          const char *pattern = g_ptr_array_index (new_pins, i);
+          if (!flatpak_g_ptr_array_contains_string (old_pins, pattern))
+            {
+              flatpak_dir_record_change (self, FLATPAK_INSTALLATION_CHANGE_KIND_PINNED, pattern);
+              pins_changed = TRUE;
+            }
+        }
+
+      for (guint i = 0; i < old_pins->len; i++)
+        {
+          const char *pattern = g_ptr_array_index (old_pins, i);
+          if (!flatpak_g_ptr_array_contains_string (new_pins, pattern))
+            {
+              flatpak_dir_record_change (self, FLATPAK_INSTALLATION_CHANGE_KIND_UNPINNED, pattern);
+              pins_changed = TRUE;
+            }
+        }
+
+      /* Let monitors know there is something new in the change log */
+      if (pins_changed && !flatpak_dir_mark_changed (self, error))
+        return FALSE;
+    }
+
   return TRUE;
 }
 
@@ -4310,12 +4448,12 @@ flatpak_dir_config_append_pattern (FlatpakDir *self,
                                    GError    **error)
 {
   g_autoptr(GPtrArray) patterns = flatpak_dir_get_config_patterns (self, key);
-  g_autofree char *regexp;
+  g_autoptr(FlatpakRefMatcher) matcher = flatpak_ref_matcher_new ();
   gboolean already_present;
   g_autofree char *merged_patterns = NULL;
 
-  regexp = flatpak_filter_glob_to_regexp (pattern, runtime_only, error);
-  if (regexp == NULL)
+  /* Validate the pattern */
+  if (!flatpak_ref_matcher_add_glob (matcher, pattern, runtime_only, error))
     return FALSE;
 
   if (!(already_present = flatpak_g_ptr_array_contains_string (patterns, pattern)))
@@ -4503,8 +4641,8 @@ flatpak_dir_deploy_appstream (FlatpakDir   *self,
   gboolean do_compress = FALSE;
   gboolean do_uncompress = TRUE;
   g_autofree char *filter_checksum = NULL;
-  g_autoptr(GRegex) allow_refs = NULL;
-  g_autoptr(GRegex) deny_refs = NULL;
+  g_autoptr(FlatpakRefMatcher) allow_refs = NULL;
+  g_autoptr(FlatpakRefMatcher) deny_refs = NULL;
   g_autofree char *subset = NULL;
   g_auto(GLnxTmpDir) tmpdir = { 0, };
   g_autoptr(FlatpakTempDir) tmplink = NULL;
@@ -5471,7 +5609,7 @@ flatpak_dir_setup_extra_data (FlatpakDir                           *self,
        */
       summary = get_summary_for_ref (state, ref);
       if (summary != NULL &&
-          flatpak_summary_lookup_ref (summary, NULL, ref, &summary_checksum, NULL) &&
+          flatpak_remote_state_lookup_summary_ref (state, summary, NULL, ref, &summary_checksum, NULL) &&
           g_strcmp0 (rev, summary_checksum) == 0 &&
           flatpak_remote_state_get_cache_version (state) >= 1)
         {
@@ -6679,6 +6817,240 @@ flatpak_dir_read_latest (FlatpakDir   *self,
   return g_steal_pointer (&res);
 }
 
+/* For finding unused refs we keep, in the installation, the dependencies
+ * of each deployed ref, and update them whenever the active deployment of
+ * a ref changes. Each ref maps to the id of the active deployment it was
+ * computed for, the refs it directly uses (its runtime and sdk, and the
+ * runtime of extra-data extensions) and its extension points (extension,
+ * branches, subdirectories, autoprune-unless). The refs the extension
+ * points actually resolve to depend on what else is installed, so they
+ * are looked up among the installed runtimes when the graph is walked. */
+#define FLATPAK_REF_DEPENDENCIES_FILE ".ref-dependencies"
+#define FLATPAK_REF_DEPENDENCIES_ENTRY_FORMAT "(sasa(sasbs))"
+#define FLATPAK_REF_DEPENDENCIES_FORMAT "a{s" FLATPAK_REF_DEPENDENCIES_ENTRY_FORMAT "}"
+
+typedef struct
+{
+  FlatpakDir *dir;
+  GHashTable *entries; /* ref -> entry variant */
+  gboolean    changed;
+} RefDependencies;
+
+static void
+ref_dependencies_free (RefDependencies *deps)
+{
+  g_object_unref (deps->dir);
+  g_hash_table_unref (deps->entries);
+  g_free (deps);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RefDependencies, ref_dependencies_free);
+
+static GVariant *
+ref_dependencies_entry_new (FlatpakDecomposed *ref,
+                            const char        *active_id,
+                            GKeyFile          *metakey)
+{
+  g_auto(GVariantBuilder) uses_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_auto(GVariantBuilder) extensions_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_auto(GStrv) groups = NULL;
+  g_autofree char *ref_branch = flatpak_decomposed_dup_branch (ref);
+  g_autofree char *sdk = NULL;
+  gboolean is_app = flatpak_decomposed_is_app (ref);
+
+  g_variant_builder_init (&uses_builder, G_VARIANT_TYPE_STRING_ARRAY);
+  g_variant_builder_init (&extensions_builder, G_VARIANT_TYPE ("a(sasbs)"));
+
+  /* App directly depends on its runtime */
+  if (is_app)
+    {
+      g_autofree char *runtime = g_key_file_get_string (metakey, "Application", "runtime", NULL);
+      if (runtime)
+        {
+          g_autoptr(FlatpakDecomposed) runtime_ref = flatpak_decomposed_new_from_pref (FLATPAK_KINDS_RUNTIME, runtime, NULL);
+          if (runtime_ref && !flatpak_decomposed_equal (runtime_ref, ref))
+            g_variant_builder_add (&uses_builder, "s", flatpak_decomposed_get_ref (runtime_ref));
+        }
+    }
+
+  /* Both apps and runtims directly depends on its sdk, to avoid suddenly uninstalling something you use to develop the app */
+  sdk = g_key_file_get_string (metakey, is_app ? "Application" : "Runtime", "sdk", NULL);
+  if (sdk)
+    {
+      g_autoptr(FlatpakDecomposed) sdk_ref = flatpak_decomposed_new_from_pref (FLATPAK_KINDS_RUNTIME, sdk, NULL);
+      if (sdk_ref && !flatpak_decomposed_equal (sdk_ref, ref))
+        g_variant_builder_add (&uses_builder, "s", flatpak_decomposed_get_ref (sdk_ref));
+    }
+
+  /* Extensions with extra data, that are not specially marked NoRuntime needs the runtime at install.
+   * Lets keep it around to not re-download it next update */
+  if (!is_app &&
+      g_key_file_has_group (metakey, "Extra Data") &&
+      !g_key_file_get_boolean (metakey, "Extra Data", "NoRuntime", NULL))
+    {
+      g_autofree char *extension_runtime_ref = g_key_file_get_string (metakey, "ExtensionOf", "runtime", NULL);
+      if (extension_runtime_ref != NULL)
+        g_variant_builder_add (&uses_builder, "s", extension_runtime_ref);
+    }
+
+  groups = g_key_file_get_groups (metakey, NULL);
+  for (int i = 0; groups[i] != NULL; i++)
+    {
+      char *tagged_extension;
+
+      if (g_str_has_prefix (groups[i], FLATPAK_METADATA_GROUP_PREFIX_EXTENSION) &&
+          *(tagged_extension = (groups[i] + strlen (FLATPAK_METADATA_GROUP_PREFIX_EXTENSION))) != 0)
+        {
+          g_autofree char *extension = NULL;
+          g_autofree char *version = g_key_file_get_string (metakey, groups[i],
+                                                            FLATPAK_METADATA_KEY_VERSION, NULL);
+          g_auto(GStrv) versions = g_key_file_get_string_list (metakey, groups[i],
+                                                               FLATPAK_METADATA_KEY_VERSIONS,
+                                                               NULL, NULL);
+          gboolean subdirectories = g_key_file_get_boolean (metakey, groups[i],
+                                                            FLATPAK_METADATA_KEY_SUBDIRECTORIES, NULL);
+          g_autofree char *autoprune_unless = g_key_file_get_string (metakey, groups[i],
+                                                                     FLATPAK_METADATA_KEY_AUTOPRUNE_UNLESS, NULL);
+          const char *default_branches[] = { NULL, NULL};
+          const char **branches;
+
+          flatpak_parse_extension_with_tag (tagged_extension, &extension, NULL);
+
+          if (versions)
+            branches = (const char **) versions;
+          else
+            {
+              default_branches[0] = version ? version : ref_branch;
+              branches = default_branches;
+            }
+
+          g_variant_builder_add (&extensions_builder, "(s^asbs)", extension, branches,
+                                 subdirectories, autoprune_unless ? autoprune_unless : "");
+        }
+    }
+
+  return g_variant_ref_sink (g_variant_new ("(sasa(sasbs))", active_id,
+                                            &uses_builder, &extensions_builder));
+}
+
+static GFile *
+flatpak_dir_get_ref_dependencies_path (FlatpakDir *self)
+{
+  return g_file_get_child (self->basedir, FLATPAK_REF_DEPENDENCIES_FILE);
+}
+
+static RefDependencies *
+ref_dependencies_load (FlatpakDir *dir)
+{
+  g_autoptr(RefDependencies) deps = g_new0 (RefDependencies, 1);
+  g_autoptr(GFile) path = flatpak_dir_get_ref_dependencies_path (dir);
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) deps_v = NULL;
+  char *contents;
+  gsize length;
+  GVariantIter iter;
+  const char *ref;
+  GVariant *entry;
+
+  deps->dir = g_object_ref (dir);
+  deps->entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_variant_unref);
+
+  if (!g_file_load_contents (path, NULL, &contents, &length, NULL, NULL))
+    return g_steal_pointer (&deps);
+
+  bytes = g_bytes_new_take (contents, length);
+  deps_v = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_REF_DEPENDENCIES_FORMAT),
+                                                         bytes, FALSE));
+
+  g_variant_iter_init (&iter, deps_v);
+  while (g_variant_iter_next (&iter, "{&s@" FLATPAK_REF_DEPENDENCIES_ENTRY_FORMAT "}", &ref, &entry))
+    g_hash_table_insert (deps->entries, g_strdup (ref), entry);
+
+  return g_steal_pointer (&deps);
+}
+
+static void
+ref_dependencies_save (RefDependencies *deps)
+{
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(GFile) path = NULL;
+  g_autoptr(GVariant) deps_v = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!deps->changed)
+    return;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (FLATPAK_REF_DEPENDENCIES_FORMAT));
+  GLNX_HASH_TABLE_FOREACH_KV (deps->entries, const char *, ref, GVariant *, entry)
+    g_variant_builder_add (&builder, "{s@" FLATPAK_REF_DEPENDENCIES_ENTRY_FORMAT "}", ref, entry);
+  deps_v = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  /* This is only a cache of what is deployed, so failing to write it (e.g.
+   * when we don't own the installation) just means we recompute it next time */
+  path = flatpak_dir_get_ref_dependencies_path (deps->dir);
+  if (!glnx_file_replace_contents_at (AT_FDCWD, flatpak_file_get_path_cached (path),
+                                      g_variant_get_data (deps_v), g_variant_get_size (deps_v),
+                                      GLNX_FILE_REPLACE_NODATASYNC, NULL, &local_error))
+    g_debug ("Failed to save ref dependencies: %s", local_error->message);
+  else
+    deps->changed = FALSE;
+}
+
+/* Returns the dependencies of @ref, which must be deployed with @active_id
+ * active, updating the graph from the deployed metadata if needed */
+static GVariant *
+ref_dependencies_lookup (RefDependencies   *deps,
+                         FlatpakDecomposed *ref,
+                         const char        *active_id)
+{
+  g_autoptr(GFile) deploy_base = NULL;
+  g_autoptr(GFile) metadata = NULL;
+  g_autoptr(GKeyFile) metakey = NULL;
+  g_autofree char *metadata_contents = NULL;
+  gsize metadata_size;
+  GVariant *entry;
+  const char *entry_active_id;
+
+  entry = g_hash_table_lookup (deps->entries, flatpak_decomposed_get_ref (ref));
+  if (entry != NULL)
+    {
+      g_variant_get_child (entry, 0, "&s", &entry_active_id);
+      if (strcmp (entry_active_id, active_id) == 0)
+        return entry;
+    }
+
+  deploy_base = flatpak_dir_get_deploy_dir (deps->dir, ref);
+  metadata = flatpak_build_file (deploy_base, active_id, "metadata", NULL);
+  if (!g_file_load_contents (metadata, NULL, &metadata_contents, &metadata_size, NULL, NULL))
+    return NULL;
+
+  metakey = g_key_file_new ();
+  if (!g_key_file_load_from_data (metakey, metadata_contents, metadata_size, 0, NULL))
+    return NULL;
+
+  entry = ref_dependencies_entry_new (ref, active_id, metakey);
+  g_hash_table_replace (deps->entries, flatpak_decomposed_dup_ref (ref), entry);
+  deps->changed = TRUE;
+
+  return entry;
+}
+
+/* Called when the active deployment of @ref changes */
+static void
+flatpak_dir_update_ref_dependencies (FlatpakDir        *self,
+                                     FlatpakDecomposed *ref,
+                                     const char        *active_id)
+{
+  g_autoptr(RefDependencies) deps = ref_dependencies_load (self);
+
+  if (active_id != NULL)
+    ref_dependencies_lookup (deps, ref, active_id);
+  else
+    deps->changed = g_hash_table_remove (deps->entries, flatpak_decomposed_get_ref (ref));
+
+  ref_dependencies_save (deps);
+}
+
 char *
 flatpak_dir_read_active (FlatpakDir        *self,
                          FlatpakDecomposed *ref,
@@ -6740,11 +7112,129 @@ flatpak_dir_set_active (FlatpakDir        *self,
         }
     }
 
+  flatpak_dir_update_ref_dependencies (self, ref, active_id);
+  flatpak_dir_record_change (self,
+                             active_id != NULL ? FLATPAK_INSTALLATION_CHANGE_KIND_DEPLOYED : FLATPAK_INSTALLATION_CHANGE_KIND_UNDEPLOYED,
+                             flatpak_decomposed_get_ref (ref));
+
   ret = TRUE;
 out:
   return ret;
 }
 
+/* The exported files each of the standard triggers processes, and the
+ * cache it writes. The trigger outputs (caches etc) are regular files next
+ * to the exported symlinks, so only symlinks are considered inputs. Other
+ * triggers are always run. */
+static const struct {
+  const char *trigger;
+  const char *input_dir;
+  const char *output;
+} trigger_inputs[] = {
+  { "desktop-database.trigger", "exports/share/applications",  "exports/share/applications/mimeinfo.cache" },
+  { "gtk-icon-cache.trigger",   "exports/share/icons",         "exports/share/icons/hicolor/icon-theme.cache" },
+  { "mime-database.trigger",    "exports/share/mime/packages", "exports/share/mime/mime.cache" },
+};
+
+typedef struct
+{
+  char         *name;
+  FlatpakBwrap *bwrap;
+  GFile        *trigger;
+  GFile        *stamp;  /* NULL if the trigger always runs */
+  const char   *input_dir;
+  const char   *output;
+  GPid          pid;
+} TriggerRun;
+
+static void
+trigger_run_free (TriggerRun *run)
+{
+  g_free (run->name);
+  g_clear_pointer (&run->bwrap, flatpak_bwrap_free);
+  g_clear_object (&run->trigger);
+  g_clear_object (&run->stamp);
+  g_free (run);
+}
+
+static void
+collect_trigger_inputs (int         parent_fd,
+                        const char *name,
+                        const char *relpath,
+                        GPtrArray  *inputs)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  struct dirent *dent;
+
+  if (!glnx_dirfd_iterator_init_at (parent_fd, name, FALSE, &iter, NULL))
+    return;
+
+  while (glnx_dirfd_iterator_next_dent_ensure_dtype (&iter, &dent, NULL, NULL) && dent != NULL)
+    {
+      g_autofree char *child_relpath = g_build_filename (relpath, dent->d_name, NULL);
+
+      if (dent->d_type == DT_DIR)
+        collect_trigger_inputs (iter.fd, dent->d_name, child_relpath, inputs);
+      else if (dent->d_type == DT_LNK)
+        {
+          g_autofree char *target = glnx_readlinkat_malloc (iter.fd, dent->d_name, NULL, NULL);
+          struct stat stbuf;
+
+          /* Exports link via the "current/active" symlinks, so the link
+           * itself doesn't change when the app is updated, but the
+           * (hardlinked from the repo) file it resolves to does */
+          if (fstatat (iter.fd, dent->d_name, &stbuf, 0) == 0)
+            g_ptr_array_add (inputs, g_strdup_printf ("%s\t%s\t%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT,
+                                                      child_relpath, target ? target : "",
+                                                      (guint64) stbuf.st_dev, (guint64) stbuf.st_ino,
+                                                      (gint64) stbuf.st_size, (gint64) stbuf.st_mtime));
+          else
+            g_ptr_array_add (inputs, g_strdup_printf ("%s\t%s\t-", child_relpath, target ? target : ""));
+        }
+    }
+}
+
+/* Returns a digest of everything that affects the output of the trigger,
+ * and of the output itself, so that it is regenerated if it is removed or
+ * changed behind our back */
+static char *
+compute_trigger_digest (int         basedir_fd,
+                        GFile      *trigger,
+                        const char *input_dir,
+                        const char *output)
+{
+  g_autoptr(GPtrArray) inputs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  struct stat stbuf;
+  int i;
+
+  if (stat (flatpak_file_get_path_cached (trigger), &stbuf) == 0)
+    g_ptr_array_add (inputs, g_strdup_printf ("trigger\t%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT,
+                                              (guint64) stbuf.st_ino, (gint64) stbuf.st_size, (gint64) stbuf.st_mtime));
+
+  collect_trigger_inputs (basedir_fd, input_dir, input_dir, inputs);
+
+  if (fstatat (basedir_fd, output, &stbuf, 0) == 0)
+    g_ptr_array_add (inputs, g_strdup_printf ("output\t%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT ":%ld",
+                                              (guint64) stbuf.st_ino, (gint64) stbuf.st_size,
+                                              (gint64) stbuf.st_mtim.tv_sec, (long) stbuf.st_mtim.tv_nsec));
+  else
+    g_ptr_array_add (inputs, g_strdup ("output\t-"));
+
+  g_ptr_array_sort (inputs, flatpak_strcmp0_ptr);
+
+  for (i = 0; i < inputs->len; i++)
+    {
+      const char *input = g_ptr_array_index (inputs, i);
+      g_checksum_update (checksum, (const guchar *) input, strlen (input) + 1);
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Runs the triggers, in parallel since they work on separate parts of the
+ * exports. Triggers whose inputs didn't change since they last succeeded
+ * are skipped; removing exports/.triggers forces them to run again. */
 gboolean
 flatpak_dir_run_triggers (FlatpakDir   *self,
                           GCancellable *cancellable,
@@ -6754,8 +7244,15 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
   g_autoptr(GFileEnumerator) dir_enum = NULL;
   g_autoptr(GFileInfo) child_info = NULL;
   g_autoptr(GFile) triggersdir = NULL;
+  g_autoptr(GFile) stampsdir = NULL;
+  g_autoptr(GPtrArray) runs = NULL;
   GError *temp_error = NULL;
   const char *triggerspath;
+  glnx_autofd int basedir_fd = -1;
+  g_autofree char *basedir_orig = NULL;
+  g_autofree char *basedir = NULL;
+  guint max_parallel;
+  guint next, first_running;
 
   if (flatpak_dir_use_system_helper (self, NULL))
     {
@@ -6778,17 +7275,28 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
   g_debug ("running triggers from %s", triggerspath);
 
   triggersdir = g_file_new_for_path (triggerspath);
+  stampsdir = g_file_resolve_relative_path (self->basedir, "exports/.triggers");
+
+  /* We need to canonicalize the basedir, because if has a symlink
+     somewhere the bind mount will be on the target of that, not
+     at that exact path. */
+  basedir_orig = g_file_get_path (self->basedir);
+  basedir = realpath (basedir_orig, NULL);
+
+  if (!glnx_opendirat (AT_FDCWD, basedir_orig, TRUE, &basedir_fd, error))
+    goto out;
 
   dir_enum = g_file_enumerate_children (triggersdir, "standard::type,standard::name",
                                         0, cancellable, error);
   if (!dir_enum)
     goto out;
 
+  runs = g_ptr_array_new_with_free_func ((GDestroyNotify) trigger_run_free);
+
   while ((child_info = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)) != NULL)
     {
       g_autoptr(GFile) child = NULL;
       const char *name;
-      GError *trigger_error = NULL;
 
       name = g_file_info_get_name (child_info);
 
@@ -6797,15 +7305,42 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
       if (g_file_info_get_file_type (child_info) == G_FILE_TYPE_REGULAR &&
           g_str_has_suffix (name, ".trigger"))
         {
-          /* We need to canonicalize the basedir, because if has a symlink
-             somewhere the bind mount will be on the target of that, not
-             at that exact path. */
-          g_autofree char *basedir_orig = g_file_get_path (self->basedir);
-          g_autofree char *basedir = realpath (basedir_orig, NULL);
           g_autoptr(FlatpakBwrap) bwrap = NULL;
           g_autofree char *commandline = NULL;
+          TriggerRun *run;
+          int i;
+
+          run = g_new0 (TriggerRun, 1);
+          run->name = g_strdup (name);
+
+          for (i = 0; i < G_N_ELEMENTS (trigger_inputs); i++)
+            {
+              g_autofree char *old_digest = NULL;
+              g_autofree char *digest = NULL;
+
+              if (strcmp (name, trigger_inputs[i].trigger) != 0)
+                continue;
+
+              run->trigger = g_object_ref (child);
+              run->stamp = g_file_get_child (stampsdir, name);
+              run->input_dir = trigger_inputs[i].input_dir;
+              run->output = trigger_inputs[i].output;
+              digest = compute_trigger_digest (basedir_fd, child, run->input_dir, run->output);
+
+              if (g_file_load_contents (run->stamp, NULL, &old_digest, NULL, NULL, NULL) &&
+                  strcmp (old_digest, digest) == 0)
+                {
+                  g_debug ("skipping trigger %s, %s is unchanged", name, trigger_inputs[i].input_dir);
+                  g_clear_pointer (&run, trigger_run_free);
+                }
+              break;
+            }
 
-          g_debug ("running trigger %s", name);
+          if (run == NULL)
+            {
+              g_clear_object (&child_info);
+              continue;
+            }
 
           bwrap = flatpak_bwrap_new (NULL);
 
@@ -6830,18 +7365,8 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
           commandline = flatpak_quote_argv ((const char **) bwrap->argv->pdata, -1);
           g_debug ("Running '%s'", commandline);
 
-          /* We use LEAVE_DESCRIPTORS_OPEN to work around dead-lock, see flatpak_close_fds_workaround */
-          if (!g_spawn_sync ("/",
-                             (char **) bwrap->argv->pdata,
-                             NULL,
-                             G_SPAWN_SEARCH_PATH | G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
-                             flatpak_bwrap_child_setup_cb, bwrap->fds,
-                             NULL, NULL,
-                             NULL, &trigger_error))
-            {
-              g_warning ("Error running trigger %s: %s", name, trigger_error->message);
-              g_clear_error (&trigger_error);
-            }
+          run->bwrap = g_steal_pointer (&bwrap);
+          g_ptr_array_add (runs, run);
         }
 
       g_clear_object (&child_info);
@@ -6853,18 +7378,92 @@ flatpak_dir_run_triggers (FlatpakDir   *self,
       goto out;
     }
 
-  ret = TRUE;
-out:
-  return ret;
-}
+  /* Run at most max_parallel triggers at a time, reaping them in the
+   * order they were started */
+  max_parallel = MAX (g_get_num_processors (), 1);
+  next = 0;
+  first_running = 0;
+  while (first_running < runs->len)
+    {
+      TriggerRun *run;
+      int wait_status;
 
-static gboolean
-read_fd (int          fd,
-         struct stat *stat_buf,
-         gchar      **contents,
-         gsize       *length,
-         GError     **error)
-{
+      while (next < runs->len && next - first_running < max_parallel)
+        {
+          GError *trigger_error = NULL;
+
+          run = g_ptr_array_index (runs, next++);
+
+          g_debug ("running trigger %s", run->name);
+
+          /* We use LEAVE_DESCRIPTORS_OPEN to work around dead-lock, see flatpak_close_fds_workaround */
+          if (!g_spawn_async ("/",
+                              (char **) run->bwrap->argv->pdata,
+                              NULL,
+                              G_SPAWN_SEARCH_PATH | G_SPAWN_LEAVE_DESCRIPTORS_OPEN | G_SPAWN_DO_NOT_REAP_CHILD,
+                              flatpak_bwrap_child_setup_cb, run->bwrap->fds,
+                              &run->pid, &trigger_error))
+            {
+              g_warning ("Error running trigger %s: %s", run->name, trigger_error->message);
+              g_clear_error (&trigger_error);
+              run->pid = 0;
+            }
+        }
+
+      run = g_ptr_array_index (runs, first_running++);
+      if (run->pid == 0)
+        continue;
+
+      if (TEMP_FAILURE_RETRY (waitpid (run->pid, &wait_status, 0)) != run->pid)
+        {
+          g_warning ("Failed to wait for trigger %s: %s", run->name, g_strerror (errno));
+          continue;
+        }
+      g_spawn_close_pid (run->pid);
+
+      if (!WIFEXITED (wait_status) || WEXITSTATUS (wait_status) != 0)
+        {
+          g_debug ("trigger %s failed", run->name);
+          continue;
+        }
+
+      if (run->stamp != NULL)
+        {
+          g_autoptr(GError) local_error = NULL;
+          g_autofree char *digest = NULL;
+
+          /* The triggers also succeed if the tool they use isn't installed,
+           * so unless there was nothing to process, only skip them next time
+           * if they produced their output */
+          if (faccessat (basedir_fd, run->output, F_OK, 0) != 0 &&
+              faccessat (basedir_fd, run->input_dir, F_OK, 0) == 0)
+            {
+              g_debug ("trigger %s didn't write %s, not skipping it next time", run->name, run->output);
+              continue;
+            }
+
+          /* This includes the output as written now */
+          digest = compute_trigger_digest (basedir_fd, run->trigger, run->input_dir, run->output);
+
+          if (!flatpak_mkdir_p (stampsdir, NULL, &local_error) ||
+              !g_file_replace_contents (run->stamp, digest, strlen (digest), NULL, FALSE,
+                                        G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, &local_error))
+            g_debug ("Failed to write stamp for trigger %s: %s", run->name, local_error->message);
+        }
+    }
+
+  ret = TRUE;
+out:
+  return ret;
+}
+
+static gboolean
+read_fd (int          fd,
+         struct stat *stat_buf,
+         gchar      **contents,
+         gsize       *length,
+         GError     **error)
+{
   gchar *buf;
   gsize bytes_read;
   gsize size;
@@ -7558,6 +8157,8 @@ out:
 }
 
 
+/* If @exported is not %NULL, the paths of the created symlinks, relative
+ * to the exports dir (@source_relpath is the directory part), are added to it */
 static gboolean
 export_dir (int           source_parent_fd,
             const char   *source_name,
@@ -7565,6 +8166,7 @@ export_dir (int           source_parent_fd,
             const char   *source_relpath,
             int           destination_parent_fd,
             const char   *destination_name,
+            GPtrArray    *exported,
             GCancellable *cancellable,
             GError      **error)
 {
@@ -7622,7 +8224,7 @@ export_dir (int           source_parent_fd,
           g_autofree gchar *child_relpath = g_strconcat (source_relpath, dent->d_name, "/", NULL);
 
           if (!export_dir (source_iter.fd, dent->d_name, child_symlink_prefix, child_relpath, destination_dfd, dent->d_name,
-                           cancellable, error))
+                           exported, cancellable, error))
             goto out;
         }
       else if (S_ISREG (stbuf.st_mode))
@@ -7651,6 +8253,9 @@ export_dir (int           source_parent_fd,
                   goto out;
                 }
 
+              if (exported)
+                g_ptr_array_add (exported, g_strconcat (source_relpath, dent->d_name, NULL));
+
               break;
             }
         }
@@ -7666,6 +8271,7 @@ static gboolean
 flatpak_export_dir (GFile        *source,
                     GFile        *destination,
                     const char   *symlink_prefix,
+                    GPtrArray    *exported,
                     GCancellable *cancellable,
                     GError      **error)
 {
@@ -7686,6 +8292,7 @@ flatpak_export_dir (GFile        *source,
       g_autoptr(GFile) sub_source = g_file_resolve_relative_path (source, exported_subdirs[i]);
       g_autoptr(GFile) sub_destination = g_file_resolve_relative_path (destination, exported_subdirs[i]);
       g_autofree char *sub_symlink_prefix = g_build_filename (exported_subdirs[i + 1], symlink_prefix, exported_subdirs[i], NULL);
+      g_autofree char *sub_relpath = g_strconcat (exported_subdirs[i], "/", NULL);
 
       if (!g_file_query_exists (sub_source, cancellable))
         continue;
@@ -7693,15 +8300,92 @@ flatpak_export_dir (GFile        *source,
       if (!flatpak_mkdir_p (sub_destination, cancellable, error))
         return FALSE;
 
-      if (!export_dir (AT_FDCWD, flatpak_file_get_path_cached (sub_source), sub_symlink_prefix, "",
+      if (!export_dir (AT_FDCWD, flatpak_file_get_path_cached (sub_source), sub_symlink_prefix, sub_relpath,
                        AT_FDCWD, flatpak_file_get_path_cached (sub_destination),
-                       cancellable, error))
+                       exported, cancellable, error))
         return FALSE;
     }
 
   return TRUE;
 }
 
+/* The export manifest of an app lists the symlinks (NUL separated, relative
+ * to the exports dir) that were created the last time it was exported */
+static GFile *
+flatpak_dir_get_export_manifest (FlatpakDir *self,
+                                 const char *app)
+{
+  g_autoptr(GFile) exports = flatpak_dir_get_exports_dir (self);
+  g_autoptr(GFile) manifests = g_file_get_child (exports, ".manifests");
+
+  return g_file_get_child (manifests, app);
+}
+
+/* Removes the symlinks listed in @old_manifest that were not exported again and are now dangling */
+static gboolean
+remove_stale_exports (GFile        *exports,
+                      const char   *old_manifest,
+                      gsize         old_manifest_len,
+                      GPtrArray    *exported,
+                      GCancellable *cancellable,
+                      GError      **error)
+{
+  g_autoptr(GHashTable) still_exported = g_hash_table_new (g_str_hash, g_str_equal);
+  glnx_autofd int exports_dfd = -1;
+  const char *path;
+  int i;
+
+  for (i = 0; i < exported->len; i++)
+    g_hash_table_add (still_exported, g_ptr_array_index (exported, i));
+
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (exports), TRUE, &exports_dfd, error))
+    return FALSE;
+
+  for (path = old_manifest; path < old_manifest + old_manifest_len; path += strlen (path) + 1)
+    {
+      struct stat stbuf;
+
+      if (*path == 0 || *path == '/' || strstr (path, "..") != NULL)
+        continue;
+
+      if (g_hash_table_contains (still_exported, path))
+        continue;
+
+      if (fstatat (exports_dfd, path, &stbuf, 0) != 0 && errno == ENOENT)
+        {
+          if (unlinkat (exports_dfd, path, 0) != 0 && errno != ENOENT)
+            return glnx_throw_errno_prefix (error, "unlinkat(%s)", path);
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+write_export_manifest (GFile        *manifest,
+                       GPtrArray    *exported,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  g_autoptr(GFile) manifests = g_file_get_parent (manifest);
+  g_autoptr(GString) contents = g_string_new ("");
+  int i;
+
+  if (!flatpak_mkdir_p (manifests, cancellable, error))
+    return FALSE;
+
+  for (i = 0; i < exported->len; i++)
+    g_string_append_len (contents, g_ptr_array_index (exported, i),
+                         strlen (g_ptr_array_index (exported, i)) + 1);
+
+  return g_file_replace_contents (manifest, contents->str, contents->len, NULL, FALSE,
+                                  G_FILE_CREATE_REPLACE_DESTINATION, NULL, cancellable, error);
+}
+
+/* Updates the exports after @changed_app changed. Only the symlinks that
+ * were exported for that app last time are checked, so this doesn't depend
+ * on the number of installed apps. If @changed_app is %NULL, or it has no
+ * export manifest yet, the whole exports dir is swept for dangling symlinks. */
 gboolean
 flatpak_dir_update_exports (FlatpakDir   *self,
                             const char   *changed_app,
@@ -7713,12 +8397,25 @@ flatpak_dir_update_exports (FlatpakDir   *self,
   g_autoptr(FlatpakDecomposed) current_ref = NULL;
   g_autofree char *active_id = NULL;
   g_autofree char *symlink_prefix = NULL;
+  g_autoptr(GFile) manifest = NULL;
+  g_autoptr(GPtrArray) exported = NULL;
+  g_autofree char *old_manifest = NULL;
+  gsize old_manifest_len = 0;
 
   exports = flatpak_dir_get_exports_dir (self);
 
   if (!flatpak_mkdir_p (exports, cancellable, error))
     goto out;
 
+  if (changed_app)
+    {
+      manifest = flatpak_dir_get_export_manifest (self, changed_app);
+      exported = g_ptr_array_new_with_free_func (g_free);
+
+      if (!g_file_load_contents (manifest, cancellable, &old_manifest, &old_manifest_len, NULL, NULL))
+        old_manifest = NULL;
+    }
+
   if (changed_app &&
       (current_ref = flatpak_dir_current_ref (self, changed_app, cancellable)) &&
       (active_id = flatpak_dir_read_active (self, current_ref, cancellable)))
@@ -7736,14 +8433,34 @@ flatpak_dir_update_exports (FlatpakDir   *self,
           symlink_prefix = g_build_filename ("..", "app", changed_app, "current", "active", "export", NULL);
           if (!flatpak_export_dir (export, exports,
                                    symlink_prefix,
+                                   exported,
                                    cancellable,
                                    error))
             goto out;
         }
     }
 
-  if (!flatpak_remove_dangling_symlinks (exports, cancellable, error))
-    goto out;
+  if (old_manifest != NULL)
+    {
+      if (!remove_stale_exports (exports, old_manifest, old_manifest_len, exported, cancellable, error))
+        goto out;
+    }
+  else
+    {
+      if (!flatpak_remove_dangling_symlinks (exports, cancellable, error))
+        goto out;
+    }
+
+  if (changed_app)
+    {
+      if (active_id != NULL)
+        {
+          if (!write_export_manifest (manifest, exported, cancellable, error))
+            goto out;
+        }
+      else
+        (void) g_file_delete (manifest, NULL, NULL);
+    }
 
   ret = TRUE;
 
@@ -10048,6 +10765,438 @@ flatpak_dir_needs_update_for_commit_and_subpaths (FlatpakDir        *self,
   return FALSE;
 }
 
+void
+flatpak_dir_update_info_free (FlatpakDirUpdateInfo *info)
+{
+  flatpak_decomposed_unref (info->ref);
+  g_free (info->remote);
+  g_free (info->commit);
+  g_free (info->installed_commit);
+  g_clear_pointer (&info->state, flatpak_remote_state_unref);
+  g_free (info);
+}
+
+/* Looks up the subdirectory NAME in DIRTREE, returning FALSE if there is none */
+static gboolean
+dirtree_lookup_subdir (GVariant   *dirtree,
+                       const char *name,
+                       char      **out_tree_checksum,
+                       char      **out_meta_checksum)
+{
+  g_autoptr(GVariant) dirs = g_variant_get_child_value (dirtree, 1);
+  gsize n = g_variant_n_children (dirs);
+  gsize i;
+
+  for (i = 0; i < n; i++)
+    {
+      const char *dirname;
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &dirname, &tree_csum_v, &meta_csum_v);
+      if (strcmp (dirname, name) != 0)
+        continue;
+
+      *out_tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+      *out_meta_checksum = ostree_checksum_from_bytes_v (meta_csum_v);
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Looks up the file NAME in DIRTREE, returning NULL if there is none */
+static char *
+dirtree_lookup_file (GVariant   *dirtree,
+                     const char *name)
+{
+  g_autoptr(GVariant) files = g_variant_get_child_value (dirtree, 0);
+  gsize n = g_variant_n_children (files);
+  gsize i;
+
+  for (i = 0; i < n; i++)
+    {
+      const char *filename;
+      g_autoptr(GVariant) csum_v = NULL;
+
+      g_variant_get_child (files, i, "(&s@ay)", &filename, &csum_v);
+      if (strcmp (filename, name) == 0)
+        return ostree_checksum_from_bytes_v (csum_v);
+    }
+
+  return NULL;
+}
+
+/* TRUE if all the objects of the tree are in the repo */
+static gboolean
+repo_has_dirtree (OstreeRepo   *repo,
+                  const char   *tree_checksum,
+                  const char   *meta_checksum,
+                  GCancellable *cancellable)
+{
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  gboolean has_object;
+  gsize n, i;
+
+  if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_DIR_META, meta_checksum, &has_object, cancellable, NULL) ||
+      !has_object)
+    return FALSE;
+
+  if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_DIR_TREE, tree_checksum, &dirtree, NULL) ||
+      dirtree == NULL)
+    return FALSE;
+
+  files = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree char *checksum = NULL;
+
+      g_variant_get_child (files, i, "(&s@ay)", NULL, &csum_v);
+      checksum = ostree_checksum_from_bytes_v (csum_v);
+
+      if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, checksum, &has_object, cancellable, NULL) ||
+          !has_object)
+        return FALSE;
+    }
+
+  dirs = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_autofree char *subtree_checksum = NULL;
+      g_autofree char *submeta_checksum = NULL;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", NULL, &tree_csum_v, &meta_csum_v);
+      subtree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+      submeta_checksum = ostree_checksum_from_bytes_v (meta_csum_v);
+
+      if (!repo_has_dirtree (repo, subtree_checksum, submeta_checksum, cancellable))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* A partial commit is as good as a full one for an update if everything
+ * that the update would pull, i.e. the metadata and the given subpaths of
+ * the files, is in the repo. Subpaths that aren't in the commit at all are
+ * not pulled, so they don't count. */
+static gboolean
+repo_has_commit_subpaths (OstreeRepo   *repo,
+                          const char   *commit,
+                          const char  **subpaths,
+                          GCancellable *cancellable)
+{
+  g_autoptr(GVariant) commit_v = NULL;
+  g_autoptr(GVariant) root_tree_csum_v = NULL;
+  g_autoptr(GVariant) root = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autofree char *root_tree_checksum = NULL;
+  g_autofree char *files_tree_checksum = NULL;
+  g_autofree char *files_meta_checksum = NULL;
+  g_autofree char *metadata_checksum = NULL;
+  gboolean has_object;
+  int i;
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit, &commit_v, NULL))
+    return FALSE;
+
+  root_tree_csum_v = g_variant_get_child_value (commit_v, 6);
+  root_tree_checksum = ostree_checksum_from_bytes_v (root_tree_csum_v);
+
+  if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_DIR_TREE, root_tree_checksum, &root, NULL) ||
+      root == NULL)
+    return FALSE;
+
+  metadata_checksum = dirtree_lookup_file (root, "metadata");
+  if (metadata_checksum == NULL ||
+      !ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, metadata_checksum, &has_object, cancellable, NULL) ||
+      !has_object)
+    return FALSE;
+
+  if (!dirtree_lookup_subdir (root, "files", &files_tree_checksum, &files_meta_checksum))
+    return TRUE;
+
+  if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_DIR_TREE, files_tree_checksum, &files, NULL) ||
+      files == NULL)
+    return FALSE;
+
+  for (i = 0; subpaths[i] != NULL; i++)
+    {
+      g_auto(GStrv) elements = g_strsplit (subpaths[i], "/", -1);
+      g_autoptr(GVariant) dirtree = g_variant_ref (files);
+      g_autofree char *tree_checksum = NULL;
+      g_autofree char *meta_checksum = NULL;
+      gboolean in_commit = TRUE;
+      int j;
+
+      for (j = 0; elements[j] != NULL; j++)
+        {
+          g_autofree char *file_checksum = NULL;
+
+          if (*elements[j] == 0)
+            continue;
+
+          if (tree_checksum != NULL)
+            {
+              g_clear_pointer (&dirtree, g_variant_unref);
+              if (!ostree_repo_load_variant_if_exists (repo, OSTREE_OBJECT_TYPE_DIR_TREE, tree_checksum, &dirtree, NULL) ||
+                  dirtree == NULL)
+                return FALSE;
+              g_clear_pointer (&tree_checksum, g_free);
+              g_clear_pointer (&meta_checksum, g_free);
+            }
+
+          if (dirtree_lookup_subdir (dirtree, elements[j], &tree_checksum, &meta_checksum))
+            continue;
+
+          /* A subpath can name a file too, but then it has to be the last element */
+          file_checksum = dirtree_lookup_file (dirtree, elements[j]);
+          if (file_checksum != NULL && elements[j + 1] == NULL)
+            {
+              if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, file_checksum, &has_object, cancellable, NULL) ||
+                  !has_object)
+                return FALSE;
+            }
+
+          in_commit = FALSE;
+          break;
+        }
+
+      if (in_commit && tree_checksum == NULL)
+        {
+          tree_checksum = g_strdup (files_tree_checksum);
+          meta_checksum = g_strdup (files_meta_checksum);
+        }
+
+      if (in_commit &&
+          !repo_has_dirtree (repo, tree_checksum, meta_checksum, cancellable))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* This is a fast check for which deployed refs have a different commit
+ * available in their origin remote. Unlike a transaction it doesn't resolve
+ * dependencies or related refs, it only does one pass over the deployed refs
+ * and looks them up in the (cached, or conditionally refreshed) summary of
+ * each origin, which is fetched at most once.
+ *
+ * The download size is that of the whole commit, so it is an upper bound,
+ * or 0 if the commit is already available in the local repo (e.g. pulled
+ * with --no-deploy), in full or with all the deployed subpaths.
+ */
+GPtrArray *
+flatpak_dir_list_available_updates (FlatpakDir   *self,
+                                    gboolean      only_cached,
+                                    GCancellable *cancellable,
+                                    GError      **error)
+{
+  g_autoptr(GPtrArray) refs = NULL;
+  g_autoptr(GPtrArray) updates = NULL;
+  g_autoptr(GHashTable) states = NULL; /* (element-type utf8 FlatpakRemoteState) */
+  g_autoptr(GHashTable) skipped_origins = NULL; /* (element-type utf8) */
+  int i;
+
+  if (!flatpak_dir_maybe_ensure_repo (self, cancellable, error))
+    return NULL;
+
+  updates = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_dir_update_info_free);
+
+  if (self->repo == NULL)
+    return g_steal_pointer (&updates);
+
+  refs = flatpak_dir_list_refs (self, FLATPAK_KINDS_APP | FLATPAK_KINDS_RUNTIME, cancellable, error);
+  if (refs == NULL)
+    return NULL;
+
+  states = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) flatpak_remote_state_unref);
+  /* Disabled remotes and remotes we failed to fetch, so they are only tried once */
+  skipped_origins = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  for (i = 0; i < refs->len; i++)
+    {
+      FlatpakDecomposed *ref = g_ptr_array_index (refs, i);
+      g_autoptr(GBytes) deploy_data = NULL;
+      g_autofree char *remote_commit = NULL;
+      FlatpakRemoteState *state = NULL;
+      OstreeRepoCommitState commit_state;
+      FlatpakDirUpdateInfo *info;
+      const char *origin;
+
+      deploy_data = flatpak_dir_get_deploy_data (self, ref, FLATPAK_DEPLOY_VERSION_ANY, cancellable, NULL);
+      if (deploy_data == NULL)
+        continue;
+
+      origin = flatpak_deploy_data_get_origin (deploy_data);
+
+      if (g_hash_table_contains (skipped_origins, origin))
+        continue;
+
+      state = g_hash_table_lookup (states, origin);
+      if (state == NULL)
+        {
+          g_autoptr(GError) local_error = NULL;
+
+          if (flatpak_dir_get_remote_disabled (self, origin))
+            {
+              g_hash_table_add (skipped_origins, g_strdup (origin));
+              continue;
+            }
+
+          state = flatpak_dir_get_remote_state_optional (self, origin, only_cached, cancellable, &local_error);
+          if (state == NULL)
+            {
+              if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                {
+                  g_propagate_error (error, g_steal_pointer (&local_error));
+                  return NULL;
+                }
+              g_debug ("Unable to check %s for updates: %s", origin, local_error->message);
+              g_hash_table_add (skipped_origins, g_strdup (origin));
+              continue;
+            }
+
+          g_hash_table_insert (states, g_strdup (origin), state);
+        }
+
+      if (state->index != NULL)
+        {
+          g_autofree char *arch = flatpak_decomposed_dup_arch (ref);
+          g_autoptr(GError) local_error = NULL;
+
+          if (!flatpak_remote_state_ensure_subsummary (state, self, arch, only_cached, cancellable, &local_error))
+            {
+              g_debug ("Unable to check %s for updates: %s", flatpak_decomposed_get_ref (ref), local_error->message);
+              continue;
+            }
+        }
+
+      if (!flatpak_remote_state_lookup_ref (state, flatpak_decomposed_get_ref (ref),
+                                            &remote_commit, NULL, NULL, NULL, NULL))
+        continue;
+
+      if (!flatpak_dir_needs_update_for_commit_and_subpaths (self, origin, ref, remote_commit, NULL))
+        continue;
+
+      info = g_new0 (FlatpakDirUpdateInfo, 1);
+      info->ref = flatpak_decomposed_ref (ref);
+      info->remote = g_strdup (origin);
+      info->commit = g_steal_pointer (&remote_commit);
+      info->installed_commit = g_strdup (flatpak_deploy_data_get_commit (deploy_data));
+      info->state = flatpak_remote_state_ref (state);
+
+      flatpak_remote_state_load_data (state, flatpak_decomposed_get_ref (ref),
+                                      &info->download_size, &info->installed_size, NULL, NULL);
+
+      if (ostree_repo_load_commit (self->repo, info->commit, NULL, &commit_state, NULL))
+        {
+          g_autofree const char **subpaths = flatpak_deploy_data_get_subpaths (deploy_data);
+
+          /* Refs deployed with subpaths, like .Locale extensions, are
+           * only ever pulled as partial commits */
+          if (commit_state == OSTREE_REPO_COMMIT_STATE_NORMAL ||
+              (subpaths[0] != NULL &&
+               repo_has_commit_subpaths (self->repo, info->commit, subpaths, cancellable)))
+            {
+              info->download_size = 0;
+              info->prefetched = TRUE;
+            }
+        }
+
+      g_ptr_array_add (updates, info);
+    }
+
+  return g_steal_pointer (&updates);
+}
+
+/* Pulls the commits of the available updates into the local repo without
+ * deploying them, so that a later update only has to deploy them. This is
+ * meant to run in the background, so it never asks for authorization, and
+ * a failure to prefetch one ref doesn't stop the others.
+ *
+ * If the prefetch-download-limit config key is set, updates are only
+ * prefetched while their download sizes add up to at most that many bytes,
+ * the rest are left for a later run.
+ *
+ * Returns the available updates, with prefetched set for those whose
+ * commit is now in the local repo.
+ */
+GPtrArray *
+flatpak_dir_prefetch_updates (FlatpakDir   *self,
+                              GCancellable *cancellable,
+                              GError      **error)
+{
+  g_autoptr(GPtrArray) updates = NULL;
+  g_autofree char *limit_str = NULL;
+  guint64 limit = G_MAXUINT64;
+  guint64 downloaded = 0;
+  gboolean no_interaction;
+  int i;
+
+  limit_str = flatpak_dir_get_config (self, "prefetch-download-limit", NULL);
+  if (limit_str != NULL &&
+      !flatpak_utils_ascii_string_to_unsigned (limit_str, 10, 0, G_MAXUINT64, &limit, error))
+    return NULL;
+
+  updates = flatpak_dir_list_available_updates (self, FALSE, cancellable, error);
+  if (updates == NULL)
+    return NULL;
+
+  no_interaction = flatpak_dir_get_no_interaction (self);
+  flatpak_dir_set_no_interaction (self, TRUE);
+
+  for (i = 0; i < updates->len; i++)
+    {
+      FlatpakDirUpdateInfo *info = g_ptr_array_index (updates, i);
+      const char *ref = flatpak_decomposed_get_ref (info->ref);
+      g_autoptr(GError) local_error = NULL;
+
+      if (info->prefetched)
+        continue;
+
+      if (info->download_size > limit - downloaded)
+        {
+          g_debug ("Not prefetching %s, it would go over the download limit", ref);
+          continue;
+        }
+
+      g_debug ("Prefetching %s commit %s", ref, info->commit);
+
+      if (!flatpak_dir_update (self, FALSE, TRUE, FALSE, FALSE,
+                               flatpak_decomposed_is_app (info->ref), FALSE,
+                               info->state, info->ref, info->commit,
+                               NULL, NULL, NULL, NULL, NULL, NULL,
+                               cancellable, &local_error))
+        {
+          if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            {
+              flatpak_dir_set_no_interaction (self, no_interaction);
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return NULL;
+            }
+
+          g_debug ("Failed to prefetch %s: %s", ref, local_error->message);
+          continue;
+        }
+
+      downloaded += info->download_size;
+      info->download_size = 0;
+      info->prefetched = TRUE;
+    }
+
+  flatpak_dir_set_no_interaction (self, no_interaction);
+
+  return g_steal_pointer (&updates);
+}
+
 /* This is called by the old-school non-transaction flatpak_installation_update, so doesn't do a lot. */
 char *
 flatpak_dir_check_for_update (FlatpakDir               *self,
@@ -11234,9 +12383,9 @@ remote_filter_free (RemoteFilter *remote_filter)
   g_free (remote_filter->checksum);
   g_object_unref (remote_filter->path);
   if (remote_filter->allow)
-    g_regex_unref (remote_filter->allow);
+    flatpak_ref_matcher_unref (remote_filter->allow);
   if (remote_filter->deny)
-    g_regex_unref (remote_filter->deny);
+    flatpak_ref_matcher_unref (remote_filter->deny);
 
   g_free (remote_filter);
 }
@@ -11249,8 +12398,8 @@ remote_filter_load (GFile *path, GError **error)
   g_autofree char *data = NULL;
   gsize data_size;
   GTimeVal mtime;
-  g_autoptr(GRegex) allow_refs = NULL;
-  g_autoptr(GRegex) deny_refs = NULL;
+  g_autoptr(FlatpakRefMatcher) allow_refs = NULL;
+  g_autoptr(FlatpakRefMatcher) deny_refs = NULL;
 
   /* Save mtime before loading to avoid races */
   if (!get_mtime (path, &mtime, NULL, error))
@@ -11289,8 +12438,8 @@ flatpak_dir_lookup_remote_filter (FlatpakDir *self,
                                   const char *name,
                                   gboolean    force_load,
                                   char      **checksum_out,
-                                  GRegex    **allow_regex,
-                                  GRegex    **deny_regex,
+                                  FlatpakRefMatcher **allow_refs,
+                                  FlatpakRefMatcher **deny_refs,
                                   GError **error)
 {
   RemoteFilter *filter = NULL;
@@ -11300,8 +12449,8 @@ flatpak_dir_lookup_remote_filter (FlatpakDir *self,
 
   if (checksum_out)
     *checksum_out = NULL;
-  *allow_regex = NULL;
-  *deny_regex = NULL;
+  *allow_refs = NULL;
+  *deny_refs = NULL;
 
   filter_path = flatpak_dir_get_remote_filter (self, name);
 
@@ -11347,9 +12496,9 @@ flatpak_dir_lookup_remote_filter (FlatpakDir *self,
       if (checksum_out)
         *checksum_out = g_strdup (filter->checksum);
       if (filter->allow)
-        *allow_regex = g_regex_ref (filter->allow);
+        *allow_refs = flatpak_ref_matcher_ref (filter->allow);
       if (filter->deny)
-        *deny_regex = g_regex_ref (filter->deny);
+        *deny_refs = flatpak_ref_matcher_ref (filter->deny);
     }
 
   G_UNLOCK (filters);
@@ -11372,9 +12521,9 @@ flatpak_dir_lookup_remote_filter (FlatpakDir *self,
   if (checksum_out)
     *checksum_out = g_strdup (filter->checksum);
   if (filter->allow)
-    *allow_regex = g_regex_ref (filter->allow);
+    *allow_refs = flatpak_ref_matcher_ref (filter->allow);
   if (filter->deny)
-    *deny_regex = g_regex_ref (filter->deny);
+    *deny_refs = flatpak_ref_matcher_ref (filter->deny);
 
   G_LOCK (filters);
   g_hash_table_replace (self->remote_filters, g_strdup (name), filter);
@@ -11487,6 +12636,36 @@ flatpak_dir_cache_summary (FlatpakDir *self,
   G_UNLOCK (cache);
 }
 
+/* Summaries are kept around for a long time by the in-memory cache and
+ * remote states, so once one has been written to the on-disk cache we
+ * switch to a read-only mapping of that. This keeps the data in page
+ * cache that is shared between processes and can be reclaimed, rather
+ * than on the heap. */
+static void
+replace_with_mapped_file (GFile   *file,
+                          GBytes **bytes)
+{
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) mapped = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  mfile = g_mapped_file_new (flatpak_file_get_path_cached (file), FALSE, &local_error);
+  if (mfile == NULL)
+    {
+      g_debug ("Failed to map %s: %s", flatpak_file_get_path_cached (file), local_error->message);
+      return;
+    }
+
+  mapped = g_mapped_file_get_bytes (mfile);
+
+  /* Someone else may have replaced the file since */
+  if (!g_bytes_equal (mapped, *bytes))
+    return;
+
+  g_bytes_unref (*bytes);
+  *bytes = g_steal_pointer (&mapped);
+}
+
 gboolean
 flatpak_dir_remote_make_oci_summary (FlatpakDir   *self,
                                      const char   *remote,
@@ -11553,6 +12732,8 @@ flatpak_dir_remote_make_oci_summary (FlatpakDir   *self,
               return FALSE;
             }
 
+          replace_with_mapped_file (summary_cache, &summary_bytes);
+
           if (out_summary)
             *out_summary = g_steal_pointer (&summary_bytes);
           return TRUE;
@@ -11723,12 +12904,13 @@ flatpak_dir_remote_clear_cached_summary (FlatpakDir   *self,
 }
 
 
+/* On success *main is replaced by a mapping of the saved file */
 static gboolean
 flatpak_dir_remote_save_cached_summary (FlatpakDir   *self,
                                         const char   *basename,
                                         const char   *main_ext,
                                         const char   *sig_ext,
-                                        GBytes       *main,
+                                        GBytes      **main,
                                         GBytes       *sig,
                                         GCancellable *cancellable,
                                         GError      **error)
@@ -11743,7 +12925,7 @@ flatpak_dir_remote_save_cached_summary (FlatpakDir   *self,
   if (!flatpak_mkdir_p (cache_dir, cancellable, error))
     return FALSE;
 
-  if (!g_file_replace_contents (main_cache_file, g_bytes_get_data (main, NULL), g_bytes_get_size (main), NULL, FALSE,
+  if (!g_file_replace_contents (main_cache_file, g_bytes_get_data (*main, NULL), g_bytes_get_size (*main), NULL, FALSE,
                                 G_FILE_CREATE_REPLACE_DESTINATION, NULL, cancellable, error))
     return FALSE;
 
@@ -11766,6 +12948,8 @@ flatpak_dir_remote_save_cached_summary (FlatpakDir   *self,
         }
     }
 
+  replace_with_mapped_file (main_cache_file, main);
+
   return TRUE;
 }
 
@@ -11886,6 +13070,13 @@ flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
                                                  cancellable,
                                                  error))
             return FALSE;
+
+          /* ostree saves the summary in the same cache we load from above */
+          if (summary != NULL && !is_local)
+            {
+              g_autoptr(GFile) cache_file = flatpak_build_file (self->cache_dir, "summaries", name_or_uri, NULL);
+              replace_with_mapped_file (cache_file, &summary);
+            }
         }
     }
 
@@ -12112,7 +13303,7 @@ flatpak_dir_remote_fetch_summary_index (FlatpakDir   *self,
       /* Update cache on disk if we downloaded anything, but never cache for file: repos */
       if (used_download && !is_local &&
           !flatpak_dir_remote_save_cached_summary (self, name_or_uri, ".idx", ".idx.sig",
-                                                   index, index_sig, cancellable, error))
+                                                   &index, index_sig, cancellable, error))
         return FALSE;
     }
 
@@ -12130,6 +13321,153 @@ flatpak_dir_remote_fetch_summary_index (FlatpakDir   *self,
   return TRUE;
 }
 
+/* The buffer size for writing summary files in low-memory mode */
+#define SUMMARY_LOW_MEMORY_BUFFER_SIZE (64 * 1024)
+
+/* Whether the summary-low-memory config key is set. If so, subsummaries
+ * are handled in low-memory mode, see fetch_indexed_summary_low_memory(). */
+static gboolean
+flatpak_dir_get_summary_low_memory (FlatpakDir *self)
+{
+  g_autofree char *value = NULL;
+
+  value = flatpak_dir_get_config (self, "summary-low-memory", NULL);
+
+  return g_strcmp0 (value, "true") == 0;
+}
+
+static GOutputStream *
+low_memory_output_stream_new (int fd)
+{
+  g_autoptr(GOutputStream) file_out = g_unix_output_stream_new (fd, FALSE);
+
+  return g_buffered_output_stream_new_sized (file_out, SUMMARY_LOW_MEMORY_BUFFER_SIZE);
+}
+
+/* Downloads @uri into @tmpf, gunzipping it on the fly */
+static gboolean
+download_uncompressed_to_tmpfile (FlatpakDir   *self,
+                                  const char   *uri,
+                                  GLnxTmpfile  *tmpf,
+                                  GCancellable *cancellable,
+                                  GError      **error)
+{
+  g_autoptr(GOutputStream) file_out = low_memory_output_stream_new (tmpf->fd);
+  g_autoptr(GZlibDecompressor) decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+  g_autoptr(GOutputStream) out = g_converter_output_stream_new (file_out, G_CONVERTER (decompressor));
+
+  if (!flatpak_download_http_uri (self->soup_session, uri, 0, out, NULL,
+                                  NULL, NULL, cancellable, error))
+    return FALSE;
+
+  return g_output_stream_close (out, cancellable, error);
+}
+
+/* Applies the delta from @old_checksum to @checksum, writing the result
+ * to @filename in @cache_dfd */
+static gboolean
+apply_summary_delta_low_memory (FlatpakDir   *self,
+                                const char   *url,
+                                int           cache_dfd,
+                                const char   *filename,
+                                const char   *old_checksum,
+                                GBytes       *old_summary,
+                                const char   *checksum,
+                                GCancellable *cancellable,
+                                GError      **error)
+{
+  g_autofree char *delta_filename = g_strconcat (old_checksum, "-", checksum, ".delta", NULL);
+  g_autofree char *delta_url = g_build_filename (url, "summaries", delta_filename, NULL);
+  g_auto(GLnxTmpfile) delta_tmpf = { 0, };
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  g_autoptr(GMappedFile) delta_mfile = NULL;
+  g_autoptr(GBytes) delta = NULL;
+  g_autoptr(GOutputStream) out = NULL;
+
+  g_debug ("Fetching indexed summary delta %s in low-memory mode", delta_filename);
+
+  if (!glnx_open_tmpfile_linkable_at (cache_dfd, ".", O_RDWR | O_CLOEXEC, &delta_tmpf, error))
+    return FALSE;
+
+  if (!download_uncompressed_to_tmpfile (self, delta_url, &delta_tmpf, cancellable, error))
+    return FALSE;
+
+  delta_mfile = g_mapped_file_new_from_fd (delta_tmpf.fd, FALSE, error);
+  if (delta_mfile == NULL)
+    return FALSE;
+  delta = g_mapped_file_get_bytes (delta_mfile);
+
+  if (!glnx_open_tmpfile_linkable_at (cache_dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+
+  out = low_memory_output_stream_new (tmpf.fd);
+  if (!flatpak_summary_apply_uncompressed_diff (old_summary, delta, out, cancellable, error) ||
+      !g_output_stream_close (out, cancellable, error))
+    return FALSE;
+
+  return glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE, cache_dfd, filename, error);
+}
+
+/* Like the rest of flatpak_dir_remote_fetch_indexed_summary(), but for
+ * devices where a summary doesn't comfortably fit in memory. The delta
+ * or full summary is streamed through gunzip into files in the cache,
+ * the delta is applied from a mapping of the old summary straight into
+ * the new cache file, and the result is checksummed and used from a
+ * mapping of that file. Apart from small write buffers, none of the data
+ * ends up on the heap. This doesn't put a bound on the memory used, as
+ * the mapped pages still count, but they can be reclaimed by the kernel
+ * under memory pressure, unlike heap copies. */
+static gboolean
+fetch_indexed_summary_low_memory (FlatpakDir   *self,
+                                  const char   *name_or_uri,
+                                  const char   *url,
+                                  const char   *cache_name,
+                                  const char   *checksum,
+                                  const char   *old_checksum,
+                                  GBytes       *old_summary,
+                                  GBytes      **out_summary,
+                                  GCancellable *cancellable,
+                                  GError      **error)
+{
+  g_autoptr(GFile) cache_dir = flatpak_build_file (self->cache_dir, "summaries", NULL);
+  g_autofree char *filename = g_strconcat (cache_name, ".sub", NULL);
+  g_autofree char *summary_filename = g_strconcat (checksum, ".gz", NULL);
+  g_autofree char *summary_url = g_build_filename (url, "summaries", summary_filename, NULL);
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  glnx_autofd int cache_dfd = -1;
+
+  if (!flatpak_mkdir_p (cache_dir, cancellable, error) ||
+      !glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (cache_dir), TRUE, &cache_dfd, error))
+    return FALSE;
+
+  if (old_summary != NULL)
+    {
+      g_autoptr(GError) delta_error = NULL;
+
+      if (apply_summary_delta_low_memory (self, url, cache_dfd, filename,
+                                          old_checksum, old_summary, checksum,
+                                          cancellable, &delta_error) &&
+          flatpak_dir_remote_load_cached_summary (self, cache_name, checksum, ".sub", NULL,
+                                                  out_summary, NULL, cancellable, &delta_error))
+        return TRUE;
+
+      g_debug ("Failed to apply delta, falling back: %s", delta_error->message);
+    }
+
+  g_debug ("Fetching indexed summary file %s for remote ‘%s’ in low-memory mode", summary_filename, name_or_uri);
+
+  if (!glnx_open_tmpfile_linkable_at (cache_dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+
+  if (!download_uncompressed_to_tmpfile (self, summary_url, &tmpf, cancellable, error) ||
+      !glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE, cache_dfd, filename, error))
+    return FALSE;
+
+  /* This checks the checksum, and removes the file if it's wrong */
+  return flatpak_dir_remote_load_cached_summary (self, cache_name, checksum, ".sub", NULL,
+                                                 out_summary, NULL, cancellable, error);
+}
+
 static gboolean
 flatpak_dir_remote_fetch_indexed_summary (FlatpakDir   *self,
                                           const char   *name_or_uri,
@@ -12151,6 +13489,7 @@ flatpak_dir_remote_fetch_indexed_summary (FlatpakDir   *self,
   const guchar *checksum_bytes;
   g_autofree char *checksum = NULL;
   g_autofree char *cache_name = NULL;
+  gboolean low_memory = FALSE;
 
   ensure_soup_session (self);
 
@@ -12216,69 +13555,86 @@ flatpak_dir_remote_fetch_indexed_summary (FlatpakDir   *self,
             break;
         }
 
-      if (old_summary)
+      if (!is_local)
+        low_memory = flatpak_dir_get_summary_low_memory (self);
+
+      if (low_memory)
         {
-          g_autoptr(GError) delta_error = NULL;
+          if (!fetch_indexed_summary_low_memory (self, name_or_uri, url, cache_name, checksum,
+                                                 old_checksum, old_summary,
+                                                 &summary, cancellable, error))
+            return FALSE;
 
-          g_autofree char *delta_filename = g_strconcat (old_checksum, "-", checksum, ".delta", NULL);
-          g_autofree char *delta_url = g_build_filename (url, "summaries", delta_filename, NULL);
+          if (!flatpak_dir_gc_cached_digested_summaries (self, name_or_uri, cache_name,
+                                                         cancellable, error))
+            return FALSE;
+        }
+      else
+        {
+          if (old_summary)
+            {
+              g_autoptr(GError) delta_error = NULL;
 
-          g_debug ("Fetching indexed summary delta %s for remote ‘%s’", delta_filename, name_or_uri);
+              g_autofree char *delta_filename = g_strconcat (old_checksum, "-", checksum, ".delta", NULL);
+              g_autofree char *delta_url = g_build_filename (url, "summaries", delta_filename, NULL);
 
-          g_autoptr(GBytes) delta = flatpak_load_uri (self->soup_session, delta_url, 0, NULL,
-                                                      NULL, NULL, NULL,
-                                                      cancellable, &delta_error);
-          if (delta == NULL)
-            g_debug ("Failed to load delta, falling back: %s", delta_error->message);
-          else
-            {
-              g_autoptr(GBytes) applied = flatpak_summary_apply_diff (old_summary, delta, &delta_error);
+              g_debug ("Fetching indexed summary delta %s for remote ‘%s’", delta_filename, name_or_uri);
 
-              if (applied == NULL)
-                g_warning ("Failed to apply delta, falling back: %s", delta_error->message);
+              g_autoptr(GBytes) delta = flatpak_load_uri (self->soup_session, delta_url, 0, NULL,
+                                                          NULL, NULL, NULL,
+                                                          cancellable, &delta_error);
+              if (delta == NULL)
+                g_debug ("Failed to load delta, falling back: %s", delta_error->message);
               else
                 {
-                  sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, applied);
-                  if (strcmp (sha256, checksum) != 0)
-                    g_warning ("Applying delta gave wrong checksum, falling back");
+                  g_autoptr(GBytes) applied = flatpak_summary_apply_diff (old_summary, delta, &delta_error);
+
+                  if (applied == NULL)
+                    g_warning ("Failed to apply delta, falling back: %s", delta_error->message);
                   else
-                    summary = g_steal_pointer (&applied);
+                    {
+                      sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, applied);
+                      if (strcmp (sha256, checksum) != 0)
+                        g_warning ("Applying delta gave wrong checksum, falling back");
+                      else
+                        summary = g_steal_pointer (&applied);
+                    }
                 }
             }
-        }
-
-      if (summary == NULL)
-        {
-          g_autofree char *filename = g_strconcat (checksum, ".gz", NULL);
-          g_debug ("Fetching indexed summary file %s for remote ‘%s’", filename, name_or_uri);
-          g_autofree char *subsummary_url = g_build_filename (url, "summaries", filename, NULL);
-          summary_z = flatpak_load_uri (self->soup_session, subsummary_url, 0, NULL,
-                                        NULL, NULL, NULL,
-                                        cancellable, error);
-          if (summary_z == NULL)
-            return FALSE;
 
-          summary = flatpak_zlib_decompress_bytes (summary_z, error);
           if (summary == NULL)
-            return FALSE;
+            {
+              g_autofree char *filename = g_strconcat (checksum, ".gz", NULL);
+              g_debug ("Fetching indexed summary file %s for remote ‘%s’", filename, name_or_uri);
+              g_autofree char *subsummary_url = g_build_filename (url, "summaries", filename, NULL);
+              summary_z = flatpak_load_uri (self->soup_session, subsummary_url, 0, NULL,
+                                            NULL, NULL, NULL,
+                                            cancellable, error);
+              if (summary_z == NULL)
+                return FALSE;
 
-          g_free (sha256);
-          sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, summary);
-          if (strcmp (sha256, checksum) != 0)
-            return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid checksum for indexed summary %s for remote '%s'"), checksum, name_or_uri);
-        }
+              summary = flatpak_zlib_decompress_bytes (summary_z, error);
+              if (summary == NULL)
+                return FALSE;
 
-      /* Save to disk */
-      if (!is_local)
-        {
-          if (!flatpak_dir_remote_save_cached_summary (self, cache_name, ".sub", NULL,
-                                                       summary, NULL,
-                                                       cancellable, error))
-            return FALSE;
+              g_free (sha256);
+              sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, summary);
+              if (strcmp (sha256, checksum) != 0)
+                return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid checksum for indexed summary %s for remote '%s'"), checksum, name_or_uri);
+            }
 
-          if (!flatpak_dir_gc_cached_digested_summaries (self, name_or_uri, cache_name,
-                                                         cancellable, error))
-            return FALSE;
+          /* Save to disk */
+          if (!is_local)
+            {
+              if (!flatpak_dir_remote_save_cached_summary (self, cache_name, ".sub", NULL,
+                                                           &summary, NULL,
+                                                           cancellable, error))
+                return FALSE;
+
+              if (!flatpak_dir_gc_cached_digested_summaries (self, name_or_uri, cache_name,
+                                                             cancellable, error))
+                return FALSE;
+            }
         }
     }
   else
@@ -12331,7 +13687,7 @@ _flatpak_dir_get_remote_state (FlatpakDir   *self,
         return NULL;
       if (!repo_get_remote_collection_id (self->repo, remote_or_uri, &state->collection_id, error))
         return NULL;
-      if (!flatpak_dir_lookup_remote_filter (self, remote_or_uri, FALSE, NULL, &state->allow_refs, &state->deny_refs, error))
+      if (!flatpak_dir_lookup_remote_filter (self, remote_or_uri, FALSE, &state->filter_checksum, &state->allow_refs, &state->deny_refs, error))
         return NULL;
       if (!ostree_repo_remote_get_url (self->repo, remote_or_uri, &url, error))
         return NULL;
@@ -12614,12 +13970,69 @@ flatpak_dir_get_remote_state_local_only (FlatpakDir   *self,
   return _flatpak_dir_get_remote_state (self, remote, TRUE, TRUE, FALSE, FALSE, NULL, NULL, cancellable, error);
 }
 
+/* Checks the ref name directly, so that refs that don't match are
+ * skipped without decomposing them */
+static gboolean
+remote_ref_filter_matches (const FlatpakRemoteRefFilter *filter,
+                           const char                   *ref)
+{
+  const char *id, *arch, *branch;
+  gsize id_len, arch_len;
+
+  if (filter == NULL)
+    return TRUE;
+
+  if (g_str_has_prefix (ref, "app/"))
+    {
+      if ((filter->kinds & FLATPAK_KINDS_APP) == 0)
+        return FALSE;
+      id = ref + strlen ("app/");
+    }
+  else if (g_str_has_prefix (ref, "runtime/"))
+    {
+      if ((filter->kinds & FLATPAK_KINDS_RUNTIME) == 0)
+        return FALSE;
+      id = ref + strlen ("runtime/");
+    }
+  else
+    return FALSE;
+
+  arch = strchr (id, '/');
+  if (arch == NULL)
+    return FALSE;
+  id_len = arch - id;
+  arch++;
+
+  branch = strchr (arch, '/');
+  if (branch == NULL)
+    return FALSE;
+  arch_len = branch - arch;
+  branch++;
+
+  if (filter->id_prefix != NULL &&
+      (id_len < strlen (filter->id_prefix) ||
+       strncmp (id, filter->id_prefix, strlen (filter->id_prefix)) != 0))
+    return FALSE;
+
+  if (filter->arch != NULL &&
+      (arch_len != strlen (filter->arch) ||
+       strncmp (arch, filter->arch, arch_len) != 0))
+    return FALSE;
+
+  if (filter->branch != NULL &&
+      strcmp (branch, filter->branch) != 0)
+    return FALSE;
+
+  return TRUE;
+}
+
 static void
-populate_hash_table_from_refs_map (GHashTable         *ret_all_refs,
-                                   GHashTable         *ref_timestamps,
-                                   VarRefMapRef        ref_map,
-                                   const char         *opt_collection_id,
-                                   FlatpakRemoteState *state)
+populate_hash_table_from_refs_map (GHashTable                   *ret_all_refs,
+                                   GHashTable                   *ref_timestamps,
+                                   VarRefMapRef                  ref_map,
+                                   const char                   *opt_collection_id,
+                                   FlatpakRemoteState           *state,
+                                   const FlatpakRemoteRefFilter *filter)
 {
   gsize len, i;
 
@@ -12634,6 +14047,9 @@ populate_hash_table_from_refs_map (GHashTable         *ret_all_refs,
       guint64 *new_timestamp = NULL;
       g_autoptr(FlatpakDecomposed) decomposed = NULL;
 
+      if (!remote_ref_filter_matches (filter, ref_name))
+        continue;
+
       if (!flatpak_remote_state_allow_ref (state, ref_name))
         continue;
 
@@ -12643,7 +14059,10 @@ populate_hash_table_from_refs_map (GHashTable         *ret_all_refs,
       if (csum_len != OSTREE_SHA256_DIGEST_LEN)
         continue;
 
-      decomposed = flatpak_decomposed_new_from_col_ref (ref_name, opt_collection_id, NULL);
+      if (opt_collection_id == NULL)
+        decomposed = flatpak_decomposed_new_from_ref_interned (ref_name, NULL);
+      else
+        decomposed = flatpak_decomposed_new_from_col_ref (ref_name, opt_collection_id, NULL);
       if (decomposed == NULL)
         continue;
 
@@ -12678,6 +14097,20 @@ flatpak_dir_list_all_remote_refs (FlatpakDir         *self,
                                   GHashTable        **out_all_refs,
                                   GCancellable       *cancellable,
                                   GError            **error)
+{
+  return flatpak_dir_list_all_remote_refs_filtered (self, state, NULL, out_all_refs,
+                                                    cancellable, error);
+}
+
+/* Like flatpak_dir_list_all_remote_refs(), but only lists the refs
+ * matching @filter (if not %NULL) */
+gboolean
+flatpak_dir_list_all_remote_refs_filtered (FlatpakDir                   *self,
+                                           FlatpakRemoteState           *state,
+                                           const FlatpakRemoteRefFilter *filter,
+                                           GHashTable                  **out_all_refs,
+                                           GCancellable                 *cancellable,
+                                           GError                      **error)
 {
   g_autoptr(GHashTable) ret_all_refs = NULL;
   VarSummaryRef summary;
@@ -12699,7 +14132,7 @@ flatpak_dir_list_all_remote_refs (FlatpakDir         *self,
           /* NOTE: collection id is NULL here not state->collection_id, see the
            * note on flatpak_decomposed_get_collection_id()
            */
-          populate_hash_table_from_refs_map (ret_all_refs, NULL, ref_map, NULL /* collection id */, state);
+          populate_hash_table_from_refs_map (ret_all_refs, NULL, ref_map, NULL /* collection id */, state, filter);
         }
     }
   else if (state->summary != NULL)
@@ -12730,7 +14163,7 @@ flatpak_dir_list_all_remote_refs (FlatpakDir         *self,
                   const char *collection_id = var_collection_map_entry_get_key (entry);
                   ref_map = var_collection_map_entry_get_value (entry);
 
-                  populate_hash_table_from_refs_map (ret_all_refs, NULL, ref_map, collection_id, state);
+                  populate_hash_table_from_refs_map (ret_all_refs, NULL, ref_map, collection_id, state, filter);
                 }
             }
         }
@@ -12738,7 +14171,7 @@ flatpak_dir_list_all_remote_refs (FlatpakDir         *self,
       /* refs that match the main collection-id,
          NOTE: We only set collection id if this is a file: uri remote */
       ref_map = var_summary_get_ref_map (summary);
-      populate_hash_table_from_refs_map (ret_all_refs, NULL, ref_map, main_collection_id, state);
+      populate_hash_table_from_refs_map (ret_all_refs, NULL, ref_map, main_collection_id, state, filter);
     }
   else if (state->collection_id)
     {
@@ -12758,7 +14191,7 @@ flatpak_dir_list_all_remote_refs (FlatpakDir         *self,
               VarCollectionMapRef map = var_collection_map_from_variant (v);
 
               if (var_collection_map_lookup (map, state->collection_id, NULL, &ref_map))
-                populate_hash_table_from_refs_map (ret_all_refs, ref_mtimes, ref_map, NULL, state);
+                populate_hash_table_from_refs_map (ret_all_refs, ref_mtimes, ref_map, NULL, state, filter);
             }
         }
     }
@@ -14413,6 +15846,26 @@ flatpak_dir_list_dependency_remotes (FlatpakDir   *self,
   return (char **) g_ptr_array_free (g_steal_pointer (&res), FALSE);
 }
 
+/* Removes the cached related refs of the remote, see
+ * get_remote_related_candidates() */
+static void
+remove_remote_related_cache (FlatpakDir   *self,
+                             const char   *remote_name,
+                             GCancellable *cancellable)
+{
+  g_autoptr(GFile) related_cache_dir = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (self->cache_dir == NULL)
+    return;
+
+  related_cache_dir = flatpak_build_file (self->cache_dir, "related", remote_name, NULL);
+
+  /* This is only a cache, so failing to remove it isn't fatal */
+  if (!flatpak_rm_rf (related_cache_dir, cancellable, &local_error))
+    g_debug ("Failed to remove related refs cache of %s: %s", remote_name, local_error->message);
+}
+
 gboolean
 flatpak_dir_remove_remote (FlatpakDir   *self,
                            gboolean      force_remove,
@@ -14445,6 +15898,8 @@ flatpak_dir_remove_remote (FlatpakDir   *self,
                                                             cancellable, error))
         return FALSE;
 
+      remove_remote_related_cache (self, remote_name, cancellable);
+
       return TRUE;
     }
 
@@ -14501,6 +15956,8 @@ flatpak_dir_remove_remote (FlatpakDir   *self,
                                      cancellable, error))
     return FALSE;
 
+  remove_remote_related_cache (self, remote_name, cancellable);
+
   ostree_repo_remote_get_url (self->repo, remote_name, &url, NULL);
 
   if (!ostree_repo_remote_change (self->repo, NULL,
@@ -14513,6 +15970,8 @@ flatpak_dir_remove_remote (FlatpakDir   *self,
   if (!flatpak_dir_mark_changed (self, error))
     return FALSE;
 
+  flatpak_dir_record_change (self, FLATPAK_INSTALLATION_CHANGE_KIND_REMOTE_CHANGED, remote_name);
+
   flatpak_dir_log (self, "remove remote",
                    remote_name, NULL, NULL, NULL, url,
                    "Removed remote %s", remote_name);
@@ -14687,6 +16146,8 @@ flatpak_dir_modify_remote (FlatpakDir   *self,
   if (!flatpak_dir_mark_changed (self, error))
     return FALSE;
 
+  flatpak_dir_record_change (self, FLATPAK_INSTALLATION_CHANGE_KIND_REMOTE_CHANGED, remote_name);
+
   if (has_remote)
     flatpak_dir_log (self, "modify remote", remote_name, NULL, NULL, NULL, url,
                      "Modified remote %s to %s", remote_name, url);
@@ -14703,14 +16164,26 @@ flatpak_dir_list_remote_refs (FlatpakDir         *self,
                               GHashTable        **refs,
                               GCancellable       *cancellable,
                               GError            **error)
+{
+  return flatpak_dir_list_remote_refs_filtered (self, state, NULL, refs,
+                                                cancellable, error);
+}
+
+gboolean
+flatpak_dir_list_remote_refs_filtered (FlatpakDir                   *self,
+                                       FlatpakRemoteState           *state,
+                                       const FlatpakRemoteRefFilter *filter,
+                                       GHashTable                  **refs,
+                                       GCancellable                 *cancellable,
+                                       GError                      **error)
 {
   g_autoptr(GError) my_error = NULL;
 
   if (error == NULL)
     error = &my_error;
 
-  if (!flatpak_dir_list_all_remote_refs (self, state, refs,
-                                         cancellable, error))
+  if (!flatpak_dir_list_all_remote_refs_filtered (self, state, filter, refs,
+                                                  cancellable, error))
     return FALSE;
 
   if (flatpak_dir_get_remote_noenumerate (self, state->remote_name))
@@ -15184,150 +16657,201 @@ add_related (FlatpakDir        *self,
   g_ptr_array_add (related, rel);
 }
 
-static GRegex *
-flatpak_dir_get_mask_regexp (FlatpakDir *self)
+static FlatpakRefMatcher *
+flatpak_dir_get_config_matcher (FlatpakDir         *self,
+                                const char         *key,
+                                gboolean            runtime_only,
+                                FlatpakRefMatcher **cached)
 {
-  GRegex *res = NULL;
+  FlatpakRefMatcher *res = NULL;
 
   G_LOCK (config_cache);
 
-  if (self->masked == NULL)
+  if (*cached == NULL)
     {
-      g_autofree char *masked = NULL;
+      g_autofree char *patterns_str = NULL;
 
-      masked = flatpak_dir_get_config (self, "masked", NULL);
-      if (masked)
+      patterns_str = flatpak_dir_get_config (self, key, NULL);
+      if (patterns_str)
         {
-          g_auto(GStrv) patterns = g_strsplit (masked, ";", -1);
-          g_autoptr(GString) deny_regexp = g_string_new ("^(");
+          g_auto(GStrv) patterns = g_strsplit (patterns_str, ";", -1);
           int i;
 
+          *cached = flatpak_ref_matcher_new ();
+
           for (i = 0; patterns[i] != NULL; i++)
             {
               const char *pattern = patterns[i];
 
+              /* Invalid patterns are ignored */
               if (*pattern != 0)
-                {
-                  g_autofree char *regexp = NULL;
-
-                  regexp = flatpak_filter_glob_to_regexp (pattern, FALSE, NULL);
-                  if (regexp)
-                    {
-                      if (i != 0)
-                        g_string_append (deny_regexp, "|");
-                      g_string_append (deny_regexp, regexp);
-                    }
-                }
+                flatpak_ref_matcher_add_glob (*cached, pattern, runtime_only, NULL);
             }
-
-          g_string_append (deny_regexp, ")$");
-          self->masked = g_regex_new (deny_regexp->str, G_REGEX_DOLLAR_ENDONLY|G_REGEX_RAW|G_REGEX_OPTIMIZE, G_REGEX_MATCH_ANCHORED, NULL);
         }
     }
 
-  if (self->masked)
-    res = g_regex_ref (self->masked);
+  if (*cached)
+    res = flatpak_ref_matcher_ref (*cached);
 
   G_UNLOCK (config_cache);
 
   return res;
 }
 
+static FlatpakRefMatcher *
+flatpak_dir_get_mask_matcher (FlatpakDir *self)
+{
+  return flatpak_dir_get_config_matcher (self, "masked", FALSE, &self->masked);
+}
+
 gboolean
 flatpak_dir_ref_is_masked (FlatpakDir *self,
                            const char *ref)
 {
-  g_autoptr(GRegex) masked = flatpak_dir_get_mask_regexp (self);
+  g_autoptr(FlatpakRefMatcher) masked = flatpak_dir_get_mask_matcher (self);
 
   return !flatpak_filters_allow_ref (NULL, masked, ref);
 }
 
-static GRegex *
-flatpak_dir_get_pin_regexp (FlatpakDir *self)
+static FlatpakRefMatcher *
+flatpak_dir_get_pin_matcher (FlatpakDir *self)
 {
-  GRegex *res = NULL;
+  return flatpak_dir_get_config_matcher (self, "pinned",
+                                         TRUE, /* only match runtimes */
+                                         &self->pinned);
+}
 
-  G_LOCK (config_cache);
+gboolean
+flatpak_dir_ref_is_pinned (FlatpakDir *self,
+                           const char *ref)
+{
+  g_autoptr(FlatpakRefMatcher) pinned = flatpak_dir_get_pin_matcher (self);
 
-  if (self->pinned == NULL)
-    {
-      g_autofree char *pinned = NULL;
+  return !flatpak_filters_allow_ref (NULL, pinned, ref);
+}
 
-      pinned = flatpak_dir_get_config (self, "pinned", NULL);
-      if (pinned)
-        {
-          g_auto(GStrv) patterns = g_strsplit (pinned, ";", -1);
-          g_autoptr(GString) deny_regexp = g_string_new ("^(");
-          int i;
+/* The remote related refs of a ref only depend on its metadata, on the
+ * summary of the remote and on the remote filter, so we cache the
+ * extensions found in the summary (before masking and before looking at
+ * what is installed). Each entry is (extension, extension ref, checksum,
+ * no-autodownload, download-if, autoprune-unless, autodelete,
+ * locale-subset). The cache is kept in memory in the remote state, and
+ * on disk with one file per remote and ref, holding the latest key and
+ * its candidates. */
+#define REMOTE_RELATED_CANDIDATES_FORMAT "a(sssbssbb)"
+#define REMOTE_RELATED_CACHE_FORMAT "(s" REMOTE_RELATED_CANDIDATES_FORMAT ")"
 
-          for (i = 0; patterns[i] != NULL; i++)
-            {
-              const char *pattern = patterns[i];
+static char *
+get_remote_related_cache_key (FlatpakRemoteState *state,
+                              FlatpakDecomposed  *ref,
+                              GKeyFile           *metakey)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree char *metadata = NULL;
+  FlatpakSummaryRefIndex *index;
+  GVariant *summary;
+  gsize metadata_len;
 
-              if (*pattern != 0)
-                {
-                  g_autofree char *regexp = NULL;
+  summary = get_summary_for_ref (state, flatpak_decomposed_get_ref (ref));
+  if (summary == NULL)
+    return NULL;
 
-                  regexp = flatpak_filter_glob_to_regexp (pattern,
-                                                          TRUE, /* only match runtimes */
-                                                          NULL);
-                  if (regexp)
-                    {
-                      if (i != 0)
-                        g_string_append (deny_regexp, "|");
-                      g_string_append (deny_regexp, regexp);
-                    }
-                }
-            }
+  index = flatpak_remote_state_get_ref_index (state, summary, NULL);
+  if (index == NULL)
+    return NULL;
 
-          g_string_append (deny_regexp, ")$");
-          self->pinned = g_regex_new (deny_regexp->str, G_REGEX_DOLLAR_ENDONLY|G_REGEX_RAW|G_REGEX_OPTIMIZE, G_REGEX_MATCH_ANCHORED, NULL);
-        }
-    }
+  metadata = g_key_file_to_data (metakey, &metadata_len, NULL);
 
-  if (self->pinned)
-    res = g_regex_ref (self->pinned);
+  g_checksum_update (checksum, (guchar *) state->remote_name, strlen (state->remote_name) + 1);
+  g_checksum_update (checksum, (guchar *) flatpak_decomposed_get_ref (ref), -1);
+  g_checksum_update (checksum, (guchar *) "", 1);
+  g_checksum_update (checksum, (guchar *) metadata, metadata_len + 1);
+  g_checksum_update (checksum, (guchar *) flatpak_summary_ref_index_get_digest (index), -1);
+  g_checksum_update (checksum, (guchar *) "", 1);
+  /* The filter decides which of the summary refs are visible */
+  if (state->filter_checksum)
+    g_checksum_update (checksum, (guchar *) state->filter_checksum, -1);
 
-  G_UNLOCK (config_cache);
+  return g_strdup (g_checksum_get_string (checksum));
+}
 
-  return res;
+static GFile *
+get_remote_related_cache_file (FlatpakDir         *self,
+                               FlatpakRemoteState *state,
+                               FlatpakDecomposed  *ref)
+{
+  g_autofree char *name = NULL;
+
+  name = g_compute_checksum_for_string (G_CHECKSUM_SHA256,
+                                        flatpak_decomposed_get_ref (ref), -1);
+
+  return flatpak_build_file (self->cache_dir, "related", state->remote_name, name, NULL);
 }
 
-gboolean
-flatpak_dir_ref_is_pinned (FlatpakDir *self,
-                           const char *ref)
+static GVariant *
+load_remote_related_candidates (FlatpakDir         *self,
+                                FlatpakRemoteState *state,
+                                FlatpakDecomposed  *ref,
+                                const char         *key)
 {
-  g_autoptr(GRegex) pinned = flatpak_dir_get_pin_regexp (self);
+  g_autoptr(GFile) cache_file = get_remote_related_cache_file (self, state, ref);
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) cache = NULL;
+  char *contents;
+  gsize length;
+  const char *cached_key;
+  GVariant *candidates;
 
-  return !flatpak_filters_allow_ref (NULL, pinned, ref);
+  if (!g_file_load_contents (cache_file, NULL, &contents, &length, NULL, NULL))
+    return NULL;
+
+  bytes = g_bytes_new_take (contents, length);
+
+  cache = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (REMOTE_RELATED_CACHE_FORMAT),
+                                                        bytes, FALSE));
+  g_variant_get (cache, "(&s@" REMOTE_RELATED_CANDIDATES_FORMAT ")", &cached_key, &candidates);
+  if (strcmp (cached_key, key) != 0)
+    {
+      g_variant_unref (candidates);
+      return NULL;
+    }
+
+  return candidates;
 }
 
-GPtrArray *
-flatpak_dir_find_remote_related_for_metadata (FlatpakDir         *self,
-                                              FlatpakRemoteState *state,
-                                              FlatpakDecomposed  *ref,
-                                              GKeyFile           *metakey,
-                                              GCancellable       *cancellable,
-                                              GError            **error)
+static void
+save_remote_related_candidates (FlatpakDir         *self,
+                                FlatpakRemoteState *state,
+                                FlatpakDecomposed  *ref,
+                                const char         *key,
+                                GVariant           *candidates)
+{
+  g_autoptr(GFile) cache_file = get_remote_related_cache_file (self, state, ref);
+  g_autoptr(GFile) cache_dir = g_file_get_parent (cache_file);
+  g_autoptr(GVariant) cache = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  cache = g_variant_ref_sink (g_variant_new ("(s@" REMOTE_RELATED_CANDIDATES_FORMAT ")", key, candidates));
+
+  /* This is only a cache, so failing to write it isn't fatal */
+  if (!flatpak_mkdir_p (cache_dir, NULL, &local_error) ||
+      !g_file_replace_contents (cache_file, g_variant_get_data (cache), g_variant_get_size (cache),
+                                NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, &local_error))
+    g_debug ("Failed to save related refs of %s: %s", flatpak_decomposed_get_ref (ref), local_error->message);
+}
+
+static GVariant *
+find_remote_related_candidates (FlatpakRemoteState *state,
+                                FlatpakDecomposed  *ref,
+                                GKeyFile           *metakey)
 {
-  int i;
-  g_autoptr(GPtrArray) related = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_related_free);
-  g_autofree char *url = NULL;
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
   g_auto(GStrv) groups = NULL;
-  g_autoptr(GRegex) masked = NULL;
   g_autofree char *ref_arch = flatpak_decomposed_dup_arch (ref);
   g_autofree char *ref_branch = flatpak_decomposed_dup_branch (ref);
+  int i;
 
-  if (!ostree_repo_remote_get_url (self->repo,
-                                   state->remote_name,
-                                   &url,
-                                   error))
-    return NULL;
-
-  if (*url == 0)
-    return g_steal_pointer (&related);  /* Empty url, silently disables updates */
-
-  masked = flatpak_dir_get_mask_regexp (self);
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (REMOTE_RELATED_CANDIDATES_FORMAT));
 
   groups = g_key_file_get_groups (metakey, NULL);
   for (i = 0; groups[i] != NULL; i++)
@@ -15386,9 +16910,11 @@ flatpak_dir_find_remote_related_for_metadata (FlatpakDir         *self,
 
               if (flatpak_remote_state_lookup_ref (state, flatpak_decomposed_get_ref (extension_ref), &checksum, NULL, NULL, NULL, NULL))
                 {
-                  if (flatpak_filters_allow_ref (NULL, masked, flatpak_decomposed_get_ref (extension_ref)))
-                    add_related (self, related, state->remote_name, extension, extension_ref, checksum,
-                                 no_autodownload, download_if, autoprune_unless, autodelete, locale_subset);
+                  g_variant_builder_add (&builder, "(sssbssbb)", extension,
+                                         flatpak_decomposed_get_ref (extension_ref), checksum,
+                                         no_autodownload, download_if ? download_if : "",
+                                         autoprune_unless ? autoprune_unless : "",
+                                         autodelete, locale_subset);
                 }
               else if (subdirectories)
                 {
@@ -15399,16 +16925,105 @@ flatpak_dir_find_remote_related_for_metadata (FlatpakDir         *self,
                       g_autofree char *subref_checksum = NULL;
 
                       if (flatpak_remote_state_lookup_ref (state, flatpak_decomposed_get_ref (subref_ref),
-                                                           &subref_checksum, NULL, NULL, NULL, NULL) &&
-                          flatpak_filters_allow_ref (NULL, masked,  flatpak_decomposed_get_ref (subref_ref)))
-                        add_related (self, related, state->remote_name, extension, subref_ref, subref_checksum,
-                                     no_autodownload, download_if, autoprune_unless, autodelete, locale_subset);
+                                                           &subref_checksum, NULL, NULL, NULL, NULL))
+                        g_variant_builder_add (&builder, "(sssbssbb)", extension,
+                                               flatpak_decomposed_get_ref (subref_ref), subref_checksum,
+                                               no_autodownload, download_if ? download_if : "",
+                                               autoprune_unless ? autoprune_unless : "",
+                                               autodelete, locale_subset);
                     }
                 }
             }
         }
     }
 
+  return g_variant_ref_sink (g_variant_builder_end (&builder));
+}
+
+static GVariant *
+get_remote_related_candidates (FlatpakDir         *self,
+                               FlatpakRemoteState *state,
+                               FlatpakDecomposed  *ref,
+                               GKeyFile           *metakey)
+{
+  g_autofree char *key = NULL;
+  GVariant *candidates = NULL;
+
+  /* Without a summary (e.g. only sideload repos) we can't cache */
+  key = get_remote_related_cache_key (state, ref, metakey);
+  if (key == NULL)
+    return find_remote_related_candidates (state, ref, metakey);
+
+  g_mutex_lock (&state->related_cache_lock);
+  candidates = g_hash_table_lookup (state->related_cache, key);
+  if (candidates != NULL)
+    g_variant_ref (candidates);
+  g_mutex_unlock (&state->related_cache_lock);
+
+  if (candidates != NULL)
+    return candidates;
+
+  candidates = load_remote_related_candidates (self, state, ref, key);
+  if (candidates == NULL)
+    {
+      candidates = find_remote_related_candidates (state, ref, metakey);
+      save_remote_related_candidates (self, state, ref, key, candidates);
+    }
+
+  g_mutex_lock (&state->related_cache_lock);
+  g_hash_table_replace (state->related_cache, g_steal_pointer (&key), g_variant_ref (candidates));
+  g_mutex_unlock (&state->related_cache_lock);
+
+  return candidates;
+}
+
+GPtrArray *
+flatpak_dir_find_remote_related_for_metadata (FlatpakDir         *self,
+                                              FlatpakRemoteState *state,
+                                              FlatpakDecomposed  *ref,
+                                              GKeyFile           *metakey,
+                                              GCancellable       *cancellable,
+                                              GError            **error)
+{
+  g_autoptr(GPtrArray) related = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_related_free);
+  g_autofree char *url = NULL;
+  g_autoptr(FlatpakRefMatcher) masked = NULL;
+  g_autoptr(GVariant) candidates = NULL;
+  GVariantIter iter;
+  const char *extension, *extension_ref_str, *checksum, *download_if, *autoprune_unless;
+  gboolean no_autodownload, autodelete, locale_subset;
+
+  if (!ostree_repo_remote_get_url (self->repo,
+                                   state->remote_name,
+                                   &url,
+                                   error))
+    return NULL;
+
+  if (*url == 0)
+    return g_steal_pointer (&related);  /* Empty url, silently disables updates */
+
+  masked = flatpak_dir_get_mask_matcher (self);
+
+  candidates = get_remote_related_candidates (self, state, ref, metakey);
+
+  g_variant_iter_init (&iter, candidates);
+  while (g_variant_iter_next (&iter, "(&s&s&sb&s&sbb)", &extension, &extension_ref_str, &checksum,
+                              &no_autodownload, &download_if, &autoprune_unless,
+                              &autodelete, &locale_subset))
+    {
+      g_autoptr(FlatpakDecomposed) extension_ref = NULL;
+
+      if (!flatpak_filters_allow_ref (NULL, masked, extension_ref_str))
+        continue;
+
+      extension_ref = flatpak_decomposed_new_from_ref_interned (extension_ref_str, NULL);
+      if (extension_ref == NULL)
+        continue;
+
+      add_related (self, related, state->remote_name, extension, extension_ref, checksum,
+                   no_autodownload, download_if, autoprune_unless, autodelete, locale_subset);
+    }
+
   return g_steal_pointer (&related);
 }
 
@@ -16115,9 +17730,10 @@ static void
                      const char *format,
                      ...)
 {
-#ifdef HAVE_LIBSYSTEMD
   const char *installation = source ? source : flatpak_dir_get_name_cached (self);
   pid_t source_pid = flatpak_dir_get_source_pid (self);
+  g_autoptr(GError) local_error = NULL;
+#ifdef HAVE_LIBSYSTEMD
   char message[1024];
   int len;
   va_list args;
@@ -16149,6 +17765,13 @@ static void
                    "URL=%s", url ? url : "",
                    NULL);
 #endif
+
+  /* Also keep an indexed copy in the installation, for fast history lookups.
+   * Pulls into temporary child repos (named by path) are not interesting there. */
+  if (installation[0] != '/' &&
+      !flatpak_history_append (self->basedir, installation, change, remote, ref,
+                               commit, old_commit, url, source_pid, &local_error))
+    g_warning ("Failed to append to history store: %s", local_error->message);
 }
 
 /* Delete refs that are in refs/mirrors/ rather than refs/remotes/ to prevent
@@ -16238,46 +17861,34 @@ flatpak_dir_delete_mirror_refs (FlatpakDir    *self,
 }
 
 
-static gboolean
-dir_get_metadata (FlatpakDir        *dir,
-                  FlatpakDecomposed *ref,
-                  GKeyFile         **out_metakey)
+static GVariant *
+dir_get_dependencies (RefDependencies   *deps,
+                      FlatpakDecomposed *ref)
 {
-  g_autoptr(GFile) deploy_dir = NULL;
-  g_autoptr(GKeyFile) metakey = NULL;
-  g_autoptr(GFile) metadata = NULL;
-  g_autofree char *metadata_contents = NULL;
-  gsize metadata_size;
-
-  deploy_dir = flatpak_dir_get_if_deployed (dir, ref, NULL, NULL);
-  if (deploy_dir == NULL)
-    return FALSE;
-
-  metadata = g_file_get_child (deploy_dir, "metadata");
-  if (!g_file_load_contents (metadata, NULL, &metadata_contents, &metadata_size, NULL, NULL))
-    return FALSE;
-
-  metakey = g_key_file_new ();
-  if (!g_key_file_load_from_data (metakey, metadata_contents, metadata_size, 0, NULL))
-    return FALSE;
+  g_autofree char *active_id = NULL;
 
-  *out_metakey = g_steal_pointer (&metakey);
+  active_id = flatpak_dir_read_active (deps->dir, ref, NULL);
+  if (active_id == NULL)
+    return NULL;
 
-  return TRUE;
+  return ref_dependencies_lookup (deps, ref, active_id);
 }
 
 static gboolean
-maybe_get_metakey (FlatpakDir        *dir,
-                   FlatpakDir        *shadowing_dir,
-                   FlatpakDecomposed *ref,
-                   GHashTable        *metadata_injection,
-                   GKeyFile         **out_metakey,
-                   gboolean          *out_ref_is_shadowed)
+maybe_get_dependencies (RefDependencies   *deps,
+                        RefDependencies   *shadowing_deps,
+                        FlatpakDecomposed *ref,
+                        GHashTable        *metadata_injection,
+                        GVariant         **out_dependencies,
+                        gboolean          *out_ref_is_shadowed)
 {
-  if (shadowing_dir &&
-      dir_get_metadata (shadowing_dir, ref, out_metakey))
+  GVariant *dependencies;
+
+  if (shadowing_deps &&
+      (dependencies = dir_get_dependencies (shadowing_deps, ref)) != NULL)
     {
       *out_ref_is_shadowed = TRUE;
+      *out_dependencies = g_variant_ref (dependencies);
       return TRUE;
     }
 
@@ -16287,14 +17898,15 @@ maybe_get_metakey (FlatpakDir        *dir,
       if (injected_metakey != NULL)
         {
           *out_ref_is_shadowed = FALSE;
-          *out_metakey = g_key_file_ref (injected_metakey);
+          *out_dependencies = ref_dependencies_entry_new (ref, "", injected_metakey);
           return TRUE;
         }
     }
 
-  if (dir_get_metadata (dir, ref, out_metakey))
+  if ((dependencies = dir_get_dependencies (deps, ref)) != NULL)
     {
       *out_ref_is_shadowed = FALSE;
+      *out_dependencies = g_variant_ref (dependencies);
       return TRUE;
     }
 
@@ -16328,10 +17940,15 @@ queue_ref_for_analysis (FlatpakDecomposed *ref,
  * Notes:
  *  The "root" refs come from @shadowing_dir if not %NULL and @self otherwise.
  *  refs_to_exclude, and metadata_injection both only affect @self, not @shadowing_dir
+ *  The dependencies come from @deps and @shadowing_deps rather than from the deployed
+ *  metadata, and related refs are looked up in @installed_runtimes (the runtimes in @self)
  */
 static GHashTable *
 find_used_refs (FlatpakDir         *self,
+                RefDependencies    *deps,
                 FlatpakDir         *shadowing_dir, /* nullable */
+                RefDependencies    *shadowing_deps, /* nullable */
+                GHashTable         *installed_runtimes,
                 const char         *arch,
                 GHashTable         *metadata_injection,
                 GHashTable         *refs_to_exclude,
@@ -16396,14 +18013,20 @@ find_used_refs (FlatpakDir         *self,
 
   while ((ref_to_analyze = g_queue_pop_head (refs_to_analyze)) != NULL)
     {
-      g_autoptr(GKeyFile) metakey = NULL;
+      g_autoptr(GVariant) dependencies = NULL;
+      g_autoptr(GVariant) uses = NULL;
+      g_autoptr(GVariant) extensions = NULL;
+      g_autofree char *ref_arch = NULL;
       gboolean ref_is_shadowed;
-      gboolean is_app;
-      g_autoptr(GPtrArray) related = NULL;
-      g_autofree char *sdk = NULL;
-
-      if (!maybe_get_metakey (self, shadowing_dir, ref_to_analyze, metadata_injection,
-                              &metakey, &ref_is_shadowed))
+      GVariantIter iter;
+      const char *used_ref;
+      const char *extension;
+      const char **branches;
+      gboolean subdirectories;
+      const char *autoprune_unless;
+
+      if (!maybe_get_dependencies (deps, shadowing_deps, ref_to_analyze, metadata_injection,
+                                   &dependencies, &ref_is_shadowed))
         continue; /* Something used something we could not find, that is fine and happens for instance with sdk dependencies */
 
       if (!ref_is_shadowed)
@@ -16423,55 +18046,60 @@ find_used_refs (FlatpakDir         *self,
        * Find all dependencies and queue for analysis *
        ***********************************************/
 
-      is_app = flatpak_decomposed_is_app (ref_to_analyze);
-
-      /* App directly depends on its runtime */
-      if (is_app)
-        {
-          g_autofree char *runtime = g_key_file_get_string (metakey, "Application", "runtime", NULL);
-          if (runtime)
-            {
-              g_autoptr(FlatpakDecomposed) runtime_ref = flatpak_decomposed_new_from_pref (FLATPAK_KINDS_RUNTIME, runtime, NULL);
-              if (runtime_ref && !flatpak_decomposed_equal (runtime_ref, ref_to_analyze))
-                queue_ref_for_analysis (runtime_ref, arch, analyzed_refs, refs_to_analyze);
-            }
-        }
-
-      /* Both apps and runtims directly depends on its sdk, to avoid suddenly uninstalling something you use to develop the app */
-      sdk = g_key_file_get_string (metakey, is_app ? "Application" : "Runtime", "sdk", NULL);
-      if (sdk)
+      /* The runtime, sdk and extra-data runtime are used directly */
+      uses = g_variant_get_child_value (dependencies, 1);
+      g_variant_iter_init (&iter, uses);
+      while (g_variant_iter_next (&iter, "&s", &used_ref))
         {
-          g_autoptr(FlatpakDecomposed) sdk_ref = flatpak_decomposed_new_from_pref (FLATPAK_KINDS_RUNTIME, sdk, NULL);
-          if (sdk_ref && !flatpak_decomposed_equal (sdk_ref, ref_to_analyze))
-            queue_ref_for_analysis (sdk_ref, arch, analyzed_refs, refs_to_analyze);
+          g_autoptr(FlatpakDecomposed) d = flatpak_decomposed_new_from_ref (used_ref, NULL);
+          if (d)
+            queue_ref_for_analysis (d, arch, analyzed_refs, refs_to_analyze);
         }
 
-      /* Extensions with extra data, that are not specially marked NoRuntime needs the runtime at install.
-       * Lets keep it around to not re-download it next update */
-      if (!is_app &&
-          g_key_file_has_group (metakey, "Extra Data") &&
-          !g_key_file_get_boolean (metakey, "Extra Data", "NoRuntime", NULL))
+      /* Related refs are the extensions installed in @self, from any remote */
+      ref_arch = flatpak_decomposed_dup_arch (ref_to_analyze);
+      extensions = g_variant_get_child_value (dependencies, 2);
+      g_variant_iter_init (&iter, extensions);
+      while (g_variant_iter_next (&iter, "(&s^a&sb&s)", &extension, &branches, &subdirectories, &autoprune_unless))
         {
-          g_autofree char *extension_runtime_ref = g_key_file_get_string (metakey, "ExtensionOf", "runtime", NULL);
-          if (extension_runtime_ref != NULL)
+          for (int i = 0; branches[i] != NULL; i++)
             {
-              g_autoptr(FlatpakDecomposed) d = flatpak_decomposed_new_from_ref (extension_runtime_ref, NULL);
-              if (d)
-                queue_ref_for_analysis (d, arch, analyzed_refs, refs_to_analyze);
-            }
-        }
+              g_autoptr(FlatpakDecomposed) extension_ref = NULL;
+              g_autofree char *id_prefix = NULL;
 
-      /* We pass NULL for remote-name here, because we want to consider related refs from all remotes */
-      related = flatpak_dir_find_local_related_for_metadata (self, ref_to_analyze,
-                                                             NULL, metakey, NULL, NULL);
-      for (int i = 0; related != NULL && i < related->len; i++)
-        {
-          FlatpakRelated *rel = g_ptr_array_index (related, i);
+              extension_ref = flatpak_decomposed_new_from_parts (FLATPAK_KINDS_RUNTIME,
+                                                                 extension, ref_arch, branches[i], NULL);
+              if (extension_ref == NULL)
+                continue;
 
-          if (!rel->auto_prune)
-            {
-              queue_ref_for_analysis (rel->ref, arch, analyzed_refs, refs_to_analyze);
+              if (g_hash_table_contains (installed_runtimes, extension_ref))
+                {
+                  if (flatpak_extension_matches_reason (extension, autoprune_unless, TRUE))
+                    queue_ref_for_analysis (extension_ref, arch, analyzed_refs, refs_to_analyze);
+                  continue;
+                }
+
+              if (!subdirectories)
+                continue;
+
+              id_prefix = g_strconcat (extension, ".", NULL);
+              GLNX_HASH_TABLE_FOREACH (installed_runtimes, FlatpakDecomposed *, installed_ref)
+                {
+                  g_autofree char *id = NULL;
+
+                  /* Must match arch and branch, but only prefix of id */
+                  if (!flatpak_decomposed_is_arch (installed_ref, ref_arch) ||
+                      !flatpak_decomposed_is_branch (installed_ref, branches[i]) ||
+                      !flatpak_decomposed_id_has_prefix (installed_ref, id_prefix))
+                    continue;
+
+                  id = flatpak_decomposed_dup_id (installed_ref);
+                  if (flatpak_extension_matches_reason (id, autoprune_unless, TRUE))
+                    queue_ref_for_analysis (installed_ref, arch, analyzed_refs, refs_to_analyze);
+                }
             }
+
+          g_free (branches);
         }
     }
 
@@ -16495,6 +18123,8 @@ flatpak_dir_list_unused_refs (FlatpakDir         *self,
   g_autoptr(GHashTable) excluded_refs_ht = NULL;
   g_autoptr(GPtrArray) refs =  NULL;
   g_autoptr(GPtrArray) runtime_refs = NULL;
+  g_autoptr(GHashTable) installed_runtimes = NULL;
+  g_autoptr(RefDependencies) deps = NULL;
 
   /* Convert refs_to_exclude to hashtable for fast repeated lookups */
   if (refs_to_exclude)
@@ -16509,9 +18139,19 @@ flatpak_dir_list_unused_refs (FlatpakDir         *self,
         }
     }
 
+  runtime_refs = flatpak_dir_list_refs (self, FLATPAK_KINDS_RUNTIME, cancellable, error);
+  if (runtime_refs == NULL)
+    return NULL;
+
+  installed_runtimes = g_hash_table_new ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal);
+  for (int i = 0; i < runtime_refs->len; i++)
+    g_hash_table_add (installed_runtimes, g_ptr_array_index (runtime_refs, i));
+
+  deps = ref_dependencies_load (self);
+
   used_refs = g_hash_table_new_full ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal, (GDestroyNotify)flatpak_decomposed_unref, NULL);
 
-  if (!find_used_refs (self, NULL, arch, metadata_injection, excluded_refs_ht,
+  if (!find_used_refs (self, deps, NULL, NULL, installed_runtimes, arch, metadata_injection, excluded_refs_ht,
                        used_refs, cancellable, error))
     return NULL;
 
@@ -16524,9 +18164,10 @@ flatpak_dir_list_unused_refs (FlatpakDir         *self,
   if (!flatpak_dir_is_user (self))
     {
       g_autoptr(FlatpakDir) user_dir = flatpak_dir_get_user ();
+      g_autoptr(RefDependencies) user_deps = ref_dependencies_load (user_dir);
       g_autoptr(GError) local_error = NULL;
 
-      if (!find_used_refs (self, user_dir, arch, metadata_injection, excluded_refs_ht,
+      if (!find_used_refs (self, deps, user_dir, user_deps, installed_runtimes, arch, metadata_injection, excluded_refs_ht,
                            used_refs, cancellable, &local_error))
         {
           /* We may get permission denied if the process is sandboxed with
@@ -16539,11 +18180,13 @@ flatpak_dir_list_unused_refs (FlatpakDir         *self,
               return NULL;
             }
         }
+      else
+        ref_dependencies_save (user_deps);
     }
 
-  runtime_refs = flatpak_dir_list_refs (self, FLATPAK_KINDS_RUNTIME, cancellable, error);
-  if (runtime_refs == NULL)
-    return NULL;
+  /* Save any dependencies we had to recompute, e.g. for refs deployed
+   * before the graph was kept up to date */
+  ref_dependencies_save (deps);
 
   refs = g_ptr_array_new_with_free_func (g_free);
 
@@ -0,0 +1,54 @@
+/*
+ * Copyright © 2022 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_GPG_SIGNER_H__
+#define __FLATPAK_GPG_SIGNER_H__
+
+#include <gio/gio.h>
+#include <ostree.h>
+
+/* A set of gpg keys, looked up once, that can sign any number of commits
+ * and summaries. The signatures are the same as the ones created by
+ * ostree_repo_sign_commit() and ostree_repo_gpg_sign_data(). A signer
+ * must only be used by one thread at a time. */
+typedef struct FlatpakGpgSigner FlatpakGpgSigner;
+
+FlatpakGpgSigner *flatpak_gpg_signer_new         (const char      **key_ids,
+                                                  const char       *homedir,
+                                                  GError          **error);
+void              flatpak_gpg_signer_free        (FlatpakGpgSigner *signer);
+GVariant *        flatpak_gpg_signer_sign_data   (FlatpakGpgSigner *signer,
+                                                  GBytes           *data,
+                                                  GVariant         *old_metadata,
+                                                  GError          **error);
+gboolean          flatpak_gpg_signer_sign_commit (FlatpakGpgSigner *signer,
+                                                  OstreeRepo       *repo,
+                                                  const char       *commit_checksum,
+                                                  GCancellable     *cancellable,
+                                                  GError          **error);
+
+gboolean          flatpak_gpg_sign_commits       (OstreeRepo       *repo,
+                                                  GPtrArray        *commits,
+                                                  const char      **key_ids,
+                                                  const char       *homedir,
+                                                  guint             n_jobs,
+                                                  GCancellable     *cancellable,
+                                                  GError          **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakGpgSigner, flatpak_gpg_signer_free)
+
+#endif /* __FLATPAK_GPG_SIGNER_H__ */
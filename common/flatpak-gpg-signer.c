@@ -0,0 +1,492 @@
+/*
+ * Copyright © 2022 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <glib/gi18n-lib.h>
+
+#include <string.h>
+#include <gpgme.h>
+
+#include "flatpak-gpg-signer-private.h"
+#include "flatpak-utils-private.h"
+#include "flatpak-error.h"
+#include "libglnx/libglnx.h"
+
+/* Signing with ostree_repo_sign_commit() sets up a new gpg context and
+ * looks up the key for every signature, and checks for existing signatures
+ * by importing the keyring into a temporary gpg home. A FlatpakGpgSigner
+ * does the context setup and key lookup once, and checks existing
+ * signatures with the context it already has. */
+
+#define GPGSIGS_KEY "ostree.gpgsigs"
+
+G_DEFINE_AUTO_CLEANUP_FREE_FUNC (gpgme_data_t, gpgme_data_release, NULL)
+G_DEFINE_AUTO_CLEANUP_FREE_FUNC (gpgme_key_t, gpgme_key_unref, NULL)
+
+typedef struct
+{
+  char        *key_id;
+  gpgme_ctx_t  context;      /* Has this key as its only signer */
+  char       **fingerprints; /* Of the key and all its subkeys */
+} SignerKey;
+
+struct FlatpakGpgSigner
+{
+  GPtrArray *keys;
+};
+
+static void
+signer_key_free (SignerKey *key)
+{
+  if (key->context)
+    gpgme_release (key->context);
+  g_strfreev (key->fingerprints);
+  g_free (key->key_id);
+  g_free (key);
+}
+
+static gboolean
+gpg_fail (GError      **error,
+          gpgme_error_t err,
+          const char   *message)
+{
+  return flatpak_fail (error, "%s: %s", message, gpgme_strerror (err));
+}
+
+FlatpakGpgSigner *
+flatpak_gpg_signer_new (const char **key_ids,
+                        const char  *homedir,
+                        GError     **error)
+{
+  g_autoptr(FlatpakGpgSigner) signer = g_new0 (FlatpakGpgSigner, 1);
+  static gsize gpgme_initialized = 0;
+  gsize i;
+
+  if (g_once_init_enter (&gpgme_initialized))
+    {
+      gpgme_check_version (NULL);
+      g_once_init_leave (&gpgme_initialized, 1);
+    }
+
+  signer->keys = g_ptr_array_new_with_free_func ((GDestroyNotify) signer_key_free);
+
+  for (i = 0; key_ids[i] != NULL; i++)
+    {
+      SignerKey *key = g_new0 (SignerKey, 1);
+      g_auto(gpgme_key_t) gpg_key = NULL;
+      g_autoptr(GPtrArray) fingerprints = g_ptr_array_new ();
+      gpgme_subkey_t subkey;
+      gpgme_error_t err;
+
+      key->key_id = g_strdup (key_ids[i]);
+      g_ptr_array_add (signer->keys, key);
+
+      if ((err = gpgme_new (&key->context)) != GPG_ERR_NO_ERROR)
+        {
+          gpg_fail (error, err, "Unable to create gpg context");
+          return NULL;
+        }
+
+      if (homedir != NULL)
+        {
+          gpgme_engine_info_t info = gpgme_ctx_get_engine_info (key->context);
+
+          if ((err = gpgme_ctx_set_engine_info (key->context, info->protocol, NULL, homedir))
+              != GPG_ERR_NO_ERROR)
+            {
+              gpg_fail (error, err, "Unable to set gpg homedir");
+              return NULL;
+            }
+        }
+
+      /* Get the secret key with the given key id */
+      err = gpgme_get_key (key->context, key->key_id, &gpg_key, 1);
+      if (gpgme_err_code (err) == GPG_ERR_EOF)
+        {
+          flatpak_fail_error (error, FLATPAK_ERROR_UNTRUSTED,
+                              _("No gpg key found with ID %s (homedir: %s)"),
+                              key->key_id, homedir ? homedir : "<default>");
+          return NULL;
+        }
+      else if (err != GPG_ERR_NO_ERROR)
+        {
+          flatpak_fail_error (error, FLATPAK_ERROR_UNTRUSTED,
+                              _("Unable to lookup key ID %s: %d)"),
+                              key->key_id, err);
+          return NULL;
+        }
+
+      if ((err = gpgme_signers_add (key->context, gpg_key)) != GPG_ERR_NO_ERROR)
+        {
+          gpg_fail (error, err, "Unable to add signing key");
+          return NULL;
+        }
+
+      for (subkey = gpg_key->subkeys; subkey != NULL; subkey = subkey->next)
+        {
+          if (subkey->fpr != NULL)
+            g_ptr_array_add (fingerprints, g_strdup (subkey->fpr));
+        }
+      g_ptr_array_add (fingerprints, NULL);
+      key->fingerprints = (char **) g_ptr_array_free (g_steal_pointer (&fingerprints), FALSE);
+    }
+
+  return g_steal_pointer (&signer);
+}
+
+void
+flatpak_gpg_signer_free (FlatpakGpgSigner *signer)
+{
+  g_clear_pointer (&signer->keys, g_ptr_array_unref);
+  g_free (signer);
+}
+
+static GBytes *
+sign_with_key (SignerKey *key,
+               GBytes    *data,
+               GError   **error)
+{
+  g_auto(gpgme_data_t) data_buffer = NULL;
+  g_auto(gpgme_data_t) signature_buffer = NULL;
+  gpgme_error_t err;
+  const char *buf;
+  gsize len;
+  char *signature;
+  size_t signature_len;
+  GBytes *res;
+
+  buf = g_bytes_get_data (data, &len);
+  if ((err = gpgme_data_new_from_mem (&data_buffer, buf, len, 0)) != GPG_ERR_NO_ERROR ||
+      (err = gpgme_data_new (&signature_buffer)) != GPG_ERR_NO_ERROR)
+    {
+      gpg_fail (error, err, "Failed to create gpg buffer");
+      return NULL;
+    }
+
+  if ((err = gpgme_op_sign (key->context, data_buffer, signature_buffer, GPGME_SIG_MODE_DETACH))
+      != GPG_ERR_NO_ERROR)
+    {
+      gpg_fail (error, err, "Failure signing data");
+      return NULL;
+    }
+
+  signature = gpgme_data_release_and_get_mem (g_steal_pointer (&signature_buffer), &signature_len);
+  res = g_bytes_new (signature, signature_len);
+  gpgme_free (signature);
+
+  return res;
+}
+
+static gboolean
+key_has_fingerprint (SignerKey  *key,
+                     const char *fpr)
+{
+  char **iter;
+
+  /* Old signatures only carry the (long) key id */
+  for (iter = key->fingerprints; *iter != NULL; iter++)
+    {
+      if (g_ascii_strcasecmp (*iter, fpr) == 0 ||
+          (strlen (fpr) >= 16 && g_str_has_suffix (*iter, fpr)))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+key_has_signed (SignerKey *key,
+                GBytes    *data,
+                GVariant  *signatures)
+{
+  const char *buf;
+  gsize len;
+  gsize i;
+
+  buf = g_bytes_get_data (data, &len);
+
+  for (i = 0; i < g_variant_n_children (signatures); i++)
+    {
+      g_autoptr(GVariant) signature = g_variant_get_child_value (signatures, i);
+      g_auto(gpgme_data_t) data_buffer = NULL;
+      g_auto(gpgme_data_t) signature_buffer = NULL;
+      gpgme_verify_result_t result;
+      gpgme_signature_t sig;
+
+      if (gpgme_data_new_from_mem (&data_buffer, buf, len, 0) != GPG_ERR_NO_ERROR ||
+          gpgme_data_new_from_mem (&signature_buffer, g_variant_get_data (signature),
+                                   g_variant_get_size (signature), 0) != GPG_ERR_NO_ERROR)
+        continue;
+
+      if (gpgme_op_verify (key->context, signature_buffer, data_buffer, NULL) != GPG_ERR_NO_ERROR)
+        continue;
+
+      result = gpgme_op_verify_result (key->context);
+      for (sig = result ? result->signatures : NULL; sig != NULL; sig = sig->next)
+        {
+          if (sig->fpr != NULL && key_has_fingerprint (key, sig->fpr))
+            return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static GVariant *
+sign_data (FlatpakGpgSigner *signer,
+           GBytes           *data,
+           GVariant         *old_metadata,
+           gboolean          skip_signed,
+           guint            *out_n_added,
+           GError          **error)
+{
+  g_auto(GVariantDict) metadata_dict = FLATPAK_VARIANT_DICT_INITIALIZER;
+  g_auto(GVariantBuilder) signatures_builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(GVariant) old_signatures = NULL;
+  guint n_added = 0;
+  gsize i;
+
+  g_variant_dict_init (&metadata_dict, old_metadata);
+  old_signatures = g_variant_dict_lookup_value (&metadata_dict, GPGSIGS_KEY, G_VARIANT_TYPE ("aay"));
+
+  g_variant_builder_init (&signatures_builder, G_VARIANT_TYPE ("aay"));
+  for (i = 0; old_signatures != NULL && i < g_variant_n_children (old_signatures); i++)
+    {
+      g_autoptr(GVariant) old_signature = g_variant_get_child_value (old_signatures, i);
+      g_variant_builder_add_value (&signatures_builder, old_signature);
+    }
+
+  /* One signature per key, like ostree does */
+  for (i = 0; i < signer->keys->len; i++)
+    {
+      SignerKey *key = g_ptr_array_index (signer->keys, i);
+      g_autoptr(GBytes) signature = NULL;
+
+      if (skip_signed && old_signatures != NULL && key_has_signed (key, data, old_signatures))
+        continue;
+
+      signature = sign_with_key (key, data, error);
+      if (signature == NULL)
+        {
+          g_prefix_error (error, "Signing with key %s: ", key->key_id);
+          return NULL;
+        }
+
+      g_variant_builder_add_value (&signatures_builder,
+                                   g_variant_new_from_bytes (G_VARIANT_TYPE ("ay"), signature, FALSE));
+      n_added++;
+    }
+
+  g_variant_dict_insert_value (&metadata_dict, GPGSIGS_KEY, g_variant_builder_end (&signatures_builder));
+
+  if (out_n_added)
+    *out_n_added = n_added;
+
+  return g_variant_ref_sink (g_variant_dict_end (&metadata_dict));
+}
+
+/* Returns @old_metadata (which may be %NULL) with a signature of @data by
+ * each key added to the ostree.gpgsigs key. This is the format of commit
+ * detached metadata and summary signatures. */
+GVariant *
+flatpak_gpg_signer_sign_data (FlatpakGpgSigner *signer,
+                              GBytes           *data,
+                              GVariant         *old_metadata,
+                              GError          **error)
+{
+  return sign_data (signer, data, old_metadata, FALSE, NULL, error);
+}
+
+/* Adds signatures to the detached metadata of the commit. Keys that
+ * already signed the commit are skipped. */
+gboolean
+flatpak_gpg_signer_sign_commit (FlatpakGpgSigner *signer,
+                                OstreeRepo       *repo,
+                                const char       *commit_checksum,
+                                GCancellable     *cancellable,
+                                GError          **error)
+{
+  g_autoptr(GVariant) commit_variant = NULL;
+  g_autoptr(GVariant) old_metadata = NULL;
+  g_autoptr(GVariant) new_metadata = NULL;
+  g_autoptr(GBytes) commit_data = NULL;
+  guint n_added;
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit_checksum,
+                                 &commit_variant, error))
+    return glnx_prefix_error (error, "Failed to read commit");
+
+  if (!ostree_repo_read_commit_detached_metadata (repo, commit_checksum, &old_metadata,
+                                                  cancellable, error))
+    return glnx_prefix_error (error, "Failed to read detached metadata");
+
+  commit_data = g_variant_get_data_as_bytes (commit_variant);
+
+  new_metadata = sign_data (signer, commit_data, old_metadata, TRUE, &n_added, error);
+  if (new_metadata == NULL)
+    return FALSE;
+
+  if (n_added == 0)
+    return TRUE;
+
+  return ostree_repo_write_commit_detached_metadata (repo, commit_checksum, new_metadata,
+                                                     cancellable, error);
+}
+
+typedef struct
+{
+  OstreeRepo   *repo;
+  GAsyncQueue  *signers;
+  GCancellable *cancellable;
+  GMutex        lock;
+  GError       *error;
+} SignCommits;
+
+static void
+sign_commit_thread (gpointer data,
+                    gpointer user_data)
+{
+  const char *commit = data;
+  SignCommits *sc = user_data;
+  g_autoptr(GError) local_error = NULL;
+  FlatpakGpgSigner *signer;
+  gboolean failed;
+  gboolean res;
+
+  g_mutex_lock (&sc->lock);
+  failed = sc->error != NULL;
+  g_mutex_unlock (&sc->lock);
+
+  /* Don't bother with the rest once something failed */
+  if (failed)
+    return;
+
+  /* Each signer is only used by one thread at a time */
+  signer = g_async_queue_pop (sc->signers);
+  res = flatpak_gpg_signer_sign_commit (signer, sc->repo, commit, sc->cancellable, &local_error);
+  g_async_queue_push (sc->signers, signer);
+
+  if (!res)
+    {
+      g_prefix_error (&local_error, "Signing commit %s: ", commit);
+
+      g_mutex_lock (&sc->lock);
+      if (sc->error == NULL)
+        sc->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&sc->lock);
+    }
+}
+
+/* Signs all of @commits with each of @key_ids, using up to @n_jobs
+ * signers in parallel. */
+gboolean
+flatpak_gpg_sign_commits (OstreeRepo   *repo,
+                          GPtrArray    *commits,
+                          const char  **key_ids,
+                          const char   *homedir,
+                          guint         n_jobs,
+                          GCancellable *cancellable,
+                          GError      **error)
+{
+  g_autoptr(GHashTable) seen = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GPtrArray) unique = g_ptr_array_new ();
+  g_autoptr(GPtrArray) signers = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_gpg_signer_free);
+  SignCommits sc = { 0 };
+  GThreadPool *pool;
+  gboolean res = TRUE;
+  guint i;
+
+  /* Several refs may point to the same commit, and two threads must not
+   * rewrite the same detached metadata */
+  for (i = 0; i < commits->len; i++)
+    {
+      const char *commit = g_ptr_array_index (commits, i);
+
+      if (g_hash_table_add (seen, (char *) commit))
+        g_ptr_array_add (unique, (char *) commit);
+    }
+
+  if (unique->len == 0)
+    return TRUE;
+
+  n_jobs = CLAMP (n_jobs, 1, unique->len);
+
+  if (n_jobs == 1)
+    {
+      g_autoptr(FlatpakGpgSigner) signer = flatpak_gpg_signer_new (key_ids, homedir, error);
+
+      if (signer == NULL)
+        return FALSE;
+
+      for (i = 0; i < unique->len; i++)
+        {
+          const char *commit = g_ptr_array_index (unique, i);
+
+          if (!flatpak_gpg_signer_sign_commit (signer, repo, commit, cancellable, error))
+            return glnx_prefix_error (error, "Signing commit %s", commit);
+        }
+
+      return TRUE;
+    }
+
+  sc.repo = repo;
+  sc.cancellable = cancellable;
+  sc.signers = g_async_queue_new ();
+  g_mutex_init (&sc.lock);
+
+  for (i = 0; res && i < n_jobs; i++)
+    {
+      FlatpakGpgSigner *signer = flatpak_gpg_signer_new (key_ids, homedir, error);
+
+      if (signer == NULL)
+        res = FALSE;
+      else
+        {
+          g_ptr_array_add (signers, signer);
+          g_async_queue_push (sc.signers, signer);
+        }
+    }
+
+  pool = NULL;
+  if (res)
+    {
+      pool = g_thread_pool_new (sign_commit_thread, &sc, n_jobs, FALSE, error);
+      if (pool == NULL)
+        res = FALSE;
+    }
+
+  for (i = 0; res && i < unique->len; i++)
+    {
+      if (!g_thread_pool_push (pool, g_ptr_array_index (unique, i), error))
+        res = FALSE;
+    }
+
+  if (pool != NULL)
+    g_thread_pool_free (pool, !res, TRUE);
+  g_mutex_clear (&sc.lock);
+  g_async_queue_unref (sc.signers);
+
+  if (res && sc.error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&sc.error));
+      res = FALSE;
+    }
+  g_clear_error (&sc.error);
+
+  return res;
+}
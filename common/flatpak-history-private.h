@@ -0,0 +1,60 @@
+/*
+ * Copyright © 2022 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_HISTORY_H__
+#define __FLATPAK_HISTORY_H__
+
+#include <sys/types.h>
+#include <gio/gio.h>
+
+/* One history record: time (µs since the epoch), installation, operation,
+ * remote, ref, commit, old commit, url, flatpak version, uid, exe,
+ * object uid and object exe (the latter two describe the process the
+ * system helper acted for, if any). */
+#define FLATPAK_HISTORY_ENTRY_FORMAT "(tssssssssusus)"
+
+typedef struct FlatpakHistoryLog FlatpakHistoryLog;
+
+gboolean           flatpak_history_append              (GFile              *basedir,
+                                                        const char         *installation,
+                                                        const char         *operation,
+                                                        const char         *remote,
+                                                        const char         *ref,
+                                                        const char         *commit,
+                                                        const char         *old_commit,
+                                                        const char         *url,
+                                                        pid_t               source_pid,
+                                                        GError            **error);
+
+FlatpakHistoryLog *flatpak_history_log_open            (GFile              *basedir,
+                                                        GError            **error);
+void               flatpak_history_log_free            (FlatpakHistoryLog  *log);
+gint64             flatpak_history_log_get_created     (FlatpakHistoryLog  *log);
+gsize              flatpak_history_log_get_n_entries   (FlatpakHistoryLog  *log);
+gint64             flatpak_history_log_get_entry_time  (FlatpakHistoryLog  *log,
+                                                        gsize               index);
+gsize              flatpak_history_log_lookup_time     (FlatpakHistoryLog  *log,
+                                                        gint64              time);
+GVariant *         flatpak_history_log_get_entry       (FlatpakHistoryLog  *log,
+                                                        gsize               index);
+
+char *             flatpak_history_entry_dup_field     (GVariant           *entry,
+                                                        const char         *name);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakHistoryLog, flatpak_history_log_free)
+
+#endif /* __FLATPAK_HISTORY_H__ */
@@ -0,0 +1,406 @@
+/*
+ * Copyright © 2022 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <glib/gi18n-lib.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "flatpak-history-private.h"
+#include "flatpak-utils-private.h"
+#include "libglnx/libglnx.h"
+
+/* This is a compact, append-only copy of the history that flatpak_dir_log()
+ * sends to the journal, kept per installation so that "flatpak history" can
+ * find the entries for a time range without scanning the whole journal.
+ *
+ * It lives in $basedir/history and consists of two files:
+ *
+ * log: A sequence of records, each starting at an 8 byte aligned offset with
+ *  a little-endian guint32 size and 4 bytes of padding, followed by a
+ *  serialized FLATPAK_HISTORY_ENTRY_FORMAT variant of that size.
+ *
+ * index: A header consisting of the magic HISTORY_INDEX_MAGIC and the
+ *  little-endian creation time of the store (µs since the epoch), followed by
+ *  one (time, log offset) pair of little-endian guint64 per record. Records
+ *  are appended in time order, so the index can be binary searched.
+ *
+ * Writers take an exclusive flock() on the index file, append the record to
+ * the log and only then append the index entry. Readers map the index before
+ * the log, so every index entry they see refers to a complete record. A writer
+ * that dies half-way leaves at most an unindexed record, or a partial index
+ * entry which the next writer truncates away.
+ */
+
+#define HISTORY_INDEX_MAGIC "FPHIDX01"
+#define HISTORY_INDEX_HEADER_SIZE 16
+#define HISTORY_INDEX_ENTRY_SIZE 16
+#define HISTORY_RECORD_HEADER_SIZE 8
+#define HISTORY_NO_UID G_MAXUINT32
+
+struct FlatpakHistoryLog
+{
+  GMappedFile  *index;
+  GBytes       *log;
+  const guchar *entries;
+  gsize         n_entries;
+  gint64        created;
+};
+
+static guint64
+read_le64 (const guchar *p)
+{
+  guint64 v;
+
+  memcpy (&v, p, sizeof (v));
+  return GUINT64_FROM_LE (v);
+}
+
+static guint32
+read_le32 (const guchar *p)
+{
+  guint32 v;
+
+  memcpy (&v, p, sizeof (v));
+  return GUINT32_FROM_LE (v);
+}
+
+static char *
+get_pid_exe (pid_t pid)
+{
+  g_autofree char *path = NULL;
+
+  if (pid == 0)
+    path = g_strdup ("/proc/self/exe");
+  else
+    path = g_strdup_printf ("/proc/%d/exe", (int) pid);
+
+  return g_file_read_link (path, NULL);
+}
+
+static guint32
+get_pid_uid (pid_t pid)
+{
+  g_autofree char *path = g_strdup_printf ("/proc/%d", (int) pid);
+  struct stat stbuf;
+
+  if (stat (path, &stbuf) != 0)
+    return HISTORY_NO_UID;
+
+  return stbuf.st_uid;
+}
+
+gboolean
+flatpak_history_append (GFile      *basedir,
+                        const char *installation,
+                        const char *operation,
+                        const char *remote,
+                        const char *ref,
+                        const char *commit,
+                        const char *old_commit,
+                        const char *url,
+                        pid_t       source_pid,
+                        GError    **error)
+{
+  g_autofree char *history_path = NULL;
+  g_autofree char *exe = NULL;
+  g_autofree char *object_exe = NULL;
+  g_autoptr(GVariant) entry = NULL;
+  g_autofree guchar *record = NULL;
+  glnx_autofd int dfd = -1;
+  glnx_autofd int index_fd = -1;
+  glnx_autofd int log_fd = -1;
+  guint32 object_uid = HISTORY_NO_UID;
+  struct stat stbuf;
+  gint64 now = g_get_real_time ();
+  gsize entry_size, record_size;
+  guint64 offset, aligned_offset;
+  guint64 index_entry[2];
+  guint32 record_header[2];
+
+  history_path = g_build_filename (flatpak_file_get_path_cached (basedir), "history", NULL);
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, history_path, 0755, NULL, error))
+    return FALSE;
+
+  if (!glnx_opendirat (AT_FDCWD, history_path, TRUE, &dfd, error))
+    return FALSE;
+
+  index_fd = openat (dfd, "index", O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | O_NOCTTY, 0644);
+  if (index_fd == -1)
+    return glnx_throw_errno_prefix (error, "Can't open history index");
+
+  if (flock (index_fd, LOCK_EX) != 0)
+    return glnx_throw_errno_prefix (error, "Can't lock history index");
+
+  log_fd = openat (dfd, "log", O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | O_NOCTTY, 0644);
+  if (log_fd == -1)
+    return glnx_throw_errno_prefix (error, "Can't open history log");
+
+  if (!glnx_fstat (index_fd, &stbuf, error))
+    return FALSE;
+
+  if (stbuf.st_size < HISTORY_INDEX_HEADER_SIZE)
+    {
+      guchar header[HISTORY_INDEX_HEADER_SIZE];
+      guint64 created = GUINT64_TO_LE ((guint64) now);
+
+      if (stbuf.st_size != 0 && ftruncate (index_fd, 0) != 0)
+        return glnx_throw_errno_prefix (error, "Can't truncate history index");
+
+      memcpy (header, HISTORY_INDEX_MAGIC, 8);
+      memcpy (header + 8, &created, 8);
+      if (glnx_loop_write (index_fd, header, sizeof (header)) < 0)
+        return glnx_throw_errno_prefix (error, "Can't write history index");
+    }
+  else if ((stbuf.st_size - HISTORY_INDEX_HEADER_SIZE) % HISTORY_INDEX_ENTRY_SIZE != 0)
+    {
+      /* A previous writer died half-way through an index entry */
+      off_t valid_size = stbuf.st_size - (stbuf.st_size - HISTORY_INDEX_HEADER_SIZE) % HISTORY_INDEX_ENTRY_SIZE;
+      if (ftruncate (index_fd, valid_size) != 0)
+        return glnx_throw_errno_prefix (error, "Can't truncate history index");
+    }
+
+  if (source_pid != 0)
+    {
+      object_uid = get_pid_uid (source_pid);
+      object_exe = get_pid_exe (source_pid);
+    }
+  exe = get_pid_exe (0);
+
+  entry = g_variant_ref_sink (g_variant_new (FLATPAK_HISTORY_ENTRY_FORMAT,
+                                             (guint64) now,
+                                             installation ? installation : "",
+                                             operation ? operation : "",
+                                             remote ? remote : "",
+                                             ref ? ref : "",
+                                             commit ? commit : "",
+                                             old_commit ? old_commit : "",
+                                             url ? url : "",
+                                             PACKAGE_VERSION,
+                                             (guint32) getuid (),
+                                             exe ? exe : "",
+                                             object_uid,
+                                             object_exe ? object_exe : ""));
+
+  if (!glnx_fstat (log_fd, &stbuf, error))
+    return FALSE;
+
+  offset = stbuf.st_size;
+  aligned_offset = (offset + 7) & ~((guint64) 7);
+  entry_size = g_variant_get_size (entry);
+
+  /* Leading zeros pad the record to its aligned start, trailing zeros keep
+   * the log size a multiple of 8 */
+  record_size = (aligned_offset - offset) + HISTORY_RECORD_HEADER_SIZE + ((entry_size + 7) & ~((gsize) 7));
+  record = g_malloc0 (record_size);
+  record_header[0] = GUINT32_TO_LE ((guint32) entry_size);
+  record_header[1] = 0;
+  memcpy (record + (aligned_offset - offset), record_header, sizeof (record_header));
+  g_variant_store (entry, record + (aligned_offset - offset) + HISTORY_RECORD_HEADER_SIZE);
+
+  if (glnx_loop_write (log_fd, record, record_size) < 0)
+    return glnx_throw_errno_prefix (error, "Can't write history log");
+
+  index_entry[0] = GUINT64_TO_LE ((guint64) now);
+  index_entry[1] = GUINT64_TO_LE (aligned_offset);
+  if (glnx_loop_write (index_fd, index_entry, sizeof (index_entry)) < 0)
+    return glnx_throw_errno_prefix (error, "Can't write history index");
+
+  return TRUE;
+}
+
+void
+flatpak_history_log_free (FlatpakHistoryLog *log)
+{
+  g_clear_pointer (&log->index, g_mapped_file_unref);
+  g_clear_pointer (&log->log, g_bytes_unref);
+  g_free (log);
+}
+
+/* Returns NULL with G_IO_ERROR_NOT_FOUND if the installation has no history store */
+FlatpakHistoryLog *
+flatpak_history_log_open (GFile   *basedir,
+                          GError **error)
+{
+  g_autoptr(FlatpakHistoryLog) log = g_new0 (FlatpakHistoryLog, 1);
+  g_autoptr(GMappedFile) log_file = NULL;
+  g_autofree char *index_path = NULL;
+  g_autofree char *log_path = NULL;
+  const guchar *index_data;
+  gsize index_size;
+
+  index_path = g_build_filename (flatpak_file_get_path_cached (basedir), "history", "index", NULL);
+  log_path = g_build_filename (flatpak_file_get_path_cached (basedir), "history", "log", NULL);
+
+  /* The index must be mapped first, see above */
+  log->index = g_mapped_file_new (index_path, FALSE, error);
+  if (log->index == NULL)
+    {
+      if (error && g_error_matches (*error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        {
+          g_clear_error (error);
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, _("No history store in %s"),
+                       flatpak_file_get_path_cached (basedir));
+        }
+      return NULL;
+    }
+
+  index_data = (const guchar *) g_mapped_file_get_contents (log->index);
+  index_size = g_mapped_file_get_length (log->index);
+  if (index_size < HISTORY_INDEX_HEADER_SIZE ||
+      memcmp (index_data, HISTORY_INDEX_MAGIC, 8) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, _("Invalid history index %s"), index_path);
+      return NULL;
+    }
+
+  log_file = g_mapped_file_new (log_path, FALSE, error);
+  if (log_file == NULL)
+    return NULL;
+  log->log = g_mapped_file_get_bytes (log_file);
+
+  log->created = (gint64) read_le64 (index_data + 8);
+  log->entries = index_data + HISTORY_INDEX_HEADER_SIZE;
+  log->n_entries = (index_size - HISTORY_INDEX_HEADER_SIZE) / HISTORY_INDEX_ENTRY_SIZE;
+
+  return g_steal_pointer (&log);
+}
+
+/* Everything logged after this time (µs since the epoch) is in the store */
+gint64
+flatpak_history_log_get_created (FlatpakHistoryLog *log)
+{
+  return log->created;
+}
+
+gsize
+flatpak_history_log_get_n_entries (FlatpakHistoryLog *log)
+{
+  return log->n_entries;
+}
+
+gint64
+flatpak_history_log_get_entry_time (FlatpakHistoryLog *log,
+                                    gsize              index)
+{
+  g_return_val_if_fail (index < log->n_entries, 0);
+
+  return (gint64) read_le64 (log->entries + index * HISTORY_INDEX_ENTRY_SIZE);
+}
+
+/* Returns the index of the first entry at or after @time, or the number of entries if none */
+gsize
+flatpak_history_log_lookup_time (FlatpakHistoryLog *log,
+                                 gint64             time)
+{
+  gsize lo = 0;
+  gsize hi = log->n_entries;
+
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+
+      if (flatpak_history_log_get_entry_time (log, mid) < time)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  return lo;
+}
+
+/* Returns NULL if the record is corrupt */
+GVariant *
+flatpak_history_log_get_entry (FlatpakHistoryLog *log,
+                               gsize              index)
+{
+  g_autoptr(GBytes) entry_bytes = NULL;
+  const guchar *log_data;
+  gsize log_size;
+  guint64 offset;
+  guint32 entry_size;
+
+  g_return_val_if_fail (index < log->n_entries, NULL);
+
+  log_data = g_bytes_get_data (log->log, &log_size);
+  offset = read_le64 (log->entries + index * HISTORY_INDEX_ENTRY_SIZE + 8);
+  if (offset > log_size || log_size - offset < HISTORY_RECORD_HEADER_SIZE)
+    return NULL;
+
+  entry_size = read_le32 (log_data + offset);
+  if (log_size - offset - HISTORY_RECORD_HEADER_SIZE < entry_size)
+    return NULL;
+
+  entry_bytes = g_bytes_new_from_bytes (log->log, offset + HISTORY_RECORD_HEADER_SIZE, entry_size);
+  return g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_HISTORY_ENTRY_FORMAT),
+                                                       entry_bytes, FALSE));
+}
+
+/* Maps the journal field names used by flatpak_dir_log() to the entry
+ * contents, so that entries can be displayed the same way as journal ones.
+ * Returns NULL for fields that are not set. */
+char *
+flatpak_history_entry_dup_field (GVariant   *entry,
+                                 const char *name)
+{
+  static const char *string_fields[] = {
+    "INSTALLATION", "OPERATION", "REMOTE", "REF", "COMMIT",
+    "OLD_COMMIT", "URL", "FLATPAK_VERSION"
+  };
+  guint32 uid;
+  int i;
+
+  for (i = 0; i < G_N_ELEMENTS (string_fields); i++)
+    {
+      if (strcmp (name, string_fields[i]) == 0)
+        {
+          const char *value;
+          g_variant_get_child (entry, i + 1, "&s", &value);
+          return g_strdup (value);
+        }
+    }
+
+  if (strcmp (name, "_SOURCE_REALTIME_TIMESTAMP") == 0)
+    {
+      guint64 time;
+      g_variant_get_child (entry, 0, "t", &time);
+      return g_strdup_printf ("%" G_GUINT64_FORMAT, time);
+    }
+  else if (strcmp (name, "_UID") == 0 || strcmp (name, "OBJECT_UID") == 0)
+    {
+      g_variant_get_child (entry, name[0] == '_' ? 9 : 11, "u", &uid);
+      if (uid == HISTORY_NO_UID)
+        return NULL;
+      return g_strdup_printf ("%u", uid);
+    }
+  else if (strcmp (name, "_EXE") == 0 || strcmp (name, "OBJECT_EXE") == 0)
+    {
+      const char *exe;
+      g_variant_get_child (entry, name[0] == '_' ? 10 : 12, "&s", &exe);
+      if (*exe == 0 && name[0] != '_')
+        return NULL;
+      return g_strdup (exe);
+    }
+
+  return NULL;
+}
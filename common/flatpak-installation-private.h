@@ -37,4 +37,8 @@ FlatpakInstallation *flatpak_installation_new_for_dir (FlatpakDir   *dir,
                                                        GCancellable *cancellable,
                                                        GError      **error);
 
+FlatpakInstallationChange *flatpak_installation_change_new (guint64                        sequence,
+                                                            FlatpakInstallationChangeKind  kind,
+                                                            const char                    *name);
+
 #endif /* __FLATPAK_INSTALLATION_PRIVATE_H__ */
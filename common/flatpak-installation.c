@@ -27,6 +27,7 @@
 #include <ostree.h>
 #include <ostree-repo-finder-avahi.h>
 
+#include "flatpak-change-log-private.h"
 #include "flatpak-dir-private.h"
 #include "flatpak-enum-types.h"
 #include "flatpak-error.h"
@@ -737,7 +738,6 @@ get_ref (FlatpakDir        *dir,
   g_autoptr(GBytes) deploy_data = NULL;
   g_autofree const char **subpaths = NULL;
   g_autofree char *collection_id = NULL;
-  g_autoptr(GHashTable) content_rating = NULL;
   gboolean is_current = FALSE;
   guint64 installed_size = 0;
 
@@ -766,7 +766,6 @@ get_ref (FlatpakDir        *dir,
   latest_commit = flatpak_dir_read_latest (dir, origin, flatpak_decomposed_get_ref (ref), &latest_alt_id, NULL, NULL);
 
   collection_id = flatpak_dir_get_remote_collection_id (dir, origin);
-  content_rating = flatpak_deploy_data_get_appdata_content_rating (deploy_data);
 
   return flatpak_installed_ref_new (ref,
                                     alt_id ? alt_id : commit,
@@ -775,14 +774,7 @@ get_ref (FlatpakDir        *dir,
                                     deploy_path,
                                     installed_size,
                                     is_current,
-                                    flatpak_deploy_data_get_eol (deploy_data),
-                                    flatpak_deploy_data_get_eol_rebase (deploy_data),
-                                    flatpak_deploy_data_get_appdata_name (deploy_data),
-                                    flatpak_deploy_data_get_appdata_summary (deploy_data),
-                                    flatpak_deploy_data_get_appdata_version (deploy_data),
-                                    flatpak_deploy_data_get_appdata_license (deploy_data),
-                                    flatpak_deploy_data_get_appdata_content_rating_type (deploy_data),
-                                    content_rating);
+                                    deploy_data);
 }
 
 /**
@@ -1213,6 +1205,133 @@ flatpak_installation_list_installed_refs_for_update (FlatpakInstallation *self,
   return g_steal_pointer (&installed_refs_for_update);
 }
 
+/**
+ * flatpak_installation_list_available_updates_sync:
+ * @self: a #FlatpakInstallation
+ * @flags: set of #FlatpakQueryFlags
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Lists the installed apps and runtimes for which a different commit is
+ * available in the remote they were installed from.
+ *
+ * This is a lot cheaper than flatpak_installation_list_installed_refs_for_update(),
+ * as it does a single pass over the installed refs, looking each of them up in
+ * the summary of its remote, which is fetched at most once (and only
+ * conditionally refreshed). Unlike that function it does not report refs that
+ * are only affected by missing runtimes or related refs.
+ *
+ * The returned refs describe the available commits. Their download size
+ * is that of the whole commit, so it is an upper bound of what an update
+ * needs to download, or 0 if the commit is already in the local repo, e.g.
+ * because it was prefetched with flatpak_installation_prefetch_updates_sync().
+ *
+ * If @flags contains %FLATPAK_QUERY_FLAGS_ONLY_CACHED, no network i/o is done
+ * and remotes that have no cached summary are skipped.
+ *
+ * Returns: (transfer container) (element-type FlatpakRemoteRef): a GPtrArray of
+ *   #FlatpakRemoteRef instances, or %NULL on error
+ *
+ * Since: 1.13.3
+ */
+GPtrArray *
+flatpak_installation_list_available_updates_sync (FlatpakInstallation *self,
+                                                  FlatpakQueryFlags    flags,
+                                                  GCancellable        *cancellable,
+                                                  GError             **error)
+{
+  g_autoptr(FlatpakDir) dir = NULL;
+  g_autoptr(GPtrArray) updates = NULL;
+  g_autoptr(GPtrArray) refs = NULL;
+
+  dir = flatpak_installation_get_dir (self, error);
+  if (dir == NULL)
+    return NULL;
+
+  updates = flatpak_dir_list_available_updates (dir, (flags & FLATPAK_QUERY_FLAGS_ONLY_CACHED) != 0,
+                                                cancellable, error);
+  if (updates == NULL)
+    return NULL;
+
+  refs = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (guint i = 0; i < updates->len; i++)
+    {
+      FlatpakDirUpdateInfo *info = g_ptr_array_index (updates, i);
+      FlatpakRemoteRef *ref;
+
+      ref = flatpak_remote_ref_new (info->ref, info->commit, info->remote,
+                                    info->state->collection_id, info->state);
+      if (info->prefetched)
+        flatpak_remote_ref_set_downloaded (ref);
+
+      g_ptr_array_add (refs, ref);
+    }
+
+  return g_steal_pointer (&refs);
+}
+
+/**
+ * flatpak_installation_prefetch_updates_sync:
+ * @self: a #FlatpakInstallation
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Downloads the available updates (as listed by
+ * flatpak_installation_list_available_updates_sync()) into the local repo,
+ * without deploying them. A later update then only needs to deploy them,
+ * which is much quicker.
+ *
+ * This is meant to be called in the background, so it never asks for
+ * authorization, and refs that fail to download are skipped. It is up to
+ * the caller to only call it when the network is not metered and the
+ * system is not on battery. If the prefetch-download-limit key of the
+ * installation's config is set, it only downloads updates that fit in
+ * that many bytes.
+ *
+ * Returns: (transfer container) (element-type FlatpakRemoteRef): a GPtrArray of
+ *   #FlatpakRemoteRef instances for the updates that are now in the local
+ *   repo, or %NULL on error
+ *
+ * Since: 1.13.3
+ */
+GPtrArray *
+flatpak_installation_prefetch_updates_sync (FlatpakInstallation *self,
+                                            GCancellable        *cancellable,
+                                            GError             **error)
+{
+  g_autoptr(FlatpakDir) dir = NULL;
+  g_autoptr(GPtrArray) updates = NULL;
+  g_autoptr(GPtrArray) refs = NULL;
+
+  dir = flatpak_installation_get_dir (self, error);
+  if (dir == NULL)
+    return NULL;
+
+  updates = flatpak_dir_prefetch_updates (dir, cancellable, error);
+  if (updates == NULL)
+    return NULL;
+
+  refs = g_ptr_array_new_with_free_func (g_object_unref);
+
+  for (guint i = 0; i < updates->len; i++)
+    {
+      FlatpakDirUpdateInfo *info = g_ptr_array_index (updates, i);
+      FlatpakRemoteRef *ref;
+
+      if (!info->prefetched)
+        continue;
+
+      ref = flatpak_remote_ref_new (info->ref, info->commit, info->remote,
+                                    info->state->collection_id, info->state);
+      flatpak_remote_ref_set_downloaded (ref);
+
+      g_ptr_array_add (refs, ref);
+    }
+
+  return g_steal_pointer (&refs);
+}
+
 /* Find all USB and LAN repositories which share the same collection ID as
  * @remote_name, and add a #FlatpakRemote to @remotes for each of them. The caller
  * must initialise @remotes. Returns %TRUE without modifying @remotes if the
@@ -2409,6 +2528,49 @@ flatpak_installation_list_remote_refs_sync_full (FlatpakInstallation *self,
                                                  FlatpakQueryFlags    flags,
                                                  GCancellable        *cancellable,
                                                  GError             **error)
+{
+  return flatpak_installation_query_remote_refs_sync (self, remote_or_uri, flags,
+                                                      NULL, NULL, NULL,
+                                                      FLATPAK_REMOTE_REF_FIELDS_ALL,
+                                                      cancellable, error);
+}
+
+/**
+ * flatpak_installation_query_remote_refs_sync:
+ * @self: a #FlatpakInstallation
+ * @remote_or_uri: the name or URI of the remote
+ * @flags: set of #FlatpakQueryFlags
+ * @id_prefix: (nullable): only list refs whose id starts with this
+ * @arch: (nullable): only list refs for this architecture
+ * @branch: (nullable): only list refs for this branch
+ * @fields: the #FlatpakRemoteRefFields to fill in
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Lists the applications and runtimes in a remote that match the given
+ * predicates. Use %FLATPAK_QUERY_FLAGS_ONLY_APPS or
+ * %FLATPAK_QUERY_FLAGS_ONLY_RUNTIMES in @flags to only list one kind.
+ *
+ * The predicates are checked against the summary of the remote, so this
+ * is a lot cheaper than flatpak_installation_list_remote_refs_sync_full()
+ * when only a few refs match. Similarly, only the properties in @fields
+ * are looked up, and the others are left at their default values.
+ *
+ * Returns: (transfer container) (element-type FlatpakRemoteRef): a GPtrArray of
+ *   #FlatpakRemoteRef instances
+ *
+ * Since: 1.13.3
+ */
+GPtrArray *
+flatpak_installation_query_remote_refs_sync (FlatpakInstallation   *self,
+                                             const char            *remote_or_uri,
+                                             FlatpakQueryFlags      flags,
+                                             const char            *id_prefix,
+                                             const char            *arch,
+                                             const char            *branch,
+                                             FlatpakRemoteRefFields fields,
+                                             GCancellable          *cancellable,
+                                             GError               **error)
 {
   g_autoptr(FlatpakDir) dir = NULL;
   g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_object_unref);
@@ -2421,6 +2583,14 @@ flatpak_installation_list_remote_refs_sync_full (FlatpakInstallation *self,
   gboolean only_sideloaded = (flags & FLATPAK_QUERY_FLAGS_ONLY_SIDELOADED) != 0;
   gboolean only_cached = (flags & FLATPAK_QUERY_FLAGS_ONLY_CACHED) != 0;
   gboolean all_arches = (flags & FLATPAK_QUERY_FLAGS_ALL_ARCHES) != 0;
+  FlatpakRemoteRefFilter filter = { 0, id_prefix, arch, branch };
+
+  if (flags & FLATPAK_QUERY_FLAGS_ONLY_APPS)
+    filter.kinds |= FLATPAK_KINDS_APP;
+  if (flags & FLATPAK_QUERY_FLAGS_ONLY_RUNTIMES)
+    filter.kinds |= FLATPAK_KINDS_RUNTIME;
+  if (filter.kinds == 0)
+    filter.kinds = FLATPAK_KINDS_APP | FLATPAK_KINDS_RUNTIME;
 
   dir = flatpak_installation_get_dir (self, error);
   if (dir == NULL)
@@ -2441,10 +2611,15 @@ flatpak_installation_list_remote_refs_sync_full (FlatpakInstallation *self,
       if (all_arches &&
           !flatpak_remote_state_ensure_subsummary_all_arches (state, dir, only_cached, cancellable, error))
         return NULL;
+
+      /* Only the subsummary for a requested arch is needed, even if it is not a primary one */
+      if (!all_arches && arch != NULL &&
+          !flatpak_remote_state_ensure_subsummary (state, dir, arch, only_cached, cancellable, error))
+        return NULL;
     }
 
-  if (!flatpak_dir_list_remote_refs (dir, state, &ht,
-                                     cancellable, &local_error))
+  if (!flatpak_dir_list_remote_refs_filtered (dir, state, &filter, &ht,
+                                              cancellable, &local_error))
     {
       if (only_sideloaded)
         {
@@ -2465,7 +2640,8 @@ flatpak_installation_list_remote_refs_sync_full (FlatpakInstallation *self,
       const gchar *ref_commit = value;
       FlatpakRemoteRef *ref;
 
-      ref = flatpak_remote_ref_new (decomposed, ref_commit, remote_or_uri, state->collection_id, state);
+      ref = flatpak_remote_ref_new_with_fields (decomposed, ref_commit, remote_or_uri,
+                                                state->collection_id, state, fields);
 
       if (ref)
         g_ptr_array_add (refs, ref);
@@ -2673,6 +2849,170 @@ flatpak_installation_create_monitor (FlatpakInstallation *self,
                               cancellable, error);
 }
 
+struct _FlatpakInstallationChange
+{
+  guint64                        sequence;
+  FlatpakInstallationChangeKind  kind;
+  char                          *name;
+};
+
+G_DEFINE_BOXED_TYPE (FlatpakInstallationChange, flatpak_installation_change,
+                     flatpak_installation_change_copy, flatpak_installation_change_free)
+
+FlatpakInstallationChange *
+flatpak_installation_change_new (guint64                        sequence,
+                                 FlatpakInstallationChangeKind  kind,
+                                 const char                    *name)
+{
+  FlatpakInstallationChange *change = g_new0 (FlatpakInstallationChange, 1);
+
+  change->sequence = sequence;
+  change->kind = kind;
+  change->name = g_strdup (name);
+
+  return change;
+}
+
+/**
+ * flatpak_installation_change_copy:
+ * @change: a #FlatpakInstallationChange
+ *
+ * Copies @change.
+ *
+ * Returns: (transfer full): a copy of @change
+ *
+ * Since: 1.13.3
+ */
+FlatpakInstallationChange *
+flatpak_installation_change_copy (FlatpakInstallationChange *change)
+{
+  return flatpak_installation_change_new (change->sequence, change->kind, change->name);
+}
+
+/**
+ * flatpak_installation_change_free:
+ * @change: a #FlatpakInstallationChange
+ *
+ * Frees @change.
+ *
+ * Since: 1.13.3
+ */
+void
+flatpak_installation_change_free (FlatpakInstallationChange *change)
+{
+  g_free (change->name);
+  g_free (change);
+}
+
+/**
+ * flatpak_installation_change_get_sequence:
+ * @change: a #FlatpakInstallationChange
+ *
+ * Gets the sequence number of the change. Sequence numbers increase by one
+ * with each change made to the installation.
+ *
+ * Returns: the sequence number
+ *
+ * Since: 1.13.3
+ */
+guint64
+flatpak_installation_change_get_sequence (FlatpakInstallationChange *change)
+{
+  return change->sequence;
+}
+
+/**
+ * flatpak_installation_change_get_kind:
+ * @change: a #FlatpakInstallationChange
+ *
+ * Gets the kind of the change.
+ *
+ * Returns: a #FlatpakInstallationChangeKind
+ *
+ * Since: 1.13.3
+ */
+FlatpakInstallationChangeKind
+flatpak_installation_change_get_kind (FlatpakInstallationChange *change)
+{
+  return change->kind;
+}
+
+/**
+ * flatpak_installation_change_get_name:
+ * @change: a #FlatpakInstallationChange
+ *
+ * Gets the ref, pin pattern or remote name the change affected, depending
+ * on its kind; see #FlatpakInstallationChangeKind.
+ *
+ * Returns: (transfer none): the name
+ *
+ * Since: 1.13.3
+ */
+const char *
+flatpak_installation_change_get_name (FlatpakInstallationChange *change)
+{
+  return change->name;
+}
+
+/**
+ * flatpak_installation_get_latest_change:
+ * @self: a #FlatpakInstallation
+ *
+ * Gets the sequence number of the latest change recorded for the
+ * installation, see flatpak_installation_list_changes_since().
+ *
+ * A client that wants to follow the changes of the installation can call
+ * this before listing what is installed, and then list the changes since
+ * the returned number whenever the monitor returned by
+ * flatpak_installation_create_monitor() reports a change.
+ *
+ * Returns: the sequence number of the latest change, or 0 if no changes
+ *   were recorded
+ *
+ * Since: 1.13.3
+ */
+guint64
+flatpak_installation_get_latest_change (FlatpakInstallation *self)
+{
+  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir_maybe_no_repo (self);
+
+  return flatpak_change_log_get_latest (flatpak_dir_get_path (dir));
+}
+
+/**
+ * flatpak_installation_list_changes_since:
+ * @self: a #FlatpakInstallation
+ * @since: the sequence number of the last change the caller knows about
+ * @out_latest: (out) (optional): return location for the sequence number
+ *   of the latest change
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for a #GError
+ *
+ * Lists the changes made to the installation after the change with
+ * sequence number @since, in the order they were made.
+ *
+ * Only a limited number of changes is kept. If any of the changes after
+ * @since is no longer available, or if the installation was recreated
+ * since, this fails with %FLATPAK_ERROR_NOT_CACHED, and the caller needs to
+ * rescan the installation, starting again from
+ * flatpak_installation_get_latest_change().
+ *
+ * Returns: (transfer container) (element-type FlatpakInstallationChange): a
+ *   GPtrArray of #FlatpakInstallationChange, or %NULL on error
+ *
+ * Since: 1.13.3
+ */
+GPtrArray *
+flatpak_installation_list_changes_since (FlatpakInstallation *self,
+                                         guint64              since,
+                                         guint64             *out_latest,
+                                         GCancellable        *cancellable,
+                                         GError             **error)
+{
+  g_autoptr(FlatpakDir) dir = flatpak_installation_get_dir_maybe_no_repo (self);
+
+  return flatpak_change_log_read (flatpak_dir_get_path (dir), since, out_latest, error);
+}
 
 /**
  * flatpak_installation_list_remote_related_refs_sync:
@@ -3186,3 +3526,488 @@ flatpak_installation_list_pinned_refs (FlatpakInstallation *self,
 
   return g_steal_pointer (&refs);
 }
+
+/* The async variants of the slow calls run the corresponding sync call on a
+ * worker thread. We use our own bounded pool rather than the shared GTask
+ * one, so that a service issuing many calls at once doesn't use up all the
+ * GLib worker threads, and the rest of the calls just queue up. The sync
+ * calls all go through the (thread-safe) shared FlatpakDir of the
+ * installation, so its caches are shared between them. */
+#define FLATPAK_INSTALLATION_MAX_WORKERS 4
+
+typedef struct
+{
+  GTask          *task;
+  GTaskThreadFunc func;
+} AsyncJob;
+
+typedef struct
+{
+  char             *remote_name;
+  char             *name;
+  char             *arch;
+  char             *branch;
+  FlatpakRefKind    kind;
+  FlatpakQueryFlags flags;
+  gboolean          changed;
+} AsyncCallData;
+
+static void
+async_call_data_free (AsyncCallData *data)
+{
+  g_free (data->remote_name);
+  g_free (data->name);
+  g_free (data->arch);
+  g_free (data->branch);
+  g_free (data);
+}
+
+static void
+async_worker (gpointer data,
+              gpointer user_data)
+{
+  AsyncJob *job = data;
+  GTask *task = job->task;
+
+  if (!g_task_return_error_if_cancelled (task))
+    job->func (task, g_task_get_source_object (task),
+               g_task_get_task_data (task), g_task_get_cancellable (task));
+
+  g_object_unref (task);
+  g_free (job);
+}
+
+static void
+run_in_worker (GTask          *task,
+               GTaskThreadFunc func)
+{
+  static gsize pool_initialized = 0;
+  static GThreadPool *pool = NULL;
+  AsyncJob *job;
+
+  if (g_once_init_enter (&pool_initialized))
+    {
+      pool = g_thread_pool_new (async_worker, NULL, FLATPAK_INSTALLATION_MAX_WORKERS, FALSE, NULL);
+      g_once_init_leave (&pool_initialized, 1);
+    }
+
+  job = g_new0 (AsyncJob, 1);
+  job->task = g_object_ref (task);
+  job->func = func;
+
+  g_thread_pool_push (pool, job, NULL);
+}
+
+static GTask *
+async_task_new (FlatpakInstallation *self,
+                gpointer             source_tag,
+                AsyncCallData       *data,
+                GCancellable        *cancellable,
+                GAsyncReadyCallback  callback,
+                gpointer             user_data)
+{
+  GTask *task = g_task_new (self, cancellable, callback, user_data);
+
+  g_task_set_source_tag (task, source_tag);
+  g_task_set_task_data (task, data, (GDestroyNotify) async_call_data_free);
+
+  return task;
+}
+
+static void
+list_installed_refs_thread (GTask        *task,
+                            gpointer      source_object,
+                            gpointer      task_data,
+                            GCancellable *cancellable)
+{
+  GPtrArray *refs;
+  GError *error = NULL;
+
+  refs = flatpak_installation_list_installed_refs (source_object, cancellable, &error);
+  if (refs == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, refs, (GDestroyNotify) g_ptr_array_unref);
+}
+
+/**
+ * flatpak_installation_list_installed_refs_async:
+ * @self: a #FlatpakInstallation
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when done
+ * @user_data: (closure): data to pass to @callback
+ *
+ * Asynchronously lists the installed refs, see
+ * flatpak_installation_list_installed_refs().
+ *
+ * Since: 1.13.3
+ */
+void
+flatpak_installation_list_installed_refs_async (FlatpakInstallation *self,
+                                                GCancellable        *cancellable,
+                                                GAsyncReadyCallback  callback,
+                                                gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  g_return_if_fail (FLATPAK_IS_INSTALLATION (self));
+
+  task = async_task_new (self, flatpak_installation_list_installed_refs_async,
+                         g_new0 (AsyncCallData, 1), cancellable, callback, user_data);
+  run_in_worker (task, list_installed_refs_thread);
+}
+
+/**
+ * flatpak_installation_list_installed_refs_finish:
+ * @self: a #FlatpakInstallation
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with
+ * flatpak_installation_list_installed_refs_async().
+ *
+ * Returns: (transfer container) (element-type FlatpakInstalledRef): a GPtrArray of
+ *   #FlatpakInstalledRef instances, or %NULL on error
+ *
+ * Since: 1.13.3
+ */
+GPtrArray *
+flatpak_installation_list_installed_refs_finish (FlatpakInstallation *self,
+                                                 GAsyncResult        *result,
+                                                 GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_val_if_fail (g_async_result_is_tagged (result, flatpak_installation_list_installed_refs_async), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+list_installed_refs_for_update_thread (GTask        *task,
+                                       gpointer      source_object,
+                                       gpointer      task_data,
+                                       GCancellable *cancellable)
+{
+  GPtrArray *refs;
+  GError *error = NULL;
+
+  refs = flatpak_installation_list_installed_refs_for_update (source_object, cancellable, &error);
+  if (refs == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, refs, (GDestroyNotify) g_ptr_array_unref);
+}
+
+/**
+ * flatpak_installation_list_installed_refs_for_update_async:
+ * @self: a #FlatpakInstallation
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when done
+ * @user_data: (closure): data to pass to @callback
+ *
+ * Asynchronously lists the installed refs that have updates, see
+ * flatpak_installation_list_installed_refs_for_update().
+ *
+ * Since: 1.13.3
+ */
+void
+flatpak_installation_list_installed_refs_for_update_async (FlatpakInstallation *self,
+                                                           GCancellable        *cancellable,
+                                                           GAsyncReadyCallback  callback,
+                                                           gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  g_return_if_fail (FLATPAK_IS_INSTALLATION (self));
+
+  task = async_task_new (self, flatpak_installation_list_installed_refs_for_update_async,
+                         g_new0 (AsyncCallData, 1), cancellable, callback, user_data);
+  run_in_worker (task, list_installed_refs_for_update_thread);
+}
+
+/**
+ * flatpak_installation_list_installed_refs_for_update_finish:
+ * @self: a #FlatpakInstallation
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with
+ * flatpak_installation_list_installed_refs_for_update_async().
+ *
+ * Returns: (transfer container) (element-type FlatpakInstalledRef): a GPtrArray of
+ *   #FlatpakInstalledRef instances, or %NULL on error
+ *
+ * Since: 1.13.3
+ */
+GPtrArray *
+flatpak_installation_list_installed_refs_for_update_finish (FlatpakInstallation *self,
+                                                            GAsyncResult        *result,
+                                                            GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_val_if_fail (g_async_result_is_tagged (result, flatpak_installation_list_installed_refs_for_update_async), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+list_remote_refs_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  AsyncCallData *data = task_data;
+  GPtrArray *refs;
+  GError *error = NULL;
+
+  refs = flatpak_installation_list_remote_refs_sync_full (source_object, data->remote_name, data->flags,
+                                                          cancellable, &error);
+  if (refs == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, refs, (GDestroyNotify) g_ptr_array_unref);
+}
+
+/**
+ * flatpak_installation_list_remote_refs_async:
+ * @self: a #FlatpakInstallation
+ * @remote_or_uri: the name or URI of the remote
+ * @flags: set of #FlatpakQueryFlags
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when done
+ * @user_data: (closure): data to pass to @callback
+ *
+ * Asynchronously lists all the applications and runtimes in a remote, see
+ * flatpak_installation_list_remote_refs_sync_full().
+ *
+ * Since: 1.13.3
+ */
+void
+flatpak_installation_list_remote_refs_async (FlatpakInstallation *self,
+                                             const char          *remote_or_uri,
+                                             FlatpakQueryFlags    flags,
+                                             GCancellable        *cancellable,
+                                             GAsyncReadyCallback  callback,
+                                             gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncCallData *data;
+
+  g_return_if_fail (FLATPAK_IS_INSTALLATION (self));
+  g_return_if_fail (remote_or_uri != NULL);
+
+  data = g_new0 (AsyncCallData, 1);
+  data->remote_name = g_strdup (remote_or_uri);
+  data->flags = flags;
+
+  task = async_task_new (self, flatpak_installation_list_remote_refs_async,
+                         data, cancellable, callback, user_data);
+  run_in_worker (task, list_remote_refs_thread);
+}
+
+/**
+ * flatpak_installation_list_remote_refs_finish:
+ * @self: a #FlatpakInstallation
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with
+ * flatpak_installation_list_remote_refs_async().
+ *
+ * Returns: (transfer container) (element-type FlatpakRemoteRef): a GPtrArray of
+ *   #FlatpakRemoteRef instances, or %NULL on error
+ *
+ * Since: 1.13.3
+ */
+GPtrArray *
+flatpak_installation_list_remote_refs_finish (FlatpakInstallation *self,
+                                              GAsyncResult        *result,
+                                              GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_val_if_fail (g_async_result_is_tagged (result, flatpak_installation_list_remote_refs_async), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+fetch_remote_ref_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  AsyncCallData *data = task_data;
+  FlatpakRemoteRef *ref;
+  GError *error = NULL;
+
+  ref = flatpak_installation_fetch_remote_ref_sync_full (source_object, data->remote_name,
+                                                         data->kind, data->name, data->arch, data->branch,
+                                                         data->flags, cancellable, &error);
+  if (ref == NULL)
+    g_task_return_error (task, error);
+  else
+    g_task_return_pointer (task, ref, g_object_unref);
+}
+
+/**
+ * flatpak_installation_fetch_remote_ref_async:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @kind: what this ref contains (an #FlatpakRefKind)
+ * @name: name of the app/runtime to fetch
+ * @arch: (nullable): which architecture to fetch (default: current architecture)
+ * @branch: (nullable): which branch to fetch (default: 'master')
+ * @flags: set of #FlatpakQueryFlags
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when done
+ * @user_data: (closure): data to pass to @callback
+ *
+ * Asynchronously gets the current remote branch of a ref in the remote, see
+ * flatpak_installation_fetch_remote_ref_sync_full().
+ *
+ * Since: 1.13.3
+ */
+void
+flatpak_installation_fetch_remote_ref_async (FlatpakInstallation *self,
+                                             const char          *remote_name,
+                                             FlatpakRefKind       kind,
+                                             const char          *name,
+                                             const char          *arch,
+                                             const char          *branch,
+                                             FlatpakQueryFlags    flags,
+                                             GCancellable        *cancellable,
+                                             GAsyncReadyCallback  callback,
+                                             gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncCallData *data;
+
+  g_return_if_fail (FLATPAK_IS_INSTALLATION (self));
+  g_return_if_fail (remote_name != NULL);
+  g_return_if_fail (name != NULL);
+
+  data = g_new0 (AsyncCallData, 1);
+  data->remote_name = g_strdup (remote_name);
+  data->kind = kind;
+  data->name = g_strdup (name);
+  data->arch = g_strdup (arch);
+  data->branch = g_strdup (branch);
+  data->flags = flags;
+
+  task = async_task_new (self, flatpak_installation_fetch_remote_ref_async,
+                         data, cancellable, callback, user_data);
+  run_in_worker (task, fetch_remote_ref_thread);
+}
+
+/**
+ * flatpak_installation_fetch_remote_ref_finish:
+ * @self: a #FlatpakInstallation
+ * @result: a #GAsyncResult
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with
+ * flatpak_installation_fetch_remote_ref_async().
+ *
+ * Returns: (transfer full): a #FlatpakRemoteRef instance, or %NULL on error
+ *
+ * Since: 1.13.3
+ */
+FlatpakRemoteRef *
+flatpak_installation_fetch_remote_ref_finish (FlatpakInstallation *self,
+                                              GAsyncResult        *result,
+                                              GError             **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+  g_return_val_if_fail (g_async_result_is_tagged (result, flatpak_installation_fetch_remote_ref_async), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+update_appstream_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  AsyncCallData *data = task_data;
+  GError *error = NULL;
+
+  if (!flatpak_installation_update_appstream_full_sync (source_object, data->remote_name, data->arch,
+                                                        NULL, NULL, &data->changed,
+                                                        cancellable, &error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * flatpak_installation_update_appstream_async:
+ * @self: a #FlatpakInstallation
+ * @remote_name: the name of the remote
+ * @arch: (nullable): Architecture to update, or %NULL for the local machine arch
+ * @cancellable: (nullable): a #GCancellable
+ * @callback: (scope async): a #GAsyncReadyCallback to call when done
+ * @user_data: (closure): data to pass to @callback
+ *
+ * Asynchronously updates the local copy of appstream for @remote_name for
+ * the specified @arch, see flatpak_installation_update_appstream_full_sync().
+ *
+ * Since: 1.13.3
+ */
+void
+flatpak_installation_update_appstream_async (FlatpakInstallation *self,
+                                             const char          *remote_name,
+                                             const char          *arch,
+                                             GCancellable        *cancellable,
+                                             GAsyncReadyCallback  callback,
+                                             gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  AsyncCallData *data;
+
+  g_return_if_fail (FLATPAK_IS_INSTALLATION (self));
+  g_return_if_fail (remote_name != NULL);
+
+  data = g_new0 (AsyncCallData, 1);
+  data->remote_name = g_strdup (remote_name);
+  data->arch = g_strdup (arch);
+
+  task = async_task_new (self, flatpak_installation_update_appstream_async,
+                         data, cancellable, callback, user_data);
+  run_in_worker (task, update_appstream_thread);
+}
+
+/**
+ * flatpak_installation_update_appstream_finish:
+ * @self: a #FlatpakInstallation
+ * @result: a #GAsyncResult
+ * @out_changed: (nullable): Set to %TRUE if the contents of the appstream changed, %FALSE if nothing changed
+ * @error: return location for a #GError
+ *
+ * Finishes an operation started with
+ * flatpak_installation_update_appstream_async().
+ *
+ * Returns: %TRUE on success, or %FALSE on error
+ *
+ * Since: 1.13.3
+ */
+gboolean
+flatpak_installation_update_appstream_finish (FlatpakInstallation *self,
+                                              GAsyncResult        *result,
+                                              gboolean            *out_changed,
+                                              GError             **error)
+{
+  AsyncCallData *data;
+
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  g_return_val_if_fail (g_async_result_is_tagged (result, flatpak_installation_update_appstream_async), FALSE);
+
+  if (!g_task_propagate_boolean (G_TASK (result), error))
+    return FALSE;
+
+  data = g_task_get_task_data (G_TASK (result));
+  if (out_changed)
+    *out_changed = data->changed;
+
+  return TRUE;
+}
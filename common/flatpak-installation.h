@@ -132,6 +132,8 @@ typedef enum {
  * @FLATPAK_QUERY_FLAGS_ONLY_SIDELOADED: Only list refs available from sideload
  * repos; see flatpak(1). (Since: 1.7)
  * @FLATPAK_QUERY_FLAGS_ALL_ARCHES: Include refs from all arches, not just the primary ones. (Since: 1.11.2)
+ * @FLATPAK_QUERY_FLAGS_ONLY_APPS: Only list applications, used when listing remote refs. (Since: 1.13.3)
+ * @FLATPAK_QUERY_FLAGS_ONLY_RUNTIMES: Only list runtimes, used when listing remote refs. (Since: 1.13.3)
  *
  * Flags to alter the behavior of e.g flatpak_installation_list_remote_refs_sync_full().
  *
@@ -142,6 +144,8 @@ typedef enum {
   FLATPAK_QUERY_FLAGS_ONLY_CACHED = (1 << 0),
   FLATPAK_QUERY_FLAGS_ONLY_SIDELOADED = (1 << 1),
   FLATPAK_QUERY_FLAGS_ALL_ARCHES = (1 << 2),
+  FLATPAK_QUERY_FLAGS_ONLY_APPS = (1 << 3),
+  FLATPAK_QUERY_FLAGS_ONLY_RUNTIMES = (1 << 4),
 } FlatpakQueryFlags;
 
 /**
@@ -164,9 +168,50 @@ typedef enum {
   FLATPAK_STORAGE_TYPE_NETWORK,
 } FlatpakStorageType;
 
+/**
+ * FlatpakInstallationChangeKind:
+ * @FLATPAK_INSTALLATION_CHANGE_KIND_DEPLOYED: A ref was installed or updated, the name is the ref
+ * @FLATPAK_INSTALLATION_CHANGE_KIND_UNDEPLOYED: A ref was uninstalled, the name is the ref
+ * @FLATPAK_INSTALLATION_CHANGE_KIND_PINNED: A pattern was pinned, the name is the pattern
+ * @FLATPAK_INSTALLATION_CHANGE_KIND_UNPINNED: A pattern was unpinned, the name is the pattern
+ * @FLATPAK_INSTALLATION_CHANGE_KIND_REMOTE_CHANGED: A remote was added, modified or removed,
+ * the name is the remote name
+ *
+ * The kind of a #FlatpakInstallationChange.
+ *
+ * Since: 1.13.3
+ */
+typedef enum {
+  FLATPAK_INSTALLATION_CHANGE_KIND_DEPLOYED,
+  FLATPAK_INSTALLATION_CHANGE_KIND_UNDEPLOYED,
+  FLATPAK_INSTALLATION_CHANGE_KIND_PINNED,
+  FLATPAK_INSTALLATION_CHANGE_KIND_UNPINNED,
+  FLATPAK_INSTALLATION_CHANGE_KIND_REMOTE_CHANGED,
+} FlatpakInstallationChangeKind;
+
+/**
+ * FlatpakInstallationChange:
+ *
+ * A change made to an installation, as returned by
+ * flatpak_installation_list_changes_since().
+ *
+ * Since: 1.13.3
+ */
+typedef struct _FlatpakInstallationChange FlatpakInstallationChange;
+
+#define FLATPAK_TYPE_INSTALLATION_CHANGE flatpak_installation_change_get_type ()
+
+FLATPAK_EXTERN GType                          flatpak_installation_change_get_type     (void);
+FLATPAK_EXTERN FlatpakInstallationChange     *flatpak_installation_change_copy         (FlatpakInstallationChange *change);
+FLATPAK_EXTERN void                           flatpak_installation_change_free         (FlatpakInstallationChange *change);
+FLATPAK_EXTERN guint64                        flatpak_installation_change_get_sequence (FlatpakInstallationChange *change);
+FLATPAK_EXTERN FlatpakInstallationChangeKind  flatpak_installation_change_get_kind     (FlatpakInstallationChange *change);
+FLATPAK_EXTERN const char                    *flatpak_installation_change_get_name     (FlatpakInstallationChange *change);
+
 
 #ifdef G_DEFINE_AUTOPTR_CLEANUP_FUNC
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakInstallation, g_object_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakInstallationChange, flatpak_installation_change_free)
 #endif
 
 FLATPAK_EXTERN const char  *flatpak_get_default_arch (void);
@@ -236,9 +281,22 @@ FLATPAK_EXTERN gboolean             flatpak_installation_launch_full (FlatpakIns
 FLATPAK_EXTERN GFileMonitor        *flatpak_installation_create_monitor (FlatpakInstallation *self,
                                                                          GCancellable        *cancellable,
                                                                          GError             **error);
+FLATPAK_EXTERN guint64              flatpak_installation_get_latest_change (FlatpakInstallation *self);
+FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_changes_since (FlatpakInstallation *self,
+                                                                             guint64              since,
+                                                                             guint64             *out_latest,
+                                                                             GCancellable        *cancellable,
+                                                                             GError             **error);
 FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_installed_refs (FlatpakInstallation *self,
                                                                               GCancellable        *cancellable,
                                                                               GError             **error);
+FLATPAK_EXTERN void                 flatpak_installation_list_installed_refs_async (FlatpakInstallation *self,
+                                                                                    GCancellable        *cancellable,
+                                                                                    GAsyncReadyCallback  callback,
+                                                                                    gpointer             user_data);
+FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_installed_refs_finish (FlatpakInstallation *self,
+                                                                                     GAsyncResult        *result,
+                                                                                     GError             **error);
 FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_installed_refs_by_kind (FlatpakInstallation *self,
                                                                                       FlatpakRefKind       kind,
                                                                                       GCancellable        *cancellable,
@@ -246,6 +304,20 @@ FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_installed_refs_by_
 FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_installed_refs_for_update (FlatpakInstallation *self,
                                                                                          GCancellable        *cancellable,
                                                                                          GError             **error);
+FLATPAK_EXTERN void                 flatpak_installation_list_installed_refs_for_update_async (FlatpakInstallation *self,
+                                                                                               GCancellable        *cancellable,
+                                                                                               GAsyncReadyCallback  callback,
+                                                                                               gpointer             user_data);
+FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_installed_refs_for_update_finish (FlatpakInstallation *self,
+                                                                                                GAsyncResult        *result,
+                                                                                                GError             **error);
+FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_available_updates_sync (FlatpakInstallation *self,
+                                                                                      FlatpakQueryFlags    flags,
+                                                                                      GCancellable        *cancellable,
+                                                                                      GError             **error);
+FLATPAK_EXTERN GPtrArray           *flatpak_installation_prefetch_updates_sync (FlatpakInstallation *self,
+                                                                                GCancellable        *cancellable,
+                                                                                GError             **error);
 FLATPAK_EXTERN GPtrArray           *flatpak_installation_list_unused_refs (FlatpakInstallation *self,
                                                                            const char          *arch,
                                                                            GCancellable        *cancellable,
@@ -424,6 +496,24 @@ FLATPAK_EXTERN GPtrArray    *    flatpak_installation_list_remote_refs_sync_full
                                                                                   FlatpakQueryFlags    flags,
                                                                                   GCancellable        *cancellable,
                                                                                   GError             **error);
+FLATPAK_EXTERN GPtrArray    *    flatpak_installation_query_remote_refs_sync (FlatpakInstallation   *self,
+                                                                              const char            *remote_or_uri,
+                                                                              FlatpakQueryFlags      flags,
+                                                                              const char            *id_prefix,
+                                                                              const char            *arch,
+                                                                              const char            *branch,
+                                                                              FlatpakRemoteRefFields fields,
+                                                                              GCancellable          *cancellable,
+                                                                              GError               **error);
+FLATPAK_EXTERN void             flatpak_installation_list_remote_refs_async (FlatpakInstallation *self,
+                                                                              const char          *remote_or_uri,
+                                                                              FlatpakQueryFlags    flags,
+                                                                              GCancellable        *cancellable,
+                                                                              GAsyncReadyCallback  callback,
+                                                                              gpointer             user_data);
+FLATPAK_EXTERN GPtrArray    *    flatpak_installation_list_remote_refs_finish (FlatpakInstallation *self,
+                                                                               GAsyncResult        *result,
+                                                                               GError             **error);
 FLATPAK_EXTERN FlatpakRemoteRef  *flatpak_installation_fetch_remote_ref_sync (FlatpakInstallation *self,
                                                                               const char          *remote_name,
                                                                               FlatpakRefKind       kind,
@@ -441,6 +531,19 @@ FLATPAK_EXTERN FlatpakRemoteRef  *flatpak_installation_fetch_remote_ref_sync_ful
                                                                                    FlatpakQueryFlags    flags,
                                                                                    GCancellable        *cancellable,
                                                                                    GError             **error);
+FLATPAK_EXTERN void              flatpak_installation_fetch_remote_ref_async (FlatpakInstallation *self,
+                                                                               const char          *remote_name,
+                                                                               FlatpakRefKind       kind,
+                                                                               const char          *name,
+                                                                               const char          *arch,
+                                                                               const char          *branch,
+                                                                               FlatpakQueryFlags    flags,
+                                                                               GCancellable        *cancellable,
+                                                                               GAsyncReadyCallback  callback,
+                                                                               gpointer             user_data);
+FLATPAK_EXTERN FlatpakRemoteRef  *flatpak_installation_fetch_remote_ref_finish (FlatpakInstallation *self,
+                                                                                GAsyncResult        *result,
+                                                                                GError             **error);
 FLATPAK_EXTERN gboolean          flatpak_installation_update_appstream_sync (FlatpakInstallation *self,
                                                                              const char          *remote_name,
                                                                              const char          *arch,
@@ -455,6 +558,16 @@ FLATPAK_EXTERN gboolean          flatpak_installation_update_appstream_full_sync
                                                                                   gboolean               *out_changed,
                                                                                   GCancellable           *cancellable,
                                                                                   GError                **error);
+FLATPAK_EXTERN void              flatpak_installation_update_appstream_async (FlatpakInstallation *self,
+                                                                              const char          *remote_name,
+                                                                              const char          *arch,
+                                                                              GCancellable        *cancellable,
+                                                                              GAsyncReadyCallback  callback,
+                                                                              gpointer             user_data);
+FLATPAK_EXTERN gboolean          flatpak_installation_update_appstream_finish (FlatpakInstallation *self,
+                                                                               GAsyncResult        *result,
+                                                                               gboolean            *out_changed,
+                                                                               GError             **error);
 FLATPAK_EXTERN GPtrArray    *    flatpak_installation_list_remote_related_refs_sync (FlatpakInstallation *self,
                                                                                      const char          *remote_name,
                                                                                      const char          *ref,
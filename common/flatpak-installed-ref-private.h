@@ -37,13 +37,6 @@ FlatpakInstalledRef *flatpak_installed_ref_new (FlatpakDecomposed *ref,
                                                 const char  *deploy_dir,
                                                 guint64      installed_size,
                                                 gboolean     current,
-                                                const char  *eol,
-                                                const char  *eol_rebase,
-                                                const char  *appdata_name,
-                                                const char  *appdata_summary,
-                                                const char  *appdata_version,
-                                                const char  *appdata_license,
-                                                const char  *appdata_content_rating_type,
-                                                GHashTable  *appdata_content_rating);
+                                                GBytes      *deploy_data);
 
 #endif /* __FLATPAK_INSTALLED_REF_PRIVATE_H__ */
@@ -55,6 +55,10 @@ struct _FlatpakInstalledRefPrivate
   char    *appdata_license;
   char    *appdata_content_rating_type;
   GHashTable *appdata_content_rating;  /* (element-type interned-utf8 interned-utf8) */
+
+  /* The eol and appdata properties that were not set explicitly are
+   * decoded from this when asked for */
+  GBytes  *deploy_data;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (FlatpakInstalledRef, flatpak_installed_ref, FLATPAK_TYPE_REF)
@@ -96,6 +100,7 @@ flatpak_installed_ref_finalize (GObject *object)
   g_free (priv->appdata_license);
   g_free (priv->appdata_content_rating_type);
   g_clear_pointer (&priv->appdata_content_rating, g_hash_table_unref);
+  g_clear_pointer (&priv->deploy_data, g_bytes_unref);
 
   G_OBJECT_CLASS (flatpak_installed_ref_parent_class)->finalize (object);
 }
@@ -221,35 +226,35 @@ flatpak_installed_ref_get_property (GObject    *object,
       break;
 
     case PROP_EOL:
-      g_value_set_string (value, priv->eol);
+      g_value_set_string (value, flatpak_installed_ref_get_eol (self));
       break;
 
     case PROP_EOL_REBASE:
-      g_value_set_string (value, priv->eol_rebase);
+      g_value_set_string (value, flatpak_installed_ref_get_eol_rebase (self));
       break;
 
     case PROP_APPDATA_NAME:
-      g_value_set_string (value, priv->appdata_name);
+      g_value_set_string (value, flatpak_installed_ref_get_appdata_name (self));
       break;
 
     case PROP_APPDATA_SUMMARY:
-      g_value_set_string (value, priv->appdata_summary);
+      g_value_set_string (value, flatpak_installed_ref_get_appdata_summary (self));
       break;
 
     case PROP_APPDATA_VERSION:
-      g_value_set_string (value, priv->appdata_version);
+      g_value_set_string (value, flatpak_installed_ref_get_appdata_version (self));
       break;
 
     case PROP_APPDATA_LICENSE:
-      g_value_set_string (value, priv->appdata_license);
+      g_value_set_string (value, flatpak_installed_ref_get_appdata_license (self));
       break;
 
     case PROP_APPDATA_CONTENT_RATING_TYPE:
-      g_value_set_string (value, priv->appdata_content_rating_type);
+      g_value_set_string (value, flatpak_installed_ref_get_appdata_content_rating_type (self));
       break;
 
     case PROP_APPDATA_CONTENT_RATING:
-      g_value_set_boxed (value, priv->appdata_content_rating);
+      g_value_set_boxed (value, flatpak_installed_ref_get_appdata_content_rating (self));
       break;
 
     default:
@@ -372,6 +377,21 @@ flatpak_installed_ref_init (FlatpakInstalledRef *self)
 {
 }
 
+typedef const char *(*DeployDataStringGetter) (GBytes *deploy_data);
+
+/* Strings are returned from inside the deploy data, so they don't need
+ * to be copied or cached */
+static const char *
+get_deploy_data_string (FlatpakInstalledRefPrivate *priv,
+                        const char                 *value,
+                        DeployDataStringGetter      getter)
+{
+  if (value != NULL || priv->deploy_data == NULL)
+    return value;
+
+  return getter (priv->deploy_data);
+}
+
 /**
  * flatpak_installed_ref_get_origin:
  * @self: a #FlatpakInstalledRef
@@ -557,7 +577,7 @@ flatpak_installed_ref_get_eol (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
-  return priv->eol;
+  return get_deploy_data_string (priv, priv->eol, flatpak_deploy_data_get_eol);
 }
 
 /**
@@ -574,7 +594,7 @@ flatpak_installed_ref_get_eol_rebase (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
-  return priv->eol_rebase;
+  return get_deploy_data_string (priv, priv->eol_rebase, flatpak_deploy_data_get_eol_rebase);
 }
 
 /**
@@ -594,7 +614,7 @@ flatpak_installed_ref_get_appdata_name (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
-  return priv->appdata_name;
+  return get_deploy_data_string (priv, priv->appdata_name, flatpak_deploy_data_get_appdata_name);
 }
 
 /**
@@ -614,7 +634,7 @@ flatpak_installed_ref_get_appdata_summary (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
-  return priv->appdata_summary;
+  return get_deploy_data_string (priv, priv->appdata_summary, flatpak_deploy_data_get_appdata_summary);
 }
 
 /**
@@ -632,7 +652,7 @@ flatpak_installed_ref_get_appdata_version (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
-  return priv->appdata_version;
+  return get_deploy_data_string (priv, priv->appdata_version, flatpak_deploy_data_get_appdata_version);
 }
 
 /**
@@ -650,7 +670,7 @@ flatpak_installed_ref_get_appdata_license (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
-  return priv->appdata_license;
+  return get_deploy_data_string (priv, priv->appdata_license, flatpak_deploy_data_get_appdata_license);
 }
 
 /**
@@ -669,7 +689,7 @@ flatpak_installed_ref_get_appdata_content_rating_type (FlatpakInstalledRef *self
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
 
-  return priv->appdata_content_rating_type;
+  return get_deploy_data_string (priv, priv->appdata_content_rating_type, flatpak_deploy_data_get_appdata_content_rating_type);
 }
 
 /**
@@ -690,8 +710,23 @@ GHashTable *
 flatpak_installed_ref_get_appdata_content_rating (FlatpakInstalledRef *self)
 {
   FlatpakInstalledRefPrivate *priv = flatpak_installed_ref_get_instance_private (self);
+  GHashTable *content_rating = g_atomic_pointer_get (&priv->appdata_content_rating);
 
-  return priv->appdata_content_rating;
+  if (content_rating == NULL && priv->deploy_data != NULL)
+    {
+      content_rating = flatpak_deploy_data_get_appdata_content_rating (priv->deploy_data);
+      if (content_rating == NULL)
+        return NULL;
+
+      /* Another thread may have got here first */
+      if (!g_atomic_pointer_compare_and_exchange (&priv->appdata_content_rating, NULL, content_rating))
+        {
+          g_hash_table_unref (content_rating);
+          content_rating = g_atomic_pointer_get (&priv->appdata_content_rating);
+        }
+    }
+
+  return content_rating;
 }
 
 FlatpakInstalledRef *
@@ -704,15 +739,9 @@ flatpak_installed_ref_new (FlatpakDecomposed *decomposed,
                            const char  *deploy_dir,
                            guint64      installed_size,
                            gboolean     is_current,
-                           const char  *eol,
-                           const char  *eol_rebase,
-                           const char  *appdata_name,
-                           const char  *appdata_summary,
-                           const char  *appdata_version,
-                           const char  *appdata_license,
-                           const char  *appdata_content_rating_type,
-                           GHashTable  *appdata_content_rating)
+                           GBytes      *deploy_data)
 {
+  FlatpakInstalledRefPrivate *priv;
   FlatpakInstalledRef *ref;
 
   /* Canonicalize the "no subpaths" case */
@@ -732,15 +761,11 @@ flatpak_installed_ref_new (FlatpakDecomposed *decomposed,
                       "is-current", is_current,
                       "installed-size", installed_size,
                       "deploy-dir", deploy_dir,
-                      "end-of-life", eol,
-                      "end-of-life-rebase", eol_rebase,
-                      "appdata-name", appdata_name,
-                      "appdata-summary", appdata_summary,
-                      "appdata-version", appdata_version,
-                      "appdata-license", appdata_license,
-                      "appdata-content-rating-type", appdata_content_rating_type,
-                      "appdata-content-rating", appdata_content_rating,
                       NULL);
 
+  /* The eol and appdata properties are decoded when asked for */
+  priv = flatpak_installed_ref_get_instance_private (ref);
+  priv->deploy_data = g_bytes_ref (deploy_data);
+
   return ref;
 }
@@ -0,0 +1,45 @@
+/*
+ * Copyright © 2022 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_REF_MATCHER_H__
+#define __FLATPAK_REF_MATCHER_H__
+
+#include <gio/gio.h>
+
+/* A set of ref globs, as used by remote filters, masks and pins. A glob
+ * is [app/|runtime/]ID[/ARCH[/BRANCH]], where each segment may contain
+ * '*' wildcards, and missing or empty segments match anything.
+ *
+ * The globs are indexed by their id segment (exact, prefix or other),
+ * so matching a ref only looks at the globs that can possibly match
+ * it. A matcher is immutable once built, so it can be shared between
+ * threads. */
+typedef struct FlatpakRefMatcher FlatpakRefMatcher;
+
+FlatpakRefMatcher *flatpak_ref_matcher_new      (void);
+FlatpakRefMatcher *flatpak_ref_matcher_ref      (FlatpakRefMatcher *self);
+void               flatpak_ref_matcher_unref    (FlatpakRefMatcher *self);
+gboolean           flatpak_ref_matcher_add_glob (FlatpakRefMatcher *self,
+                                                 const char        *glob,
+                                                 gboolean           runtime_only,
+                                                 GError           **error);
+gboolean           flatpak_ref_matcher_match    (FlatpakRefMatcher *self,
+                                                 const char        *ref);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakRefMatcher, flatpak_ref_matcher_unref)
+
+#endif /* __FLATPAK_REF_MATCHER_H__ */
@@ -0,0 +1,450 @@
+/*
+ * Copyright © 2022 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <glib/gi18n-lib.h>
+
+#include <string.h>
+
+#include "flatpak-ref-matcher-private.h"
+#include "flatpak-ref-utils-private.h"
+#include "flatpak-utils-private.h"
+#include "flatpak-error.h"
+
+/* The id, arch and branch segments of a glob */
+#define N_SEGMENTS 3
+
+typedef enum {
+  SEGMENT_ANY,    /* Missing, empty or only '*' */
+  SEGMENT_EXACT,  /* No '*' */
+  SEGMENT_PREFIX, /* Only trailing '*' */
+  SEGMENT_GLOB,
+} SegmentType;
+
+typedef struct
+{
+  SegmentType type;
+  char       *pattern;
+  gsize       len; /* Length of the exact string or prefix */
+} RefSegment;
+
+typedef struct
+{
+  FlatpakKinds kinds;
+  RefSegment   segments[N_SEGMENTS];
+} RefGlob;
+
+struct FlatpakRefMatcher
+{
+  gint        ref_count;
+  GPtrArray  *globs;       /* RefGlob, owns them */
+  GHashTable *exact_ids;   /* id -> GPtrArray of RefGlob */
+  GHashTable *prefix_ids;  /* id prefix -> GPtrArray of RefGlob */
+  GArray     *prefix_lens; /* distinct lengths of the keys in prefix_ids */
+  GPtrArray  *other_ids;   /* RefGlob with any or wildcard id */
+};
+
+static void
+ref_glob_free (RefGlob *glob)
+{
+  for (int i = 0; i < N_SEGMENTS; i++)
+    g_free (glob->segments[i].pattern);
+  g_free (glob);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RefGlob, ref_glob_free)
+
+FlatpakRefMatcher *
+flatpak_ref_matcher_new (void)
+{
+  FlatpakRefMatcher *self = g_new0 (FlatpakRefMatcher, 1);
+
+  self->ref_count = 1;
+  self->globs = g_ptr_array_new_with_free_func ((GDestroyNotify) ref_glob_free);
+  self->exact_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
+  self->prefix_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
+  self->prefix_lens = g_array_new (FALSE, FALSE, sizeof (gsize));
+  self->other_ids = g_ptr_array_new ();
+
+  return self;
+}
+
+FlatpakRefMatcher *
+flatpak_ref_matcher_ref (FlatpakRefMatcher *self)
+{
+  g_atomic_int_inc (&self->ref_count);
+  return self;
+}
+
+void
+flatpak_ref_matcher_unref (FlatpakRefMatcher *self)
+{
+  if (!g_atomic_int_dec_and_test (&self->ref_count))
+    return;
+
+  g_ptr_array_unref (self->other_ids);
+  g_array_unref (self->prefix_lens);
+  g_hash_table_unref (self->prefix_ids);
+  g_hash_table_unref (self->exact_ids);
+  g_ptr_array_unref (self->globs);
+  g_free (self);
+}
+
+static gboolean
+is_glob_char (char c)
+{
+  return g_ascii_isalnum (c) || c == '.' || c == '-' || c == '_';
+}
+
+static void
+segment_init (RefSegment *segment,
+              const char *pattern,
+              gsize       len,
+              gboolean    empty_is_any)
+{
+  const char *star = memchr (pattern, '*', len);
+  gsize n_stars = 0;
+
+  for (gsize i = 0; i < len; i++)
+    if (pattern[i] == '*')
+      n_stars++;
+
+  segment->pattern = g_strndup (pattern, len);
+
+  if ((len == 0 && empty_is_any) || (len > 0 && n_stars == len))
+    segment->type = SEGMENT_ANY;
+  else if (star == NULL)
+    {
+      segment->type = SEGMENT_EXACT;
+      segment->len = len;
+    }
+  else if (n_stars == len - (star - pattern))
+    {
+      segment->type = SEGMENT_PREFIX;
+      segment->len = star - pattern;
+    }
+  else
+    segment->type = SEGMENT_GLOB;
+}
+
+/* This accepts the same globs as the old regexp based filters did, with
+ * the same errors. Note that an empty segment in the middle of the glob
+ * matches anything, but a trailing one only matches an empty segment. */
+static RefGlob *
+ref_glob_parse (const char  *glob,
+                gboolean     runtime_only,
+                GError     **error)
+{
+  g_autoptr(RefGlob) res = g_new0 (RefGlob, 1);
+  const char *p;
+  const char *segment_start;
+  int n_segments = 0;
+
+  if (g_str_has_prefix (glob, "app/"))
+    {
+      if (runtime_only)
+        {
+          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Glob can't match apps"));
+          return NULL;
+        }
+
+      glob += strlen ("app/");
+      res->kinds = FLATPAK_KINDS_APP;
+    }
+  else if (g_str_has_prefix (glob, "runtime/"))
+    {
+      glob += strlen ("runtime/");
+      res->kinds = FLATPAK_KINDS_RUNTIME;
+    }
+  else if (runtime_only)
+    res->kinds = FLATPAK_KINDS_RUNTIME;
+  else
+    res->kinds = FLATPAK_KINDS_APP | FLATPAK_KINDS_RUNTIME;
+
+  /* We really need an id part, the rest is optional */
+  if (*glob == 0)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Empty glob"));
+      return NULL;
+    }
+
+  segment_start = glob;
+  for (p = glob; *p != 0; p++)
+    {
+      char c = *p;
+
+      if (c == '/')
+        {
+          if (n_segments == N_SEGMENTS - 1)
+            {
+              flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Too many segments in glob"));
+              return NULL;
+            }
+
+          segment_init (&res->segments[n_segments++], segment_start, p - segment_start, TRUE);
+          segment_start = p + 1;
+        }
+      else if (c != '*' && !is_glob_char (c))
+        {
+          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid glob character '%c'"), c);
+          return NULL;
+        }
+    }
+
+  segment_init (&res->segments[n_segments++], segment_start, p - segment_start, FALSE);
+
+  while (n_segments < N_SEGMENTS)
+    segment_init (&res->segments[n_segments++], "", 0, TRUE);
+
+  return g_steal_pointer (&res);
+}
+
+static void
+add_to_index (GHashTable *index,
+              const char *key,
+              RefGlob    *glob)
+{
+  GPtrArray *globs = g_hash_table_lookup (index, key);
+
+  if (globs == NULL)
+    {
+      globs = g_ptr_array_new ();
+      g_hash_table_insert (index, g_strdup (key), globs);
+    }
+
+  g_ptr_array_add (globs, glob);
+}
+
+gboolean
+flatpak_ref_matcher_add_glob (FlatpakRefMatcher *self,
+                              const char        *glob,
+                              gboolean           runtime_only,
+                              GError           **error)
+{
+  RefGlob *ref_glob;
+  RefSegment *id;
+
+  ref_glob = ref_glob_parse (glob, runtime_only, error);
+  if (ref_glob == NULL)
+    return FALSE;
+
+  g_ptr_array_add (self->globs, ref_glob);
+
+  id = &ref_glob->segments[0];
+  if (id->type == SEGMENT_EXACT)
+    add_to_index (self->exact_ids, id->pattern, ref_glob);
+  else if (id->type == SEGMENT_PREFIX)
+    {
+      g_autofree char *prefix = g_strndup (id->pattern, id->len);
+      guint i;
+
+      add_to_index (self->prefix_ids, prefix, ref_glob);
+
+      for (i = 0; i < self->prefix_lens->len; i++)
+        if (g_array_index (self->prefix_lens, gsize, i) == id->len)
+          break;
+      if (i == self->prefix_lens->len)
+        g_array_append_val (self->prefix_lens, id->len);
+    }
+  else
+    g_ptr_array_add (self->other_ids, ref_glob);
+
+  return TRUE;
+}
+
+static gboolean
+glob_match (const char *pattern,
+            const char *str,
+            gsize       len)
+{
+  const char *end = str + len;
+  const char *star = NULL;
+  const char *star_str = NULL;
+
+  while (str < end)
+    {
+      if (*pattern == '*')
+        {
+          star = pattern++;
+          star_str = str;
+        }
+      else if (*pattern != 0 && *pattern == *str)
+        {
+          pattern++;
+          str++;
+        }
+      else if (star != NULL)
+        {
+          pattern = star + 1;
+          str = ++star_str;
+        }
+      else
+        return FALSE;
+    }
+
+  while (*pattern == '*')
+    pattern++;
+
+  return *pattern == 0;
+}
+
+static gboolean
+segment_match (RefSegment *segment,
+               const char *str,
+               gsize       len)
+{
+  switch (segment->type)
+    {
+    case SEGMENT_ANY:
+      return TRUE;
+
+    case SEGMENT_EXACT:
+      return len == segment->len && memcmp (str, segment->pattern, len) == 0;
+
+    case SEGMENT_PREFIX:
+      return len >= segment->len && memcmp (str, segment->pattern, segment->len) == 0;
+
+    case SEGMENT_GLOB:
+    default:
+      return glob_match (segment->pattern, str, len);
+    }
+}
+
+typedef struct
+{
+  FlatpakKinds kind;
+  const char  *segments[N_SEGMENTS];
+  gsize        lens[N_SEGMENTS];
+} RefParts;
+
+static gboolean
+split_ref (const char *ref,
+           RefParts   *parts)
+{
+  const char *p;
+  int n = 0;
+
+  if (g_str_has_prefix (ref, "app/"))
+    {
+      parts->kind = FLATPAK_KINDS_APP;
+      p = ref + strlen ("app/");
+    }
+  else if (g_str_has_prefix (ref, "runtime/"))
+    {
+      parts->kind = FLATPAK_KINDS_RUNTIME;
+      p = ref + strlen ("runtime/");
+    }
+  else
+    return FALSE;
+
+  parts->segments[0] = p;
+  for (; *p != 0; p++)
+    {
+      if (*p == '/')
+        {
+          if (n == N_SEGMENTS - 1)
+            return FALSE;
+
+          parts->lens[n] = p - parts->segments[n];
+          parts->segments[++n] = p + 1;
+        }
+      else if (!is_glob_char (*p))
+        return FALSE; /* Globs can't match any other character */
+    }
+
+  if (n != N_SEGMENTS - 1)
+    return FALSE;
+
+  parts->lens[n] = p - parts->segments[n];
+
+  return TRUE;
+}
+
+static gboolean
+ref_glob_match (RefGlob  *glob,
+                RefParts *parts,
+                int       first_segment)
+{
+  if ((glob->kinds & parts->kind) == 0)
+    return FALSE;
+
+  for (int i = first_segment; i < N_SEGMENTS; i++)
+    if (!segment_match (&glob->segments[i], parts->segments[i], parts->lens[i]))
+      return FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+any_glob_match (GPtrArray *globs,
+                RefParts  *parts,
+                int        first_segment)
+{
+  for (guint i = 0; globs != NULL && i < globs->len; i++)
+    if (ref_glob_match (g_ptr_array_index (globs, i), parts, first_segment))
+      return TRUE;
+
+  return FALSE;
+}
+
+gboolean
+flatpak_ref_matcher_match (FlatpakRefMatcher *self,
+                           const char        *ref)
+{
+  RefParts parts;
+  char id_buf[256];
+  g_autofree char *id_alloc = NULL;
+  char *id;
+
+  if (!split_ref (ref, &parts))
+    return FALSE;
+
+  /* Valid ids are at most 255 chars, so this avoids allocating */
+  if (parts.lens[0] < sizeof (id_buf))
+    {
+      memcpy (id_buf, parts.segments[0], parts.lens[0]);
+      id_buf[parts.lens[0]] = 0;
+      id = id_buf;
+    }
+  else
+    id = id_alloc = g_strndup (parts.segments[0], parts.lens[0]);
+
+  /* The exact and prefix indexes already matched the id */
+  if (any_glob_match (g_hash_table_lookup (self->exact_ids, id), &parts, 1))
+    return TRUE;
+
+  for (guint i = 0; i < self->prefix_lens->len; i++)
+    {
+      gsize len = g_array_index (self->prefix_lens, gsize, i);
+      char saved;
+      gboolean found;
+
+      if (len > parts.lens[0])
+        continue;
+
+      saved = id[len];
+      id[len] = 0;
+      found = any_glob_match (g_hash_table_lookup (self->prefix_ids, id), &parts, 1);
+      id[len] = saved;
+
+      if (found)
+        return TRUE;
+    }
+
+  return any_glob_match (self->other_ids, &parts, 0);
+}
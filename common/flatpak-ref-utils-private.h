@@ -52,6 +52,8 @@ FlatpakKinds flatpak_kinds_from_kind (FlatpakRefKind kind);
 typedef struct _FlatpakDecomposed FlatpakDecomposed;
 FlatpakDecomposed *flatpak_decomposed_new_from_ref          (const char         *ref,
                                                              GError            **error);
+FlatpakDecomposed *flatpak_decomposed_new_from_ref_interned (const char         *ref,
+                                                             GError            **error);
 FlatpakDecomposed *flatpak_decomposed_new_from_col_ref      (const char         *ref,
                                                              const char         *collection_id,
                                                              GError            **error);
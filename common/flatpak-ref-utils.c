@@ -541,6 +541,7 @@ struct _FlatpakDecomposed {
   guint16 id_offset;
   guint16 arch_offset;
   guint16 branch_offset;
+  gboolean interned;
   char *data;
 
   /* This is only used when we're directly manipulating sideload repos, by giving
@@ -708,6 +709,7 @@ _flatpak_decomposed_new (char            *ref,
       decomposed->data = inline_data;
     }
   decomposed->ref_count = 1;
+  decomposed->interned = FALSE;
   decomposed->collection_id = NULL;
   decomposed->ref_offset = (guint16)ref_offset;
   decomposed->id_offset = (guint16)id_offset;
@@ -724,6 +726,43 @@ flatpak_decomposed_new_from_ref (const char         *ref,
   return _flatpak_decomposed_new ((char *)ref, FALSE, FALSE, error);
 }
 
+G_LOCK_DEFINE_STATIC (interned_refs);
+static GHashTable *interned_refs = NULL; /* ref -> FlatpakDecomposed, key owned by the value, no reference held */
+
+/* Like flatpak_decomposed_new_from_ref(), but returns a shared instance
+ * for each distinct ref, so each ref is only validated and allocated
+ * once while it is in use, and interned refs can be compared by pointer.
+ * An interned ref is dropped from the table with its last reference, see
+ * flatpak_decomposed_unref(). */
+FlatpakDecomposed *
+flatpak_decomposed_new_from_ref_interned (const char         *ref,
+                                          GError            **error)
+{
+  FlatpakDecomposed *decomposed;
+
+  G_LOCK (interned_refs);
+
+  if (interned_refs == NULL)
+    interned_refs = g_hash_table_new (g_str_hash, g_str_equal);
+
+  decomposed = g_hash_table_lookup (interned_refs, ref);
+  if (decomposed != NULL)
+    flatpak_decomposed_ref (decomposed);
+  else
+    {
+      decomposed = _flatpak_decomposed_new ((char *)ref, FALSE, FALSE, error);
+      if (decomposed != NULL)
+        {
+          decomposed->interned = TRUE;
+          g_hash_table_insert (interned_refs, decomposed->data, decomposed);
+        }
+    }
+
+  G_UNLOCK (interned_refs);
+
+  return decomposed;
+}
+
 FlatpakDecomposed *
 flatpak_decomposed_new_from_refspec (const char         *refspec,
                                      GError            **error)
@@ -872,6 +911,7 @@ _flatpak_decomposed_new_from_decomposed (FlatpakDecomposed  *old,
   inline_data = (char *)decomposed + sizeof (FlatpakDecomposed);
 
   decomposed->ref_count = 1;
+  decomposed->interned = FALSE;
   decomposed->data = inline_data;
   decomposed->collection_id = NULL;
 
@@ -994,17 +1034,50 @@ flatpak_decomposed_ref (FlatpakDecomposed  *ref)
   return ref;
 }
 
+static void
+flatpak_decomposed_free (FlatpakDecomposed  *ref)
+{
+  char *inline_data = (char *)ref + sizeof (FlatpakDecomposed);
+  if (ref->data != inline_data)
+    g_free (ref->data);
+  g_free (ref->collection_id);
+  g_free (ref);
+}
+
 void
 flatpak_decomposed_unref (FlatpakDecomposed  *ref)
 {
+  int ref_count;
+
+  if (!ref->interned)
+    {
+      if (g_atomic_int_dec_and_test (&ref->ref_count))
+        flatpak_decomposed_free (ref);
+      return;
+    }
+
+  /* Interned refs are only looked up under the lock, so only the last
+   * unref needs to take it to drop the ref from the table */
+  do
+    {
+      ref_count = g_atomic_int_get (&ref->ref_count);
+      if (ref_count == 1)
+        break;
+    }
+  while (!g_atomic_int_compare_and_exchange (&ref->ref_count, ref_count, ref_count - 1));
+
+  if (ref_count > 1)
+    return;
+
+  G_LOCK (interned_refs);
+
   if (g_atomic_int_dec_and_test (&ref->ref_count))
     {
-      char *inline_data = (char *)ref + sizeof (FlatpakDecomposed);
-      if (ref->data != inline_data)
-        g_free (ref->data);
-      g_free (ref->collection_id);
-      g_free (ref);
+      g_hash_table_remove (interned_refs, ref->data);
+      flatpak_decomposed_free (ref);
     }
+
+  G_UNLOCK (interned_refs);
 }
 
 const char *
@@ -1068,6 +1141,13 @@ gboolean
 flatpak_decomposed_equal (FlatpakDecomposed  *ref_a,
                           FlatpakDecomposed  *ref_b)
 {
+  if (ref_a == ref_b)
+    return TRUE;
+
+  /* There is only one interned instance of each ref */
+  if (ref_a->interned && ref_b->interned)
+    return FALSE;
+
   return strcmp (ref_a->data, ref_b->data) == 0 &&
     g_strcmp0 (ref_a->collection_id, ref_b->collection_id) == 0;
 }
@@ -1076,7 +1156,12 @@ gint
 flatpak_decomposed_strcmp (FlatpakDecomposed  *ref_a,
                            FlatpakDecomposed  *ref_b)
 {
-  int res = strcmp (ref_a->data, ref_b->data);
+  int res;
+
+  if (ref_a == ref_b)
+    return 0;
+
+  res = strcmp (ref_a->data, ref_b->data);
   if (res != 0)
     return res;
 
@@ -33,5 +33,12 @@ FlatpakRemoteRef *flatpak_remote_ref_new (FlatpakDecomposed *ref,
                                           const char         *remote_name,
                                           const char         *collection_id,
                                           FlatpakRemoteState *remote_state);
+FlatpakRemoteRef *flatpak_remote_ref_new_with_fields (FlatpakDecomposed     *ref,
+                                                      const char            *commit,
+                                                      const char            *remote_name,
+                                                      const char            *collection_id,
+                                                      FlatpakRemoteState    *remote_state,
+                                                      FlatpakRemoteRefFields fields);
+void              flatpak_remote_ref_set_downloaded (FlatpakRemoteRef *self);
 
 #endif /* __FLATPAK_REMOTE_REF_PRIVATE_H__ */
@@ -46,6 +46,14 @@ struct _FlatpakRemoteRefPrivate
   GBytes *metadata;
   char   *eol;
   char   *eol_rebase;
+
+  /* When created from a summary, the lazy_fields are decoded from it
+   * when first asked for. The cache data and sparse cache point into
+   * the summary. */
+  GVariant              *summary;
+  FlatpakRemoteRefFields lazy_fields;
+  VarCacheDataRef        cache_data;
+  VarMetadataRef         sparse_cache;
 };
 
 G_DEFINE_TYPE_WITH_PRIVATE (FlatpakRemoteRef, flatpak_remote_ref, FLATPAK_TYPE_REF)
@@ -71,6 +79,7 @@ flatpak_remote_ref_finalize (GObject *object)
   g_free (priv->eol);
   g_free (priv->eol_rebase);
   g_clear_pointer (&priv->metadata, g_bytes_unref);
+  g_clear_pointer (&priv->summary, g_variant_unref);
 
   G_OBJECT_CLASS (flatpak_remote_ref_parent_class)->finalize (object);
 }
@@ -136,23 +145,23 @@ flatpak_remote_ref_get_property (GObject    *object,
       break;
 
     case PROP_INSTALLED_SIZE:
-      g_value_set_uint64 (value, priv->installed_size);
+      g_value_set_uint64 (value, flatpak_remote_ref_get_installed_size (self));
       break;
 
     case PROP_DOWNLOAD_SIZE:
-      g_value_set_uint64 (value, priv->installed_size);
+      g_value_set_uint64 (value, flatpak_remote_ref_get_download_size (self));
       break;
 
     case PROP_METADATA:
-      g_value_set_boxed (value, priv->metadata);
+      g_value_set_boxed (value, flatpak_remote_ref_get_metadata (self));
       break;
 
     case PROP_EOL:
-      g_value_set_string (value, priv->eol);
+      g_value_set_string (value, flatpak_remote_ref_get_eol (self));
       break;
 
     case PROP_EOL_REBASE:
-      g_value_set_string (value, priv->eol_rebase);
+      g_value_set_string (value, flatpak_remote_ref_get_eol_rebase (self));
       break;
 
     default:
@@ -248,6 +257,9 @@ flatpak_remote_ref_get_installed_size (FlatpakRemoteRef *self)
 {
   FlatpakRemoteRefPrivate *priv = flatpak_remote_ref_get_instance_private (self);
 
+  if (priv->lazy_fields & FLATPAK_REMOTE_REF_FIELDS_SIZES)
+    return var_cache_data_get_installed_size (priv->cache_data);
+
   return priv->installed_size;
 }
 
@@ -264,6 +276,9 @@ flatpak_remote_ref_get_download_size (FlatpakRemoteRef *self)
 {
   FlatpakRemoteRefPrivate *priv = flatpak_remote_ref_get_instance_private (self);
 
+  if (priv->lazy_fields & FLATPAK_REMOTE_REF_FIELDS_SIZES)
+    return var_cache_data_get_download_size (priv->cache_data);
+
   return priv->download_size;
 }
 
@@ -280,8 +295,26 @@ GBytes *
 flatpak_remote_ref_get_metadata (FlatpakRemoteRef *self)
 {
   FlatpakRemoteRefPrivate *priv = flatpak_remote_ref_get_instance_private (self);
+  GBytes *metadata = g_atomic_pointer_get (&priv->metadata);
+
+  if (metadata == NULL && (priv->lazy_fields & FLATPAK_REMOTE_REF_FIELDS_METADATA))
+    {
+      const char *str = var_cache_data_get_metadata (priv->cache_data);
+
+      /* Keeps the summary alive rather than copying the metadata out of it */
+      metadata = g_bytes_new_with_free_func (str, strlen (str),
+                                             (GDestroyNotify) g_variant_unref,
+                                             g_variant_ref (priv->summary));
+
+      /* Another thread may have got here first */
+      if (!g_atomic_pointer_compare_and_exchange (&priv->metadata, NULL, metadata))
+        {
+          g_bytes_unref (metadata);
+          metadata = g_atomic_pointer_get (&priv->metadata);
+        }
+    }
 
-  return priv->metadata;
+  return metadata;
 }
 
 /**
@@ -298,6 +331,9 @@ flatpak_remote_ref_get_eol (FlatpakRemoteRef *self)
 {
   FlatpakRemoteRefPrivate *priv = flatpak_remote_ref_get_instance_private (self);
 
+  if (priv->eol == NULL && (priv->lazy_fields & FLATPAK_REMOTE_REF_FIELDS_EOL))
+    return var_metadata_lookup_string (priv->sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLINE, NULL);
+
   return priv->eol;
 }
 
@@ -315,6 +351,9 @@ flatpak_remote_ref_get_eol_rebase (FlatpakRemoteRef *self)
 {
   FlatpakRemoteRefPrivate *priv = flatpak_remote_ref_get_instance_private (self);
 
+  if (priv->eol_rebase == NULL && (priv->lazy_fields & FLATPAK_REMOTE_REF_FIELDS_EOL))
+    return var_metadata_lookup_string (priv->sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLINE_REBASE, NULL);
+
   return priv->eol_rebase;
 }
 
@@ -325,36 +364,92 @@ flatpak_remote_ref_new (FlatpakDecomposed   *decomposed,
                         const char          *collection_id,
                         FlatpakRemoteState  *state)
 {
+  return flatpak_remote_ref_new_with_fields (decomposed, commit, remote_name, collection_id,
+                                             state, FLATPAK_REMOTE_REF_FIELDS_ALL);
+}
+
+/* Makes the download size 0, for refs whose commit is already in the
+ * local repo. This must be called before the ref is shared. */
+void
+flatpak_remote_ref_set_downloaded (FlatpakRemoteRef *self)
+{
+  FlatpakRemoteRefPrivate *priv = flatpak_remote_ref_get_instance_private (self);
+
+  priv->installed_size = flatpak_remote_ref_get_installed_size (self);
+  priv->download_size = 0;
+  priv->lazy_fields &= ~FLATPAK_REMOTE_REF_FIELDS_SIZES;
+}
+
+/* Like flatpak_remote_ref_new(), but only looks up the data for @fields */
+FlatpakRemoteRef *
+flatpak_remote_ref_new_with_fields (FlatpakDecomposed     *decomposed,
+                                    const char            *commit,
+                                    const char            *remote_name,
+                                    const char            *collection_id,
+                                    FlatpakRemoteState    *state,
+                                    FlatpakRemoteRefFields fields)
+{
+  gboolean want_sizes = (fields & FLATPAK_REMOTE_REF_FIELDS_SIZES) != 0;
+  gboolean want_metadata = (fields & FLATPAK_REMOTE_REF_FIELDS_METADATA) != 0;
+  const char *ref_str = flatpak_decomposed_get_ref (decomposed);
   guint64 download_size = 0, installed_size = 0;
   g_autofree char *metadata = NULL;
   g_autoptr(GBytes) metadata_bytes = NULL;
-  VarMetadataRef sparse_cache;
+  VarMetadataRef sparse_cache = { NULL };
   const char *eol = NULL;
   const char *eol_rebase = NULL;
+  GVariant *summary = NULL;
+  FlatpakRemoteRefFields lazy_fields = 0;
+  VarCacheDataRef cache_data = { NULL };
+  FlatpakRemoteRefPrivate *priv;
   FlatpakRemoteRef *ref;
 
   if (collection_id == NULL)
     collection_id = flatpak_decomposed_get_collection_id (decomposed);
 
-  if (state &&
-      !flatpak_remote_state_load_data (state, flatpak_decomposed_get_ref (decomposed),
-                                       &download_size, &installed_size, &metadata,
-                                       NULL))
-    {
-      g_debug ("Can't find metadata for ref %s", flatpak_decomposed_get_ref (decomposed));
-    }
+  if (state)
+    summary = flatpak_remote_state_get_summary_for_ref (state, ref_str);
 
-  if (metadata)
+  if (summary != NULL)
     {
-      metadata_bytes = g_bytes_new_take (metadata, strlen (metadata));
-      metadata = NULL; /* steal */
+      /* Only find where the data is, it is decoded on demand */
+      if (want_sizes || want_metadata)
+        {
+          if (flatpak_remote_state_lookup_cache_data (state, ref_str, &cache_data, NULL))
+            lazy_fields |= fields & (FLATPAK_REMOTE_REF_FIELDS_SIZES | FLATPAK_REMOTE_REF_FIELDS_METADATA);
+          else
+            g_debug ("Can't find metadata for ref %s", ref_str);
+        }
+
+      if ((fields & FLATPAK_REMOTE_REF_FIELDS_EOL) != 0 &&
+          flatpak_remote_state_lookup_sparse_cache (state, ref_str, &sparse_cache, NULL))
+        lazy_fields |= FLATPAK_REMOTE_REF_FIELDS_EOL;
     }
-
-  if (state &&
-      flatpak_remote_state_lookup_sparse_cache (state, flatpak_decomposed_get_ref (decomposed), &sparse_cache, NULL))
+  else if (state)
     {
-      eol = var_metadata_lookup_string (sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLINE, NULL);
-      eol_rebase = var_metadata_lookup_string (sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLINE_REBASE, NULL);
+      /* Sideloaded refs have their data in the commits, so load it now */
+      if ((want_sizes || want_metadata) &&
+          !flatpak_remote_state_load_data (state, ref_str,
+                                           want_sizes ? &download_size : NULL,
+                                           want_sizes ? &installed_size : NULL,
+                                           want_metadata ? &metadata : NULL,
+                                           NULL))
+        {
+          g_debug ("Can't find metadata for ref %s", ref_str);
+        }
+
+      if (metadata)
+        {
+          metadata_bytes = g_bytes_new_take (metadata, strlen (metadata));
+          metadata = NULL; /* steal */
+        }
+
+      if ((fields & FLATPAK_REMOTE_REF_FIELDS_EOL) != 0 &&
+          flatpak_remote_state_lookup_sparse_cache (state, ref_str, &sparse_cache, NULL))
+        {
+          eol = var_metadata_lookup_string (sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLINE, NULL);
+          eol_rebase = var_metadata_lookup_string (sparse_cache, FLATPAK_SPARSE_CACHE_KEY_ENDOFLINE_REBASE, NULL);
+        }
     }
 
   ref = g_object_new (FLATPAK_TYPE_REMOTE_REF,
@@ -372,5 +467,14 @@ flatpak_remote_ref_new (FlatpakDecomposed   *decomposed,
                       "end-of-life-rebase", eol_rebase,
                       NULL);
 
+  if (lazy_fields != 0)
+    {
+      priv = flatpak_remote_ref_get_instance_private (ref);
+      priv->summary = g_variant_ref (summary);
+      priv->lazy_fields = lazy_fields;
+      priv->cache_data = cache_data;
+      priv->sparse_cache = sparse_cache;
+    }
+
   return ref;
 }
@@ -38,6 +38,30 @@ G_BEGIN_DECLS
 
 FLATPAK_EXTERN GType flatpak_remote_ref_get_type (void);
 
+/**
+ * FlatpakRemoteRefFields:
+ * @FLATPAK_REMOTE_REF_FIELDS_NONE: Only the ref, commit and remote name
+ * @FLATPAK_REMOTE_REF_FIELDS_SIZES: The installed and download sizes
+ * @FLATPAK_REMOTE_REF_FIELDS_METADATA: The metadata
+ * @FLATPAK_REMOTE_REF_FIELDS_EOL: The end-of-life reason and rebase
+ * @FLATPAK_REMOTE_REF_FIELDS_ALL: All of the above
+ *
+ * The optional properties of a #FlatpakRemoteRef to fill in, see
+ * flatpak_installation_query_remote_refs_sync(). Properties that are
+ * not requested are left at their default values.
+ *
+ * Since: 1.13.3
+ */
+typedef enum {
+  FLATPAK_REMOTE_REF_FIELDS_NONE     = 0,
+  FLATPAK_REMOTE_REF_FIELDS_SIZES    = (1 << 0),
+  FLATPAK_REMOTE_REF_FIELDS_METADATA = (1 << 1),
+  FLATPAK_REMOTE_REF_FIELDS_EOL      = (1 << 2),
+  FLATPAK_REMOTE_REF_FIELDS_ALL      = (FLATPAK_REMOTE_REF_FIELDS_SIZES |
+                                        FLATPAK_REMOTE_REF_FIELDS_METADATA |
+                                        FLATPAK_REMOTE_REF_FIELDS_EOL),
+} FlatpakRemoteRefFields;
+
 struct _FlatpakRemoteRef
 {
   FlatpakRef parent;
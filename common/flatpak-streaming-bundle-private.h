@@ -0,0 +1,47 @@
+/*
+ * Copyright © 2022 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_STREAMING_BUNDLE_H__
+#define __FLATPAK_STREAMING_BUNDLE_H__
+
+#include <gio/gio.h>
+#include <ostree.h>
+
+/* The header of a streaming bundle: the bundle metadata (same keys as
+ * in a classic bundle), the commit checksum, the commit object, its
+ * detached metadata, the commit the bundle is a delta from (empty if
+ * none), and the index of parts (offset, compressed size, uncompressed
+ * size, number of objects). */
+#define FLATPAK_STREAMING_BUNDLE_HEADER_FORMAT "(a{sv}ayaya{sv}aya(tttu))"
+
+gboolean  flatpak_is_streaming_bundle              (GFile         *file);
+GVariant *flatpak_streaming_bundle_load_header     (GFile         *file,
+                                                    GError       **error);
+guint64   flatpak_streaming_bundle_get_installed_size (GVariant   *header);
+gboolean  flatpak_streaming_bundle_write           (OstreeRepo    *repo,
+                                                    const char    *commit_checksum,
+                                                    const char    *from_commit,
+                                                    GVariant      *metadata,
+                                                    GFile         *file,
+                                                    GCancellable  *cancellable,
+                                                    GError       **error);
+gboolean  flatpak_streaming_bundle_import          (OstreeRepo    *repo,
+                                                    GFile         *file,
+                                                    GCancellable  *cancellable,
+                                                    GError       **error);
+
+#endif /* __FLATPAK_STREAMING_BUNDLE_H__ */
@@ -0,0 +1,902 @@
+/*
+ * Copyright © 2022 Red Hat, Inc
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <glib/gi18n-lib.h>
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "flatpak-streaming-bundle-private.h"
+#include "flatpak-utils-private.h"
+#include "flatpak-error.h"
+#include "libglnx/libglnx.h"
+
+/* Classic bundles are a static delta with all parts inline, which has to
+ * be generated, compressed and applied as a whole. Streaming bundles
+ * instead store the objects in independently zstd compressed parts, so
+ * they can be compressed and imported on all CPUs, one part at a time.
+ *
+ * The file layout is:
+ *
+ *  - An 8 byte magic, a little-endian guint32 version and 4 bytes padding
+ *  - The compressed parts, in no particular order
+ *  - The header, a FLATPAK_STREAMING_BUNDLE_HEADER_FORMAT variant stored in
+ *    little-endian byte order, which has the index of the parts
+ *  - A footer with the little-endian guint64 offset and size of the
+ *    header, followed by the magic again
+ *
+ * Each part decompresses to a sequence of 8 byte aligned records, which
+ * are a BundleRecord followed by the object data: the variant for
+ * metadata objects, and the content stream (as produced by
+ * ostree_raw_file_to_content_stream()) for file objects. The commit
+ * object itself is in the header, and is written last on import, so a
+ * partial import never leaves a commit with missing objects behind.
+ */
+
+#define BUNDLE_MAGIC "fpbundle"
+#define BUNDLE_MAGIC_LEN 8
+#define BUNDLE_VERSION 2
+#define BUNDLE_PREAMBLE_SIZE 16
+#define BUNDLE_FOOTER_SIZE (16 + BUNDLE_MAGIC_LEN)
+
+/* Parts are filled up to this size (but hold at least one object) */
+#define BUNDLE_PART_SIZE (8 * 1024 * 1024)
+
+/* Parts are decompressed in memory, so to bound what a bundle can make the
+ * import allocate, objects are limited to this size, and a part can't be
+ * bigger than a full part plus one such object */
+#define BUNDLE_MAX_OBJECT_SIZE ((guint64) 1024 * 1024 * 1024)
+#define BUNDLE_MAX_PART_SIZE (BUNDLE_PART_SIZE + sizeof (BundleRecord) + BUNDLE_MAX_OBJECT_SIZE + 8)
+
+/* A good ratio, while still much faster than the xz used for classic bundles */
+#define BUNDLE_ZSTD_LEVEL 12
+
+typedef struct
+{
+  guint8  objtype;
+  guint8  padding[7];
+  guint8  checksum[OSTREE_SHA256_DIGEST_LEN];
+  guint64 size; /* Little-endian */
+} BundleRecord;
+
+G_STATIC_ASSERT (sizeof (BundleRecord) == 48);
+
+typedef struct
+{
+  guint64 offset;
+  guint64 size;
+  guint64 uncompressed_size;
+  guint32 n_objects;
+} BundlePartInfo;
+
+static gboolean
+read_at (int     fd,
+         void   *buf,
+         gsize   len,
+         guint64 offset,
+         GError **error)
+{
+  guint8 *p = buf;
+
+  while (len > 0)
+    {
+      ssize_t res = TEMP_FAILURE_RETRY (pread (fd, p, len, offset));
+
+      if (res < 0)
+        return glnx_throw_errno_prefix (error, "pread");
+
+      if (res == 0)
+        return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, unexpected end of file"));
+
+      p += res;
+      len -= res;
+      offset += res;
+    }
+
+  return TRUE;
+}
+
+gboolean
+flatpak_is_streaming_bundle (GFile *file)
+{
+  glnx_autofd int fd = -1;
+  char magic[BUNDLE_MAGIC_LEN];
+
+  if (!glnx_openat_rdonly (AT_FDCWD, flatpak_file_get_path_cached (file), TRUE, &fd, NULL))
+    return FALSE;
+
+  if (!read_at (fd, magic, sizeof (magic), 0, NULL))
+    return FALSE;
+
+  return memcmp (magic, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN) == 0;
+}
+
+static GVariant *
+load_header (int      fd,
+             guint64 *out_header_offset,
+             GError **error)
+{
+  guint8 preamble[BUNDLE_PREAMBLE_SIZE];
+  guint8 footer[BUNDLE_FOOTER_SIZE];
+  guint32 version;
+  guint64 header_offset, header_size;
+  struct stat stbuf;
+  guint64 file_size;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) header = NULL;
+  g_autoptr(GVariant) to_csum_v = NULL;
+  guint8 *data;
+
+  if (!glnx_fstat (fd, &stbuf, error))
+    return NULL;
+
+  file_size = stbuf.st_size;
+  if (file_size < BUNDLE_PREAMBLE_SIZE + BUNDLE_FOOTER_SIZE)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, file too small"));
+      return NULL;
+    }
+
+  if (!read_at (fd, preamble, sizeof (preamble), 0, error) ||
+      !read_at (fd, footer, sizeof (footer), file_size - BUNDLE_FOOTER_SIZE, error))
+    return NULL;
+
+  if (memcmp (preamble, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN) != 0 ||
+      memcmp (footer + 16, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN) != 0)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, wrong magic"));
+      return NULL;
+    }
+
+  memcpy (&version, preamble + BUNDLE_MAGIC_LEN, sizeof (version));
+  if (GUINT32_FROM_LE (version) != BUNDLE_VERSION)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Unsupported bundle version %u"),
+                          GUINT32_FROM_LE (version));
+      return NULL;
+    }
+
+  memcpy (&header_offset, footer, sizeof (header_offset));
+  memcpy (&header_size, footer + 8, sizeof (header_size));
+  header_offset = GUINT64_FROM_LE (header_offset);
+  header_size = GUINT64_FROM_LE (header_size);
+
+  if (header_offset < BUNDLE_PREAMBLE_SIZE ||
+      header_offset > file_size - BUNDLE_FOOTER_SIZE ||
+      header_size != file_size - BUNDLE_FOOTER_SIZE - header_offset)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, bad header location"));
+      return NULL;
+    }
+
+  data = g_malloc (header_size);
+  bytes = g_bytes_new_take (data, header_size);
+  if (!read_at (fd, data, header_size, header_offset, error))
+    return NULL;
+
+  header = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_STREAMING_BUNDLE_HEADER_FORMAT),
+                                                         bytes, FALSE));
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+    {
+      GVariant *swapped = g_variant_byteswap (header);
+      g_variant_unref (header);
+      header = g_variant_ref_sink (swapped);
+    }
+
+  to_csum_v = g_variant_get_child_value (header, 1);
+  if (!ostree_validate_structureof_csum_v (to_csum_v, error))
+    return NULL;
+
+  if (out_header_offset)
+    *out_header_offset = header_offset;
+
+  return g_steal_pointer (&header);
+}
+
+GVariant *
+flatpak_streaming_bundle_load_header (GFile   *file,
+                                      GError **error)
+{
+  glnx_autofd int fd = -1;
+
+  if (!glnx_openat_rdonly (AT_FDCWD, flatpak_file_get_path_cached (file), TRUE, &fd, error))
+    return NULL;
+
+  return load_header (fd, NULL, error);
+}
+
+guint64
+flatpak_streaming_bundle_get_installed_size (GVariant *header)
+{
+  g_autoptr(GVariant) parts = g_variant_get_child_value (header, 5);
+  guint64 total = 0;
+  guint64 uncompressed_size;
+  GVariantIter iter;
+
+  g_variant_iter_init (&iter, parts);
+  while (g_variant_iter_next (&iter, "(tttu)", NULL, NULL, &uncompressed_size, NULL))
+    total += uncompressed_size;
+
+  return total;
+}
+
+#ifdef HAVE_ZSTD
+
+typedef struct
+{
+  GByteArray *data;
+  guint32     n_objects;
+  guint       index;
+} WritePart;
+
+typedef struct
+{
+  int     fd;
+  guint64 offset;
+  GArray *parts;
+  guint   in_flight;
+  GMutex  lock;
+  GCond   cond;
+  GError *error;
+} BundleWriter;
+
+static void
+write_part_free (WritePart *part)
+{
+  g_byte_array_unref (part->data);
+  g_free (part);
+}
+
+static void
+compress_part_thread (gpointer data,
+                      gpointer user_data)
+{
+  WritePart *part = data;
+  BundleWriter *writer = user_data;
+  g_autofree guint8 *compressed = NULL;
+  size_t bound, res;
+
+  bound = ZSTD_compressBound (part->data->len);
+  compressed = g_malloc (bound);
+  res = ZSTD_compress (compressed, bound, part->data->data, part->data->len, BUNDLE_ZSTD_LEVEL);
+
+  g_mutex_lock (&writer->lock);
+
+  if (writer->error != NULL)
+    ; /* Already failed */
+  else if (ZSTD_isError (res))
+    g_set_error (&writer->error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Zstd compression error: %s", ZSTD_getErrorName (res));
+  else if (glnx_loop_write (writer->fd, compressed, res) < 0)
+    glnx_throw_errno_prefix (&writer->error, "write");
+  else
+    {
+      BundlePartInfo *info = &g_array_index (writer->parts, BundlePartInfo, part->index);
+
+      info->offset = writer->offset;
+      info->size = res;
+      info->uncompressed_size = part->data->len;
+      info->n_objects = part->n_objects;
+      writer->offset += res;
+    }
+
+  writer->in_flight--;
+  g_cond_signal (&writer->cond);
+  g_mutex_unlock (&writer->lock);
+
+  write_part_free (part);
+}
+
+/* Hands the part to the compression threads, waiting if too many parts
+ * are already in memory */
+static gboolean
+submit_part (BundleWriter *writer,
+             GThreadPool  *pool,
+             WritePart    *part,
+             guint         max_in_flight,
+             GError      **error)
+{
+  g_mutex_lock (&writer->lock);
+  while (writer->in_flight >= max_in_flight)
+    g_cond_wait (&writer->cond, &writer->lock);
+  writer->in_flight++;
+  g_array_set_size (writer->parts, MAX (writer->parts->len, part->index + 1));
+  g_mutex_unlock (&writer->lock);
+
+  return g_thread_pool_push (pool, part, error);
+}
+
+static gboolean
+append_object (OstreeRepo       *repo,
+               GByteArray       *data,
+               const char       *checksum,
+               OstreeObjectType  objtype,
+               GCancellable     *cancellable,
+               GError          **error)
+{
+  BundleRecord record = { 0 };
+  g_autoptr(GInputStream) in = NULL;
+  guint64 size;
+  gsize offset, bytes_read;
+
+  if (!ostree_repo_load_object_stream (repo, objtype, checksum, &in, &size, cancellable, error))
+    return FALSE;
+
+  if (size > BUNDLE_MAX_OBJECT_SIZE)
+    return flatpak_fail (error, _("Object %s is too large for a bundle"), checksum);
+
+  record.objtype = objtype;
+  ostree_checksum_inplace_to_bytes (checksum, record.checksum);
+  record.size = GUINT64_TO_LE (size);
+
+  g_byte_array_append (data, (const guint8 *) &record, sizeof (record));
+
+  offset = data->len;
+  g_byte_array_set_size (data, offset + size);
+  if (!g_input_stream_read_all (in, data->data + offset, size, &bytes_read, cancellable, error))
+    return FALSE;
+  if (bytes_read != size)
+    return flatpak_fail (error, "Short read of object %s", checksum);
+
+  /* Keep the next record aligned */
+  g_byte_array_set_size (data, (data->len + 7) & ~(gsize) 7);
+
+  return TRUE;
+}
+
+static gint
+compare_object_names (gconstpointer a,
+                      gconstpointer b)
+{
+  GVariant *va = *(GVariant **) a;
+  GVariant *vb = *(GVariant **) b;
+  const char *csum_a, *csum_b;
+  OstreeObjectType type_a, type_b;
+
+  ostree_object_name_deserialize (va, &csum_a, &type_a);
+  ostree_object_name_deserialize (vb, &csum_b, &type_b);
+
+  /* Metadata first, so the trees are complete early on import */
+  if (OSTREE_OBJECT_TYPE_IS_META (type_a) != OSTREE_OBJECT_TYPE_IS_META (type_b))
+    return OSTREE_OBJECT_TYPE_IS_META (type_a) ? -1 : 1;
+
+  if (type_a != type_b)
+    return type_a - type_b;
+
+  return strcmp (csum_a, csum_b);
+}
+
+static GPtrArray *
+list_bundle_objects (OstreeRepo   *repo,
+                     const char   *commit_checksum,
+                     const char   *from_commit,
+                     GCancellable *cancellable,
+                     GError      **error)
+{
+  g_autoptr(GHashTable) reachable = NULL;
+  g_autoptr(GPtrArray) objects = g_ptr_array_new ();
+  GHashTableIter iter;
+  GVariant *object;
+
+  if (!ostree_repo_traverse_commit (repo, commit_checksum, 0, &reachable, cancellable, error))
+    return NULL;
+
+  /* For deltas, leave out everything the target already has */
+  if (from_commit != NULL)
+    {
+      g_autoptr(GHashTable) from_reachable = NULL;
+
+      if (!ostree_repo_traverse_commit (repo, from_commit, 0, &from_reachable, cancellable, error))
+        return NULL;
+
+      g_hash_table_iter_init (&iter, from_reachable);
+      while (g_hash_table_iter_next (&iter, (gpointer *) &object, NULL))
+        g_hash_table_remove (reachable, object);
+    }
+
+  g_hash_table_iter_init (&iter, reachable);
+  while (g_hash_table_iter_next (&iter, (gpointer *) &object, NULL))
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+
+      ostree_object_name_deserialize (object, &checksum, &objtype);
+      if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+        continue;
+
+      g_ptr_array_add (objects, g_variant_ref (object));
+    }
+
+  g_ptr_array_set_free_func (objects, (GDestroyNotify) g_variant_unref);
+  g_ptr_array_sort (objects, compare_object_names);
+
+  return g_steal_pointer (&objects);
+}
+
+static gboolean
+write_bundle_parts (OstreeRepo   *repo,
+                    GPtrArray    *objects,
+                    BundleWriter *writer,
+                    GCancellable *cancellable,
+                    GError      **error)
+{
+  guint n_threads = MAX (g_get_num_processors (), 1);
+  /* Bounds the memory used by parts waiting for compression */
+  guint max_in_flight = n_threads * 2;
+  GThreadPool *pool;
+  WritePart *part = NULL;
+  guint n_parts = 0;
+  gboolean res = TRUE;
+  guint i;
+
+  pool = g_thread_pool_new (compress_part_thread, writer, n_threads, FALSE, error);
+  if (pool == NULL)
+    return FALSE;
+
+  for (i = 0; res && i < objects->len; i++)
+    {
+      const char *checksum;
+      OstreeObjectType objtype;
+
+      ostree_object_name_deserialize (g_ptr_array_index (objects, i), &checksum, &objtype);
+
+      if (part == NULL)
+        {
+          part = g_new0 (WritePart, 1);
+          part->data = g_byte_array_new ();
+          part->index = n_parts++;
+        }
+
+      res = append_object (repo, part->data, checksum, objtype, cancellable, error);
+      if (!res)
+        break;
+      part->n_objects++;
+
+      if (part->data->len >= BUNDLE_PART_SIZE || i + 1 == objects->len)
+        {
+          res = submit_part (writer, pool, part, max_in_flight, error);
+          if (!res)
+            write_part_free (part);
+          part = NULL;
+        }
+    }
+
+  if (part != NULL)
+    write_part_free (part);
+
+  g_thread_pool_free (pool, !res, TRUE);
+
+  return res;
+}
+
+gboolean
+flatpak_streaming_bundle_write (OstreeRepo   *repo,
+                                const char   *commit_checksum,
+                                const char   *from_commit,
+                                GVariant     *metadata,
+                                GFile        *file,
+                                GCancellable *cancellable,
+                                GError      **error)
+{
+  g_auto(GLnxTmpfile) tmpf = { 0 };
+  g_autofree char *dir = g_path_get_dirname (flatpak_file_get_path_cached (file));
+  g_autoptr(GVariant) commit = NULL;
+  g_autoptr(GVariant) detached = NULL;
+  g_autoptr(GVariant) header = NULL;
+  g_autoptr(GPtrArray) objects = NULL;
+  g_autoptr(GArray) parts = NULL;
+  GVariantBuilder parts_builder;
+  BundleWriter writer = { 0 };
+  guint8 preamble[BUNDLE_PREAMBLE_SIZE] = { 0 };
+  guint8 footer[BUNDLE_FOOTER_SIZE];
+  guint64 header_offset, header_size;
+  guint32 version = GUINT32_TO_LE (BUNDLE_VERSION);
+  gboolean res;
+  guint i;
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, commit_checksum, &commit, error))
+    return FALSE;
+
+  if (!ostree_repo_read_commit_detached_metadata (repo, commit_checksum, &detached, cancellable, error))
+    return FALSE;
+
+  if (from_commit != NULL &&
+      !ostree_validate_checksum_string (from_commit, error))
+    return FALSE;
+
+  objects = list_bundle_objects (repo, commit_checksum, from_commit, cancellable, error);
+  if (objects == NULL)
+    return FALSE;
+
+  if (!glnx_open_tmpfile_linkable_at (AT_FDCWD, dir, O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+
+  memcpy (preamble, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN);
+  memcpy (preamble + BUNDLE_MAGIC_LEN, &version, sizeof (version));
+  if (glnx_loop_write (tmpf.fd, preamble, sizeof (preamble)) < 0)
+    return glnx_throw_errno_prefix (error, "write");
+
+  parts = g_array_new (FALSE, TRUE, sizeof (BundlePartInfo));
+
+  writer.fd = tmpf.fd;
+  writer.offset = BUNDLE_PREAMBLE_SIZE;
+  writer.parts = parts;
+  g_mutex_init (&writer.lock);
+  g_cond_init (&writer.cond);
+
+  res = write_bundle_parts (repo, objects, &writer, cancellable, error);
+
+  g_mutex_clear (&writer.lock);
+  g_cond_clear (&writer.cond);
+
+  if (!res)
+    {
+      g_clear_error (&writer.error);
+      return FALSE;
+    }
+
+  if (writer.error != NULL)
+    {
+      g_propagate_error (error, writer.error);
+      return FALSE;
+    }
+
+  g_variant_builder_init (&parts_builder, G_VARIANT_TYPE ("a(tttu)"));
+  for (i = 0; i < parts->len; i++)
+    {
+      BundlePartInfo *info = &g_array_index (parts, BundlePartInfo, i);
+
+      g_variant_builder_add (&parts_builder, "(tttu)",
+                             info->offset, info->size, info->uncompressed_size, info->n_objects);
+    }
+
+  header = g_variant_ref_sink (g_variant_new ("(@a{sv}@ay@ay@a{sv}@aya(tttu))",
+                                              metadata,
+                                              ostree_checksum_to_bytes_v (commit_checksum),
+                                              g_variant_new_from_data (G_VARIANT_TYPE_BYTESTRING,
+                                                                       g_variant_get_data (commit),
+                                                                       g_variant_get_size (commit),
+                                                                       TRUE,
+                                                                       (GDestroyNotify) g_variant_unref,
+                                                                       g_variant_ref (commit)),
+                                              detached ? detached : g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0),
+                                              from_commit ? ostree_checksum_to_bytes_v (from_commit) : g_variant_new_from_data (G_VARIANT_TYPE_BYTESTRING, "", 0, TRUE, NULL, NULL),
+                                              &parts_builder));
+  if (G_BYTE_ORDER == G_BIG_ENDIAN)
+    {
+      GVariant *swapped = g_variant_byteswap (header);
+      g_variant_unref (header);
+      header = g_variant_ref_sink (swapped);
+    }
+
+  header_offset = GUINT64_TO_LE (writer.offset);
+  header_size = GUINT64_TO_LE (g_variant_get_size (header));
+  memcpy (footer, &header_offset, sizeof (header_offset));
+  memcpy (footer + 8, &header_size, sizeof (header_size));
+  memcpy (footer + 16, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN);
+
+  if (glnx_loop_write (tmpf.fd, g_variant_get_data (header), g_variant_get_size (header)) < 0 ||
+      glnx_loop_write (tmpf.fd, footer, sizeof (footer)) < 0)
+    return glnx_throw_errno_prefix (error, "write");
+
+  if (fchmod (tmpf.fd, 0644) != 0)
+    return glnx_throw_errno_prefix (error, "fchmod");
+
+  return glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE,
+                               AT_FDCWD, flatpak_file_get_path_cached (file), error);
+}
+
+typedef struct
+{
+  OstreeRepo   *repo;
+  int           fd;
+  guint64       header_offset;
+  GCancellable *cancellable;
+  GMutex        lock;
+  GError       *error;
+} BundleImporter;
+
+static gboolean
+import_record (BundleImporter     *importer,
+               const BundleRecord *record,
+               const guint8       *data,
+               gsize               size,
+               GError            **error)
+{
+  char checksum[OSTREE_SHA256_STRING_LEN + 1];
+  OstreeObjectType objtype = record->objtype;
+  gboolean have_object;
+
+  if (objtype != OSTREE_OBJECT_TYPE_FILE &&
+      objtype != OSTREE_OBJECT_TYPE_DIR_TREE &&
+      objtype != OSTREE_OBJECT_TYPE_DIR_META)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, unexpected object type %d"), objtype);
+
+  ostree_checksum_inplace_from_bytes (record->checksum, checksum);
+
+  if (!ostree_repo_has_object (importer->repo, objtype, checksum, &have_object,
+                               importer->cancellable, error))
+    return FALSE;
+
+  if (have_object)
+    return TRUE;
+
+  /* Both of these verify the checksum of the data */
+  if (objtype == OSTREE_OBJECT_TYPE_FILE)
+    {
+      g_autoptr(GInputStream) in = g_memory_input_stream_new_from_data (data, size, NULL);
+
+      if (!ostree_repo_write_content (importer->repo, checksum, in, size, NULL,
+                                      importer->cancellable, error))
+        return FALSE;
+    }
+  else
+    {
+      g_autoptr(GVariant) object = g_variant_ref_sink (g_variant_new_from_data (ostree_metadata_variant_type (objtype),
+                                                                                data, size, FALSE, NULL, NULL));
+
+      if (!ostree_repo_write_metadata (importer->repo, objtype, checksum, object, NULL,
+                                       importer->cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+import_part (BundleImporter *importer,
+             GVariant       *part,
+             GError        **error)
+{
+  guint64 offset, size, uncompressed_size, content_size;
+  guint32 n_objects;
+  g_autofree guint8 *compressed = NULL;
+  g_autofree guint8 *data = NULL;
+  size_t res;
+  gsize pos;
+  guint32 i;
+
+  g_variant_get (part, "(tttu)", &offset, &size, &uncompressed_size, &n_objects);
+
+  /* The parts are between the preamble and the header */
+  if (offset < BUNDLE_PREAMBLE_SIZE ||
+      offset > importer->header_offset ||
+      size > importer->header_offset - offset)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, part outside of the file"));
+
+  if (uncompressed_size > BUNDLE_MAX_PART_SIZE ||
+      size > ZSTD_compressBound (BUNDLE_MAX_PART_SIZE))
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, part too large"));
+
+  compressed = g_try_malloc (MAX (size, 1));
+  if (compressed == NULL)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, part too large"));
+
+  if (!read_at (importer->fd, compressed, size, offset, error))
+    return FALSE;
+
+  /* Don't trust the header alone before allocating for the decompressed data */
+  content_size = ZSTD_getFrameContentSize (compressed, size);
+  if (content_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+      content_size == ZSTD_CONTENTSIZE_ERROR ||
+      content_size != uncompressed_size)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, part size mismatch"));
+
+  data = g_try_malloc (MAX (uncompressed_size, 1));
+  if (data == NULL)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, part too large"));
+
+  res = ZSTD_decompress (data, uncompressed_size, compressed, size);
+  if (ZSTD_isError (res))
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, "Zstd decompression error: %s", ZSTD_getErrorName (res));
+  if (res != uncompressed_size)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, part size mismatch"));
+
+  g_clear_pointer (&compressed, g_free);
+
+  pos = 0;
+  for (i = 0; i < n_objects; i++)
+    {
+      BundleRecord record;
+      guint64 object_size;
+
+      if (uncompressed_size - pos < sizeof (record))
+        return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, truncated part"));
+
+      memcpy (&record, data + pos, sizeof (record));
+      pos += sizeof (record);
+
+      object_size = GUINT64_FROM_LE (record.size);
+      if (uncompressed_size - pos < object_size)
+        return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, truncated part"));
+
+      if (!import_record (importer, &record, data + pos, object_size, error))
+        return FALSE;
+
+      pos = MIN ((pos + object_size + 7) & ~(gsize) 7, uncompressed_size);
+
+      if (g_cancellable_set_error_if_cancelled (importer->cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+import_part_thread (gpointer data,
+                    gpointer user_data)
+{
+  GVariant *part = data;
+  BundleImporter *importer = user_data;
+  g_autoptr(GError) local_error = NULL;
+  gboolean failed;
+
+  g_mutex_lock (&importer->lock);
+  failed = importer->error != NULL;
+  g_mutex_unlock (&importer->lock);
+
+  if (!failed && !import_part (importer, part, &local_error))
+    {
+      g_mutex_lock (&importer->lock);
+      if (importer->error == NULL)
+        importer->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&importer->lock);
+    }
+
+  g_variant_unref (part);
+}
+
+/* Writes all objects in the bundle to the repo, which must be in a
+ * transaction. The parts are decompressed, verified and written on all
+ * CPUs. */
+gboolean
+flatpak_streaming_bundle_import (OstreeRepo   *repo,
+                                 GFile        *file,
+                                 GCancellable *cancellable,
+                                 GError      **error)
+{
+  glnx_autofd int fd = -1;
+  g_autoptr(GVariant) header = NULL;
+  g_autoptr(GVariant) to_csum_v = NULL;
+  g_autoptr(GVariant) commit_bytes = NULL;
+  g_autoptr(GBytes) commit_data = NULL;
+  g_autoptr(GVariant) commit = NULL;
+  g_autoptr(GVariant) detached = NULL;
+  g_autoptr(GVariant) from_csum_v = NULL;
+  g_autoptr(GVariant) parts = NULL;
+  g_autofree char *checksum = NULL;
+  BundleImporter importer = { 0 };
+  GThreadPool *pool;
+  GVariantIter iter;
+  GVariant *part;
+  gboolean res = TRUE;
+
+  if (!glnx_openat_rdonly (AT_FDCWD, flatpak_file_get_path_cached (file), TRUE, &fd, error))
+    return FALSE;
+
+  header = load_header (fd, &importer.header_offset, error);
+  if (header == NULL)
+    return FALSE;
+
+  to_csum_v = g_variant_get_child_value (header, 1);
+  commit_bytes = g_variant_get_child_value (header, 2);
+  detached = g_variant_get_child_value (header, 3);
+  from_csum_v = g_variant_get_child_value (header, 4);
+  parts = g_variant_get_child_value (header, 5);
+
+  checksum = ostree_checksum_from_bytes_v (to_csum_v);
+
+  if (g_variant_n_children (from_csum_v) > 0)
+    {
+      g_autofree char *from_checksum = NULL;
+      gboolean have_from;
+
+      if (!ostree_validate_structureof_csum_v (from_csum_v, error))
+        return FALSE;
+
+      from_checksum = ostree_checksum_from_bytes_v (from_csum_v);
+      if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, from_checksum, &have_from,
+                                   cancellable, error))
+        return FALSE;
+
+      if (!have_from)
+        return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA,
+                                   _("Commit %s, which the bundle is a delta from, is not in the repository"),
+                                   from_checksum);
+    }
+
+  if (g_variant_n_children (detached) > 0 &&
+      !ostree_repo_write_commit_detached_metadata (repo, checksum, detached, cancellable, error))
+    return FALSE;
+
+  importer.repo = repo;
+  importer.fd = fd;
+  importer.cancellable = cancellable;
+  g_mutex_init (&importer.lock);
+
+  pool = g_thread_pool_new (import_part_thread, &importer, MAX (g_get_num_processors (), 1), FALSE, error);
+  if (pool == NULL)
+    {
+      g_mutex_clear (&importer.lock);
+      return FALSE;
+    }
+
+  g_variant_iter_init (&iter, parts);
+  while (res && (part = g_variant_iter_next_value (&iter)) != NULL)
+    res = g_thread_pool_push (pool, part, error);
+
+  g_thread_pool_free (pool, !res, TRUE);
+  g_mutex_clear (&importer.lock);
+
+  if (!res)
+    {
+      g_clear_error (&importer.error);
+      return FALSE;
+    }
+
+  if (importer.error != NULL)
+    {
+      g_propagate_error (error, importer.error);
+      return FALSE;
+    }
+
+  /* Last, so the commit is only there once all its objects are */
+  /* Copied, as the commit needs to be aligned */
+  commit_data = g_bytes_new (g_variant_get_data (commit_bytes), g_variant_get_size (commit_bytes));
+  commit = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_COMMIT_GVARIANT_STRING),
+                                                         commit_data, FALSE));
+
+  if (!ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_COMMIT, checksum, commit, NULL,
+                                   cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+#else /* HAVE_ZSTD */
+
+gboolean
+flatpak_streaming_bundle_write (OstreeRepo   *repo,
+                                const char   *commit_checksum,
+                                const char   *from_commit,
+                                GVariant     *metadata,
+                                GFile        *file,
+                                GCancellable *cancellable,
+                                GError      **error)
+{
+  return flatpak_fail (error, _("Streaming bundles need libzstd, which is not available"));
+}
+
+gboolean
+flatpak_streaming_bundle_import (OstreeRepo   *repo,
+                                 GFile        *file,
+                                 GCancellable *cancellable,
+                                 GError      **error)
+{
+  return flatpak_fail (error, _("Streaming bundles need libzstd, which is not available"));
+}
+
+#endif /* HAVE_ZSTD */
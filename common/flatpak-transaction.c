@@ -2623,7 +2623,7 @@ flatpak_transaction_add_install (FlatpakTransaction *self,
   g_return_val_if_fail (ref != NULL, FALSE);
   g_return_val_if_fail (remote != NULL, FALSE);
 
-  decomposed = flatpak_decomposed_new_from_ref (ref, error);
+  decomposed = flatpak_decomposed_new_from_ref_interned (ref, error);
   if (decomposed == NULL)
     return FALSE;
 
@@ -2680,7 +2680,7 @@ flatpak_transaction_add_rebase (FlatpakTransaction *self,
   /* flatpak_transaction_add_rebase without previous_ids doesn't make sense */
   g_return_val_if_fail (previous_ids != NULL, FALSE);
 
-  decomposed = flatpak_decomposed_new_from_ref (ref, error);
+  decomposed = flatpak_decomposed_new_from_ref_interned (ref, error);
   if (decomposed == NULL)
     return FALSE;
 
@@ -2780,7 +2780,7 @@ flatpak_transaction_add_update (FlatpakTransaction *self,
   if (subpaths != NULL && subpaths[0] != NULL && subpaths[0][0] == 0)
     subpaths = all_paths;
 
-  decomposed = flatpak_decomposed_new_from_ref (ref, error);
+  decomposed = flatpak_decomposed_new_from_ref_interned (ref, error);
   if (decomposed == NULL)
     return FALSE;
 
@@ -2807,7 +2807,7 @@ flatpak_transaction_add_uninstall (FlatpakTransaction *self,
 
   g_return_val_if_fail (ref != NULL, FALSE);
 
-  decomposed = flatpak_decomposed_new_from_ref (ref, error);
+  decomposed = flatpak_decomposed_new_from_ref_interned (ref, error);
   if (decomposed == NULL)
     return FALSE;
 
@@ -195,6 +195,21 @@ gboolean flatpak_var_ref_map_lookup_ref (VarRefMapRef   ref_map,
                                          const char    *ref,
                                          VarRefInfoRef *out_info);
 
+typedef struct FlatpakSummaryRefIndex FlatpakSummaryRefIndex;
+
+FlatpakSummaryRefIndex *flatpak_summary_ref_index_new           (GVariant               *summary,
+                                                                  const char             *collection_id);
+void                    flatpak_summary_ref_index_free          (FlatpakSummaryRefIndex *index);
+const char *            flatpak_summary_ref_index_get_digest    (FlatpakSummaryRefIndex *index);
+gboolean                flatpak_summary_ref_index_lookup_ref    (FlatpakSummaryRefIndex *index,
+                                                                  const char             *ref,
+                                                                  char                  **out_checksum,
+                                                                  VarRefInfoRef          *out_info);
+GPtrArray *             flatpak_summary_ref_index_match_subrefs (FlatpakSummaryRefIndex *index,
+                                                                  FlatpakDecomposed      *ref);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakSummaryRefIndex, flatpak_summary_ref_index_free)
+
 gboolean flatpak_get_allowed_exports (const char     *source_path,
                                       const char     *app_id,
                                       FlatpakContext *context,
@@ -471,6 +486,11 @@ GBytes *flatpak_zlib_decompress_bytes (GBytes  *bytes,
 GBytes *flatpak_summary_apply_diff (GBytes *old,
                                     GBytes *diff,
                                     GError **error);
+gboolean flatpak_summary_apply_uncompressed_diff (GBytes        *old,
+                                                  GBytes        *diff,
+                                                  GOutputStream *out,
+                                                  GCancellable  *cancellable,
+                                                  GError       **error);
 
 typedef enum {
   FLATPAK_REPO_UPDATE_FLAG_NONE = 0,
@@ -489,6 +509,8 @@ gboolean flatpak_repo_collect_sizes (OstreeRepo   *repo,
                                      guint64      *download_size,
                                      GCancellable *cancellable,
                                      GError      **error);
+void flatpak_repo_prune_size_memo (OstreeRepo   *repo,
+                                   GCancellable *cancellable);
 GVariant *flatpak_commit_get_extra_data_sources (GVariant *commitv,
                                                  GError  **error);
 GVariant *flatpak_repo_get_extra_data_sources (OstreeRepo   *repo,
@@ -819,16 +841,15 @@ gboolean   flatpak_repo_generate_appstream (OstreeRepo   *repo,
                                             GCancellable *cancellable,
                                             GError      **error);
 void flatpak_appstream_xml_filter (FlatpakXml *appstream,
-                                   GRegex *allow_refs,
-                                   GRegex *deny_refs);
+                                   FlatpakRefMatcher *allow_refs,
+                                   FlatpakRefMatcher *deny_refs);
 
-char * flatpak_filter_glob_to_regexp (const char *glob, gboolean runtime_only, GError **error);
 gboolean flatpak_parse_filters (const char *data,
-                                GRegex **allow_refs_out,
-                                GRegex **deny_refs_out,
+                                FlatpakRefMatcher **allow_refs_out,
+                                FlatpakRefMatcher **deny_refs_out,
                                 GError **error);
-gboolean flatpak_filters_allow_ref (GRegex *allow_refs,
-                                    GRegex *deny_refs,
+gboolean flatpak_filters_allow_ref (FlatpakRefMatcher *allow_refs,
+                                    FlatpakRefMatcher *deny_refs,
                                     const char *ref);
 
 gboolean flatpak_allocate_tmpdir (int           tmpdir_dfd,
@@ -45,9 +45,11 @@
 
 #include "flatpak-dir-private.h"
 #include "flatpak-error.h"
+#include "flatpak-gpg-signer-private.h"
 #include "flatpak-oci-registry-private.h"
 #include "flatpak-progress-private.h"
 #include "flatpak-run-private.h"
+#include "flatpak-streaming-bundle-private.h"
 #include "flatpak-utils-base-private.h"
 #include "flatpak-utils-private.h"
 #include "flatpak-variant-impl-private.h"
@@ -844,112 +846,16 @@ line_get_word (char **line)
   return word;
 }
 
-char *
-flatpak_filter_glob_to_regexp (const char  *glob,
-                               gboolean     runtime_only,
-                               GError     **error)
-{
-  g_autoptr(GString) regexp = g_string_new ("");
-  int parts = 1;
-  gboolean empty_part;
-
-  if (g_str_has_prefix (glob, "app/"))
-    {
-      if (runtime_only)
-        {
-          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Glob can't match apps"));
-          return NULL;
-        }
-      else
-        {
-          glob += strlen ("app/");
-          g_string_append (regexp, "app/");
-        }
-    }
-  else if (g_str_has_prefix (glob, "runtime/"))
-    {
-      glob += strlen ("runtime/");
-      g_string_append (regexp, "runtime/");
-    }
-  else
-    {
-      if (runtime_only)
-        g_string_append (regexp, "runtime/");
-      else
-        g_string_append (regexp, "(app|runtime)/");
-    }
-
-  /* We really need an id part, the rest is optional */
-  if (*glob == 0)
-    {
-      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Empty glob"));
-      return NULL;
-    }
-
-  empty_part = TRUE;
-  while (*glob != 0)
-    {
-      char c = *glob;
-      glob++;
-
-      if (c == '/')
-        {
-          if (empty_part)
-            g_string_append (regexp, "[.\\-_a-zA-Z0-9]*");
-          empty_part = TRUE;
-          parts++;
-          g_string_append (regexp, "/");
-          if (parts > 3)
-            {
-              flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Too many segments in glob"));
-              return NULL;
-            }
-        }
-      else if (c == '*')
-        {
-          empty_part = FALSE;
-         g_string_append (regexp, "[.\\-_a-zA-Z0-9]*");
-        }
-      else if (c == '.')
-        {
-          empty_part = FALSE;
-          g_string_append (regexp, "\\.");
-        }
-      else if (g_ascii_isalnum (c) || c == '-' || c == '_')
-        {
-          empty_part = FALSE;
-          g_string_append_c (regexp, c);
-        }
-      else
-        {
-          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid glob character '%c'"), c);
-          return NULL;
-        }
-    }
-
-  while (parts < 3)
-    {
-      parts++;
-      g_string_append (regexp, "/[.\\-_a-zA-Z0-9]*");
-    }
-
-  return g_string_free (g_steal_pointer (&regexp), FALSE);
-}
-
 gboolean
 flatpak_parse_filters (const char *data,
-                       GRegex **allow_refs_out,
-                       GRegex **deny_refs_out,
+                       FlatpakRefMatcher **allow_refs_out,
+                       FlatpakRefMatcher **deny_refs_out,
                        GError **error)
 {
   g_auto(GStrv) lines = NULL;
   int i;
-  g_autoptr(GString) allow_regexp = g_string_new ("^(");
-  g_autoptr(GString) deny_regexp = g_string_new ("^(");
-  gboolean has_allow = FALSE;
-  gboolean has_deny = FALSE;
-  g_autoptr(GRegex) allow_refs = NULL;
-  g_autoptr(GRegex) deny_refs = NULL;
+  g_autoptr(FlatpakRefMatcher) allow_refs = flatpak_ref_matcher_new ();
+  g_autoptr(FlatpakRefMatcher) deny_refs = flatpak_ref_matcher_new ();
 
   lines = g_strsplit (data, "\n", -1);
   for (i = 0; lines[i] != NULL; i++)
@@ -970,9 +876,7 @@ flatpak_parse_filters (const char *data,
       if (strcmp (command, "allow") == 0 || strcmp (command, "deny") == 0)
         {
           char *glob, *next;
-          g_autofree char *ref_regexp = NULL;
-          GString *command_regexp;
-          gboolean *has_type = NULL;
+          FlatpakRefMatcher *command_refs;
 
           glob = line_get_word (&line);
           if (glob == NULL)
@@ -982,27 +886,13 @@ flatpak_parse_filters (const char *data,
           if (next != NULL)
             return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Trailing text on line %d"), i + 1);
 
-          ref_regexp = flatpak_filter_glob_to_regexp (glob, FALSE, error);
-          if (ref_regexp == NULL)
-            return glnx_prefix_error (error, _("on line %d"), i + 1);
-
           if (strcmp (command, "allow") == 0)
-            {
-              command_regexp = allow_regexp;
-              has_type = &has_allow;
-            }
-          else
-            {
-              command_regexp = deny_regexp;
-              has_type = &has_deny;
-            }
-
-          if (*has_type)
-            g_string_append (command_regexp, "|");
+            command_refs = allow_refs;
           else
-            *has_type = TRUE;
+            command_refs = deny_refs;
 
-          g_string_append (command_regexp, ref_regexp);
+          if (!flatpak_ref_matcher_add_glob (command_refs, glob, FALSE, error))
+            return glnx_prefix_error (error, _("on line %d"), i + 1);
         }
       else
         {
@@ -1010,23 +900,6 @@ flatpak_parse_filters (const char *data,
         }
     }
 
-  g_string_append (allow_regexp, ")$");
-  g_string_append (deny_regexp, ")$");
-
-  if (allow_regexp)
-    {
-      allow_refs = g_regex_new (allow_regexp->str, G_REGEX_DOLLAR_ENDONLY|G_REGEX_RAW|G_REGEX_OPTIMIZE, G_REGEX_MATCH_ANCHORED, error);
-      if (allow_refs == NULL)
-        return FALSE;
-    }
-
-  if (deny_regexp)
-    {
-      deny_refs = g_regex_new (deny_regexp->str, G_REGEX_DOLLAR_ENDONLY|G_REGEX_RAW|G_REGEX_OPTIMIZE, G_REGEX_MATCH_ANCHORED, error);
-      if (deny_refs == NULL)
-        return FALSE;
-    }
-
   *allow_refs_out = g_steal_pointer (&allow_refs);
   *deny_refs_out = g_steal_pointer (&deny_refs);
 
@@ -1034,17 +907,17 @@ flatpak_parse_filters (const char *data,
 }
 
 gboolean
-flatpak_filters_allow_ref (GRegex *allow_refs,
-                           GRegex *deny_refs,
+flatpak_filters_allow_ref (FlatpakRefMatcher *allow_refs,
+                           FlatpakRefMatcher *deny_refs,
                            const char *ref)
 {
   if (deny_refs == NULL)
     return TRUE; /* All refs are allowed by default */
 
-  if (!g_regex_match (deny_refs, ref, G_REGEX_MATCH_ANCHORED, NULL))
+  if (!flatpak_ref_matcher_match (deny_refs, ref))
     return TRUE; /* Not denied */
 
-  if (allow_refs &&  g_regex_match (allow_refs, ref, G_REGEX_MATCH_ANCHORED, NULL))
+  if (allow_refs && flatpak_ref_matcher_match (allow_refs, ref))
     return TRUE; /* Explicitly allowed */
 
   return FALSE;
@@ -2218,7 +2091,7 @@ flatpak_summary_match_subrefs (GVariant          *summary_v,
           if (memchr (id_suffix, '.', id_end - id_suffix) != NULL)
             continue;
 
-          FlatpakDecomposed *d = flatpak_decomposed_new_from_ref (cur, NULL);
+          FlatpakDecomposed *d = flatpak_decomposed_new_from_ref_interned (cur, NULL);
           if (d)
             g_ptr_array_add (res, d);
         }
@@ -2262,6 +2135,177 @@ flatpak_summary_lookup_ref (GVariant      *summary_v,
   return TRUE;
 }
 
+struct FlatpakSummaryRefIndex
+{
+  GVariant     *summary;
+  VarRefMapRef  ref_map;
+  GHashTable   *refs;    /* ref -> index + 1 */
+  GHashTable   *subrefs; /* parent ref -> GArray of indexes */
+  char         *digest;  /* Computed on first use, see g_once_init_enter() */
+};
+
+/* For kind/$ID.$SUFFIX/arch/branch this returns kind/$ID/arch/branch,
+ * which is the ref flatpak_summary_match_subrefs() matches it for */
+static char *
+get_subref_parent (const char *ref)
+{
+  const char *id_start;
+  const char *id_end;
+  const char *last_dot;
+  GString *parent;
+
+  id_start = strchr (ref, '/');
+  if (id_start == NULL)
+    return NULL;
+  id_start += 1;
+
+  id_end = strchr (id_start, '/');
+  if (id_end == NULL)
+    return NULL;
+
+  last_dot = g_strrstr_len (id_start, id_end - id_start, ".");
+  if (last_dot == NULL)
+    return NULL;
+
+  parent = g_string_new_len (ref, last_dot - ref);
+  g_string_append (parent, id_end);
+  return g_string_free (parent, FALSE);
+}
+
+/* Builds hash tables over the ref map of @summary_v, so that looking up
+ * refs and subrefs doesn't have to search the (possibly huge) ref map
+ * every time. The keys point into @summary_v, which the index keeps
+ * alive. Returns %NULL if @collection_id isn't in the summary. */
+FlatpakSummaryRefIndex *
+flatpak_summary_ref_index_new (GVariant   *summary_v,
+                               const char *collection_id)
+{
+  FlatpakSummaryRefIndex *index;
+  VarSummaryRef summary;
+  VarRefMapRef ref_map;
+  gsize n, i;
+
+  summary = var_summary_from_gvariant (summary_v);
+  if (!flatpak_summary_find_ref_map (summary, collection_id, &ref_map))
+    return NULL;
+
+  index = g_new0 (FlatpakSummaryRefIndex, 1);
+  index->summary = g_variant_ref (summary_v);
+  index->ref_map = ref_map;
+  index->refs = g_hash_table_new (g_str_hash, g_str_equal);
+  index->subrefs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_array_unref);
+
+  n = var_ref_map_get_length (ref_map);
+  for (i = 0; i < n; i++)
+    {
+      VarRefMapEntryRef entry = var_ref_map_get_at (ref_map, i);
+      const char *ref = var_ref_map_entry_get_ref (entry);
+      g_autofree char *parent = NULL;
+      GArray *subrefs;
+      guint idx = i;
+
+      g_hash_table_insert (index->refs, (char *) ref, GUINT_TO_POINTER (i + 1));
+
+      parent = get_subref_parent (ref);
+      if (parent == NULL)
+        continue;
+
+      subrefs = g_hash_table_lookup (index->subrefs, parent);
+      if (subrefs == NULL)
+        {
+          subrefs = g_array_new (FALSE, FALSE, sizeof (guint));
+          g_hash_table_insert (index->subrefs, g_steal_pointer (&parent), subrefs);
+        }
+      g_array_append_val (subrefs, idx);
+    }
+
+  return index;
+}
+
+void
+flatpak_summary_ref_index_free (FlatpakSummaryRefIndex *index)
+{
+  g_hash_table_unref (index->subrefs);
+  g_hash_table_unref (index->refs);
+  g_variant_unref (index->summary);
+  g_free (index->digest);
+  g_free (index);
+}
+
+/* The sha256 of the indexed summary, to identify the summary in caches.
+ * The index is shared between threads via the remote state, so the
+ * digest is computed at most once. */
+const char *
+flatpak_summary_ref_index_get_digest (FlatpakSummaryRefIndex *index)
+{
+  if (g_once_init_enter (&index->digest))
+    {
+      char *digest = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+                                                  g_variant_get_data (index->summary),
+                                                  g_variant_get_size (index->summary));
+
+      g_once_init_leave (&index->digest, digest);
+    }
+
+  return index->digest;
+}
+
+/* Same as flatpak_summary_lookup_ref() */
+gboolean
+flatpak_summary_ref_index_lookup_ref (FlatpakSummaryRefIndex *index,
+                                      const char             *ref,
+                                      char                  **out_checksum,
+                                      VarRefInfoRef          *out_info)
+{
+  VarRefInfoRef info;
+  const guchar *checksum_bytes;
+  gsize checksum_bytes_len;
+  guint idx;
+
+  idx = GPOINTER_TO_UINT (g_hash_table_lookup (index->refs, ref));
+  if (idx == 0)
+    return FALSE;
+
+  info = var_ref_map_entry_get_info (var_ref_map_get_at (index->ref_map, idx - 1));
+
+  checksum_bytes = var_ref_info_peek_checksum (info, &checksum_bytes_len);
+  if (G_UNLIKELY (checksum_bytes_len != OSTREE_SHA256_DIGEST_LEN))
+    return FALSE;
+
+  if (out_checksum)
+    *out_checksum = ostree_checksum_from_bytes (checksum_bytes);
+
+  if (out_info)
+    *out_info = info;
+
+  return TRUE;
+}
+
+/* Same as flatpak_summary_match_subrefs() */
+GPtrArray *
+flatpak_summary_ref_index_match_subrefs (FlatpakSummaryRefIndex *index,
+                                         FlatpakDecomposed      *ref)
+{
+  GPtrArray *res = g_ptr_array_new_with_free_func ((GDestroyNotify)flatpak_decomposed_unref);
+  GArray *subrefs;
+
+  subrefs = g_hash_table_lookup (index->subrefs, flatpak_decomposed_get_ref (ref));
+  if (subrefs == NULL)
+    return res;
+
+  for (guint i = 0; i < subrefs->len; i++)
+    {
+      guint idx = g_array_index (subrefs, guint, i);
+      VarRefMapEntryRef entry = var_ref_map_get_at (index->ref_map, idx);
+      FlatpakDecomposed *d = flatpak_decomposed_new_from_ref_interned (var_ref_map_entry_get_ref (entry), NULL);
+
+      if (d)
+        g_ptr_array_add (res, d);
+    }
+
+  return res;
+}
+
 GKeyFile *
 flatpak_parse_repofile (const char   *remote_name,
                         gboolean      from_ref,
@@ -2796,93 +2840,336 @@ flatpak_repo_parse_extra_data_sources (GVariant      *extra_data_sources,
     *sha256 = ostree_checksum_bytes_peek (sha256_v);
 }
 
-#define OSTREE_GIO_FAST_QUERYINFO ("standard::name,standard::type,standard::size,standard::is-symlink,standard::symlink-target," \
-                                   "unix::device,unix::inode,unix::mode,unix::uid,unix::gid,unix::rdev")
+/* The size memo maps a "dirtree-dirmeta" checksum pair to the installed
+ * and download size of that directory, so subtrees shared between
+ * commits (other arches, older versions) are only walked once. It is
+ * persisted in the repo by flatpak_repo_update(), so a new commit only
+ * costs walking its changed subtrees, and pruned along with the repo by
+ * flatpak_repo_prune_size_memo(). */
+#define FLATPAK_SIZE_MEMO "size-memo"
+#define FLATPAK_SIZE_MEMO_FORMAT "a{s(ttb)}"
 
-static gboolean
-_flatpak_repo_collect_sizes (OstreeRepo   *repo,
-                             GFile        *file,
-                             GFileInfo    *file_info,
-                             guint64      *installed_size,
-                             guint64      *download_size,
-                             GCancellable *cancellable,
-                             GError      **error)
+typedef struct
+{
+  guint64  installed_size;
+  guint64  download_size;
+  gboolean have_download_size;
+} DirSizes;
+
+typedef struct
 {
-  g_autoptr(GFileEnumerator) dir_enum = NULL;
-  GFileInfo *child_info_tmp;
-  g_autoptr(GError) temp_error = NULL;
+  GMutex      lock;
+  GHashTable *sizes; /* "dirtree-dirmeta" -> DirSizes */
+  gboolean    changed;
+} SizeMemo;
+
+static SizeMemo *
+size_memo_new (void)
+{
+  SizeMemo *memo = g_new0 (SizeMemo, 1);
+
+  g_mutex_init (&memo->lock);
+  memo->sizes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  return memo;
+}
+
+static void
+size_memo_free (SizeMemo *memo)
+{
+  g_hash_table_unref (memo->sizes);
+  g_mutex_clear (&memo->lock);
+  g_free (memo);
+}
 
-  if (file_info != NULL && g_file_info_get_file_type (file_info) == G_FILE_TYPE_REGULAR)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (SizeMemo, size_memo_free)
+
+static SizeMemo *
+load_size_memo (OstreeRepo *repo)
+{
+  g_autoptr(SizeMemo) memo = size_memo_new ();
+  glnx_autofd int fd = -1;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) memo_v = NULL;
+  GVariantIter iter;
+  const char *key;
+  guint64 installed_size, download_size;
+  gboolean have_download_size;
+
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), FLATPAK_SIZE_MEMO, TRUE, &fd, NULL))
+    return g_steal_pointer (&memo);
+
+  bytes = glnx_fd_readall_bytes (fd, NULL, NULL);
+  if (bytes == NULL)
+    return g_steal_pointer (&memo);
+
+  memo_v = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_SIZE_MEMO_FORMAT),
+                                                         bytes, FALSE));
+
+  g_variant_iter_init (&iter, memo_v);
+  while (g_variant_iter_next (&iter, "{&s(ttb)}", &key, &installed_size, &download_size, &have_download_size))
     {
-      const char *checksum = ostree_repo_file_get_checksum (OSTREE_REPO_FILE (file));
-      guint64 obj_size;
-      guint64 file_size = g_file_info_get_size (file_info);
+      DirSizes *sizes = g_new0 (DirSizes, 1);
 
-      if (installed_size)
-        *installed_size += ((file_size + 511) / 512) * 512;
+      sizes->installed_size = GUINT64_FROM_BE (installed_size);
+      sizes->download_size = GUINT64_FROM_BE (download_size);
+      sizes->have_download_size = have_download_size;
+      g_hash_table_insert (memo->sizes, g_strdup (key), sizes);
+    }
 
-      if (download_size)
+  return g_steal_pointer (&memo);
+}
+
+static void
+save_size_memo (OstreeRepo   *repo,
+                SizeMemo     *memo,
+                GCancellable *cancellable)
+{
+  g_auto(GVariantBuilder) builder = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(GVariant) memo_v = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (!memo->changed)
+    return;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE (FLATPAK_SIZE_MEMO_FORMAT));
+  GLNX_HASH_TABLE_FOREACH_KV (memo->sizes, const char *, key, DirSizes *, sizes)
+    {
+      g_variant_builder_add (&builder, "{s(ttb)}", key,
+                             GUINT64_TO_BE (sizes->installed_size),
+                             GUINT64_TO_BE (sizes->download_size),
+                             sizes->have_download_size);
+    }
+  memo_v = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  /* This is only a cache, so failing to write it isn't fatal */
+  if (!glnx_file_replace_contents_at (ostree_repo_get_dfd (repo), FLATPAK_SIZE_MEMO,
+                                      g_variant_get_data (memo_v),
+                                      g_variant_get_size (memo_v),
+                                      GLNX_FILE_REPLACE_NODATASYNC,
+                                      cancellable, &local_error))
+    g_debug ("Failed to save size memo: %s", local_error->message);
+}
+
+/* Drops the memo entries of dirtrees that are no longer in @repo, so
+ * the memo doesn't keep the sizes of every commit that was ever pruned.
+ * Like the rest of the memo handling this is best-effort. */
+void
+flatpak_repo_prune_size_memo (OstreeRepo   *repo,
+                              GCancellable *cancellable)
+{
+  g_autoptr(SizeMemo) memo = load_size_memo (repo);
+  g_autoptr(GError) local_error = NULL;
+  GHashTableIter iter;
+  gpointer key;
+
+  g_hash_table_iter_init (&iter, memo->sizes);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      g_autofree char *tree_checksum = g_strndup (key, OSTREE_SHA256_STRING_LEN);
+      gboolean have_tree;
+
+      if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_DIR_TREE, tree_checksum,
+                                   &have_tree, cancellable, &local_error))
         {
-          g_autoptr(GInputStream) input = NULL;
-          GInputStream *base_input;
-          g_autoptr(GError) local_error = NULL;
+          g_debug ("Failed to prune size memo: %s", local_error->message);
+          return;
+        }
 
-          if (!ostree_repo_query_object_storage_size (repo,
-                                                      OSTREE_OBJECT_TYPE_FILE, checksum,
-                                                      &obj_size, cancellable, &local_error))
-            {
-              int fd;
-              struct stat stbuf;
-
-              /* Ostree does not look at the staging directory when querying storage
-                 size, so may return a NOT_FOUND error here. We work around this
-                 by loading the object and walking back until we find the original
-                 fd which we can fstat(). */
-              if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-                return FALSE;
+      if (!have_tree)
+        {
+          g_hash_table_iter_remove (&iter);
+          memo->changed = TRUE;
+        }
+    }
 
-              if (!ostree_repo_load_file (repo, checksum,  &input, NULL, NULL, NULL, error))
-                return FALSE;
+  save_size_memo (repo, memo, cancellable);
+}
 
-              base_input = input;
-              while (G_IS_FILTER_INPUT_STREAM (base_input))
-                base_input = g_filter_input_stream_get_base_stream (G_FILTER_INPUT_STREAM (base_input));
+static gboolean
+get_object_download_size (OstreeRepo   *repo,
+                          const char   *checksum,
+                          guint64      *out_size,
+                          GCancellable *cancellable,
+                          GError      **error)
+{
+  g_autoptr(GInputStream) input = NULL;
+  GInputStream *base_input;
+  g_autoptr(GError) local_error = NULL;
+  int fd;
+  struct stat stbuf;
 
-              if (!G_IS_UNIX_INPUT_STREAM (base_input))
-                return flatpak_fail (error, "Unable to find size of commit %s, not an unix stream", checksum);
+  if (ostree_repo_query_object_storage_size (repo,
+                                             OSTREE_OBJECT_TYPE_FILE, checksum,
+                                             out_size, cancellable, &local_error))
+    return TRUE;
 
-              fd = g_unix_input_stream_get_fd (G_UNIX_INPUT_STREAM (base_input));
+  /* Ostree does not look at the staging directory when querying storage
+     size, so may return a NOT_FOUND error here. We work around this
+     by loading the object and walking back until we find the original
+     fd which we can fstat(). */
+  if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
 
-              if (fstat (fd, &stbuf) != 0)
-                return glnx_throw_errno_prefix (error, "Can't find commit size: ");
+  if (!ostree_repo_load_file (repo, checksum,  &input, NULL, NULL, NULL, error))
+    return FALSE;
 
-              obj_size = stbuf.st_size;
-            }
+  base_input = input;
+  while (G_IS_FILTER_INPUT_STREAM (base_input))
+    base_input = g_filter_input_stream_get_base_stream (G_FILTER_INPUT_STREAM (base_input));
+
+  if (!G_IS_UNIX_INPUT_STREAM (base_input))
+    return flatpak_fail (error, "Unable to find size of commit %s, not an unix stream", checksum);
+
+  fd = g_unix_input_stream_get_fd (G_UNIX_INPUT_STREAM (base_input));
+
+  if (fstat (fd, &stbuf) != 0)
+    return glnx_throw_errno_prefix (error, "Can't find commit size: ");
+
+  *out_size = stbuf.st_size;
+  return TRUE;
+}
+
+/* Sums up the sizes of the dirtree @tree_checksum (with dirmeta
+ * @meta_checksum) in @tree_repo. Download sizes are those of the objects
+ * in @repo, which may differ from @tree_repo. */
+static gboolean
+_flatpak_repo_collect_sizes (OstreeRepo   *repo,
+                             OstreeRepo   *tree_repo,
+                             SizeMemo     *memo,
+                             const char   *tree_checksum,
+                             const char   *meta_checksum,
+                             gboolean      want_download_size,
+                             DirSizes     *out_sizes,
+                             GCancellable *cancellable,
+                             GError      **error)
+{
+  g_autofree char *key = NULL;
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  DirSizes sizes = { 0, 0, want_download_size };
+  gsize i, n;
 
-          *download_size += obj_size;
+  if (memo)
+    {
+      DirSizes *cached;
+      gboolean found = FALSE;
+
+      key = g_strconcat (tree_checksum, "-", meta_checksum, NULL);
+
+      g_mutex_lock (&memo->lock);
+      cached = g_hash_table_lookup (memo->sizes, key);
+      if (cached != NULL && (cached->have_download_size || !want_download_size))
+        {
+          sizes = *cached;
+          found = TRUE;
+        }
+      g_mutex_unlock (&memo->lock);
+
+      if (found)
+        {
+          *out_sizes = sizes;
+          return TRUE;
         }
     }
 
-  if (file_info == NULL || g_file_info_get_file_type (file_info) == G_FILE_TYPE_DIRECTORY)
+  if (!ostree_repo_load_variant (tree_repo, OSTREE_OBJECT_TYPE_DIR_TREE, tree_checksum, &dirtree, error))
+    return FALSE;
+
+  files = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files);
+  for (i = 0; i < n; i++)
     {
-      dir_enum = g_file_enumerate_children (file, OSTREE_GIO_FAST_QUERYINFO,
-                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
-                                            cancellable, error);
-      if (!dir_enum)
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autoptr(GFileInfo) file_info = NULL;
+      g_autofree char *checksum = NULL;
+
+      g_variant_get_child (files, i, "(&s@ay)", NULL, &csum_v);
+      checksum = ostree_checksum_from_bytes_v (csum_v);
+
+      if (!ostree_repo_load_file (tree_repo, checksum, NULL, &file_info, NULL, cancellable, error))
         return FALSE;
 
+      if (g_file_info_get_file_type (file_info) != G_FILE_TYPE_REGULAR)
+        continue;
 
-      while ((child_info_tmp = g_file_enumerator_next_file (dir_enum, cancellable, &temp_error)))
+      sizes.installed_size += ((g_file_info_get_size (file_info) + 511) / 512) * 512;
+
+      if (want_download_size)
         {
-          g_autoptr(GFileInfo) child_info = child_info_tmp;
-          const char *name = g_file_info_get_name (child_info);
-          g_autoptr(GFile) child = g_file_get_child (file, name);
+          guint64 obj_size;
 
-          if (!_flatpak_repo_collect_sizes (repo, child, child_info, installed_size, download_size, cancellable, error))
+          if (!get_object_download_size (repo, checksum, &obj_size, cancellable, error))
             return FALSE;
+
+          sizes.download_size += obj_size;
         }
     }
 
+  dirs = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs);
+  for (i = 0; i < n; i++)
+    {
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_autofree char *subtree_checksum = NULL;
+      g_autofree char *submeta_checksum = NULL;
+      DirSizes subdir_sizes;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", NULL, &tree_csum_v, &meta_csum_v);
+      subtree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+      submeta_checksum = ostree_checksum_from_bytes_v (meta_csum_v);
+
+      if (!_flatpak_repo_collect_sizes (repo, tree_repo, memo, subtree_checksum, submeta_checksum,
+                                        want_download_size, &subdir_sizes, cancellable, error))
+        return FALSE;
+
+      sizes.installed_size += subdir_sizes.installed_size;
+      sizes.download_size += subdir_sizes.download_size;
+    }
+
+  if (memo)
+    {
+      g_mutex_lock (&memo->lock);
+      g_hash_table_replace (memo->sizes, g_steal_pointer (&key), g_memdup (&sizes, sizeof (sizes)));
+      memo->changed = TRUE;
+      g_mutex_unlock (&memo->lock);
+    }
+
+  *out_sizes = sizes;
+  return TRUE;
+}
+
+static gboolean
+flatpak_repo_collect_sizes_memo (OstreeRepo   *repo,
+                                 SizeMemo     *memo,
+                                 GFile        *root,
+                                 guint64      *installed_size,
+                                 guint64      *download_size,
+                                 GCancellable *cancellable,
+                                 GError      **error)
+{
+  OstreeRepoFile *root_file = OSTREE_REPO_FILE (root);
+  DirSizes sizes;
+
+  if (!ostree_repo_file_ensure_resolved (root_file, error))
+    return FALSE;
+
+  if (!_flatpak_repo_collect_sizes (repo, ostree_repo_file_get_repo (root_file), memo,
+                                    ostree_repo_file_tree_get_contents_checksum (root_file),
+                                    ostree_repo_file_tree_get_metadata_checksum (root_file),
+                                    download_size != NULL, &sizes, cancellable, error))
+    return FALSE;
+
+  if (installed_size)
+    *installed_size = sizes.installed_size;
+  if (download_size)
+    *download_size = sizes.download_size;
+
   return TRUE;
 }
 
@@ -2894,12 +3181,12 @@ flatpak_repo_collect_sizes (OstreeRepo   *repo,
                             GCancellable *cancellable,
                             GError      **error)
 {
-  /* Initialize the sums */
-  if (installed_size)
-    *installed_size = 0;
-  if (download_size)
-    *download_size = 0;
-  return _flatpak_repo_collect_sizes (repo, root, NULL, installed_size, download_size, cancellable, error);
+  g_autoptr(SizeMemo) memo = size_memo_new ();
+
+  /* Even without a persistent memo, identical subtrees within a commit
+   * are only walked once */
+  return flatpak_repo_collect_sizes_memo (repo, memo, root, installed_size, download_size,
+                                          cancellable, error);
 }
 
 
@@ -3422,6 +3709,7 @@ populate_commit_data_cache (OstreeRepo *repo,
 
 static CommitData *
 read_commit_data (OstreeRepo   *repo,
+                  SizeMemo     *size_memo,
                   const char   *ref,
                   const char   *rev,
                   GCancellable *cancellable,
@@ -3467,7 +3755,8 @@ read_commit_data (OstreeRepo   *repo,
     }
   else
     {
-      if (!flatpak_repo_collect_sizes (repo, root, &installed_size, &download_size, cancellable, error))
+      if (!flatpak_repo_collect_sizes_memo (repo, size_memo, root, &installed_size, &download_size,
+                                            cancellable, error))
         return NULL;
     }
 
@@ -3642,6 +3931,110 @@ _ostree_repo_static_delta_superblock_digest (OstreeRepo    *repo,
                                   FALSE, g_free, FALSE);
 }
 
+/* The delta manifest caches the superblock digest of each static delta in
+ * the summary, along with the size and mtime of the superblock it was
+ * computed from, so regenerating the summary doesn't have to read every
+ * superblock again. */
+#define FLATPAK_DELTA_MANIFEST "delta-manifest"
+#define FLATPAK_DELTA_MANIFEST_FORMAT "a{s(tttay)}"
+
+static GHashTable *
+load_delta_manifest (OstreeRepo *repo)
+{
+  g_autoptr(GHashTable) manifest = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_variant_unref);
+  glnx_autofd int fd = -1;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) manifest_v = NULL;
+  GVariantIter iter;
+  const char *name;
+  GVariant *entry;
+
+  if (!glnx_openat_rdonly (ostree_repo_get_dfd (repo), FLATPAK_DELTA_MANIFEST, TRUE, &fd, NULL))
+    return g_steal_pointer (&manifest);
+
+  bytes = glnx_fd_readall_bytes (fd, NULL, NULL);
+  if (bytes == NULL)
+    return g_steal_pointer (&manifest);
+
+  manifest_v = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_DELTA_MANIFEST_FORMAT),
+                                                             bytes, FALSE));
+
+  g_variant_iter_init (&iter, manifest_v);
+  while (g_variant_iter_next (&iter, "{&s@(tttay)}", &name, &entry))
+    g_hash_table_insert (manifest, g_strdup (name), entry);
+
+  return g_steal_pointer (&manifest);
+}
+
+static void
+save_delta_manifest (OstreeRepo      *repo,
+                     GVariantBuilder *builder,
+                     GCancellable    *cancellable)
+{
+  g_autoptr(GVariant) manifest = g_variant_ref_sink (g_variant_builder_end (builder));
+  g_autoptr(GError) local_error = NULL;
+
+  /* This is only a cache, so failing to write it isn't fatal */
+  if (!glnx_file_replace_contents_at (ostree_repo_get_dfd (repo), FLATPAK_DELTA_MANIFEST,
+                                      g_variant_get_data (manifest),
+                                      g_variant_get_size (manifest),
+                                      GLNX_FILE_REPLACE_NODATASYNC,
+                                      cancellable, &local_error))
+    g_debug ("Failed to save delta manifest: %s", local_error->message);
+}
+
+/* Like _ostree_repo_static_delta_superblock_digest(), but reuses the digest
+ * from @delta_manifest if the superblock didn't change, and records the
+ * result in @new_delta_manifest */
+static GVariant *
+get_static_delta_digest (OstreeRepo      *repo,
+                         const char      *delta_name,
+                         const char      *from,
+                         const char      *to,
+                         GHashTable      *delta_manifest,
+                         GVariantBuilder *new_delta_manifest,
+                         GCancellable    *cancellable,
+                         GError         **error)
+{
+  g_autofree char *superblock = _ostree_get_relative_static_delta_superblock_path (from, to);
+  g_autoptr(GVariant) digest = NULL;
+  GVariant *entry;
+  struct stat stbuf;
+
+  if (!glnx_fstatat (ostree_repo_get_dfd (repo), superblock, &stbuf, 0, error))
+    return NULL;
+
+  entry = g_hash_table_lookup (delta_manifest, delta_name);
+  if (entry != NULL)
+    {
+      g_autoptr(GVariant) cached_digest = NULL;
+      guint64 size, mtime, mtime_nsec;
+
+      g_variant_get (entry, "(ttt@ay)", &size, &mtime, &mtime_nsec, &cached_digest);
+      if (size == stbuf.st_size &&
+          mtime == stbuf.st_mtim.tv_sec &&
+          mtime_nsec == stbuf.st_mtim.tv_nsec &&
+          g_variant_get_size (cached_digest) == OSTREE_SHA256_DIGEST_LEN)
+        digest = g_steal_pointer (&cached_digest);
+    }
+
+  if (digest == NULL)
+    {
+      digest = _ostree_repo_static_delta_superblock_digest (repo, from, to, cancellable, error);
+      if (digest == NULL)
+        return NULL;
+      g_variant_ref_sink (digest);
+    }
+
+  g_variant_builder_add (new_delta_manifest, "{s(ttt@ay)}", delta_name,
+                         (guint64) stbuf.st_size,
+                         (guint64) stbuf.st_mtim.tv_sec,
+                         (guint64) stbuf.st_mtim.tv_nsec,
+                         digest);
+
+  return g_steal_pointer (&digest);
+}
+
 static char *
 appstream_ref_get_subset (const char *ref)
 {
@@ -3935,52 +4328,39 @@ diff_consume_block (DiffData *data,
   data->last_new_offset = produce_new_offset + produce_new_size;
 }
 
-GBytes *
-flatpak_summary_apply_diff (GBytes *old,
-                            GBytes *diff,
-                            GError **error)
-{
-  g_autoptr(GBytes) uncompressed = NULL;
-  const guchar *diffdata;
-  gsize diff_size;
-  guint32 *ops;
+/* Applies an already decompressed summary diff, writing the result to
+ * @out. This doesn't need the old summary, the diff or the result to fit
+ * in memory, so they can all be file-backed. */
+gboolean
+flatpak_summary_apply_uncompressed_diff (GBytes        *old,
+                                         GBytes        *diff,
+                                         GOutputStream *out,
+                                         GCancellable  *cancellable,
+                                         GError       **error)
+{
+  const guchar *diffdata = g_bytes_get_data (diff, NULL);
+  gsize diff_size = g_bytes_get_size (diff);
+  const guint32 *ops;
   guint32 n_ops;
   gsize data_offset;
   gsize data_size;
   const guchar *data;
   const guchar *old_data = g_bytes_get_data (old, NULL);
   gsize old_size = g_bytes_get_size (old);
-  g_autoptr(GByteArray) res = g_byte_array_new ();
-
-  uncompressed = flatpak_zlib_decompress_bytes (diff, error);
-  if (uncompressed == NULL)
-    {
-      g_prefix_error (error, "Invalid summary diff: ");
-      return NULL;
-    }
-
-  diffdata = g_bytes_get_data (uncompressed, NULL);
-  diff_size = g_bytes_get_size (uncompressed);
 
   if (diff_size < 8 ||
       memcmp (diffdata, FLATPAK_SUMMARY_DIFF_HEADER, 4) != 0)
-    {
-      flatpak_fail (error, "Invalid summary diff");
-      return NULL;
-    }
+    return flatpak_fail (error, "Invalid summary diff");
 
   n_ops = GUINT32_FROM_LE (*(guint32 *)(diffdata+4));
-  ops = (guint32 *)(diffdata+8);
+  ops = (const guint32 *)(diffdata+8);
 
   data_offset = 4 + 4 + 4 * n_ops;
 
   /* All ops must fit in diff, and avoid wrapping the multiply */
   if (data_offset > diff_size ||
       (data_offset - 4 - 4) / 4 != n_ops)
-    {
-      flatpak_fail (error, "Invalid summary diff");
-      return NULL;
-    }
+    return flatpak_fail (error, "Invalid summary diff");
 
   data = diffdata + data_offset;
   data_size = diff_size - data_offset;
@@ -3995,40 +4375,58 @@ flatpak_summary_apply_diff (GBytes *old,
         {
         case DIFF_OP_KIND_RESUSE_OLD:
           if (size > old_size)
-            {
-              flatpak_fail (error, "Invalid summary diff");
-              return NULL;
-            }
-          g_byte_array_append (res, old_data, size);
+            return flatpak_fail (error, "Invalid summary diff");
+          if (!g_output_stream_write_all (out, old_data, size, NULL, cancellable, error))
+            return FALSE;
           old_data += size;
           old_size -= size;
           break;
         case DIFF_OP_KIND_SKIP_OLD:
           if (size > old_size)
-            {
-              flatpak_fail (error, "Invalid summary diff");
-              return NULL;
-            }
+            return flatpak_fail (error, "Invalid summary diff");
           old_data += size;
           old_size -= size;
           break;
         case DIFF_OP_KIND_DATA:
           if (size > data_size)
-            {
-              flatpak_fail (error, "Invalid summary diff");
-              return NULL;
-            }
-          g_byte_array_append (res, data, size);
+            return flatpak_fail (error, "Invalid summary diff");
+          if (!g_output_stream_write_all (out, data, size, NULL, cancellable, error))
+            return FALSE;
           data += size;
           data_size -= size;
           break;
         default:
-          flatpak_fail (error, "Invalid summary diff");
-          return NULL;
+          return flatpak_fail (error, "Invalid summary diff");
         }
     }
 
-  return g_byte_array_free_to_bytes (g_steal_pointer (&res));
+  return TRUE;
+}
+
+GBytes *
+flatpak_summary_apply_diff (GBytes *old,
+                            GBytes *diff,
+                            GError **error)
+{
+  g_autoptr(GBytes) uncompressed = NULL;
+  g_autoptr(GOutputStream) mem = NULL;
+
+  uncompressed = flatpak_zlib_decompress_bytes (diff, error);
+  if (uncompressed == NULL)
+    {
+      g_prefix_error (error, "Invalid summary diff: ");
+      return NULL;
+    }
+
+  mem = g_memory_output_stream_new_resizable ();
+
+  if (!flatpak_summary_apply_uncompressed_diff (old, uncompressed, mem, NULL, error))
+    return NULL;
+
+  if (!g_output_stream_close (mem, NULL, error))
+    return NULL;
+
+  return g_memory_output_stream_steal_as_bytes (G_MEMORY_OUTPUT_STREAM (mem));
 }
 
 
@@ -4316,15 +4714,17 @@ add_summary_metadata (OstreeRepo   *repo,
 }
 
 static GVariant *
-generate_summary (OstreeRepo   *repo,
-                  gboolean      compat_format,
-                  GHashTable   *refs,
-                  GHashTable   *commit_data_cache,
-                  GPtrArray    *delta_names,
-                  const char   *subset,
-                  const char  **summary_arches,
-                  GCancellable *cancellable,
-                  GError      **error)
+generate_summary (OstreeRepo      *repo,
+                  gboolean         compat_format,
+                  GHashTable      *refs,
+                  GHashTable      *commit_data_cache,
+                  GPtrArray       *delta_names,
+                  GHashTable      *delta_manifest,
+                  GVariantBuilder *new_delta_manifest,
+                  const char      *subset,
+                  const char     **summary_arches,
+                  GCancellable    *cancellable,
+                  GError         **error)
 {
   g_autoptr(GVariantBuilder) metadata_builder = g_variant_builder_new (G_VARIANT_TYPE_VARDICT);
   g_autoptr(GVariantBuilder) ref_data_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{s(tts)}"));
@@ -4495,9 +4895,10 @@ generate_summary (OstreeRepo   *repo,
           if (!g_hash_table_contains (commits, to))
             continue;
 
-          digest = _ostree_repo_static_delta_superblock_digest (repo,
-                                                                (from && from[0]) ? from : NULL,
-                                                                to, cancellable, error);
+          digest = get_static_delta_digest (repo, delta_names->pdata[i],
+                                            (from && from[0]) ? from : NULL, to,
+                                            delta_manifest, new_delta_manifest,
+                                            cancellable, error);
           if (digest == NULL)
             return FALSE;
 
@@ -4813,6 +5214,9 @@ flatpak_repo_update (OstreeRepo   *repo,
   g_autoptr(GVariant) summary_index = NULL;
   g_autoptr(GVariant) old_index = NULL;
   g_autoptr(GPtrArray) delta_names = NULL;
+  g_autoptr(GHashTable) delta_manifest = NULL;
+  g_auto(GVariantBuilder) new_delta_manifest = FLATPAK_VARIANT_BUILDER_INITIALIZER;
+  g_autoptr(SizeMemo) size_memo = NULL;
   g_auto(GStrv) summary_arches = NULL;
   g_autoptr(GHashTable) refs = NULL;
   g_autoptr(GHashTable) arches = NULL;
@@ -4821,6 +5225,7 @@ flatpak_repo_update (OstreeRepo   *repo,
   g_autoptr(GHashTable) digested_summaries = NULL;
   g_autoptr(GHashTable) digested_summary_cache = NULL;
   g_autoptr(GBytes) index_sig = NULL;
+  g_autoptr(FlatpakGpgSigner) signer = NULL;
   time_t old_compat_sig_mtime;
   GKeyFile *config;
   gboolean disable_index = (flags & FLATPAK_REPO_UPDATE_FLAG_DISABLE_INDEX) != 0;
@@ -4872,7 +5277,10 @@ flatpak_repo_update (OstreeRepo   *repo,
           rev_data = g_hash_table_lookup (commit_data_cache, rev);
           if (rev_data == NULL)
             {
-              rev_data = read_commit_data (repo, ref, rev, cancellable, error);
+              if (size_memo == NULL)
+                size_memo = load_size_memo (repo);
+
+              rev_data = read_commit_data (repo, size_memo, ref, rev, cancellable, error);
               if (rev_data == NULL)
                 return FALSE;
 
@@ -4888,12 +5296,21 @@ flatpak_repo_update (OstreeRepo   *repo,
         }
     }
 
+  if (size_memo != NULL)
+    save_size_memo (repo, size_memo, cancellable);
+
+  delta_manifest = load_delta_manifest (repo);
+  g_variant_builder_init (&new_delta_manifest, G_VARIANT_TYPE (FLATPAK_DELTA_MANIFEST_FORMAT));
+
   compat_summary = generate_summary (repo, TRUE, refs, commit_data_cache, delta_names,
+                                     delta_manifest, &new_delta_manifest,
                                      "", (const char **)summary_arches,
                                      cancellable, error);
   if (compat_summary == NULL)
     return FALSE;
 
+  save_delta_manifest (repo, &new_delta_manifest, cancellable);
+
   if (!disable_index)
     {
       GLNX_HASH_TABLE_FOREACH (subsets, const char *, subset)
@@ -4909,7 +5326,7 @@ flatpak_repo_update (OstreeRepo   *repo,
               else
                 name = g_strconcat (subset, "-", arch, NULL);
 
-              g_autoptr(GVariant) arch_summary = generate_summary (repo, FALSE, refs, commit_data_cache, NULL, subset, arch_v,
+              g_autoptr(GVariant) arch_summary = generate_summary (repo, FALSE, refs, commit_data_cache, NULL, NULL, NULL, subset, arch_v,
                                                                    cancellable, error);
               if (arch_summary == NULL)
                 return FALSE;
@@ -4935,18 +5352,24 @@ flatpak_repo_update (OstreeRepo   *repo,
   if (!ostree_repo_static_delta_reindex (repo, 0, NULL, cancellable, error))
     return FALSE;
 
-  if (summary_index && gpg_key_ids)
+  /* Sign the index and the compat summary with the same keys */
+  if (gpg_key_ids)
+    {
+      signer = flatpak_gpg_signer_new (gpg_key_ids, gpg_homedir, error);
+      if (signer == NULL)
+        return FALSE;
+    }
+
+  if (summary_index && signer)
     {
       g_autoptr(GBytes) index_bytes = g_variant_get_data_as_bytes (summary_index);
+      g_autoptr(GVariant) index_sig_v = NULL;
 
-      if (!ostree_repo_gpg_sign_data (repo, index_bytes,
-                                      NULL,
-                                      gpg_key_ids,
-                                      gpg_homedir,
-                                      &index_sig,
-                                      cancellable,
-                                      error))
+      index_sig_v = flatpak_gpg_signer_sign_data (signer, index_bytes, NULL, error);
+      if (index_sig_v == NULL)
         return FALSE;
+
+      index_sig = g_variant_get_data_as_bytes (index_sig_v);
     }
 
   if (summary_index)
@@ -4964,15 +5387,28 @@ flatpak_repo_update (OstreeRepo   *repo,
   if (!flatpak_repo_save_compat_summary (repo, compat_summary, &old_compat_sig_mtime, cancellable, error))
     return FALSE;
 
-  if (gpg_key_ids)
+  if (signer)
     {
-      if (!ostree_repo_add_gpg_signature_summary (repo,
-                                                  gpg_key_ids,
-                                                  gpg_homedir,
-                                                  cancellable,
-                                                  error))
+      g_autoptr(GBytes) summary_bytes = g_variant_get_data_as_bytes (compat_summary);
+      g_autoptr(GVariant) summary_sig = NULL;
+      GLnxFileReplaceFlags replace_flags;
+
+      summary_sig = flatpak_gpg_signer_sign_data (signer, summary_bytes, NULL, error);
+      if (summary_sig == NULL)
         return FALSE;
 
+      replace_flags = GLNX_FILE_REPLACE_INCREASING_MTIME;
+      if (ostree_repo_get_disable_fsync (repo))
+        replace_flags |= GLNX_FILE_REPLACE_NODATASYNC;
+      else
+        replace_flags |= GLNX_FILE_REPLACE_DATASYNC_NEW;
+
+      if (!glnx_file_replace_contents_at (ostree_repo_get_dfd (repo), "summary.sig",
+                                          g_variant_get_data (summary_sig),
+                                          g_variant_get_size (summary_sig),
+                                          replace_flags,
+                                          cancellable, error))
+        return FALSE;
 
       if (old_compat_sig_mtime != 0)
         {
@@ -5481,8 +5917,8 @@ flatpak_appstream_xml_root_to_data (FlatpakXml *appstream_root,
 
 void
 flatpak_appstream_xml_filter (FlatpakXml *appstream,
-                              GRegex *allow_refs,
-                              GRegex *deny_refs)
+                              FlatpakRefMatcher *allow_refs,
+                              FlatpakRefMatcher *deny_refs)
 {
   FlatpakXml *components;
   FlatpakXml *component;
@@ -5568,8 +6004,7 @@ flatpak_repo_list_flatpak_refs (OstreeRepo   *repo,
 
 static gboolean
 _flatpak_repo_generate_appstream (OstreeRepo   *repo,
-                                  const char  **gpg_key_ids,
-                                  const char   *gpg_homedir,
+                                  FlatpakGpgSigner *signer,
                                   FlatpakDecomposed **all_refs_keys,
                                   guint         n_keys,
                                   GHashTable   *all_commits,
@@ -5782,21 +6217,9 @@ _flatpak_repo_generate_appstream (OstreeRepo   *repo,
                 return FALSE;
             }
 
-          if (gpg_key_ids)
-            {
-              for (int j = 0; gpg_key_ids[j] != NULL; j++)
-                {
-                  const char *keyid = gpg_key_ids[j];
-
-                  if (!ostree_repo_sign_commit (repo,
-                                                commit_checksum,
-                                                keyid,
-                                                gpg_homedir,
-                                                cancellable,
-                                                error))
-                    return FALSE;
-                }
-            }
+          if (signer != NULL &&
+              !flatpak_gpg_signer_sign_commit (signer, repo, commit_checksum, cancellable, error))
+            return FALSE;
 
           g_debug ("Creating appstream branch %s", branch);
           if (collection_id != NULL)
@@ -5830,8 +6253,16 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
   g_autoptr(GPtrArray) arches = NULL;  /* (element-type utf8 utf8) */
   g_autoptr(GPtrArray) subsets = NULL;  /* (element-type utf8 utf8) */
   g_autoptr(FlatpakRepoTransaction) transaction = NULL;
+  g_autoptr(FlatpakGpgSigner) signer = NULL;
   OstreeRepoTransactionStats stats;
 
+  if (gpg_key_ids)
+    {
+      signer = flatpak_gpg_signer_new (gpg_key_ids, gpg_homedir, error);
+      if (signer == NULL)
+        return FALSE;
+    }
+
   arches = g_ptr_array_new_with_free_func (g_free);
   subsets = g_ptr_array_new_with_free_func (g_free);
 
@@ -5909,8 +6340,7 @@ flatpak_repo_generate_appstream (OstreeRepo   *repo,
           const char *arch = g_ptr_array_index (arches, k);
 
           if (!_flatpak_repo_generate_appstream (repo,
-                                                 gpg_key_ids,
-                                                 gpg_homedir,
+                                                 signer,
                                                  all_refs_keys,
                                                  n_keys,
                                                  all_commits,
@@ -6611,48 +7041,65 @@ flatpak_bundle_load (GFile              *file,
   guint8 endianness_char;
   gboolean byte_swap = FALSE;
 
-  GMappedFile *mfile = g_mapped_file_new (flatpak_file_get_path_cached (file), FALSE, error);
+  /* Only the header of streaming bundles is read */
+  if (flatpak_is_streaming_bundle (file))
+    {
+      g_autoptr(GVariant) header = flatpak_streaming_bundle_load_header (file, error);
 
-  if (mfile == NULL)
-    return NULL;
+      if (header == NULL)
+        return NULL;
 
-  bytes = g_mapped_file_get_bytes (mfile);
-  g_mapped_file_unref (mfile);
+      to_csum_v = g_variant_get_child_value (header, 1);
+      metadata = g_variant_get_child_value (header, 0);
+
+      if (installed_size)
+        *installed_size = flatpak_streaming_bundle_get_installed_size (header);
+    }
+  else
+    {
+      GMappedFile *mfile = g_mapped_file_new (flatpak_file_get_path_cached (file), FALSE, error);
 
-  delta = g_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT), bytes, FALSE);
-  g_variant_ref_sink (delta);
+      if (mfile == NULL)
+        return NULL;
 
-  to_csum_v = g_variant_get_child_value (delta, 3);
-  if (!ostree_validate_structureof_csum_v (to_csum_v, error))
-    return NULL;
+      bytes = g_mapped_file_get_bytes (mfile);
+      g_mapped_file_unref (mfile);
 
-  metadata = g_variant_get_child_value (delta, 0);
+      delta = g_variant_new_from_bytes (G_VARIANT_TYPE (OSTREE_STATIC_DELTA_SUPERBLOCK_FORMAT), bytes, FALSE);
+      g_variant_ref_sink (delta);
 
-  if (g_variant_lookup (metadata, "ostree.endianness", "y", &endianness_char))
-    {
-      int file_byte_order = G_BYTE_ORDER;
-      switch (endianness_char)
+      to_csum_v = g_variant_get_child_value (delta, 3);
+      if (!ostree_validate_structureof_csum_v (to_csum_v, error))
+        return NULL;
+
+      metadata = g_variant_get_child_value (delta, 0);
+
+      if (g_variant_lookup (metadata, "ostree.endianness", "y", &endianness_char))
         {
-        case 'l':
-          file_byte_order = G_LITTLE_ENDIAN;
-          break;
+          int file_byte_order = G_BYTE_ORDER;
+          switch (endianness_char)
+            {
+            case 'l':
+              file_byte_order = G_LITTLE_ENDIAN;
+              break;
 
-        case 'B':
-          file_byte_order = G_BIG_ENDIAN;
-          break;
+            case 'B':
+              file_byte_order = G_BIG_ENDIAN;
+              break;
 
-        default:
-          break;
+            default:
+              break;
+            }
+          byte_swap = (G_BYTE_ORDER != file_byte_order);
         }
-      byte_swap = (G_BYTE_ORDER != file_byte_order);
+
+      if (installed_size)
+        *installed_size = flatpak_bundle_get_installed_size (delta, byte_swap);
     }
 
   if (commit)
     *commit = ostree_checksum_from_bytes_v (to_csum_v);
 
-  if (installed_size)
-    *installed_size = flatpak_bundle_get_installed_size (delta, byte_swap);
-
   if (ref != NULL)
     {
       FlatpakDecomposed *the_ref = NULL;
@@ -6770,11 +7217,16 @@ flatpak_pull_from_bundle (OstreeRepo   *repo,
   /* Don’t need to set the collection ID here, since the remote binds this ref to the collection. */
   ostree_repo_transaction_set_ref (repo, remote, ref, to_checksum);
 
-  if (!ostree_repo_static_delta_execute_offline (repo,
-                                                 file,
-                                                 FALSE,
-                                                 cancellable,
-                                                 error))
+  if (flatpak_is_streaming_bundle (file))
+    {
+      if (!flatpak_streaming_bundle_import (repo, file, cancellable, error))
+        return FALSE;
+    }
+  else if (!ostree_repo_static_delta_execute_offline (repo,
+                                                      file,
+                                                      FALSE,
+                                                      cancellable,
+                                                      error))
     return FALSE;
 
   gpg_result = ostree_repo_verify_commit_ext (repo, to_checksum,
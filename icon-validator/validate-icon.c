@@ -31,10 +31,13 @@
 
 #define ICON_VALIDATOR_GROUP "Icon Validator"
 
-static int
-validate_icon (const char *arg_width,
-               const char *arg_height,
-               const char *filename)
+static gboolean
+check_icon (const char *arg_width,
+            const char *arg_height,
+            const char *filename,
+            GKeyFile   *key_file,
+            const char *group,
+            GError    **error)
 {
   GdkPixbufFormat *format;
   int max_width, max_height;
@@ -42,22 +45,20 @@ validate_icon (const char *arg_width,
   const char *name;
   const char *allowed_formats[] = { "png", "jpeg", "svg", NULL };
   g_autoptr(GdkPixbuf) pixbuf = NULL;
-  g_autoptr(GError) error = NULL;
-  g_autoptr(GKeyFile) key_file = NULL;
-  g_autofree char *key_file_data = NULL;
+  g_autoptr(GError) local_error = NULL;
 
   format = gdk_pixbuf_get_file_info (filename, &width, &height);
   if (format == NULL)
     {
-      g_printerr ("Format not recognized\n");
-      return 1;
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Format not recognized");
+      return FALSE;
     }
 
   name = gdk_pixbuf_format_get_name (format);
   if (!g_strv_contains (allowed_formats, name))
     {
-      g_printerr ("Format %s not accepted\n", name);
-      return 1;
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Format %s not accepted", name);
+      return FALSE;
     }
 
   if (!g_str_equal (name, "svg"))
@@ -65,15 +66,15 @@ validate_icon (const char *arg_width,
       max_width = g_ascii_strtoll (arg_width, NULL, 10);
       if (max_width < 16 || max_width > 4096)
         {
-          g_printerr ("Bad width limit: %s\n", arg_width);
-          return 1;
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Bad width limit: %s", arg_width);
+          return FALSE;
         }
 
       max_height = g_ascii_strtoll (arg_height, NULL, 10);
       if (max_height < 16 || max_height > 4096)
         {
-          g_printerr ("Bad height limit: %s\n", arg_height);
-          return 1;
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Bad height limit: %s", arg_height);
+          return FALSE;
         }
     }
   else
@@ -84,20 +85,43 @@ validate_icon (const char *arg_width,
 
   if (width > max_width || height > max_height)
     {
-      g_printerr ("Image too large (%dx%d). Max. size %dx%d\n", width, height, max_width, max_height);
-      return 1;
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Image too large (%dx%d). Max. size %dx%d", width, height, max_width, max_height);
+      return FALSE;
     }
 
-  pixbuf = gdk_pixbuf_new_from_file (filename, &error);
+  pixbuf = gdk_pixbuf_new_from_file (filename, &local_error);
   if (pixbuf == NULL)
     {
-      g_printerr ("Failed to load image: %s\n", error->message);
-      return 1;
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to load image: %s", local_error->message);
+      return FALSE;
     }
 
   if (width != height)
     {
-      g_printerr ("Expected a square icon but got: %dx%d\n", width, height);
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Expected a square icon but got: %dx%d", width, height);
+      return FALSE;
+    }
+
+  g_key_file_set_string (key_file, group, "format", name);
+  g_key_file_set_integer (key_file, group, "width", width);
+
+  return TRUE;
+}
+
+static int
+validate_icon (const char *arg_width,
+               const char *arg_height,
+               const char *filename)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GKeyFile) key_file = NULL;
+  g_autofree char *key_file_data = NULL;
+
+  key_file = g_key_file_new ();
+  if (!check_icon (arg_width, arg_height, filename, key_file, ICON_VALIDATOR_GROUP, &error))
+    {
+      g_printerr ("%s\n", error->message);
       return 1;
     }
 
@@ -106,15 +130,46 @@ validate_icon (const char *arg_width,
    * GKeyFile so the output can be easily extended in the future in a backwards
    * compatible way.
    */
-  key_file = g_key_file_new ();
-  g_key_file_set_string (key_file, ICON_VALIDATOR_GROUP, "format", name);
-  g_key_file_set_integer (key_file, ICON_VALIDATOR_GROUP, "width", width);
   key_file_data = g_key_file_to_data (key_file, NULL, NULL);
   g_print ("%s", key_file_data);
 
   return 0;
 }
 
+/* Validates all the files in one go, which avoids spawning a process (and
+ * sandbox) per icon. The result for the Nth file is printed in the group
+ * "Icon Validator N", which either has the same keys as the single-file
+ * output, or an "error" key. Returns 1 if any of the icons is invalid. */
+static int
+validate_icons (const char  *arg_width,
+                const char  *arg_height,
+                char       **filenames)
+{
+  g_autoptr(GKeyFile) key_file = NULL;
+  g_autofree char *key_file_data = NULL;
+  int res = 0;
+  int i;
+
+  key_file = g_key_file_new ();
+
+  for (i = 0; filenames[i] != NULL; i++)
+    {
+      g_autoptr(GError) error = NULL;
+      g_autofree char *group = g_strdup_printf ("%s %d", ICON_VALIDATOR_GROUP, i);
+
+      if (!check_icon (arg_width, arg_height, filenames[i], key_file, group, &error))
+        {
+          g_key_file_set_string (key_file, group, "error", error->message);
+          res = 1;
+        }
+    }
+
+  key_file_data = g_key_file_to_data (key_file, NULL, NULL);
+  g_print ("%s", key_file_data);
+
+  return res;
+}
+
 G_GNUC_NULL_TERMINATED
 static void
 add_args (GPtrArray *argv_array, ...)
@@ -159,9 +214,10 @@ path_is_usrmerged (const char *dir)
 }
 
 static int
-rerun_in_sandbox (const char *arg_width,
+rerun_in_sandbox (gboolean    batch,
+                  const char *arg_width,
                   const char *arg_height,
-                  const char *filename)
+                  char      **filenames)
 {
   const char * const usrmerged_dirs[] = { "bin", "lib32", "lib64", "lib", "sbin" };
   int i;
@@ -220,15 +276,22 @@ rerun_in_sandbox (const char *arg_width,
             "--setenv", "GIO_USE_VFS", "local",
             "--unsetenv", "TMPDIR",
             "--die-with-parent",
-            "--ro-bind", filename, filename,
             NULL);
 
+  for (i = 0; filenames[i] != NULL; i++)
+    add_args (args, "--ro-bind", filenames[i], filenames[i], NULL);
+
   if (g_getenv ("G_MESSAGES_DEBUG"))
     add_args (args, "--setenv", "G_MESSAGES_DEBUG", g_getenv ("G_MESSAGES_DEBUG"), NULL);
   if (g_getenv ("G_MESSAGES_PREFIXED"))
     add_args (args, "--setenv", "G_MESSAGES_PREFIXED", g_getenv ("G_MESSAGES_PREFIXED"), NULL);
 
-  add_args (args, validate_icon, arg_width, arg_height, filename, NULL);
+  add_args (args, validate_icon, NULL);
+  if (batch)
+    add_args (args, "--batch", NULL);
+  add_args (args, arg_width, arg_height, NULL);
+  for (i = 0; filenames[i] != NULL; i++)
+    add_args (args, filenames[i], NULL);
   g_ptr_array_add (args, NULL);
 
   {
@@ -243,9 +306,11 @@ rerun_in_sandbox (const char *arg_width,
 }
 
 static gboolean opt_sandbox;
+static gboolean opt_batch;
 
 static GOptionEntry entries[] = {
   { "sandbox", 0, 0, G_OPTION_ARG_NONE, &opt_sandbox, "Run in a sandbox", NULL },
+  { "batch", 0, 0, G_OPTION_ARG_NONE, &opt_batch, "Validate multiple icons", NULL },
   { NULL }
 };
 
@@ -254,8 +319,10 @@ main (int argc, char *argv[])
 {
   GOptionContext *context;
   GError *error = NULL;
+  g_autoptr(GPtrArray) filenames = NULL;
+  int i;
 
-  context = g_option_context_new ("WIDTH HEIGHT PATH");
+  context = g_option_context_new ("WIDTH HEIGHT PATH…");
   g_option_context_add_main_entries (context, entries, NULL);
   if (!g_option_context_parse (context, &argc, &argv, &error))
     {
@@ -263,14 +330,22 @@ main (int argc, char *argv[])
       return 1;
     }
 
-  if (argc != 4)
+  if (opt_batch ? argc < 4 : argc != 4)
     {
       g_printerr ("Usage: %s [OPTION…] WIDTH HEIGHT PATH\n", argv[0]);
+      g_printerr ("       %s [OPTION…] --batch WIDTH HEIGHT PATH…\n", argv[0]);
       return 1;
     }
 
+  filenames = g_ptr_array_new ();
+  for (i = 3; i < argc; i++)
+    g_ptr_array_add (filenames, argv[i]);
+  g_ptr_array_add (filenames, NULL);
+
   if (opt_sandbox)
-    return rerun_in_sandbox (argv[1], argv[2], argv[3]);
+    return rerun_in_sandbox (opt_batch, argv[1], argv[2], (char **) filenames->pdata);
+  else if (opt_batch)
+    return validate_icons (argv[1], argv[2], (char **) filenames->pdata);
   else
     return validate_icon (argv[1], argv[2], argv[3]);
 }
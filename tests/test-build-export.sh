@@ -0,0 +1,129 @@
+#!/bin/bash
+#
+# Copyright (C) 2022 Red Hat, Inc
+#
+# SPDX-License-Identifier: LGPL-2.0-or-later
+
+set -euo pipefail
+
+. $(dirname $0)/libtest.sh
+
+echo "1..5"
+
+APP_REF=app/org.test.Export/$ARCH/master
+
+mkdir -p build/files/bin build/files/share/data
+cat > build/metadata <<EOF
+[Application]
+name=org.test.Export
+runtime=org.test.Platform/$ARCH/master
+sdk=org.test.Platform/$ARCH/master
+EOF
+cat > build/files/bin/hello.sh <<EOF
+#!/bin/sh
+echo "Hello world, from a sandbox"
+EOF
+chmod a+x build/files/bin/hello.sh
+# Enough files to keep several writer threads busy
+for i in $(seq 1 50); do
+    echo "content $i" > build/files/share/data/file-$i
+done
+ln -s file-1 build/files/share/data/link-1
+
+${FLATPAK} build-finish --command=hello.sh build
+
+${FLATPAK} build-export --no-update-summary --disable-sandbox repos/export build master
+assert_has_file build/.export-cache
+
+# Everything is committed as it is in the build directory
+ostree --repo=repos/export checkout -U ${APP_REF} checkout
+diff -r build/files checkout/files
+ostree --repo=repos/export ls -R -C ${APP_REF} > ls-1
+
+# Unchanged files are taken from the cache and give the same tree
+${FLATPAK} -v build-export --no-update-summary --disable-sandbox repos/export build master 2> export-log
+assert_file_has_content export-log "Using cached checksum for /bin/hello\.sh"
+assert_file_has_content export-log "Using cached checksum for /share/data/file-50"
+ostree --repo=repos/export ls -R -C ${APP_REF} > ls-2
+diff ls-1 ls-2
+
+ok "build-export reuses the export cache"
+
+# Same size and mtime, but different contents, so only the ctime tells
+cp -p build/files/share/data/file-1 mtime-ref
+echo "CHANGED 1" > build/files/share/data/file-1
+touch -r mtime-ref build/files/share/data/file-1
+# Only the mode changes
+chmod a+x build/files/share/data/file-2
+# Only the ctime changes
+chmod a-x build/files/share/data/file-3
+
+${FLATPAK} -v build-export --no-update-summary --disable-sandbox repos/export build master 2> export-log
+assert_not_file_has_content export-log "Using cached checksum for /share/data/file-1$"
+assert_not_file_has_content export-log "Using cached checksum for /share/data/file-2$"
+assert_not_file_has_content export-log "Using cached checksum for /share/data/file-3$"
+assert_file_has_content export-log "Using cached checksum for /share/data/file-4$"
+
+rm -rf checkout
+ostree --repo=repos/export checkout -U ${APP_REF} checkout
+diff -r build/files checkout/files
+ostree --repo=repos/export ls -R -C ${APP_REF} > ls-3
+assert_file_has_content ls-3 "^-00755 .* /files/share/data/file-2$"
+assert_not_file_has_content ls-3 "^-00755 .* /files/share/data/file-3$"
+
+ok "build-export re-reads changed files"
+
+cp build/.export-cache export-cache-before
+echo "CHANGED 4" > build/files/share/data/file-4
+
+${FLATPAK} -v build-export --no-update-summary --disable-sandbox --no-export-cache repos/export build master 2> export-log
+assert_not_file_has_content export-log "Using cached checksum"
+cmp export-cache-before build/.export-cache
+
+rm -rf checkout
+ostree --repo=repos/export checkout -U ${APP_REF} checkout
+diff -r build/files checkout/files
+
+ok "build-export --no-export-cache"
+
+mkdir -p icon-build/files/bin
+cp build/metadata icon-build/metadata
+cp build/files/bin/hello.sh icon-build/files/bin/
+for size in 16 32 64 128; do
+    mkdir -p icon-build/files/share/icons/hicolor/${size}x${size}/apps
+    cp $(dirname $0)/org.test.Hello.png icon-build/files/share/icons/hicolor/${size}x${size}/apps/org.test.Export.png
+done
+mkdir -p icon-build/files/share/icons/hicolor/48x48/apps
+echo "not an image" > icon-build/files/share/icons/hicolor/48x48/apps/org.test.Export.Broken.png
+
+${FLATPAK} build-finish --command=hello.sh icon-build
+
+# The icons are validated in one batch, the error must still name the broken one
+if ${FLATPAK} build-export --no-update-summary --disable-sandbox repos/export icon-build master 2> export-error-log; then
+    assert_not_reached "build-export should fail with an invalid icon"
+fi
+assert_file_has_content export-error-log "48x48/apps/org\.test\.Export\.Broken\.png is not a valid icon"
+assert_not_file_has_content export-error-log "x[0-9]*/apps/org\.test\.Export\.png is not a valid icon"
+
+rm icon-build/files/share/icons/hicolor/48x48/apps/org.test.Export.Broken.png
+rm icon-build/export/share/icons/hicolor/48x48/apps/org.test.Export.Broken.png
+${FLATPAK} build-export --no-update-summary --disable-sandbox repos/export icon-build master
+ostree --repo=repos/export ls -R ${APP_REF} > ls-icons
+assert_file_has_content ls-icons "/export/share/icons/hicolor/128x128/apps/org\.test\.Export\.png$"
+
+ok "build-export validates all icons"
+
+if [ "$(id -u)" = 0 ]; then
+    echo "ok # SKIP Cannot make a file unreadable as root"
+else
+    # A failure on one of the writer threads must name the file
+    echo "secret" > build/files/share/data/unreadable
+    chmod 000 build/files/share/data/unreadable
+    if ${FLATPAK} build-export --no-update-summary --disable-sandbox repos/export build master 2> export-error-log; then
+        assert_not_reached "build-export should fail with an unreadable file"
+    fi
+    assert_file_has_content export-error-log "Writing share/data/unreadable: "
+    rm -f build/files/share/data/unreadable
+
+    ok "build-export reports write errors"
+fi
@@ -23,7 +23,7 @@ set -euo pipefail
 
 skip_without_bwrap
 
-echo "1..8"
+echo "1..9"
 
 mkdir bundles
 
@@ -170,3 +170,24 @@ run org.test.Hello > hello_out
 assert_file_has_content hello_out '^Hello world, from a sandboxUPDATED2$'
 
 ok "update as bundle"
+
+make_updated_app test org.test.Collection.test master UPDATED3
+
+if ${FLATPAK} build-bundle --zstd repos/test --repo-url=file://`pwd`/repos/test --gpg-keys=${FL_GPG_HOMEDIR}/pubring.gpg bundles/hello3.flatpak org.test.Hello 2> zstd-error; then
+    assert_has_file bundles/hello3.flatpak
+
+    ostree init --repo=repos/zstd-import --mode=archive-z2
+    ${FLATPAK} build-import-bundle repos/zstd-import bundles/hello3.flatpak > import_out
+    BUNDLE_COMMIT=`ostree rev-parse --repo=repos/test app/org.test.Hello/$ARCH/master`
+    assert_file_has_content import_out "$BUNDLE_COMMIT"
+
+    ${FLATPAK} install ${U} -y --bundle bundles/hello3.flatpak
+
+    run org.test.Hello > hello_out
+    assert_file_has_content hello_out '^Hello world, from a sandboxUPDATED3$'
+
+    ok "update as zstd bundle"
+else
+    assert_file_has_content zstd-error "libzstd"
+    ok "update as zstd bundle # skip not built with libzstd"
+fi
@@ -24,7 +24,7 @@ if [ -z "$messages" ]; then
     skip "Cannot read back from Journal with journalctl"
 fi
 
-echo "1..1"
+echo "1..2"
 
 mkdir -p ${TEST_DATA_DIR}/system-history-installation
 mkdir -p ${FLATPAK_CONFIG_DIR}/installations.d
@@ -40,6 +40,10 @@ ${FLATPAK} --installation=history-installation remote-add \
     --gpg-import=${FL_GPG_HOMEDIR}/pubring.gpg test-repo "http://127.0.0.1:${port}/test"
 ${FLATPAK} --installation=history-installation install -y test-repo org.test.Hello master
 
+# everything after this is also in the installation's indexed history store,
+# the fraction of a second orders it exactly between the install and the update
+HISTORY_STORE_TIME=$(date +"%Y-%m-%d %H:%M:%S.%N")
+
 # appstream update shouldn't show up in history
 ${FLATPAK} ${U} --appstream update test-repo
 
@@ -66,7 +70,25 @@ uninstall	org.test.Hello.Locale	master	system (history-installation)
 remove remote			system (history-installation)	test-repo
 EOF
 
+ok "history looks correct"
+
+assert_has_file ${TEST_DATA_DIR}/system-history-installation/history/index
+assert_has_file ${TEST_DATA_DIR}/system-history-installation/history/log
+
+# the store covers this range, so this doesn't need the journal
+${FLATPAK} --installation=history-installation history --since="${HISTORY_STORE_TIME}" \
+    --columns=change,application,branch,installation,remote > history-log 2>&1
+
+diff history-log - << EOF
+deploy update	org.test.Hello.Locale	master	system (history-installation)	test-repo
+deploy update	org.test.Hello	master	system (history-installation)	test-repo
+uninstall	org.test.Hello	master	system (history-installation)
+uninstall	org.test.Platform	master	system (history-installation)
+uninstall	org.test.Hello.Locale	master	system (history-installation)
+remove remote			system (history-installation)	test-repo
+EOF
+
 rm -f ${FLATPAK_CONFIG_DIR}/installations.d/history-inst.conf
 rm -rf ${TEST_DATA_DIR}/system-history-installation
 
-ok "history looks correct"
+ok "history store looks correct"
@@ -24,7 +24,7 @@ set -euo pipefail
 skip_without_bwrap
 skip_revokefs_without_fuse
 
-echo "1..43"
+echo "1..45"
 
 #Regular repo
 setup_repo
@@ -543,6 +543,47 @@ assert_has_file $FL_DIR/repo/refs/remotes/test-repo/app/org.test.Hello/$ARCH/mas
 
 ok "mirror ref deletion on update"
 
+make_updated_app test org.test.Collection.test master UPDATE3
+${FLATPAK} ${U} update --check > check-log
+assert_file_has_content check-log "org\.test\.Hello"
+assert_not_file_has_content check-log "prefetched"
+# Pretend to be on battery power, which must skip the prefetch
+mkdir -p power-supply/AC
+echo Mains > power-supply/AC/type
+echo 0 > power-supply/AC/online
+FLATPAK_POWER_SUPPLY_DIR=$(pwd)/power-supply ${FLATPAK} ${U} update --prefetch > prefetch-log
+assert_file_has_content prefetch-log "Not prefetching updates"
+assert_not_file_has_content prefetch-log "Prefetched"
+${FLATPAK} ${U} update --prefetch --force-prefetch > prefetch-log
+assert_file_has_content prefetch-log "Prefetched app/org\.test\.Hello/"
+assert_file_has_content prefetch-log "Prefetched runtime/org\.test\.Hello\.Locale/"
+${FLATPAK} ${U} update --check > check-log
+assert_file_has_content check-log "prefetched"
+# The locale extension is only pulled partially, but it is still prefetched
+if grep "org\.test\.Hello" check-log | grep -v prefetched; then
+    assert_not_reached "Not all of org.test.Hello's updates are prefetched"
+fi
+${FLATPAK} ${U} update -y org.test.Hello
+${FLATPAK} ${U} update --check > check-log
+assert_file_has_content check-log "No updates available"
+
+ok "update --check and --prefetch"
+
+# Origins that are disabled or can't be fetched are skipped, not fatal
+make_updated_app test org.test.Collection.test master UPDATE4
+${FLATPAK} ${U} remote-modify --disable test-repo
+${FLATPAK} ${U} update --check > check-log
+assert_file_has_content check-log "No updates available"
+${FLATPAK} ${U} update --prefetch --force-prefetch > prefetch-log
+assert_not_file_has_content prefetch-log "Prefetched"
+${FLATPAK} ${U} remote-modify --enable test-repo
+${FLATPAK} ${U} remote-modify --url="http://127.0.0.1:1/test" test-repo
+${FLATPAK} ${U} update --check > check-log
+${FLATPAK} ${U} remote-modify --url="http://127.0.0.1:${port}/test" test-repo
+${FLATPAK} ${U} update -y org.test.Hello
+
+ok "update --check with disabled and unreachable remotes"
+
 ${FLATPAK} ${U} list --arch=$ARCH --columns=ref > list-log
 assert_file_has_content list-log "org\.test\.Hello/"
 assert_file_has_content list-log "org\.test\.Platform/"
@@ -24,7 +24,7 @@ set -euo pipefail
 skip_without_bwrap
 skip_revokefs_without_fuse
 
-echo "1..20"
+echo "1..21"
 
 # Use stable rather than master as the branch so we can test that the run
 # command automatically finds the branch correctly
@@ -53,12 +53,17 @@ assert_file_has_content $FL_DIR/exports/share/gnome-shell/search-providers/org.t
 assert_has_file $FL_DIR/exports/share/icons/hicolor/64x64/apps/org.test.Hello.png
 assert_not_has_file $FL_DIR/exports/share/icons/hicolor/64x64/apps/dont-export.png
 assert_has_file $FL_DIR/exports/share/icons/HighContrast/64x64/apps/org.test.Hello.png
+# The exported symlinks are recorded so later updates only need to check those
+assert_has_file $FL_DIR/exports/.manifests/org.test.Hello
+assert_file_has_content $FL_DIR/exports/.manifests/org.test.Hello "share/applications/org\.test\.Hello\.desktop"
 
 # Ensure triggers ran
 assert_has_file $FL_DIR/exports/share/applications/mimeinfo.cache
 assert_file_has_content $FL_DIR/exports/share/applications/mimeinfo.cache x-test/Hello
 assert_has_file $FL_DIR/exports/share/icons/hicolor/icon-theme.cache
 assert_has_file $FL_DIR/exports/share/icons/hicolor/index.theme
+assert_has_file $FL_DIR/exports/.triggers/desktop-database.trigger
+assert_has_file $FL_DIR/exports/.triggers/gtk-icon-cache.trigger
 
 $FLATPAK list ${U} | grep org.test.Hello > /dev/null
 $FLATPAK list ${U} -d | grep org.test.Hello | grep test-repo > /dev/null
@@ -346,6 +351,31 @@ assert_not_streq "$OLD_COMMIT" "$NEW_COMMIT"
 
 ok "install --or-update"
 
+# An update that drops the exports removes their links
+BUILD_FINISH_ARGS=--no-exports make_updated_app "" "" stable UPDATED3
+${FLATPAK} ${U} update -y org.test.Hello
+assert_not_has_file $FL_DIR/exports/share/applications/org.test.Hello.desktop
+assert_not_has_file $FL_DIR/exports/share/gnome-shell/search-providers/org.test.Hello.search-provider.ini
+assert_not_has_file $FL_DIR/exports/share/icons/hicolor/64x64/apps/org.test.Hello.png
+assert_not_has_file $FL_DIR/exports/share/icons/HighContrast/64x64/apps/org.test.Hello.png
+assert_not_file_has_content $FL_DIR/exports/.manifests/org.test.Hello "org\.test\.Hello"
+
+make_updated_app "" "" stable UPDATED4
+${FLATPAK} ${U} update -y org.test.Hello
+assert_has_file $FL_DIR/exports/share/applications/org.test.Hello.desktop
+assert_has_file $FL_DIR/exports/share/icons/HighContrast/64x64/apps/org.test.Hello.png
+
+# And so does an uninstall
+${FLATPAK} ${U} uninstall -y org.test.Hello
+assert_not_has_file $FL_DIR/exports/share/applications/org.test.Hello.desktop
+assert_not_has_file $FL_DIR/exports/share/icons/hicolor/64x64/apps/org.test.Hello.png
+assert_not_has_file $FL_DIR/exports/share/icons/HighContrast/64x64/apps/org.test.Hello.png
+assert_not_has_file $FL_DIR/exports/.manifests/org.test.Hello
+
+${FLATPAK} ${U} install -y test-repo org.test.Hello stable
+
+ok "stale exports are removed"
+
 DIR=`mktemp -d`
 ${FLATPAK} build-init ${DIR} org.test.Split org.test.Platform org.test.Platform stable
 
@@ -363,8 +393,14 @@ ${FLATPAK} build-finish --command=hello.sh ${DIR}
 ${FLATPAK} build-export --no-update-summary ${FL_GPGARGS} repos/test ${DIR} stable
 update_repo
 
+# The exports of other apps don't change with this install, but a removed
+# trigger output must still be regenerated
+rm $FL_DIR/exports/share/applications/mimeinfo.cache
+
 ${FLATPAK} ${U} install -y test-repo org.test.Split --subpath=/a --subpath=/b --subpath=/nosuchdir stable
 
+assert_file_has_content $FL_DIR/exports/share/applications/mimeinfo.cache x-test/Hello
+
 COMMIT=`${FLATPAK} ${U} info --show-commit org.test.Split`
 if [ x${USE_SYSTEMDIR-} != xyes ] ; then
     # Work around bug in ostree: local pulls don't do commitpartials
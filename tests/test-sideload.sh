@@ -27,7 +27,7 @@ USE_COLLECTIONS_IN_CLIENT=yes
 skip_without_bwrap
 skip_revokefs_without_fuse
 
-echo "1..9"
+echo "1..10"
 
 #Regular repo
 setup_repo
@@ -208,3 +208,19 @@ assert_file_has_content ${FL_DIR}/repo/config '^gpg-verify-summary=true$'
 assert_not_file_has_content ${FL_DIR}/repo/config '^gpg-verify-summary=false$'
 
 ok "migrate to gpg-verify-summary"
+
+# The old commit got pruned from the local repo by the update, so bring it back
+ostree --repo=${FL_DIR}/repo pull-local repos/test ${OLD_COMMIT}
+
+${FLATPAK} ${U} create-usb --destination-repo=repo3 --delta-from=${OLD_COMMIT} usb_dir org.test.Hello
+
+ostree --repo=usb_dir/repo3 static-delta list > deltas-list
+assert_file_has_content deltas-list "^${OLD_COMMIT}-${NEW_COMMIT}\$"
+
+# The from commit is only needed to generate the delta, not on the media
+if ostree --repo=usb_dir/repo3 show ${OLD_COMMIT} &> /dev/null; then
+    assert_not_reached "The --delta-from commit should not be copied"
+fi
+assert_not_has_file usb_dir/repo3/tmp/delta-*
+
+ok "create-usb --delta-from"
@@ -21,7 +21,7 @@ set -euo pipefail
 
 . $(dirname $0)/libtest.sh
 
-echo "1..2"
+echo "1..4"
 
 setup_repo
 
@@ -261,3 +261,51 @@ assert_not_file_has_content httpd-log summaries/${ACTIVE_SUBSET}.gz
 assert_not_file_has_content httpd-log summaries/${OLD_ACTIVE_SUBSET}-${ACTIVE_SUBSET}.delta
 
 ok subsummary fetching and caching
+
+# Same delta update, but in low-memory mode
+$FLATPAK $U config --set summary-low-memory true
+
+$FLATPAK build-commit-from ${GPGARGS} --src-ref=app/org.app.App1/$ARCH/master repos/test app/org.app.App1.LOWMEM/$ARCH/master
+
+OLD_ACTIVE_SUBSET=$ACTIVE_SUBSET
+ACTIVE_SUBSET=$(active_subset repos/test)
+assert_not_streq "$OLD_ACTIVE_SUBSET" "$ACTIVE_SUBSET"
+
+sleep 1 # Ensure mtime differs for cached summary files (so they are removed)
+httpd_clear_log
+$FLATPAK $U remote-ls test-repo > remote-ls-log
+
+assert_file_has_content remote-ls-log org.app.App1.LOWMEM
+assert_has_file $FL_CACHE_DIR/summaries/test-repo-${ARCH}-${ACTIVE_SUBSET}.sub
+assert_not_has_file $FL_CACHE_DIR/summaries/test-repo-${ARCH}-${OLD_ACTIVE_SUBSET}.sub
+# We should have used the delta, and gotten the same summary as the remote
+assert_not_file_has_content httpd-log summaries/${ACTIVE_SUBSET}.gz
+assert_file_has_content httpd-log summaries/${OLD_ACTIVE_SUBSET}-${ACTIVE_SUBSET}.delta
+assert_streq "$(sha256 < $FL_CACHE_DIR/summaries/test-repo-${ARCH}-${ACTIVE_SUBSET}.sub)" "$ACTIVE_SUBSET"
+
+$FLATPAK $U config --unset summary-low-memory
+
+ok subsummary delta in low-memory mode
+
+# Sizes computed with the persisted size memo must match fresh ones
+make_updated_app test "" master MEMO
+update_repo
+assert_has_file repos/test/size-memo
+${FLATPAK} repo --branches repos/test > branches-memo
+
+rm repos/test/size-memo
+rm -f repos/test/summary.idx # Don't reuse the sizes of the old summary
+update_repo
+${FLATPAK} repo --branches repos/test > branches-fresh
+assert_streq "$(cat branches-memo)" "$(cat branches-fresh)"
+
+# Pruning drops entries from the memo, but must not change the sizes
+make_updated_app test "" master PRUNED
+UPDATE_REPO_ARGS=--prune update_repo
+${FLATPAK} repo --branches repos/test > branches-pruned
+rm -f repos/test/size-memo repos/test/summary.idx
+update_repo
+${FLATPAK} repo --branches repos/test > branches-fresh
+assert_streq "$(cat branches-pruned)" "$(cat branches-fresh)"
+
+ok size memo
@@ -27,7 +27,7 @@ export USE_SYSTEMDIR=yes
 skip_without_bwrap
 skip_revokefs_without_fuse
 
-echo "1..2"
+echo "1..3"
 
 setup_empty_repo &> /dev/null > /dev/null
 
@@ -418,3 +418,26 @@ if [ $(cat newly-unused.txt | wc -l) -ne 10 ]; then
 fi
 
 ok "list unused exclude"
+
+# The ref dependency index is only a cache, so list-unused and
+# uninstall --unused must give the same results with and without it
+rm -f $FL_DIR/.ref-dependencies $USERDIR/.ref-dependencies
+
+${test_builddir}/list-unused | sed s@^app/@@g | sed s@^runtime/@@g | sort > unused-noindex.txt
+assert_has_file $FL_DIR/.ref-dependencies
+
+${test_builddir}/list-unused | sed s@^app/@@g | sed s@^runtime/@@g | sort > unused-index.txt
+diff -u unused-noindex.txt unused-index.txt
+
+comm -23 installed.txt unused-noindex.txt > expected-remaining.txt
+
+$FLATPAK uninstall -y --system --unused &> /dev/null > /dev/null
+$FLATPAK list --system -a --columns=ref | sort > remaining.txt
+diff -u expected-remaining.txt remaining.txt
+
+# Nothing more is unused when looking without the index either
+rm -f $FL_DIR/.ref-dependencies $USERDIR/.ref-dependencies
+$FLATPAK uninstall -y --system --unused > uninstall-noindex.txt
+assert_file_has_content uninstall-noindex.txt "Nothing unused to uninstall"
+
+ok "list unused with and without the dependency index"
@@ -482,6 +482,51 @@ test_decompose (void)
   }
 }
 
+static void
+test_decompose_interned (void)
+{
+  g_autoptr(FlatpakDecomposed) a = NULL;
+  g_autoptr(FlatpakDecomposed) b = NULL;
+  g_autoptr(FlatpakDecomposed) c = NULL;
+  g_autoptr(FlatpakDecomposed) plain = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_assert_null (flatpak_decomposed_new_from_ref_interned ("app/wrong/mips64/master", &error));
+  g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_INVALID_REF);
+  g_clear_error (&error);
+
+  a = flatpak_decomposed_new_from_ref_interned ("app/org.the.app/mips64/master", &error);
+  g_assert_no_error (error);
+  b = flatpak_decomposed_new_from_ref_interned ("app/org.the.app/mips64/master", &error);
+  g_assert_no_error (error);
+  c = flatpak_decomposed_new_from_ref_interned ("app/org.the.app/mips64/beta", &error);
+  g_assert_no_error (error);
+  plain = flatpak_decomposed_new_from_ref ("app/org.the.app/mips64/master", &error);
+  g_assert_no_error (error);
+
+  g_assert_true (a == b);
+  g_assert_true (a != c);
+  g_assert_true (flatpak_decomposed_equal (a, b));
+  g_assert_false (flatpak_decomposed_equal (a, c));
+  g_assert_true (flatpak_decomposed_equal (a, plain));
+  g_assert_true (flatpak_decomposed_equal (plain, b));
+  g_assert_cmpint (flatpak_decomposed_hash (a), ==, flatpak_decomposed_hash (plain));
+  g_assert_cmpstr (flatpak_decomposed_get_branch (c), ==, "beta");
+
+  /* The last unref drops the ref from the table, interning it again must
+   * create a new one */
+  g_clear_pointer (&a, flatpak_decomposed_unref);
+  g_clear_pointer (&b, flatpak_decomposed_unref);
+  a = flatpak_decomposed_new_from_ref_interned ("app/org.the.app/mips64/master", &error);
+  g_assert_no_error (error);
+  b = flatpak_decomposed_new_from_ref_interned ("app/org.the.app/mips64/master", &error);
+  g_assert_no_error (error);
+  g_assert_true (a == b);
+  g_assert_cmpstr (flatpak_decomposed_get_ref (a), ==, "app/org.the.app/mips64/master");
+  g_assert_true (flatpak_decomposed_equal (a, plain));
+  g_assert_false (flatpak_decomposed_equal (a, c));
+}
+
 
 typedef struct
 {
@@ -1402,8 +1447,8 @@ test_filter_parser (void)
   for (i = 0; i < G_N_ELEMENTS(filters); i++)
     {
       g_autoptr(GError) error = NULL;
-      g_autoptr(GRegex) allow_refs = NULL;
-      g_autoptr(GRegex) deny_refs = NULL;
+      g_autoptr(FlatpakRefMatcher) allow_refs = NULL;
+      g_autoptr(FlatpakRefMatcher) deny_refs = NULL;
 
       ret = flatpak_parse_filters (filters[i].filter, &allow_refs, &deny_refs, &error);
       g_assert_error (error, FLATPAK_ERROR, filters[i].expected_error);
@@ -1417,8 +1462,8 @@ static void
 test_filter (void)
 {
   GError *error = NULL;
-  g_autoptr(GRegex) allow_refs = NULL;
-  g_autoptr(GRegex) deny_refs = NULL;
+  g_autoptr(FlatpakRefMatcher) allow_refs = NULL;
+  g_autoptr(FlatpakRefMatcher) deny_refs = NULL;
   gboolean ret;
   int i;
   char *filter =
@@ -1498,6 +1543,70 @@ test_filter (void)
     g_assert_cmpint (flatpak_filters_allow_ref (allow_refs, deny_refs, filter_refs[i].ref), ==, filter_refs[i].expected_result);
 }
 
+static void
+test_ref_matcher (void)
+{
+  g_autoptr(FlatpakRefMatcher) matcher = flatpak_ref_matcher_new ();
+  g_autoptr(FlatpakRefMatcher) runtimes = flatpak_ref_matcher_new ();
+  g_autoptr(GError) error = NULL;
+  int i;
+  const char *globs[] = {
+    "org.exact",
+    "org.prefix.*",
+    "org.*.middle",
+    "*.suffix/arm",
+    "app/org.app//beta",
+    "runtime/org.runtime/*/1.*",
+  };
+  struct {
+    char *ref;
+    gboolean expected_result;
+  } refs[] = {
+     { "app/org.exact/x86_64/stable", TRUE },
+     { "runtime/org.exact/arm/1.0", TRUE },
+     { "app/org.exactly/x86_64/stable", FALSE },
+     { "app/org.prefix.foo/x86_64/stable", TRUE },
+     { "app/org.prefix.foo.bar/x86_64/stable", TRUE },
+     { "app/org.prefix/x86_64/stable", FALSE },
+     { "app/org.foo.middle/x86_64/stable", TRUE },
+     { "app/org.foo.bar.middle/x86_64/stable", TRUE },
+     { "app/org.foo.middle.not/x86_64/stable", FALSE },
+     { "app/com.the.suffix/arm/stable", TRUE },
+     { "app/com.the.suffix/x86_64/stable", FALSE },
+     { "app/org.app/x86_64/beta", TRUE },
+     { "app/org.app/x86_64/stable", FALSE },
+     { "runtime/org.app/x86_64/beta", FALSE },
+     { "runtime/org.runtime/x86_64/1.0", TRUE },
+     { "runtime/org.runtime/x86_64/2.0", FALSE },
+     { "app/org.runtime/x86_64/1.0", FALSE },
+     { "app/org.exact/x86_64", FALSE },
+     { "app/org.exact/x86_64/stable/extra", FALSE },
+     { "other/org.exact/x86_64/stable", FALSE },
+  };
+
+  for (i = 0; i < G_N_ELEMENTS (globs); i++)
+    {
+      g_assert_true (flatpak_ref_matcher_add_glob (matcher, globs[i], FALSE, &error));
+      g_assert_no_error (error);
+    }
+
+  for (i = 0; i < G_N_ELEMENTS (refs); i++)
+    g_assert_cmpint (flatpak_ref_matcher_match (matcher, refs[i].ref), ==, refs[i].expected_result);
+
+  g_assert_false (flatpak_ref_matcher_add_glob (runtimes, "app/org.app", TRUE, &error));
+  g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_INVALID_DATA);
+  g_clear_error (&error);
+
+  g_assert_false (flatpak_ref_matcher_add_glob (runtimes, "org.foo/arch/branch/extra", TRUE, &error));
+  g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_INVALID_DATA);
+  g_clear_error (&error);
+
+  g_assert_true (flatpak_ref_matcher_add_glob (runtimes, "org.runtime", TRUE, &error));
+  g_assert_no_error (error);
+  g_assert_true (flatpak_ref_matcher_match (runtimes, "runtime/org.runtime/x86_64/1.0"));
+  g_assert_false (flatpak_ref_matcher_match (runtimes, "app/org.runtime/x86_64/1.0"));
+}
+
 static void
 test_dconf_app_id (void)
 {
@@ -1862,9 +1971,11 @@ main (int argc, char *argv[])
   g_test_add_func ("/common/name-matching", test_name_matching);
   g_test_add_func ("/common/filter_parser", test_filter_parser);
   g_test_add_func ("/common/filter", test_filter);
+  g_test_add_func ("/common/ref-matcher", test_ref_matcher);
   g_test_add_func ("/common/dconf-app-id", test_dconf_app_id);
   g_test_add_func ("/common/dconf-paths", test_dconf_paths);
   g_test_add_func ("/common/decompose-ref", test_decompose);
+  g_test_add_func ("/common/decompose-ref-interned", test_decompose_interned);
   g_test_add_func ("/common/envp-cmp", test_envp_cmp);
   g_test_add_func ("/common/needs-quoting", test_needs_quoting);
   g_test_add_func ("/common/quote-argv", test_quote_argv);
@@ -1124,12 +1124,137 @@ test_list_remote_refs (void)
       g_assert_cmpstr (name, ==, repo_name);
       g_assert_cmpuint (installed_size, >, 0);
       g_assert_cmpuint (download_size, >, 0);
+      g_assert_cmpuint (installed_size, ==, flatpak_remote_ref_get_installed_size (remote_ref));
+      g_assert_cmpuint (download_size, ==, flatpak_remote_ref_get_download_size (remote_ref));
       g_assert_true (metadata2 == metadata);
       g_assert_null (eol);
       g_assert_null (eol_rebase);
     }
 }
 
+static void
+test_query_remote_refs (void)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GPtrArray) refs = NULL;
+  FlatpakRemoteRef *remote_ref;
+  int i;
+
+  inst = flatpak_installation_new_user (NULL, &error);
+  g_assert_no_error (error);
+
+  refs = flatpak_installation_query_remote_refs_sync (inst, repo_name, FLATPAK_QUERY_FLAGS_ONLY_APPS,
+                                                      "org.test.", NULL, "master",
+                                                      FLATPAK_REMOTE_REF_FIELDS_SIZES,
+                                                      NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (refs);
+  g_assert_cmpint (refs->len, ==, 1);
+
+  remote_ref = g_ptr_array_index (refs, 0);
+  g_assert_cmpstr (flatpak_ref_get_name (FLATPAK_REF (remote_ref)), ==, "org.test.Hello");
+  g_assert_cmpint (flatpak_ref_get_kind (FLATPAK_REF (remote_ref)), ==, FLATPAK_REF_KIND_APP);
+  g_assert_nonnull (flatpak_ref_get_commit (FLATPAK_REF (remote_ref)));
+  g_assert_cmpuint (flatpak_remote_ref_get_installed_size (remote_ref), >, 0);
+  g_assert_cmpuint (flatpak_remote_ref_get_download_size (remote_ref), >, 0);
+  g_assert_null (flatpak_remote_ref_get_metadata (remote_ref));
+  g_clear_pointer (&refs, g_ptr_array_unref);
+
+  refs = flatpak_installation_query_remote_refs_sync (inst, repo_name, FLATPAK_QUERY_FLAGS_ONLY_RUNTIMES,
+                                                      "org.test.Hello", flatpak_get_default_arch (), NULL,
+                                                      FLATPAK_REMOTE_REF_FIELDS_ALL,
+                                                      NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (refs);
+  g_assert_cmpint (refs->len, ==, 2);
+
+  for (i = 0; i < refs->len; i++)
+    {
+      remote_ref = g_ptr_array_index (refs, i);
+      g_assert_cmpint (flatpak_ref_get_kind (FLATPAK_REF (remote_ref)), ==, FLATPAK_REF_KIND_RUNTIME);
+      g_assert_true (g_str_has_prefix (flatpak_ref_get_name (FLATPAK_REF (remote_ref)), "org.test.Hello."));
+      g_assert_nonnull (flatpak_remote_ref_get_metadata (remote_ref));
+    }
+  g_clear_pointer (&refs, g_ptr_array_unref);
+
+  refs = flatpak_installation_query_remote_refs_sync (inst, repo_name, FLATPAK_QUERY_FLAGS_NONE,
+                                                      NULL, "nosucharch", NULL,
+                                                      FLATPAK_REMOTE_REF_FIELDS_NONE,
+                                                      NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (refs);
+  g_assert_cmpint (refs->len, ==, 0);
+}
+
+static void
+async_result_cb (GObject      *source,
+                 GAsyncResult *result,
+                 gpointer      user_data)
+{
+  GAsyncResult **out_result = user_data;
+
+  *out_result = g_object_ref (result);
+  g_main_context_wakeup (NULL);
+}
+
+static GAsyncResult *
+wait_for_async_result (GAsyncResult **result)
+{
+  while (*result == NULL)
+    g_main_context_iteration (NULL, TRUE);
+
+  return *result;
+}
+
+static void
+test_list_remote_refs_async (void)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GPtrArray) sync_refs = NULL;
+  g_autoptr(GPtrArray) refs = NULL;
+  g_autoptr(FlatpakRemoteRef) remote_ref = NULL;
+  g_autoptr(GCancellable) cancellable = NULL;
+  g_autoptr(GAsyncResult) list_result = NULL;
+  g_autoptr(GAsyncResult) fetch_result = NULL;
+  g_autoptr(GAsyncResult) cancelled_result = NULL;
+
+  inst = flatpak_installation_new_user (NULL, &error);
+  g_assert_no_error (error);
+
+  sync_refs = flatpak_installation_list_remote_refs_sync (inst, repo_name, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (sync_refs);
+
+  /* Both calls are in flight at the same time */
+  flatpak_installation_list_remote_refs_async (inst, repo_name, FLATPAK_QUERY_FLAGS_NONE,
+                                               NULL, async_result_cb, &list_result);
+  flatpak_installation_fetch_remote_ref_async (inst, repo_name, FLATPAK_REF_KIND_APP,
+                                               "org.test.Hello", NULL, "master",
+                                               FLATPAK_QUERY_FLAGS_NONE,
+                                               NULL, async_result_cb, &fetch_result);
+
+  refs = flatpak_installation_list_remote_refs_finish (inst, wait_for_async_result (&list_result), &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (refs);
+  g_assert_cmpint (refs->len, ==, sync_refs->len);
+
+  remote_ref = flatpak_installation_fetch_remote_ref_finish (inst, wait_for_async_result (&fetch_result), &error);
+  g_assert_no_error (error);
+  g_assert_true (FLATPAK_IS_REMOTE_REF (remote_ref));
+  g_assert_cmpstr (flatpak_ref_get_name (FLATPAK_REF (remote_ref)), ==, "org.test.Hello");
+
+  cancellable = g_cancellable_new ();
+  g_cancellable_cancel (cancellable);
+  flatpak_installation_list_remote_refs_async (inst, repo_name, FLATPAK_QUERY_FLAGS_NONE,
+                                               cancellable, async_result_cb, &cancelled_result);
+  g_clear_pointer (&refs, g_ptr_array_unref);
+  refs = flatpak_installation_list_remote_refs_finish (inst, wait_for_async_result (&cancelled_result), &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_assert_null (refs);
+}
+
 /* Test the xa.noenumerate option on a remote, which should mask non-installed refs */
 static void
 test_list_remote_refs_noenumerate (void)
@@ -1480,6 +1605,70 @@ test_list_remote_related_refs (void)
   clean_extra_languages ();
 }
 
+static void
+assert_related_refs_equal (GPtrArray *refs_a,
+                           GPtrArray *refs_b)
+{
+  g_assert_cmpint (refs_a->len, ==, refs_b->len);
+
+  for (guint i = 0; i < refs_a->len; i++)
+    {
+      FlatpakRelatedRef *ref_a = g_ptr_array_index (refs_a, i);
+      FlatpakRelatedRef *ref_b = g_ptr_array_index (refs_b, i);
+      g_autofree char *ref_a_str = flatpak_ref_format_ref (FLATPAK_REF (ref_a));
+      g_autofree char *ref_b_str = flatpak_ref_format_ref (FLATPAK_REF (ref_b));
+      const char * const *subpaths_a = flatpak_related_ref_get_subpaths (ref_a);
+      const char * const *subpaths_b = flatpak_related_ref_get_subpaths (ref_b);
+
+      g_assert_cmpstr (ref_a_str, ==, ref_b_str);
+      g_assert_cmpstr (flatpak_ref_get_commit (FLATPAK_REF (ref_a)), ==,
+                       flatpak_ref_get_commit (FLATPAK_REF (ref_b)));
+      g_assert_true ((subpaths_a == NULL) == (subpaths_b == NULL));
+      if (subpaths_a != NULL)
+        g_assert_cmpuint (g_strv_length ((char **) subpaths_a), ==, g_strv_length ((char **) subpaths_b));
+      for (guint j = 0; subpaths_a != NULL && subpaths_a[j] != NULL; j++)
+        g_assert_cmpstr (subpaths_a[j], ==, subpaths_b[j]);
+      g_assert_cmpint (flatpak_related_ref_should_download (ref_a), ==, flatpak_related_ref_should_download (ref_b));
+      g_assert_cmpint (flatpak_related_ref_should_delete (ref_a), ==, flatpak_related_ref_should_delete (ref_b));
+      g_assert_cmpint (flatpak_related_ref_should_autoprune (ref_a), ==, flatpak_related_ref_should_autoprune (ref_b));
+    }
+}
+
+/* The remote related refs are cached on disk, make sure a cache hit
+ * gives the same results as a cache miss */
+static void
+test_list_remote_related_refs_cached (void)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GPtrArray) uncached_refs = NULL;
+  g_autoptr(GPtrArray) cached_refs = NULL;
+  g_autofree char *app = NULL;
+  g_autofree char *related_cache_dir = NULL;
+
+  app = g_strdup_printf ("app/org.test.Hello/%s/master",
+                         flatpak_get_default_arch ());
+  inst = flatpak_installation_new_user (NULL, &error);
+  g_assert_no_error (error);
+
+  related_cache_dir = g_build_filename (g_get_user_cache_dir (), "flatpak", "related", repo_name, NULL);
+  glnx_shutil_rm_rf_at (AT_FDCWD, related_cache_dir, NULL, &error);
+  g_assert_no_error (error);
+
+  uncached_refs = flatpak_installation_list_remote_related_refs_sync (inst, repo_name, app, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (uncached_refs);
+  g_assert_cmpint (uncached_refs->len, >, 0);
+
+  g_assert_true (g_file_test (related_cache_dir, G_FILE_TEST_IS_DIR));
+
+  cached_refs = flatpak_installation_list_remote_related_refs_sync (inst, repo_name, app, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (cached_refs);
+
+  assert_related_refs_equal (uncached_refs, cached_refs);
+}
+
 static void
 test_list_remote_related_refs_for_installed (void)
 {
@@ -4954,6 +5143,112 @@ test_installation_unused_refs_excludes_pins (void)
   g_assert_cmpint (refs->len, ==, 0);
 }
 
+static void
+test_installation_changes (void)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(FlatpakTransaction) transaction = NULL;
+  g_autoptr(GPtrArray) changes = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *runtime = NULL;
+  gboolean found_deployed = FALSE;
+  g_autoptr(GFile) inst_path = NULL;
+  g_autoptr(GFile) log_file = NULL;
+  g_autofree char *log_path = NULL;
+  g_autofree char *log_contents = NULL;
+  const char *last_line;
+  guint64 since, latest, prev_seq;
+  gboolean res;
+  guint i;
+
+  runtime = g_strdup_printf ("runtime/org.test.Platform/%s/master",
+                             flatpak_get_default_arch ());
+
+  inst = flatpak_installation_new_user (NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (inst);
+
+  empty_installation (inst);
+
+  since = flatpak_installation_get_latest_change (inst);
+
+  transaction = flatpak_transaction_new_for_installation (inst, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (transaction);
+
+  res = flatpak_transaction_add_install (transaction, repo_name, runtime, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  res = flatpak_transaction_run (transaction, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  /* The runtime was deployed (and pinned, unless an earlier test did that) */
+  changes = flatpak_installation_list_changes_since (inst, since, &latest, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (changes);
+  g_assert_cmpint (latest, >, since);
+
+  prev_seq = since;
+  for (i = 0; i < changes->len; i++)
+    {
+      FlatpakInstallationChange *change = g_ptr_array_index (changes, i);
+      FlatpakInstallationChangeKind kind = flatpak_installation_change_get_kind (change);
+
+      g_assert_cmpint (flatpak_installation_change_get_sequence (change), ==, prev_seq + 1);
+      prev_seq = flatpak_installation_change_get_sequence (change);
+
+      if (kind == FLATPAK_INSTALLATION_CHANGE_KIND_DEPLOYED &&
+          strcmp (flatpak_installation_change_get_name (change), runtime) == 0)
+        found_deployed = TRUE;
+      else
+        g_assert_cmpint (kind, ==, FLATPAK_INSTALLATION_CHANGE_KIND_PINNED);
+    }
+  g_assert_cmpint (prev_seq, ==, latest);
+  g_assert_true (found_deployed);
+  g_clear_pointer (&changes, g_ptr_array_unref);
+
+  g_assert_cmpint (flatpak_installation_get_latest_change (inst), ==, latest);
+
+  changes = flatpak_installation_list_changes_since (inst, latest, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (changes->len, ==, 0);
+  g_clear_pointer (&changes, g_ptr_array_unref);
+
+  /* Sequence numbers from the future mean the caller has to rescan */
+  changes = flatpak_installation_list_changes_since (inst, latest + 1, NULL, NULL, &error);
+  g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_CACHED);
+  g_assert_null (changes);
+  g_clear_error (&error);
+
+  /* Compact the log the way it is done when it gets too big, keeping only
+   * the latest change. Anything older than that is no longer available. */
+  inst_path = flatpak_installation_get_path (inst);
+  log_file = g_file_get_child (inst_path, "changes");
+  log_path = g_file_get_path (log_file);
+  res = g_file_get_contents (log_path, &log_contents, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  last_line = g_strrstr_len (log_contents, strlen (log_contents) - 1, "\n");
+  last_line = last_line ? last_line + 1 : log_contents;
+  res = g_file_set_contents (log_path, last_line, -1, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  g_assert_cmpint (latest, >, 1);
+  changes = flatpak_installation_list_changes_since (inst, latest - 2, NULL, NULL, &error);
+  g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_CACHED);
+  g_assert_null (changes);
+  g_clear_error (&error);
+
+  changes = flatpak_installation_list_changes_since (inst, latest - 1, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (changes->len, ==, 1);
+  g_assert_cmpint (flatpak_installation_change_get_sequence (g_ptr_array_index (changes, 0)), ==, latest);
+}
+
 static void
 test_installation_unused_refs_across_installations (void)
 {
@@ -5059,8 +5354,11 @@ main (int argc, char *argv[])
   g_test_add_func ("/library/remote-new", test_remote_new);
   g_test_add_func ("/library/remote-new-from-file", test_remote_new_from_file);
   g_test_add_func ("/library/list-remote-refs", test_list_remote_refs);
+  g_test_add_func ("/library/list-remote-refs-async", test_list_remote_refs_async);
+  g_test_add_func ("/library/query-remote-refs", test_query_remote_refs);
   g_test_add_func ("/library/list-remote-refs-noenumerate", test_list_remote_refs_noenumerate);
   g_test_add_func ("/library/list-remote-related-refs", test_list_remote_related_refs);
+  g_test_add_func ("/library/list-remote-related-refs-cached", test_list_remote_related_refs_cached);
   g_test_add_func ("/library/list-remote-related-refs-for-installed", test_list_remote_related_refs_for_installed);
   g_test_add_func ("/library/list-refs", test_list_refs);
   g_test_add_func ("/library/install-launch-uninstall", test_install_launch_uninstall);
@@ -5095,6 +5393,7 @@ main (int argc, char *argv[])
   g_test_add_func ("/library/installation-unused-refs", test_installation_unused_refs);
   g_test_add_func ("/library/installation-unused-refs-excludes-pins", test_installation_unused_refs_excludes_pins);
   g_test_add_func ("/library/installation-unused-refs-across-installations", test_installation_unused_refs_across_installations);
+  g_test_add_func ("/library/installation-changes", test_installation_changes);
 
   global_setup ();
 